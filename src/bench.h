@@ -0,0 +1,77 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+/* Helpers that the loopback benchmarks share. They are static so that
+ * each benchmark program stays a single source file plus the layers.
+ */
+
+#include <time.h>
+
+#include "l4sap.h"
+
+static inline double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Create two L2 entities on the loopback interface that use each
+ * other as their peer.
+ */
+static inline int bench_l2_pair(L2SAP **a, L2SAP **b)
+{
+    *b = l2sap_create("127.0.0.1", 9);
+    if (*b == NULL)
+        return -1;
+
+    *a = l2sap_create("127.0.0.1", l2sap_local_port(*b));
+    if (*a == NULL)
+    {
+        l2sap_destroy(*b);
+        return -1;
+    }
+
+    (*b)->peer_addr.sin_port = htons(l2sap_local_port(*a));
+    return 0;
+}
+
+/* The same with the given driver, see l2sap_create_driver.
+ */
+static inline int bench_l2_pair_driver(int driver, L2SAP **a, L2SAP **b)
+{
+    *b = l2sap_create_driver(driver, "127.0.0.1", 9);
+    if (*b == NULL)
+        return -1;
+
+    *a = l2sap_create_driver(driver, "127.0.0.1", l2sap_local_port(*b));
+    if (*a == NULL)
+    {
+        l2sap_destroy(*b);
+        return -1;
+    }
+
+    (*b)->peer_addr.sin_port = htons(l2sap_local_port(*a));
+    return 0;
+}
+
+/* The same for two L4 entities.
+ */
+static inline int bench_l4_pair(L4SAP **a, L4SAP **b)
+{
+    *b = l4sap_create("127.0.0.1", 9);
+    if (*b == NULL)
+        return -1;
+
+    *a = l4sap_create("127.0.0.1", l2sap_local_port((*b)->l2));
+    if (*a == NULL)
+    {
+        l4sap_destroy(*b);
+        return -1;
+    }
+
+    (*b)->l2->peer_addr.sin_port = htons(l2sap_local_port((*a)->l2));
+    return 0;
+}
+
+#endif /* BENCH_H */
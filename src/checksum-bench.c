@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "l2sap.h"
+#include "checksum.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CYCLES() __rdtsc()
+#define UNIT "bytes/cycle"
+#else
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+#define CYCLES() now_ns()
+#define UNIT "bytes/ns"
+#endif
+
+static const int sizes[] = {16, 64, 256, 512, L2Framesize};
+#define NSIZES (int)(sizeof(sizes) / sizeof(sizes[0]))
+
+/* The result is accumulated here so that the compiler cannot drop
+ * the calls that are measured.
+ */
+static volatile uint32_t sink;
+
+/* Every kernel must return the same checksum as the scalar one for
+ * every length and alignment that a frame can have.
+ */
+static int verify(const ChecksumKernel *kernels, int count, const uint8_t *buf)
+{
+    int errors = 0;
+    for (int k = 1; k < count; k++)
+    {
+        for (int off = 0; off < 32; off++)
+        {
+            for (int len = 0; len <= L2Framesize - 32; len++)
+            {
+                if (kernels[k].xor8(buf + off, len) != kernels[0].xor8(buf + off, len))
+                {
+                    fprintf(stderr, "%s: kernel %s differs at offset %d length %d\n",
+                            __FUNCTION__, kernels[k].name, off, len);
+                    errors++;
+                    break;
+                }
+            }
+        }
+    }
+    return errors;
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 200000;
+    if (iterations <= 0)
+    {
+        fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+        return -1;
+    }
+
+    static uint8_t buf[L2Framesize];
+    srand(1);
+    for (int i = 0; i < L2Framesize; i++)
+        buf[i] = rand();
+
+    int count;
+    const ChecksumKernel *kernels = checksum_kernels(&count);
+    if (verify(kernels, count, buf) != 0)
+        return -1;
+
+    printf("%-8s", "size");
+    for (int s = 0; s < NSIZES; s++)
+        printf("%10d", sizes[s]);
+    printf("   (%s, default kernel %s)\n", UNIT, checksum_kernel_name());
+
+    for (int k = 0; k < count; k++)
+    {
+        printf("%-8s", kernels[k].name);
+        for (int s = 0; s < NSIZES; s++)
+        {
+            uint64_t start = CYCLES();
+            for (int i = 0; i < iterations; i++)
+                sink += kernels[k].xor8(buf, sizes[s]);
+            uint64_t cycles = CYCLES() - start;
+            printf("%10.2f", (double)sizes[s] * iterations / cycles);
+        }
+        printf("\n");
+    }
+
+    printf("%-8s", "crc32c");
+    for (int s = 0; s < NSIZES; s++)
+    {
+        uint64_t start = CYCLES();
+        for (int i = 0; i < iterations; i++)
+            sink += checksum_crc32c(0, buf, sizes[s]);
+        uint64_t cycles = CYCLES() - start;
+        printf("%10.2f", (double)sizes[s] * iterations / cycles);
+    }
+    printf("\n");
+
+    return 0;
+}
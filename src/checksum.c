@@ -0,0 +1,217 @@
+#include <string.h>
+
+#include "checksum.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CHECKSUM_X86
+#endif
+
+/* The reference kernel: one byte per step, exactly like the original
+ * compute_checksum of l2sap.c.
+ */
+static uint8_t xor8_scalar(const uint8_t *data, int len)
+{
+    uint8_t checksum = 0;
+    for (int i = 0; i < len; ++i)
+    {
+        checksum ^= data[i];
+    }
+    return checksum;
+}
+
+/* XOR does not care about the position of a byte, so the XOR of all
+ * bytes of a word is the XOR of its two halves, folded down to 8 bits.
+ */
+static uint8_t fold64(uint64_t acc)
+{
+    acc ^= acc >> 32;
+    acc ^= acc >> 16;
+    acc ^= acc >> 8;
+    return (uint8_t)acc;
+}
+
+static uint8_t xor8_word(const uint8_t *data, int len)
+{
+    uint64_t acc = 0;
+    int i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        acc ^= word;
+    }
+    return fold64(acc) ^ xor8_scalar(data + i, len - i);
+}
+
+#ifdef CHECKSUM_X86
+__attribute__((target("sse2")))
+static uint8_t xor8_sse2(const uint8_t *data, int len)
+{
+    __m128i acc = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        acc = _mm_xor_si128(acc, _mm_loadu_si128((const __m128i *)(data + i)));
+    }
+
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    return fold64(lanes[0] ^ lanes[1]) ^ xor8_word(data + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static uint8_t xor8_avx2(const uint8_t *data, int len)
+{
+    __m256i acc = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        acc = _mm256_xor_si256(acc, _mm256_loadu_si256((const __m256i *)(data + i)));
+    }
+
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    return fold64(lanes[0] ^ lanes[1] ^ lanes[2] ^ lanes[3]) ^ xor8_word(data + i, len - i);
+}
+#endif
+
+static const ChecksumKernel all_kernels[] = {
+    {"scalar", xor8_scalar},
+    {"word", xor8_word},
+#ifdef CHECKSUM_X86
+    {"sse2", xor8_sse2},
+    {"avx2", xor8_avx2},
+#endif
+};
+
+#define ALL_KERNELS (int)(sizeof(all_kernels) / sizeof(all_kernels[0]))
+
+static int kernel_supported(const ChecksumKernel *kernel)
+{
+#ifdef CHECKSUM_X86
+    if (kernel->xor8 == xor8_sse2)
+        return __builtin_cpu_supports("sse2");
+    if (kernel->xor8 == xor8_avx2)
+        return __builtin_cpu_supports("avx2");
+#endif
+    return 1;
+}
+
+/* CRC32C uses the Castagnoli polynomial in reflected form. The table
+ * is only needed on CPUs without the SSE4.2 crc32 instruction.
+ */
+#define CRC32C_POLY 0x82F63B78u
+
+static uint32_t crc32c_table[256];
+
+static ChecksumKernel supported_kernels[ALL_KERNELS];
+static int supported_count = 0;
+static const ChecksumKernel *selected = NULL;
+
+/* Fills supported_kernels and selects the last, i.e. the widest, one.
+ * This runs before main is called, like log_init, so that threads
+ * never see the tables while they are being written.
+ */
+__attribute__((constructor)) static void checksum_init(void)
+{
+#ifdef CHECKSUM_X86
+    __builtin_cpu_init();
+#endif
+
+    int count = 0;
+    for (int i = 0; i < ALL_KERNELS; ++i)
+    {
+        if (kernel_supported(&all_kernels[i]))
+        {
+            supported_kernels[count++] = all_kernels[i];
+        }
+    }
+    supported_count = count;
+    selected = &supported_kernels[count - 1];
+
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k)
+        {
+            c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        }
+        crc32c_table[i] = c;
+    }
+}
+
+uint8_t checksum_xor(const uint8_t *data, int len)
+{
+    return selected->xor8(data, len);
+}
+
+const ChecksumKernel *checksum_kernels(int *count)
+{
+    *count = supported_count;
+    return supported_kernels;
+}
+
+int checksum_use(const char *name)
+{
+    int count;
+    const ChecksumKernel *kernels = checksum_kernels(&count);
+    for (int i = 0; i < count; ++i)
+    {
+        if (strcmp(kernels[i].name, name) == 0)
+        {
+            selected = &kernels[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *checksum_kernel_name(void)
+{
+    return selected->name;
+}
+
+static uint32_t crc32c_table_update(uint32_t crc, const uint8_t *data, int len)
+{
+    for (int i = 0; i < len; ++i)
+    {
+        crc = crc32c_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef CHECKSUM_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42_update(uint32_t crc, const uint8_t *data, int len)
+{
+    int i = 0;
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+#endif
+    for (; i < len; ++i)
+    {
+        crc = _mm_crc32_u8(crc, data[i]);
+    }
+    return crc;
+}
+#endif
+
+uint32_t checksum_crc32c(uint32_t crc, const uint8_t *data, int len)
+{
+    crc = ~crc;
+#ifdef CHECKSUM_X86
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        return ~crc32c_sse42_update(crc, data, len);
+    }
+#endif
+    return ~crc32c_table_update(crc, data, len);
+}
@@ -0,0 +1,49 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <inttypes.h>
+
+/* The checksum engine computes the 1-byte XOR checksum of the
+ * L2Header and, for links that ask for it, a CRC32C.
+ *
+ * There are several kernels for the XOR checksum. They all return
+ * exactly the same value as XORing the frame one byte at a time,
+ * but fold 8, 16 or 32 bytes per step. The fastest kernel that the
+ * CPU supports is picked when the program starts, and checksum_use can
+ * override that choice.
+ */
+
+typedef struct ChecksumKernel ChecksumKernel;
+
+struct ChecksumKernel
+{
+    const char* name;
+    uint8_t   (*xor8)( const uint8_t* data, int len );
+};
+
+/* XOR of all len bytes in data, computed with the selected kernel.
+ */
+uint8_t checksum_xor( const uint8_t* data, int len );
+
+/* CRC32C (Castagnoli) of len bytes in data. Pass 0 as crc for the
+ * first segment and the previous result to continue across segments.
+ * Uses the SSE4.2 crc32 instruction if the CPU has it.
+ */
+uint32_t checksum_crc32c( uint32_t crc, const uint8_t* data, int len );
+
+/* Returns the list of XOR kernels that this CPU can run, slowest
+ * first, and stores its length in count.
+ */
+const ChecksumKernel* checksum_kernels( int* count );
+
+/* Makes checksum_xor use the kernel with the given name. Returns 0,
+ * or -1 if there is no such kernel on this CPU. Call it before other
+ * threads compute checksums.
+ */
+int checksum_use( const char* name );
+
+/* Name of the kernel that checksum_xor uses.
+ */
+const char* checksum_kernel_name( void );
+
+#endif /* CHECKSUM_H */
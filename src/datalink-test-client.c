@@ -4,6 +4,7 @@
 #include <sys/select.h>
 
 #include "l2sap.h"
+#include "log.h"
 
 static int maxi( int a, int b )
 {
@@ -25,13 +26,13 @@ int main( int argc, char *argv[] )
 
     struct L2SAP* l2 = l2sap_create( argv[1], atoi(argv[2]) );
     if( !l2 ) {
-        fprintf( stderr, "Failed to create server\n" );
+        LOG_ERROR( "Failed to create server" );
         return -1;
     }
 
     for( int i=0; i<25; i++ )
     {
-        fprintf( stderr, "\n%s: Round %d\n\n", __FUNCTION__, i );
+        LOG_INFO( "Round %d", i );
 
         char buffer[4096];
         memset(buffer, 0, sizeof(buffer));
@@ -40,11 +41,11 @@ int main( int argc, char *argv[] )
         int len = maxi( strlen(buffer)+1, 4*(2<<i) );
         if( len > 4096 ) len = strlen(buffer) + 1;
 
-        fprintf( stderr, "%s: Client sends: '%s' and %d bytes\n", __FUNCTION__, buffer, len );
+        LOG_INFO( "Client sends: '%s' and %d bytes", buffer, len );
 
         int error = l2sap_sendto( l2, (uint8_t*)buffer, len );
         if( error < 0 ) {
-            fprintf( stderr, "Failed to send data\n" );
+            LOG_ERROR( "Failed to send data" );
             continue;
         }
 
@@ -55,11 +56,11 @@ int main( int argc, char *argv[] )
         len = l2sap_recvfrom_timeout( l2, (uint8_t*)buffer, 1024, &tv );
         if( len < 0 )
         {
-            fprintf( stderr, "Receiving data failed.\n" );
+            LOG_ERROR( "Receiving data failed." );
         }
         else if( len == 0 )
         {
-            fprintf( stderr, "Server did not respond in 1 second.\n" );
+            LOG_WARN( "Server did not respond in 1 second." );
         }
         else
         {
@@ -0,0 +1,165 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "framepool.h"
+#include "log.h"
+
+#define FRAMEPOOL_ALIGN 64
+
+struct FramePool
+{
+    /* The head of the free stack: the index of the top buffer plus 1
+     * (0 if the stack is empty) in the low 32 bits, and a tag that
+     * every push and pop increments in the high 32 bits, so that a
+     * pop that raced with a pop and a push of the same buffer fails
+     * its compare-and-swap.
+     */
+    _Atomic uint64_t head;
+
+    /* The counters change on every get and put; keep them off the
+     * cache line of the head.
+     */
+    _Alignas(FRAMEPOOL_ALIGN) _Atomic int in_use;
+    _Atomic int           high_water;
+    _Atomic uint64_t      exhausted;
+
+    int                   capacity;
+    int                   framesize;
+    int                   stride;
+
+    /* next[i] is the index plus 1 of the buffer below buffer i on the
+     * free stack.
+     */
+    _Atomic uint32_t*     next;
+    uint8_t*              frames;
+};
+
+FramePool *framepool_create(int count, int framesize)
+{
+    if (count <= 0 || framesize <= 0)
+    {
+        LOG_ERROR("invalid parameters");
+        return NULL;
+    }
+
+    FramePool *pool = aligned_alloc(FRAMEPOOL_ALIGN, sizeof(FramePool));
+    if (pool == NULL)
+    {
+        LOG_ERROR("failed to allocate memory for frame pool");
+        return NULL;
+    }
+    memset(pool, 0, sizeof(FramePool));
+
+    pool->capacity = count;
+    pool->framesize = framesize;
+    pool->stride = (framesize + FRAMEPOOL_ALIGN - 1) & ~(FRAMEPOOL_ALIGN - 1);
+    pool->next = malloc(count * sizeof(pool->next[0]));
+    pool->frames = aligned_alloc(FRAMEPOOL_ALIGN, (size_t)count * pool->stride);
+    if (pool->next == NULL || pool->frames == NULL)
+    {
+        LOG_ERROR("failed to allocate %d frames of %d bytes", count, framesize);
+        framepool_destroy(pool);
+        return NULL;
+    }
+
+    /* Buffer 0 is on top, so that a lightly used pool keeps touching
+     * the same few cache lines.
+     */
+    for (int i = 0; i < count; ++i)
+    {
+        atomic_init(&pool->next[i], i + 1 < count ? i + 2 : 0);
+    }
+    atomic_init(&pool->head, 1);
+    atomic_init(&pool->in_use, 0);
+    atomic_init(&pool->high_water, 0);
+    atomic_init(&pool->exhausted, 0);
+
+    return pool;
+}
+
+void framepool_destroy(FramePool *pool)
+{
+    if (pool == NULL)
+        return;
+
+    if (atomic_load(&pool->in_use) != 0)
+        LOG_WARN("%d frames are still in use", atomic_load(&pool->in_use));
+
+    free((void *)pool->next);
+    free(pool->frames);
+    free(pool);
+}
+
+uint8_t *framepool_get(FramePool *pool)
+{
+    uint64_t head = atomic_load_explicit(&pool->head, memory_order_acquire);
+    uint32_t top;
+
+    while (1)
+    {
+        top = (uint32_t)head;
+        if (top == 0)
+        {
+            atomic_fetch_add_explicit(&pool->exhausted, 1, memory_order_relaxed);
+            return NULL;
+        }
+
+        uint32_t below = atomic_load_explicit(&pool->next[top - 1], memory_order_relaxed);
+        uint64_t popped = (((head >> 32) + 1) << 32) | below;
+        if (atomic_compare_exchange_weak_explicit(&pool->head, &head, popped,
+                                                  memory_order_acquire, memory_order_acquire))
+            break;
+    }
+
+    int in_use = atomic_fetch_add_explicit(&pool->in_use, 1, memory_order_relaxed) + 1;
+    int high_water = atomic_load_explicit(&pool->high_water, memory_order_relaxed);
+    while (in_use > high_water &&
+           !atomic_compare_exchange_weak_explicit(&pool->high_water, &high_water, in_use,
+                                                  memory_order_relaxed, memory_order_relaxed))
+        ;
+
+    return pool->frames + (size_t)(top - 1) * pool->stride;
+}
+
+void framepool_put(FramePool *pool, uint8_t *frame)
+{
+    if (frame == NULL)
+        return;
+
+    size_t offset = frame - pool->frames;
+    if (frame < pool->frames || offset % pool->stride != 0 || offset / pool->stride >= (size_t)pool->capacity)
+    {
+        LOG_ERROR("frame does not belong to this pool");
+        return;
+    }
+    uint32_t index = offset / pool->stride;
+
+    /* Counting the buffer out before it is pushed, and in after it is
+     * popped, keeps in_use and high_water within the capacity.
+     */
+    atomic_fetch_sub_explicit(&pool->in_use, 1, memory_order_relaxed);
+
+    uint64_t head = atomic_load_explicit(&pool->head, memory_order_relaxed);
+    uint64_t pushed;
+    do
+    {
+        atomic_store_explicit(&pool->next[index], (uint32_t)head, memory_order_relaxed);
+        pushed = (((head >> 32) + 1) << 32) | (index + 1);
+    } while (!atomic_compare_exchange_weak_explicit(&pool->head, &head, pushed,
+                                                    memory_order_release, memory_order_relaxed));
+}
+
+int framepool_framesize(const FramePool *pool)
+{
+    return pool->framesize;
+}
+
+void framepool_get_stats(const FramePool *pool, FramePoolStats *stats)
+{
+    stats->capacity = pool->capacity;
+    stats->framesize = pool->framesize;
+    stats->in_use = atomic_load_explicit(&((FramePool *)pool)->in_use, memory_order_relaxed);
+    stats->high_water = atomic_load_explicit(&((FramePool *)pool)->high_water, memory_order_relaxed);
+    stats->exhausted = atomic_load_explicit(&((FramePool *)pool)->exhausted, memory_order_relaxed);
+}
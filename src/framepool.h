@@ -0,0 +1,54 @@
+#ifndef FRAMEPOOL_H
+#define FRAMEPOOL_H
+
+#include <inttypes.h>
+
+/* A frame pool is a fixed number of frame buffers of the same size
+ * that are allocated once, in one cache-line-aligned block, and
+ * handed out and taken back without calling the allocator.
+ *
+ * The free buffers form a lock-free stack (a Treiber stack whose head
+ * carries a tag against the ABA problem), so L2 entities on different
+ * threads can share one pool. Every L2SAP receives into buffers of its
+ * pool; by default it has a private pool of L2Rxframes buffers, and
+ * l2sap_set_pool lets thousands of endpoints share one pool instead,
+ * which bounds the memory of the whole process.
+ */
+
+typedef struct FramePool FramePool;
+
+typedef struct FramePoolStats FramePoolStats;
+
+struct FramePoolStats
+{
+    int      capacity;   /* number of buffers */
+    int      framesize;  /* usable bytes per buffer */
+    int      in_use;     /* buffers handed out right now */
+    int      high_water; /* largest in_use so far */
+    uint64_t exhausted;  /* framepool_get calls that found no buffer */
+};
+
+/* Creates a pool of count buffers of at least framesize bytes each.
+ * Every buffer starts on a cache line. Returns NULL in case of error.
+ */
+FramePool* framepool_create( int count, int framesize );
+
+/* Frees the pool. Buffers that are still in use become invalid.
+ */
+void       framepool_destroy( FramePool* pool );
+
+/* Takes a buffer from the pool. Returns NULL if all are in use.
+ */
+uint8_t*   framepool_get( FramePool* pool );
+
+/* Gives back a buffer that framepool_get returned.
+ */
+void       framepool_put( FramePool* pool, uint8_t* frame );
+
+/* Usable bytes per buffer.
+ */
+int        framepool_framesize( const FramePool* pool );
+
+void       framepool_get_stats( const FramePool* pool, FramePoolStats* stats );
+
+#endif /* FRAMEPOOL_H */
@@ -0,0 +1,458 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <time.h>
+
+#include "impair.h"
+#include "framepool.h"
+#include "log.h"
+
+typedef struct ImpairFrame ImpairFrame;
+
+struct ImpairFrame
+{
+    uint64_t           due_ns;
+    uint64_t           seq;
+    struct sockaddr_in addr;
+    int                len;
+    uint8_t*           data;
+};
+
+struct Impair
+{
+    ImpairProfile profile;
+    uint64_t      rng;
+    ImpairStats   stats;
+
+    ImpairOutput  output;
+    void*         output_arg;
+
+    /* Delayed frames: a binary min-heap ordered by due time and, for
+     * equal times, by the order of sending. Their bytes live in pool.
+     */
+    FramePool*    pool;
+    ImpairFrame*  heap;
+    int           count;
+    uint64_t      seq;
+
+    /* When the bottleneck has sent the last frame that it took. */
+    uint64_t      link_free_ns;
+};
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* splitmix64: small, fast and good enough to decide about frames. */
+static uint64_t impair_next(Impair *impair)
+{
+    uint64_t z = (impair->rng += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+/* A uniform number in [0, 1). */
+static double impair_uniform(Impair *impair)
+{
+    return (impair_next(impair) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int impair_chance(Impair *impair, double p)
+{
+    return p > 0 && impair_uniform(impair) < p;
+}
+
+/* impair_delay draws the delay of one frame in nanoseconds.
+ */
+static uint64_t impair_delay(Impair *impair)
+{
+    const ImpairProfile *p = &impair->profile;
+    double delay = p->delay_us;
+
+    if (p->jitter_us > 0)
+    {
+        double u = impair_uniform(impair);
+        switch (p->jitter_dist)
+        {
+        case IMPAIR_JITTER_NORMAL:
+        {
+            /* Box-Muller; 1 - u keeps the logarithm finite. */
+            double v = impair_uniform(impair);
+            delay += p->jitter_us * sqrt(-2.0 * log(1.0 - u)) * cos(2.0 * M_PI * v);
+            break;
+        }
+        case IMPAIR_JITTER_PARETO:
+            /* Lomax (shifted Pareto) with shape 2, whose mean is the
+             * scale.
+             */
+            delay += p->jitter_us * (1.0 / sqrt(1.0 - u) - 1.0);
+            break;
+        default:
+            delay += p->jitter_us * (2.0 * u - 1.0);
+            break;
+        }
+    }
+
+    return delay > 0 ? (uint64_t)(delay * 1000.0) : 0;
+}
+
+static int impair_before(const ImpairFrame *a, const ImpairFrame *b)
+{
+    return a->due_ns < b->due_ns || (a->due_ns == b->due_ns && a->seq < b->seq);
+}
+
+static void impair_push(Impair *impair, const ImpairFrame *frame)
+{
+    int i = impair->count++;
+    while (i > 0)
+    {
+        int parent = (i - 1) / 2;
+        if (!impair_before(frame, &impair->heap[parent]))
+            break;
+        impair->heap[i] = impair->heap[parent];
+        i = parent;
+    }
+    impair->heap[i] = *frame;
+}
+
+static void impair_pop(Impair *impair)
+{
+    ImpairFrame last = impair->heap[--impair->count];
+    int i = 0;
+    while (1)
+    {
+        int child = 2 * i + 1;
+        if (child >= impair->count)
+            break;
+        if (child + 1 < impair->count && impair_before(&impair->heap[child + 1], &impair->heap[child]))
+            child++;
+        if (!impair_before(&impair->heap[child], &last))
+            break;
+        impair->heap[i] = impair->heap[child];
+        i = child;
+    }
+    impair->heap[i] = last;
+}
+
+static int impair_transmit(Impair *impair, const struct sockaddr_in *addr, const uint8_t *frame, int len)
+{
+    if (impair->output(impair->output_arg, addr, frame, len) < 0)
+    {
+        LOG_RATELIMITED(LOG_LEVEL_ERROR, 1000, "failed to send a frame of %d bytes", len);
+        return -1;
+    }
+    return 0;
+}
+
+/* impair_parse_time reads a time with an optional unit and stores it
+ * in microseconds.
+ */
+static int impair_parse_time(const char *value, int *us)
+{
+    char *end;
+    double t = strtod(value, &end);
+    if (end == value || t < 0)
+        return -1;
+
+    if (strcmp(end, "us") == 0)
+        *us = (int)t;
+    else if (strcmp(end, "ms") == 0 || *end == '\0')
+        *us = (int)(t * 1000.0);
+    else if (strcmp(end, "s") == 0)
+        *us = (int)(t * 1000000.0);
+    else
+        return -1;
+    return 0;
+}
+
+/* impair_parse_size parses a number with an optional suffix that
+ * multiplies it by 1000 (k), 1000000 (m) or 1000000000 (g), followed by
+ * unit, e.g. "10mbit" with unit "bit".
+ */
+static int impair_parse_size(const char *value, const char *unit, uint64_t *result)
+{
+    char *end;
+    double number = strtod(value, &end);
+    if (end == value || number < 0)
+        return -1;
+
+    double scale = 1;
+    if (*end == 'k' || *end == 'K')
+        scale = 1e3;
+    else if (*end == 'm' || *end == 'M')
+        scale = 1e6;
+    else if (*end == 'g' || *end == 'G')
+        scale = 1e9;
+    if (scale != 1)
+        end++;
+    if (*end != '\0' && strcasecmp(end, unit) != 0)
+        return -1;
+
+    *result = (uint64_t)(number * scale);
+    return 0;
+}
+
+static int impair_parse_prob(const char *value, double *p)
+{
+    char *end;
+    *p = strtod(value, &end);
+    return end == value || *end != '\0' || *p < 0 || *p > 1 ? -1 : 0;
+}
+
+int impair_parse(ImpairProfile *profile, const char *spec)
+{
+    if (profile == NULL || spec == NULL)
+        return -1;
+
+    memset(profile, 0, sizeof(ImpairProfile));
+    profile->seed = 1;
+    profile->reorder_us = 1000;
+    profile->limit_bytes = 64000;
+
+    char buffer[256];
+    if (strlen(spec) >= sizeof(buffer))
+    {
+        LOG_ERROR("impairment settings are too long");
+        return -1;
+    }
+    strcpy(buffer, spec);
+
+    char *save;
+    for (char *item = strtok_r(buffer, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save))
+    {
+        char *value = strchr(item, '=');
+        if (value == NULL)
+        {
+            LOG_ERROR("impairment setting '%s' has no value", item);
+            return -1;
+        }
+        *value++ = '\0';
+
+        int result;
+        if (strcmp(item, "loss") == 0)
+            result = impair_parse_prob(value, &profile->loss);
+        else if (strcmp(item, "dup") == 0)
+            result = impair_parse_prob(value, &profile->duplicate);
+        else if (strcmp(item, "reorder") == 0)
+            result = impair_parse_prob(value, &profile->reorder);
+        else if (strcmp(item, "corrupt") == 0)
+            result = impair_parse_prob(value, &profile->corrupt);
+        else if (strcmp(item, "delay") == 0)
+            result = impair_parse_time(value, &profile->delay_us);
+        else if (strcmp(item, "jitter") == 0)
+            result = impair_parse_time(value, &profile->jitter_us);
+        else if (strcmp(item, "gap") == 0)
+            result = impair_parse_time(value, &profile->reorder_us);
+        else if (strcmp(item, "rate") == 0)
+            result = impair_parse_size(value, "bit", &profile->rate_bps);
+        else if (strcmp(item, "limit") == 0)
+        {
+            uint64_t limit;
+            result = impair_parse_size(value, "b", &limit);
+            if (result == 0 && limit > INT32_MAX)
+                result = -1;
+            profile->limit_bytes = (int)limit;
+        }
+        else if (strcmp(item, "seed") == 0)
+        {
+            char *end;
+            profile->seed = strtoull(value, &end, 0);
+            result = end == value || *end != '\0' ? -1 : 0;
+        }
+        else if (strcmp(item, "dist") == 0)
+        {
+            result = 0;
+            if (strcasecmp(value, "uniform") == 0)
+                profile->jitter_dist = IMPAIR_JITTER_UNIFORM;
+            else if (strcasecmp(value, "normal") == 0)
+                profile->jitter_dist = IMPAIR_JITTER_NORMAL;
+            else if (strcasecmp(value, "pareto") == 0)
+                profile->jitter_dist = IMPAIR_JITTER_PARETO;
+            else
+                result = -1;
+        }
+        else
+        {
+            LOG_ERROR("unknown impairment setting '%s'", item);
+            return -1;
+        }
+
+        if (result < 0)
+        {
+            LOG_ERROR("invalid value '%s' for impairment setting '%s'", value, item);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+Impair *impair_create(const ImpairProfile *profile, int framesize, ImpairOutput output, void *arg)
+{
+    if (profile == NULL || framesize <= 0 || output == NULL)
+    {
+        LOG_ERROR("invalid parameters");
+        return NULL;
+    }
+
+    Impair *impair = calloc(1, sizeof(Impair));
+    if (impair == NULL)
+    {
+        LOG_ERROR("failed to allocate memory for impairment");
+        return NULL;
+    }
+
+    impair->profile = *profile;
+    impair->rng = profile->seed;
+    impair->output = output;
+    impair->output_arg = arg;
+    impair->pool = framepool_create(ImpairQueue, framesize);
+    impair->heap = malloc(ImpairQueue * sizeof(ImpairFrame));
+    if (impair->pool == NULL || impair->heap == NULL)
+    {
+        LOG_ERROR("failed to allocate the impairment queue");
+        impair_destroy(impair);
+        return NULL;
+    }
+
+    return impair;
+}
+
+void impair_destroy(Impair *impair)
+{
+    if (impair == NULL)
+        return;
+
+    if (impair->pool != NULL)
+    {
+        for (int i = 0; i < impair->count; ++i)
+            framepool_put(impair->pool, impair->heap[i].data);
+        framepool_destroy(impair->pool);
+    }
+    free(impair->heap);
+    free(impair);
+}
+
+int impair_send(Impair *impair, const struct sockaddr_in *addr, const uint8_t *frame, int len)
+{
+    if (len > framepool_framesize(impair->pool))
+        return -1;
+
+    impair->stats.frames++;
+
+    if (impair_chance(impair, impair->profile.loss))
+    {
+        impair->stats.lost++;
+        LOG_DEBUG("dropping frame of %d bytes", len);
+        return 0;
+    }
+
+    int copies = 1;
+    if (impair_chance(impair, impair->profile.duplicate))
+    {
+        impair->stats.duplicated++;
+        copies = 2;
+    }
+
+    int result = 0;
+    uint64_t now = monotonic_ns();
+    for (int c = 0; c < copies; ++c)
+    {
+        uint64_t delay = 0;
+        if (impair->profile.rate_bps > 0)
+        {
+            /* The bytes still queued are those that the bottleneck
+             * cannot have sent before now.
+             */
+            uint64_t start = impair->link_free_ns > now ? impair->link_free_ns : now;
+            uint64_t queued = (start - now) * impair->profile.rate_bps / 8000000000u;
+            if (queued + len > (uint64_t)impair->profile.limit_bytes)
+            {
+                impair->stats.queue_drops++;
+                continue;
+            }
+            impair->link_free_ns = start + (uint64_t)len * 8000000000u / impair->profile.rate_bps;
+            delay = impair->link_free_ns - now;
+        }
+
+        delay += impair_delay(impair);
+        int corrupt = impair_chance(impair, impair->profile.corrupt);
+        if (impair_chance(impair, impair->profile.reorder))
+        {
+            impair->stats.reordered++;
+            delay += (uint64_t)impair->profile.reorder_us * 1000u;
+        }
+
+        if (delay == 0 && !corrupt)
+        {
+            result |= impair_transmit(impair, addr, frame, len);
+            continue;
+        }
+
+        uint8_t *copy = framepool_get(impair->pool);
+        if (copy == NULL)
+        {
+            impair->stats.overflow++;
+            LOG_RATELIMITED(LOG_LEVEL_WARN, 1000, "impairment queue is full, dropping frame");
+            continue;
+        }
+        memcpy(copy, frame, len);
+
+        if (corrupt && len > 0)
+        {
+            uint64_t bit = impair_next(impair) % (uint64_t)(len * 8);
+            copy[bit / 8] ^= (uint8_t)(1u << (bit % 8));
+            impair->stats.corrupted++;
+        }
+
+        if (delay == 0)
+        {
+            result |= impair_transmit(impair, addr, copy, len);
+            framepool_put(impair->pool, copy);
+            continue;
+        }
+
+        ImpairFrame delayed;
+        delayed.due_ns = now + delay;
+        delayed.seq = impair->seq++;
+        delayed.addr = *addr;
+        delayed.len = len;
+        delayed.data = copy;
+        impair_push(impair, &delayed);
+        impair->stats.delayed++;
+    }
+
+    return result;
+}
+
+int64_t impair_flush(Impair *impair, int all)
+{
+    uint64_t now = monotonic_ns();
+
+    while (impair->count > 0 && (all || impair->heap[0].due_ns <= now))
+    {
+        ImpairFrame frame = impair->heap[0];
+        impair_pop(impair);
+        impair_transmit(impair, &frame.addr, frame.data, frame.len);
+        framepool_put(impair->pool, frame.data);
+    }
+
+    if (impair->count == 0)
+        return -1;
+    return (int64_t)(impair->heap[0].due_ns - now);
+}
+
+void impair_get_stats(const Impair *impair, ImpairStats *stats)
+{
+    *stats = impair->stats;
+}
+
+const ImpairProfile *impair_profile(const Impair *impair)
+{
+    return &impair->profile;
+}
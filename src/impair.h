@@ -0,0 +1,125 @@
+#ifndef IMPAIR_H
+#define IMPAIR_H
+
+#include <inttypes.h>
+#include <netinet/in.h>
+
+/* The impairment emulator makes a perfect loopback link behave like a
+ * bad network, so that retransmission, reordering and checksum paths
+ * can be exercised and benchmarked on one machine.
+ *
+ * It sits in the send path of an L2 entity (see l2sap_set_impairment
+ * and the L2_IMPAIR environment variable): every frame that the entity
+ * sends may be lost, corrupted in one bit, duplicated, delayed by a
+ * latency plus jitter, or held back behind later frames. Delayed
+ * frames wait in a queue until an L2 function that waits for frames,
+ * or the reactor, sends them when they are due.
+ *
+ * All decisions come from a pseudo-random generator seeded by the
+ * profile, so the same profile and the same sequence of frames give
+ * the same losses, duplicates and delays.
+ */
+
+#define IMPAIR_JITTER_UNIFORM 0 /* delay +- jitter, evenly spread */
+#define IMPAIR_JITTER_NORMAL  1 /* jitter is the standard deviation */
+#define IMPAIR_JITTER_PARETO  2 /* heavy tail with mean jitter, never early */
+
+/* The number of frames that can be delayed at the same time. Frames
+ * beyond that are dropped and counted as overflow.
+ */
+#define ImpairQueue 1024
+
+typedef struct ImpairProfile ImpairProfile;
+
+struct ImpairProfile
+{
+    uint64_t seed;
+
+    /* Probabilities between 0 and 1 per frame. */
+    double   loss;
+    double   duplicate;
+    double   reorder;
+    double   corrupt;
+
+    /* One-way latency and its jitter in microseconds. */
+    int      delay_us;
+    int      jitter_us;
+    int      jitter_dist;
+
+    /* How long a reordered frame is held back in addition to its
+     * delay, so that the frames sent after it overtake it.
+     */
+    int      reorder_us;
+
+    /* A bottleneck in front of the delay: frames leave at rate_bps
+     * bits per second (0 for no limit), one after the other, and wait
+     * in a drop-tail queue of at most limit_bytes bytes.
+     */
+    uint64_t rate_bps;
+    int      limit_bytes;
+};
+
+typedef struct ImpairStats ImpairStats;
+
+struct ImpairStats
+{
+    uint64_t frames;
+    uint64_t lost;
+    uint64_t duplicated;
+    uint64_t reordered;
+    uint64_t corrupted;
+    uint64_t delayed;
+    uint64_t overflow;
+
+    /* Frames dropped because the bottleneck queue was full. */
+    uint64_t queue_drops;
+};
+
+typedef struct Impair Impair;
+
+/* The function through which an emulator hands frames on to the
+ * medium, with the argument given to impair_create. It returns 0, or
+ * -1 if the frame could not be sent.
+ */
+typedef int (*ImpairOutput)( void* arg, const struct sockaddr_in* addr, const uint8_t* frame, int len );
+
+/* Fills profile from a comma-separated list of settings, e.g.
+ * "loss=0.02,delay=10ms,jitter=2ms,dist=normal,seed=7". The keys are
+ * loss, dup, reorder and corrupt (probabilities), delay, jitter and
+ * gap (the reorder hold-back; times with the suffix us or ms, default
+ * ms), dist (uniform, normal or pareto), seed, rate (bits per second
+ * with the suffix kbit, mbit or gbit) and limit (the queue of the rate
+ * limit in bytes, with the suffix kb or mb). Settings that are not
+ * given are 0, except gap, which defaults to 1ms, limit, which
+ * defaults to 64kb, and seed.
+ * Returns 0, or -1 if the list cannot be parsed.
+ */
+int     impair_parse( ImpairProfile* profile, const char* spec );
+
+/* Creates an emulator for frames of up to framesize bytes, which
+ * sends the frames that pass through output.
+ */
+Impair* impair_create( const ImpairProfile* profile, int framesize, ImpairOutput output, void* arg );
+
+/* Frees the emulator. Frames that are still delayed are lost.
+ */
+void    impair_destroy( Impair* impair );
+
+/* Passes one complete frame of len bytes through the impairments.
+ * It is sent through the output to addr now, later, more than once,
+ * or not at all. Returns 0, or -1 if sending failed.
+ */
+int     impair_send( Impair* impair, const struct sockaddr_in* addr,
+                     const uint8_t* frame, int len );
+
+/* Sends the delayed frames that are due; with all set, also those that
+ * are not due yet. Returns the nanoseconds until the next delayed frame
+ * is due, or -1 if none is waiting.
+ */
+int64_t impair_flush( Impair* impair, int all );
+
+void    impair_get_stats( const Impair* impair, ImpairStats* stats );
+
+const ImpairProfile* impair_profile( const Impair* impair );
+
+#endif /* IMPAIR_H */
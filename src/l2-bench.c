@@ -0,0 +1,442 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "l2sap.h"
+#include "bench.h"
+#include "log.h"
+
+void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-n <frames>] [-s <payloadsize>] [-b <batchsize>] [-l <loglevel>] [-p <peers>]\n"
+                    "       frames      - number of frames sent per run (default 100000)\n"
+                    "       payloadsize - payload bytes per frame (default 64)\n"
+                    "       batchsize   - frames per batch in the batched run (default %d)\n"
+                    "       loglevel    - log level of the extra single run with logging on\n"
+                    "                     (default debug; redirect stderr to measure its cost)\n"
+                    "       peers       - clients of the extra run against one L2 server (default 1000)\n",
+            name, L2Batchsize);
+    exit(-1);
+}
+
+static double run_single(L2SAP *tx, L2SAP *rx, int frames, int size)
+{
+    uint8_t payload[L2Payloadsize];
+    uint8_t buffer[L2Payloadsize];
+    memset(payload, 0xa5, sizeof(payload));
+
+    struct timeval tv;
+    int received = 0;
+
+    double start = bench_now();
+    for (int i = 0; i < frames; i++)
+    {
+        if (l2sap_sendto(tx, payload, size) < 0)
+            continue;
+
+        tv.tv_sec = 1;
+        tv.tv_usec = 0;
+        if (l2sap_recvfrom_timeout(rx, buffer, sizeof(buffer), &tv) > 0)
+            received++;
+    }
+    double elapsed = bench_now() - start;
+
+    if (received != frames)
+        LOG_WARN("received %d of %d frames", received, frames);
+    return received / elapsed;
+}
+
+static double run_batched(L2SAP *tx, L2SAP *rx, int frames, int size, int batch)
+{
+    static uint8_t payload[L2Batchsize][L2Payloadsize];
+    static uint8_t buffer[L2Batchsize][L2Payloadsize];
+    const uint8_t *send_data[L2Batchsize];
+    uint8_t *recv_data[L2Batchsize];
+    int send_len[L2Batchsize];
+    int recv_len[L2Batchsize];
+
+    for (int i = 0; i < batch; i++)
+    {
+        memset(payload[i], 0xa5, size);
+        send_data[i] = payload[i];
+        send_len[i] = size;
+        recv_data[i] = buffer[i];
+    }
+
+    struct timeval tv;
+    int received = 0;
+
+    double start = bench_now();
+    for (int sent = 0; sent < frames; sent += batch)
+    {
+        int n = frames - sent < batch ? frames - sent : batch;
+        int out = l2sap_sendto_batch(tx, send_data, send_len, n);
+
+        for (int got = 0; got < out;)
+        {
+            for (int i = 0; i < out - got; i++)
+                recv_len[i] = L2Payloadsize;
+
+            tv.tv_sec = 1;
+            tv.tv_usec = 0;
+            int in = l2sap_recv_batch(rx, recv_data, recv_len, out - got, &tv);
+            if (in == L2_TIMEOUT)
+                break;
+            if (in > 0)
+                got += in;
+            received += in > 0 ? in : 0;
+        }
+    }
+    double elapsed = bench_now() - start;
+
+    if (received != frames)
+        LOG_WARN("received %d of %d frames", received, frames);
+    return received / elapsed;
+}
+
+/* The CPU time of the process, user and system, in seconds.
+ */
+static double cpu_now(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+}
+
+/* Runs the single and the batched path between two entities that
+ * both use backend, and prints packets/sec and the CPU time per packet
+ * of the sender and the receiver together.
+ */
+static void run_backend(int backend, const char *name, int frames, int size, int batch)
+{
+    L2SAP *tx;
+    L2SAP *rx;
+    if (bench_l2_pair(&tx, &rx) < 0)
+    {
+        LOG_ERROR("Failed to create loopback L2 entities");
+        return;
+    }
+
+    if (l2sap_set_backend(tx, backend) != backend || l2sap_set_backend(rx, backend) != backend)
+    {
+        printf("%-6s backend: not available\n", name);
+    }
+    else
+    {
+        double cpu = cpu_now();
+        double single = run_single(tx, rx, frames, size);
+        double single_cpu = cpu_now() - cpu;
+
+        cpu = cpu_now();
+        double batched = run_batched(tx, rx, frames, size, batch);
+        double batched_cpu = cpu_now() - cpu;
+
+        printf("%-6s single  : %10.0f packets/sec, %6.2f us CPU/packet\n",
+               name, single, single_cpu * 1e6 / frames);
+        printf("%-6s batch %-2d: %10.0f packets/sec, %6.2f us CPU/packet\n",
+               name, batch, batched, batched_cpu * 1e6 / frames);
+    }
+
+    l2sap_destroy(tx);
+    l2sap_destroy(rx);
+}
+
+/* The kinds of frames between run_driver and its echo process, in the
+ * first payload byte.
+ */
+#define ECHO_HELLO 'h'
+#define ECHO_PING  'p'
+#define ECHO_BULK  'b'
+#define ECHO_END   'e'
+#define ECHO_QUIT  'q'
+
+/* The echo process of run_driver. It tells the parent at port its own
+ * port with a hello, and then answers every frame but the bulk ones
+ * with the same frame, until it is told to quit.
+ */
+static void run_echo(int driver, int port)
+{
+    L2SAP *l2 = l2sap_create_driver(driver, "127.0.0.1", port);
+    if (l2 == NULL)
+        _exit(1);
+
+    uint8_t buffer[L2Payloadsize];
+    buffer[0] = ECHO_HELLO;
+    l2sap_sendto(l2, buffer, 1);
+
+    struct timeval tv;
+    while (1)
+    {
+        tv.tv_sec = 5;
+        tv.tv_usec = 0;
+        int n = l2sap_recvfrom_timeout(l2, buffer, sizeof(buffer), &tv);
+        if (n <= 0 || buffer[0] == ECHO_QUIT)
+            break;
+        if (buffer[0] != ECHO_BULK)
+            l2sap_sendto(l2, buffer, n);
+    }
+
+    l2sap_destroy(l2);
+    _exit(0);
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Runs a peer with driver in another process, as co-located programs
+ * would, and measures the round trip of one frame and the one-way
+ * rate of bursts of batch frames, each of which the peer acknowledges.
+ */
+static void run_driver(int driver, const char *name, int frames, int size, int batch)
+{
+    if (size < 1)
+        size = 1;
+    int rounds = frames / 10 > 0 ? frames / 10 : 1;
+
+    L2SAP *l2 = l2sap_create_driver(driver, "127.0.0.1", 9);
+    double *rtt = malloc(rounds * sizeof(double));
+    if (l2 == NULL || rtt == NULL)
+    {
+        printf("%-6s driver: not available\n", name);
+        if (l2 != NULL)
+            l2sap_destroy(l2);
+        free(rtt);
+        return;
+    }
+
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0)
+        run_echo(driver, l2sap_local_port(l2));
+
+    uint8_t buffer[L2Payloadsize];
+    struct timeval tv = { 1, 0 };
+    if (child < 0 || l2sap_recvfrom_timeout(l2, buffer, sizeof(buffer), &tv) <= 0 || buffer[0] != ECHO_HELLO)
+    {
+        printf("%-6s driver: the echo process did not start\n", name);
+        if (child > 0)
+        {
+            kill(child, SIGKILL);
+            waitpid(child, NULL, 0);
+        }
+        l2sap_destroy(l2);
+        free(rtt);
+        return;
+    }
+
+    uint8_t payload[L2Payloadsize];
+    memset(payload, 0xa5, sizeof(payload));
+
+    int answered = 0;
+    payload[0] = ECHO_PING;
+    for (int i = 0; i < rounds; i++)
+    {
+        double start = bench_now();
+        l2sap_sendto(l2, payload, size);
+        tv.tv_sec = 1;
+        tv.tv_usec = 0;
+        if (l2sap_recvfrom_timeout(l2, buffer, sizeof(buffer), &tv) > 0)
+            rtt[answered++] = (bench_now() - start) * 1e6;
+    }
+
+    static uint8_t bulk[L2Batchsize][L2Payloadsize];
+    const uint8_t *data[L2Batchsize];
+    int len[L2Batchsize];
+    for (int i = 0; i < batch; i++)
+    {
+        memset(bulk[i], 0xa5, size);
+        bulk[i][0] = i == batch - 1 ? ECHO_END : ECHO_BULK;
+        data[i] = bulk[i];
+        len[i] = size;
+    }
+
+    int bursts = 0;
+    double start = bench_now();
+    for (int sent = 0; sent < frames; sent += batch)
+    {
+        l2sap_sendto_batch(l2, data, len, batch);
+        tv.tv_sec = 1;
+        tv.tv_usec = 0;
+        if (l2sap_recvfrom_timeout(l2, buffer, sizeof(buffer), &tv) > 0)
+            bursts++;
+    }
+    double elapsed = bench_now() - start;
+
+    payload[0] = ECHO_QUIT;
+    l2sap_sendto(l2, payload, 1);
+    waitpid(child, NULL, 0);
+    l2sap_destroy(l2);
+
+    if (answered == 0)
+    {
+        printf("%-6s driver: no answers\n", name);
+        free(rtt);
+        return;
+    }
+
+    qsort(rtt, answered, sizeof(double), compare_double);
+    double sum = 0;
+    for (int i = 0; i < answered; i++)
+        sum += rtt[i];
+
+    if (answered != rounds)
+        LOG_WARN("%d of %d pings were answered", answered, rounds);
+    printf("%-6s round trip: %6.2f us mean, %6.2f us median, %6.2f us p99\n",
+           name, sum / answered, rtt[answered / 2], rtt[answered * 99 / 100]);
+    printf("%-6s one way   : %10.0f msgs/sec in bursts of %d\n",
+           name, (double)bursts * batch / elapsed, batch);
+    free(rtt);
+}
+
+/* One L2 server and many clients: every client in turn sends a frame
+ * that the server echoes to its L2Peer. Returns round trips per second.
+ */
+static double run_server(int frames, int size, int peers)
+{
+    L2SAP *server = l2sap_server_create(0);
+    L2SAP **clients = calloc(peers, sizeof(L2SAP *));
+    if (server == NULL || clients == NULL)
+    {
+        LOG_ERROR("Failed to create the L2 server");
+        return 0;
+    }
+
+    for (int i = 0; i < peers; i++)
+    {
+        clients[i] = l2sap_create("127.0.0.1", l2sap_local_port(server));
+        if (clients[i] == NULL)
+        {
+            LOG_ERROR("Failed to create client %d", i);
+            return 0;
+        }
+    }
+
+    uint8_t payload[L2Payloadsize];
+    uint8_t buffer[L2Payloadsize];
+    memset(payload, 0xa5, sizeof(payload));
+
+    struct timeval tv;
+    int echoed = 0;
+
+    double start = bench_now();
+    for (int i = 0; i < frames; i++)
+    {
+        L2SAP *client = clients[i % peers];
+        if (l2sap_sendto(client, payload, size) < 0)
+            continue;
+
+        L2View view;
+        tv.tv_sec = 1;
+        tv.tv_usec = 0;
+        if (l2sap_recv_view(server, &view, &tv) < 0)
+            continue;
+        l2sap_sendto_peer(server, view.peer, view.payload, view.len);
+        l2sap_release_view(server, &view);
+
+        tv.tv_sec = 1;
+        tv.tv_usec = 0;
+        if (l2sap_recvfrom_timeout(client, buffer, sizeof(buffer), &tv) == size)
+            echoed++;
+    }
+    double elapsed = bench_now() - start;
+
+    if (echoed != frames)
+        LOG_WARN("echoed %d of %d frames", echoed, frames);
+    if (l2sap_peer_count(server) != peers && frames >= peers)
+        LOG_WARN("server knows %d of %d peers", l2sap_peer_count(server), peers);
+
+    for (int i = 0; i < peers; i++)
+        l2sap_destroy(clients[i]);
+    free(clients);
+    l2sap_destroy(server);
+    return echoed / elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+    int frames = 100000;
+    int size = 64;
+    int batch = L2Batchsize;
+    int logging = LOG_LEVEL_DEBUG;
+    int peers = 1000;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:b:l:p:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            frames = atoi(optarg);
+            break;
+        case 's':
+            size = atoi(optarg);
+            break;
+        case 'b':
+            batch = atoi(optarg);
+            break;
+        case 'l':
+            logging = log_level_parse(optarg);
+            break;
+        case 'p':
+            peers = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (frames <= 0 || size < 0 || size > L2Payloadsize || batch <= 0 || batch > L2Batchsize || logging < 0 || peers <= 0)
+        usage(argv[0]);
+
+    L2SAP *tx;
+    L2SAP *rx;
+    if (bench_l2_pair(&tx, &rx) < 0)
+    {
+        LOG_ERROR("Failed to create loopback L2 entities");
+        return -1;
+    }
+
+    /* The runs that are compared use the level from the environment,
+     * by default info, which keeps the data path quiet. The last run
+     * shows what per-frame logging costs.
+     */
+    double single = run_single(tx, rx, frames, size);
+    double batched = run_batched(tx, rx, frames, size, batch);
+
+    int quiet = log_set_level(logging);
+    double logged = run_single(tx, rx, frames, size);
+    log_set_level(quiet);
+
+    double served = run_server(frames, size, peers);
+
+    printf("payload %d bytes, %d frames\n", size, frames);
+    printf("single  : %10.0f packets/sec\n", single);
+    printf("batch %-2d: %10.0f packets/sec (%.2fx)\n", batch, batched, batched / single);
+    printf("single, log level %d: %10.0f packets/sec (%.2fx)\n", logging, logged, logged / single);
+    printf("server, %d peers: %10.0f echoed frames/sec\n", peers, served);
+
+    l2sap_destroy(tx);
+    l2sap_destroy(rx);
+
+    /* The same two paths once with ppoll and recvfrom/sendmmsg, and once
+     * through io_uring.
+     */
+    run_backend(L2_BACKEND_SOCKET, "socket", frames, size, batch);
+    run_backend(L2_BACKEND_URING, "uring", frames, size, batch);
+
+    /* UDP over the loopback interface against the shared-memory rings,
+     * with the peer in another process.
+     */
+    run_driver(L2_DRIVER_SOCKET, "udp", frames, size, batch);
+    run_driver(L2_DRIVER_SHM, "shm", frames, size, batch);
+    return 0;
+}
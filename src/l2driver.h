@@ -0,0 +1,84 @@
+#ifndef L2DRIVER_H
+#define L2DRIVER_H
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "l2sap.h"
+
+/* An L2 driver moves whole frames between an L2 entity and its peers.
+ * The L2SAP builds and tests the frames, keeps the peers, the frame
+ * pool, the impairment emulator and the counters, and calls its driver
+ * for everything that touches the medium. Peers are addressed with a
+ * struct sockaddr_in whatever the driver, so that peer_addr and the
+ * peer table of a server work the same way.
+ *
+ * The socket driver (l2sap.c) sends UDP datagrams; the shared-memory
+ * driver (l2shm.h) moves frames through rings in POSIX shared memory
+ * to entities on the same host.
+ */
+
+typedef struct L2Driver L2Driver;
+
+struct L2Driver
+{
+    const char* name;
+
+    /* Opens the medium of an entity whose peer_addr (port 0 for a
+     * server) and frame size are set, bound to local_port (0 picks
+     * one), with SO_REUSEPORT semantics if reuseport is set. Returns 0
+     * or -1.
+     */
+    int  (*open)( L2SAP* client, int local_port, int reuseport );
+
+    /* Closes the medium. Frames that are still queued are lost.
+     */
+    void (*close)( L2SAP* client );
+
+    /* Sends one frame that is the concatenation of iovcnt segments to
+     * addr. Returns the number of bytes sent or -1. A frame that the
+     * medium drops on the way, as UDP would, counts as sent.
+     */
+    int  (*send)( L2SAP* client, const struct sockaddr_in* addr, const struct iovec* iov, int iovcnt );
+
+    /* Sends the frames of count messages like sendmmsg. Returns the
+     * number of frames sent, or -1 if the first one failed.
+     */
+    int  (*send_batch)( L2SAP* client, struct mmsghdr* msgs, int count );
+
+    /* Receives one frame of up to size bytes and stores the sender.
+     * With MSG_DONTWAIT in flags, it returns L2_AGAIN instead of
+     * waiting if none is queued. Returns the length of the frame, more
+     * than size if it was truncated (like MSG_TRUNC), or -1.
+     */
+    int  (*recv)( L2SAP* client, uint8_t* frame, int size, struct sockaddr_in* sender, int flags );
+
+    /* Receives up to count frames that are queued like recvmmsg with
+     * MSG_DONTWAIT, and sets MSG_TRUNC in msg_flags of a frame that was
+     * truncated. Returns the number of frames or -1.
+     */
+    int  (*recv_batch)( L2SAP* client, struct mmsghdr* msgs, int count );
+
+    /* Waits until a frame can be received, at most timeout (forever if
+     * it is NULL). Returns 1, 0 after the timeout, or -1 like ppoll.
+     */
+    int  (*wait)( L2SAP* client, const struct timespec* timeout );
+
+    /* Returns the descriptor that is readable while frames are queued,
+     * for epoll, or -1.
+     */
+    int  (*fd)( const L2SAP* client );
+
+    /* Returns the local port, or -1.
+     */
+    int  (*port)( const L2SAP* client );
+
+    /* Makes room for frames of framesize bytes before the entity's
+     * frame size changes to it. NULL if the medium takes frames of any
+     * size. Returns 0 or -1.
+     */
+    int  (*set_framesize)( L2SAP* client, int framesize );
+};
+
+#endif /* L2DRIVER_H */
@@ -1,290 +1,2042 @@
+/* sendmmsg, recvmmsg and ppoll are GNU extensions. */
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <stdatomic.h>
 #include <arpa/inet.h>
 
 #include "l2sap.h"
+#include "l2driver.h"
+#include "l2shm.h"
+#include "l2uring.h"
+#include "checksum.h"
+#include "log.h"
+
+/* The payload of a control frame. */
+typedef struct L2Control L2Control;
+
+struct L2Control
+{
+    /* L2_CONTROL_OFFER or L2_CONTROL_AGREE. Both values are no valid
+     * L4 packet type.
+     */
+    uint8_t  kind;
+    uint8_t  mbz[3];
+
+    /* The offered or agreed frame size in network byte order. */
+    uint32_t framesize;
+};
+
+#define L2_CONTROL_OFFER 0xc1
+#define L2_CONTROL_AGREE 0xc2
+
+/* The smallest frame size that l2sap_set_framesize accepts. */
+#define L2Minframesize   64
+
+/* The size of the buffer into which l2sap_sendto_batch builds its
+ * frames. It sends as many frames per system call as fit, but at most
+ * L2Batchsize.
+ */
+#define L2Batchbytes     (64 * 1024)
+
+/* l2sap_max_payload returns the largest payload that fits into a frame
+ * of framesize bytes, which depends on the checksum mode.
+ */
+static int l2sap_max_payload(const L2SAP *client, int framesize)
+{
+    if (client->checksum_mode == L2_CHECKSUM_CRC32C)
+    {
+        return framesize - L2Headersize - L2Crcsize;
+    }
+    return framesize - L2Headersize;
+}
+
+int l2sap_payload_size(const L2SAP *client)
+{
+    return l2sap_max_payload(client, client->framesize);
+}
+
+/* l2sap_build_frame writes the L2Header for a payload of len bytes
+ * followed by the payload itself into frame, which must have room
+ * for the entity's frame size, and fills in the checksum. In CRC32C mode,
+ * the CRC32C trailer is appended behind the payload as well.
+ * It returns the size of the complete frame.
+ */
+static int l2sap_build_frame(L2SAP *client, uint8_t *frame, const uint8_t *data, int len)
+{
+    L2Header *header = (L2Header *)frame;
+
+    int PACKET_SIZE = len + sizeof(L2Header);
+    if (client->checksum_mode == L2_CHECKSUM_CRC32C)
+    {
+        PACKET_SIZE += L2Crcsize;
+    }
+
+    header->dst_addr = client->peer_addr.sin_addr.s_addr;
+    header->len = htons(PACKET_SIZE);
+    header->checksum = 0;
+    header->mbz = 0;
+    memcpy(frame + sizeof(L2Header), data, len);
+    client->stats.tx_copy_bytes += len;
+
+    if (client->checksum_mode == L2_CHECKSUM_CRC32C)
+    {
+        uint32_t crc = htonl(checksum_crc32c(0, frame, sizeof(L2Header) + len));
+        memcpy(frame + sizeof(L2Header) + len, &crc, L2Crcsize);
+    }
+
+    header->checksum = checksum_xor(frame, PACKET_SIZE);
+
+    return PACKET_SIZE;
+}
+
+/* l2sap_check_frame tests the header and the checksum of a frame of
+ * bytes_received bytes that has just arrived. A frame longer than the
+ * entity's frame size, which the driver has truncated, is dropped.
+ * It returns the length of the payload that follows the header, or
+ * -1 if the frame must be dropped. In CRC32C mode, the CRC32C trailer
+ * is tested as well and not counted as payload.
+ */
+static int l2sap_check_frame(L2SAP *client, uint8_t *frame, int bytes_received)
+{
+    client->stats.rx_frames++;
+    client->stats.rx_bytes += bytes_received;
+
+    if (bytes_received > (int)client->framesize)
+    {
+        LOG_RATELIMITED(LOG_LEVEL_WARN, 1000, "received frame too large (%d bytes, frame size %d)",
+                        bytes_received, (int)client->framesize);
+        client->stats.rx_length_errors++;
+        return -1;
+    }
+
+    if (bytes_received < sizeof(L2Header))
+    {
+        LOG_RATELIMITED(LOG_LEVEL_WARN, 1000, "received frame too small (%d bytes)",
+                        bytes_received);
+        client->stats.rx_length_errors++;
+        return -1;
+    }
+
+    LOG_DEBUG("recieved %d bytes", bytes_received);
+
+    L2Header *header = (L2Header *)frame;
+
+    int total_len = ntohs(header->len);
+
+    int payload_len = total_len - sizeof(L2Header);
+
+    if (payload_len < 0)
+    {
+        LOG_RATELIMITED(LOG_LEVEL_WARN, 1000, "invalid payload length (%d)", payload_len);
+        client->stats.rx_length_errors++;
+        return -1;
+    }
+
+    if (total_len != bytes_received)
+    {
+        LOG_RATELIMITED(LOG_LEVEL_INFO, 1000, "header indicates total size %d, but received %d",
+                        total_len, (int)(bytes_received));
+
+        payload_len = bytes_received - sizeof(L2Header);
+
+        if (payload_len < 0)
+        {
+            LOG_RATELIMITED(LOG_LEVEL_WARN, 1000, "calculated negative payload length");
+            client->stats.rx_length_errors++;
+            return -1;
+        }
+    }
+
+    LOG_DEBUG("payload length (packet size - header size) is %d", payload_len);
+
+    /* The XOR over the whole frame including the received checksum is
+     * the checksum that the sender should have computed, XORed with
+     * the one it did compute. This saves clearing the field first.
+     */
+    uint8_t received_checksum = header->checksum;
+    uint8_t calculated_checksum = checksum_xor(frame, bytes_received) ^ received_checksum;
+
+    if (calculated_checksum != received_checksum)
+    {
+        LOG_RATELIMITED(LOG_LEVEL_WARN, 1000, "checksum verification failed (got %d, expected %d)",
+                        calculated_checksum, received_checksum);
+        client->stats.rx_checksum_errors++;
+        return -1;
+    }
+
+    if (client->checksum_mode == L2_CHECKSUM_CRC32C)
+    {
+        if (payload_len < L2Crcsize)
+        {
+            LOG_RATELIMITED(LOG_LEVEL_WARN, 1000, "frame too small for CRC32C trailer");
+            client->stats.rx_length_errors++;
+            return -1;
+        }
+        payload_len -= L2Crcsize;
+
+        uint32_t received_crc;
+        memcpy(&received_crc, frame + sizeof(L2Header) + payload_len, L2Crcsize);
+
+        header->checksum = 0;
+        uint32_t calculated_crc = checksum_crc32c(0, frame, sizeof(L2Header) + payload_len);
+        header->checksum = received_checksum;
+
+        if (calculated_crc != ntohl(received_crc))
+        {
+            LOG_RATELIMITED(LOG_LEVEL_WARN, 1000, "CRC32C verification failed (got %08x, expected %08x)",
+                            calculated_crc, ntohl(received_crc));
+            client->stats.rx_checksum_errors++;
+            return -1;
+        }
+    }
+
+    return payload_len;
+}
+
+/* The socket driver, which sends every frame as a UDP datagram.
+ */
+static int l2sap_socket_open(L2SAP *client, int local_port, int reuseport)
+{
+    client->socket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (client->socket < 0)
+    {
+        LOG_ERROR("failed to create socket.");
+        return -1;
+    }
+
+    struct sockaddr_in local_addr;
+    memset(&local_addr, 0, sizeof(local_addr));
+    local_addr.sin_family = AF_INET;
+    local_addr.sin_addr.s_addr = INADDR_ANY;
+    local_addr.sin_port = htons(local_port);
+
+    int one = 1;
+    if (reuseport && setsockopt(client->socket, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+    {
+        LOG_ERROR("failed to set SO_REUSEPORT");
+        close(client->socket);
+        return -1;
+    }
+
+    int bindValue = bind(client->socket, (struct sockaddr *)&local_addr, sizeof(local_addr));
+    if (bindValue < 0)
+    {
+        LOG_ERROR("binding failed");
+        close(client->socket);
+        return -1;
+    }
+    LOG_DEBUG("bound socket to address %s", inet_ntoa(local_addr.sin_addr));
+    return 0;
+}
+
+static void l2sap_socket_close(L2SAP *client)
+{
+    if (client->socket >= 0)
+    {
+        LOG_DEBUG("closing socket");
+        close(client->socket);
+    }
+}
+
+static int l2sap_socket_send(L2SAP *client, const struct sockaddr_in *addr, const struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = (void *)addr;
+    msg.msg_namelen = sizeof(*addr);
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = iovcnt;
+
+    return sendmsg(client->socket, &msg, 0);
+}
+
+static int l2sap_socket_send_batch(L2SAP *client, struct mmsghdr *msgs, int count)
+{
+    return sendmmsg(client->socket, msgs, count, 0);
+}
+
+static int l2sap_socket_recv(L2SAP *client, uint8_t *frame, int size, struct sockaddr_in *sender_addr, int flags)
+{
+    socklen_t sender_addr_len = sizeof(*sender_addr);
+
+    int bytes_received = recvfrom(client->socket, frame, size, flags | MSG_TRUNC,
+                                  (struct sockaddr *)sender_addr, &sender_addr_len);
+
+    if (bytes_received < 0)
+    {
+        if ((flags & MSG_DONTWAIT) && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return L2_AGAIN;
+        }
+        LOG_ERROR("recvfrom call failed");
+        return -1;
+    }
+    return bytes_received;
+}
+
+static int l2sap_socket_recv_batch(L2SAP *client, struct mmsghdr *msgs, int count)
+{
+    return recvmmsg(client->socket, msgs, count, MSG_DONTWAIT, NULL);
+}
+
+static int l2sap_socket_wait(L2SAP *client, const struct timespec *timeout)
+{
+    struct pollfd pfd;
+    pfd.fd = l2sap_fd(client);
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    return ppoll(&pfd, 1, timeout, NULL);
+}
+
+static int l2sap_socket_fd(const L2SAP *client)
+{
+    return client->socket;
+}
+
+static int l2sap_socket_port(const L2SAP *client)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getsockname(client->socket, (struct sockaddr *)&addr, &addr_len) < 0)
+    {
+        return -1;
+    }
+    return ntohs(addr.sin_port);
+}
+
+static const L2Driver l2sap_socket_driver = {
+    .name = "socket",
+    .open = l2sap_socket_open,
+    .close = l2sap_socket_close,
+    .send = l2sap_socket_send,
+    .send_batch = l2sap_socket_send_batch,
+    .recv = l2sap_socket_recv,
+    .recv_batch = l2sap_socket_recv_batch,
+    .wait = l2sap_socket_wait,
+    .fd = l2sap_socket_fd,
+    .port = l2sap_socket_port,
+};
+
+/* The drivers by their number, L2_DRIVER_SOCKET and L2_DRIVER_SHM. */
+static const L2Driver *const l2sap_drivers[] = {
+    &l2sap_socket_driver,
+    &l2shm_driver,
+};
+
+/* l2sap_default_driver is the driver that the environment variable
+ * L2_DRIVER names, "socket" (the default) or "shm".
+ */
+static int l2sap_default_driver(void)
+{
+    const char *driver = getenv("L2_DRIVER");
+    if (driver == NULL || *driver == '\0' || strcmp(driver, "socket") == 0)
+    {
+        return L2_DRIVER_SOCKET;
+    }
+    if (strcmp(driver, "shm") == 0)
+    {
+        return L2_DRIVER_SHM;
+    }
+    LOG_WARN("ignoring L2_DRIVER=%s", driver);
+    return L2_DRIVER_SOCKET;
+}
+
+/* l2sap_open creates an L2 entity with the given driver whose medium is
+ * bound to local_port (0 for any), with SO_REUSEPORT if reuseport is
+ * set, and whose peer is server_ip:server_port. It is the common part of
+ * l2sap_create and the server functions.
+ */
+static L2SAP *l2sap_open(int driver, const char *server_ip, int server_port, int local_port, int reuseport)
+{
+    if (driver != L2_DRIVER_SOCKET && driver != L2_DRIVER_SHM)
+    {
+        LOG_ERROR("invalid driver %d", driver);
+        return NULL;
+    }
+
+    L2SAP *service_access_point = malloc(sizeof(struct L2SAP));
+    if (!service_access_point)
+    {
+        LOG_ERROR("failed to allocate memory for service_access_point.");
+        return NULL;
+    }
+
+    service_access_point->socket = -1;
+    service_access_point->driver = l2sap_drivers[driver];
+    service_access_point->link = NULL;
+    service_access_point->checksum_mode = L2_CHECKSUM_XOR;
+    service_access_point->peers = NULL;
+    service_access_point->impair = NULL;
+    service_access_point->framesize = L2Framesize;
+    service_access_point->framesize_agreed = 0;
+    service_access_point->uring = NULL;
+    service_access_point->headroom = 0;
+    memset(&service_access_point->stats, 0, sizeof(service_access_point->stats));
+
+    memset(&service_access_point->peer_addr, 0, sizeof(service_access_point->peer_addr));
+    service_access_point->peer_addr.sin_family = AF_INET;
+    service_access_point->peer_addr.sin_port = htons(server_port);
+
+    int validIp = inet_pton(AF_INET, server_ip, &service_access_point->peer_addr.sin_addr);
+    if (validIp <= 0)
+    {
+        LOG_ERROR("Invalid IP address");
+        free(service_access_point);
+        return NULL;
+    }
+
+    service_access_point->rx_lent = 0;
+    service_access_point->own_pool = 1;
+    service_access_point->rxframes = L2Rxframes;
+    service_access_point->pool = framepool_create(L2Rxframes, L2Framesize);
+    if (service_access_point->pool == NULL)
+    {
+        LOG_ERROR("failed to allocate receive buffers.");
+        free(service_access_point);
+        return NULL;
+    }
+
+    if (service_access_point->driver->open(service_access_point, local_port, reuseport) < 0)
+    {
+        framepool_destroy(service_access_point->pool);
+        free(service_access_point);
+        return NULL;
+    }
+
+    const char *impairment = getenv("L2_IMPAIR");
+    if (impairment != NULL && *impairment != '\0')
+    {
+        ImpairProfile profile;
+        if (impair_parse(&profile, impairment) < 0 ||
+            l2sap_set_impairment(service_access_point, &profile) < 0)
+        {
+            LOG_WARN("ignoring L2_IMPAIR=%s", impairment);
+        }
+    }
+
+    const char *backend = getenv("L2_BACKEND");
+    if (backend != NULL && strcmp(backend, "uring") == 0)
+    {
+        l2sap_set_backend(service_access_point, L2_BACKEND_URING);
+    }
+    else if (backend != NULL && *backend != '\0' && strcmp(backend, "socket") != 0)
+    {
+        LOG_WARN("ignoring L2_BACKEND=%s", backend);
+    }
+
+    return service_access_point;
+}
+
+L2SAP *l2sap_create(const char *server_ip, int server_port)
+{
+    return l2sap_open(l2sap_default_driver(), server_ip, server_port, 0, 0);
+}
+
+L2SAP *l2sap_create_driver(int driver, const char *server_ip, int server_port)
+{
+    return l2sap_open(driver, server_ip, server_port, 0, 0);
+}
+
+/* l2sap_server_open is l2sap_server_create_driver, and with reuseport
+ * l2sap_server_create_shared.
+ */
+static L2SAP *l2sap_server_open(int driver, int port, int reuseport)
+{
+    if (port < 0 || port > 65535)
+    {
+        LOG_ERROR("invalid port %d", port);
+        return NULL;
+    }
+
+    L2SAP *server = l2sap_open(driver, "0.0.0.0", 0, port, reuseport);
+    if (server == NULL)
+    {
+        return NULL;
+    }
+
+    server->peers = peertable_create(L2Maxpeers);
+    if (server->peers == NULL)
+    {
+        l2sap_destroy(server);
+        return NULL;
+    }
+
+    return server;
+}
+
+L2SAP *l2sap_server_create(int port)
+{
+    return l2sap_server_open(l2sap_default_driver(), port, 0);
+}
+
+L2SAP *l2sap_server_create_shared(int port)
+{
+    return l2sap_server_open(l2sap_default_driver(), port, 1);
+}
+
+L2SAP *l2sap_server_create_driver(int driver, int port)
+{
+    return l2sap_server_open(driver, port, 0);
+}
+
+/* l2sap_headroom is the number of bytes in front of the frames in the
+ * receive buffers, which the io_uring backend needs.
+ */
+static int l2sap_headroom(const L2SAP *client)
+{
+    return client->headroom;
+}
+
+static atomic_uint l2sap_fd_change_count;
+
+unsigned l2sap_fd_changes(void)
+{
+    return atomic_load_explicit(&l2sap_fd_change_count, memory_order_relaxed);
+}
+
+/* l2sap_uring_failed destroys the io_uring of an entity after it
+ * failed, so that the entity goes on with its socket.
+ */
+static void l2sap_uring_failed(L2SAP *client)
+{
+    LOG_WARN("the io_uring failed, using the socket");
+    l2uring_destroy(client->uring);
+    client->uring = NULL;
+    atomic_fetch_add_explicit(&l2sap_fd_change_count, 1, memory_order_relaxed);
+}
+
+/* l2sap_private_pool creates a private pool of count buffers for
+ * frames of framesize bytes, plus the buffers of the io_uring and the
+ * headroom in front of each frame if uring is set.
+ */
+static FramePool *l2sap_private_pool(int count, int framesize, int uring)
+{
+    if (uring)
+    {
+        return framepool_create(count + L2Uringbuffers, framesize + L2Uringheadroom);
+    }
+    return framepool_create(count, framesize);
+}
+
+/* l2sap_replace_pool makes pool the pool of the entity, private if own
+ * is set, moves the receive buffers of the io_uring to it, and destroys
+ * the previous pool if it was private. Nothing may be lent.
+ */
+static int l2sap_replace_pool(L2SAP *client, FramePool *pool, int own)
+{
+    FramePool *previous = client->pool;
+    int previous_own = client->own_pool;
+    client->pool = pool;
+    client->own_pool = own;
+    client->headroom = client->uring != NULL ? L2Uringheadroom : 0;
+
+    int result = 0;
+    if (client->uring != NULL)
+    {
+        result = l2uring_set_pool(client->uring, pool, own ? L2Uringbuffers : L2Rxframes);
+    }
+
+    if (previous_own && previous != pool)
+    {
+        framepool_destroy(previous);
+    }
+    return result;
+}
+
+void l2sap_destroy(L2SAP *client)
+{
+    if (client == NULL)
+    {
+        LOG_WARN("client was null");
+        return;
+    }
+
+    /* Frames that the emulator still delays, e.g. the RESETs of
+     * l4sap_destroy, are sent early rather than lost.
+     */
+    if (client->impair != NULL)
+    {
+        impair_flush(client->impair, 1);
+        impair_destroy(client->impair);
+    }
+
+    if (client->uring != NULL)
+    {
+        l2uring_destroy(client->uring);
+    }
+
+    client->driver->close(client);
+
+    if (client->rx_lent != 0)
+    {
+        LOG_WARN("%d receive buffers are still lent", client->rx_lent);
+    }
+
+    LOG_DEBUG("freeing client memory");
+    peertable_destroy(client->peers);
+    if (client->own_pool)
+    {
+        framepool_destroy(client->pool);
+    }
+    free(client);
+}
+
+int l2sap_set_pool(L2SAP *client, FramePool *pool)
+{
+    if (client == NULL || pool == NULL || framepool_framesize(pool) < client->framesize)
+    {
+        LOG_ERROR("invalid parameters");
+        return -1;
+    }
+
+    if (client->rx_lent != 0)
+    {
+        LOG_ERROR("cannot change the pool while receive buffers are lent");
+        return -1;
+    }
+
+    if (framepool_framesize(pool) < client->framesize + l2sap_headroom(client))
+    {
+        LOG_ERROR("the pool has no room for the io_uring headroom");
+        return -1;
+    }
+
+    return l2sap_replace_pool(client, pool, 0);
+}
+
+int l2sap_set_rxframes(L2SAP *client, int count)
+{
+    if (client == NULL || count <= 0)
+    {
+        LOG_ERROR("invalid parameters");
+        return -1;
+    }
+
+    if (client->rx_lent != 0)
+    {
+        LOG_ERROR("cannot change the pool while receive buffers are lent");
+        return -1;
+    }
+
+    if (client->own_pool && count != client->rxframes)
+    {
+        FramePool *pool = l2sap_private_pool(count, client->framesize, client->uring != NULL);
+        if (pool == NULL || l2sap_replace_pool(client, pool, 1) < 0)
+        {
+            return -1;
+        }
+    }
+    client->rxframes = count;
+    return 0;
+}
+
+/* l2sap_impair_output hands the frames that the impairment emulator
+ * lets through to the driver.
+ */
+static int l2sap_impair_output(void *arg, const struct sockaddr_in *addr, const uint8_t *frame, int len)
+{
+    L2SAP *client = arg;
+
+    struct iovec iov;
+    iov.iov_base = (void *)frame;
+    iov.iov_len = len;
+
+    return client->driver->send(client, addr, &iov, 1) == len ? 0 : -1;
+}
+
+int l2sap_set_impairment(L2SAP *client, const ImpairProfile *profile)
+{
+    if (client == NULL)
+    {
+        LOG_ERROR("invalid parameters");
+        return -1;
+    }
+
+    Impair *impair = NULL;
+    if (profile != NULL)
+    {
+        impair = impair_create(profile, client->framesize, l2sap_impair_output, client);
+        if (impair == NULL)
+        {
+            return -1;
+        }
+    }
+
+    if (client->impair != NULL)
+    {
+        impair_flush(client->impair, 1);
+        impair_destroy(client->impair);
+    }
+    client->impair = impair;
+    return 0;
+}
+
+int64_t l2sap_flush_impaired(L2SAP *client)
+{
+    if (client == NULL || client->impair == NULL)
+    {
+        return -1;
+    }
+    return impair_flush(client->impair, 0);
+}
+
+int l2sap_set_framesize(L2SAP *client, int framesize)
+{
+    if (client == NULL || framesize < L2Minframesize || framesize > L2Maxframesize)
+    {
+        LOG_ERROR("invalid parameters");
+        return -1;
+    }
+
+    if (client->rx_lent != 0)
+    {
+        LOG_ERROR("cannot change the frame size while receive buffers are lent");
+        return -1;
+    }
+
+    if (client->driver->set_framesize != NULL && client->driver->set_framesize(client, framesize) < 0)
+    {
+        return -1;
+    }
+
+    if (client->own_pool && framesize != client->framesize)
+    {
+        FramePool *pool = l2sap_private_pool(client->rxframes, framesize, client->uring != NULL);
+        if (pool == NULL || l2sap_replace_pool(client, pool, 1) < 0)
+        {
+            return -1;
+        }
+    }
+    else if (!client->own_pool && framepool_framesize(client->pool) < framesize + l2sap_headroom(client))
+    {
+        LOG_ERROR("the shared pool has buffers of %d bytes only", framepool_framesize(client->pool));
+        return -1;
+    }
+
+    client->framesize = framesize;
+    client->framesize_agreed = 0;
+
+    /* The emulator keeps copies of whole frames. */
+    if (client->impair != NULL)
+    {
+        ImpairProfile profile = *impair_profile(client->impair);
+        if (l2sap_set_impairment(client, &profile) < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int l2sap_set_checksum(L2SAP *client, int mode)
+{
+    if (client == NULL || (mode != L2_CHECKSUM_XOR && mode != L2_CHECKSUM_CRC32C))
+    {
+        LOG_ERROR("invalid parameters");
+        return -1;
+    }
+
+    client->checksum_mode = mode;
+    return 0;
+}
+
+int l2sap_set_backend(L2SAP *client, int backend)
+{
+    if (client == NULL || (backend != L2_BACKEND_SOCKET && backend != L2_BACKEND_URING))
+    {
+        LOG_ERROR("invalid parameters");
+        return -1;
+    }
+
+    if (client->rx_lent != 0)
+    {
+        LOG_ERROR("cannot change the backend while receive buffers are lent");
+        return -1;
+    }
+
+    if (backend == l2sap_backend(client))
+    {
+        return backend;
+    }
+
+    if (client->driver != &l2sap_socket_driver)
+    {
+        LOG_WARN("the %s driver has no io_uring backend", client->driver->name);
+        return L2_BACKEND_SOCKET;
+    }
+
+    if (backend == L2_BACKEND_SOCKET)
+    {
+        l2uring_destroy(client->uring);
+        client->uring = NULL;
+        client->headroom = 0;
+        if (client->own_pool)
+        {
+            FramePool *pool = l2sap_private_pool(client->rxframes, client->framesize, 0);
+            if (pool != NULL)
+            {
+                l2sap_replace_pool(client, pool, 1);
+            }
+        }
+        return L2_BACKEND_SOCKET;
+    }
+
+    FramePool *pool = client->pool;
+    if (client->own_pool)
+    {
+        pool = l2sap_private_pool(client->rxframes, client->framesize, 1);
+        if (pool == NULL)
+        {
+            return -1;
+        }
+    }
+    else if (framepool_framesize(pool) < client->framesize + L2Uringheadroom)
+    {
+        LOG_WARN("the shared pool has no room for the io_uring headroom, using the socket");
+        return L2_BACKEND_SOCKET;
+    }
+
+    client->uring = l2uring_create(client->socket, pool, client->own_pool ? L2Uringbuffers : L2Rxframes);
+    if (client->uring == NULL)
+    {
+        LOG_WARN("io_uring is not available, using the socket");
+        if (pool != client->pool)
+        {
+            framepool_destroy(pool);
+        }
+        return L2_BACKEND_SOCKET;
+    }
+
+    if (pool != client->pool)
+    {
+        framepool_destroy(client->pool);
+        client->pool = pool;
+    }
+    client->headroom = L2Uringheadroom;
+    return L2_BACKEND_URING;
+}
+
+int l2sap_backend(const L2SAP *client)
+{
+    return client->uring != NULL ? L2_BACKEND_URING : L2_BACKEND_SOCKET;
+}
+
+int l2sap_fd(const L2SAP *client)
+{
+    if (client->uring != NULL)
+    {
+        return l2uring_fd(client->uring);
+    }
+    return client->driver->fd(client);
+}
+
+int l2sap_driver(const L2SAP *client)
+{
+    return client->driver == &l2shm_driver ? L2_DRIVER_SHM : L2_DRIVER_SOCKET;
+}
+
+int l2sap_local_port(const L2SAP *client)
+{
+    return client->driver->port(client);
+}
+
+int l2sap_pending(const L2SAP *client)
+{
+    if (client->uring != NULL)
+    {
+        return l2uring_pending(client->uring);
+    }
+    return 0;
+}
+
+/* l2sap_sendto sends data through the entity's driver (over UDP
+ * unless it has another, see l2sap_create_driver) to the remote
+ * receiver that is identified by peer_address.
+ * The parameter data points to payload that L3 wants to send
+ * to the remote L3 entity. This payload is len bytes long.
+ * l2_sendto must add an L2 header in front of this payload.
+ * When the payload length and the L2Header together exceed
+ * the entity's frame size (see l2sap_set_framesize), l2_sendto fails.
+ */
+int l2sap_sendto(L2SAP *client, const uint8_t *data, int len)
+{
+    if (client == NULL || data == NULL || len < 0)
+    {
+        LOG_ERROR("invalid parameters");
+        return -1;
+    }
+
+    struct iovec iov;
+    iov.iov_base = (void *)data;
+    iov.iov_len = len;
+
+    return l2sap_sendv(client, &iov, 1);
+}
+
+int l2sap_sendto_peer(L2SAP *server, L2Peer *peer, const uint8_t *data, int len)
+{
+    if (server == NULL || data == NULL || len < 0)
+    {
+        LOG_ERROR("invalid parameters");
+        return -1;
+    }
+
+    struct iovec iov;
+    iov.iov_base = (void *)data;
+    iov.iov_len = len;
+
+    return l2sap_sendv_peer(server, peer, &iov, 1);
+}
+
+/* l2sap_sendv_addr sends one frame whose payload is split into
+ * segments to addr, a peer that accepts frames of up to framesize
+ * bytes. With control set, it is a control frame. It is l2sap_sendv,
+ * l2sap_sendv_peer and the sending half of the negotiation.
+ * The L2Header (and the CRC32C trailer) are built on the stack and
+ * handed to the driver together with the caller's segments (the socket
+ * driver sends them with one sendmsg call), so the payload is not
+ * copied in user space on the way. The XOR checksum is the XOR of the
+ * per-segment checksums, and the CRC32C is chained across the header
+ * and the segments, which gives the same values as l2sap_build_frame.
+ */
+static int l2sap_sendv_addr(L2SAP *client, struct sockaddr_in *addr, int framesize, int control,
+                            const struct iovec *iov, int iovcnt)
+{
+    if (iov == NULL || iovcnt < 0 || iovcnt > L2Maxsegments)
+    {
+        LOG_ERROR("invalid parameters");
+        return -1;
+    }
+
+    int len = 0;
+    for (int i = 0; i < iovcnt; ++i)
+    {
+        if (iov[i].iov_base == NULL && iov[i].iov_len > 0)
+        {
+            LOG_ERROR("invalid parameters");
+            return -1;
+        }
+        len += iov[i].iov_len;
+    }
+
+    if (len > l2sap_max_payload(client, framesize))
+    {
+        LOG_ERROR("payload is too large");
+        return -1;
+    }
+
+    int PACKET_SIZE = len + sizeof(L2Header);
+    if (client->checksum_mode == L2_CHECKSUM_CRC32C)
+    {
+        PACKET_SIZE += L2Crcsize;
+    }
+
+    L2Header header;
+    header.dst_addr = addr->sin_addr.s_addr;
+    header.len = htons(PACKET_SIZE);
+    header.checksum = 0;
+    header.mbz = control ? L2_MBZ_CONTROL : 0;
+
+    struct iovec segments[L2Maxsegments + 2];
+    segments[0].iov_base = &header;
+    segments[0].iov_len = sizeof(L2Header);
+
+    uint8_t checksum = checksum_xor((const uint8_t *)&header, sizeof(L2Header));
+    for (int i = 0; i < iovcnt; ++i)
+    {
+        segments[i + 1] = iov[i];
+        checksum ^= checksum_xor(iov[i].iov_base, iov[i].iov_len);
+    }
+    int count = iovcnt + 1;
+
+    uint32_t crc;
+    if (client->checksum_mode == L2_CHECKSUM_CRC32C)
+    {
+        crc = checksum_crc32c(0, (const uint8_t *)&header, sizeof(L2Header));
+        for (int i = 0; i < iovcnt; ++i)
+        {
+            crc = checksum_crc32c(crc, iov[i].iov_base, iov[i].iov_len);
+        }
+        crc = htonl(crc);
+        checksum ^= checksum_xor((const uint8_t *)&crc, L2Crcsize);
+
+        segments[count].iov_base = &crc;
+        segments[count].iov_len = L2Crcsize;
+        count++;
+    }
+
+    header.checksum = checksum;
+
+    LOG_DEBUG("Size of payload+headerr: %d", PACKET_SIZE);
+
+    if (client->impair != NULL)
+    {
+        /* The emulator may have to keep the frame, so it gets one
+         * contiguous copy.
+         */
+        uint8_t frame[L2Maxframesize];
+        int offset = 0;
+        for (int i = 0; i < count; ++i)
+        {
+            memcpy(frame + offset, segments[i].iov_base, segments[i].iov_len);
+            offset += segments[i].iov_len;
+        }
+        client->stats.tx_copy_bytes += len;
+
+        impair_flush(client->impair, 0);
+        if (impair_send(client->impair, addr, frame, PACKET_SIZE) < 0)
+        {
+            client->stats.tx_errors++;
+            return -1;
+        }
+        client->stats.tx_frames++;
+        client->stats.tx_bytes += PACKET_SIZE;
+        return len;
+    }
+
+    int bytes_sent = client->driver->send(client, addr, segments, count);
+
+    if (bytes_sent < 0)
+    {
+        LOG_RATELIMITED(LOG_LEVEL_ERROR, 1000, "fail to send bytes, sent %d.", bytes_sent);
+        client->stats.tx_errors++;
+        return -1;
+    }
+    if (bytes_sent != PACKET_SIZE)
+    {
+        LOG_RATELIMITED(LOG_LEVEL_ERROR, 1000, "sent %d bytes,  expected %d",
+                        bytes_sent, PACKET_SIZE);
+        client->stats.tx_errors++;
+        return -1;
+    }
+    client->stats.tx_frames++;
+    client->stats.tx_bytes += bytes_sent;
+
+    LOG_DEBUG("Sending frame of size %d to %s:%d",
+              bytes_sent, inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+
+    return len;
+}
+
+int l2sap_sendv(L2SAP *client, const struct iovec *iov, int iovcnt)
+{
+    if (client == NULL)
+    {
+        LOG_ERROR("invalid parameters");
+        return -1;
+    }
+
+    if (client->peers != NULL)
+    {
+        LOG_ERROR("a server must send to a peer");
+        return -1;
+    }
+
+    return l2sap_sendv_addr(client, &client->peer_addr, client->framesize, 0, iov, iovcnt);
+}
+
+int l2sap_sendv_peer(L2SAP *server, L2Peer *peer, const struct iovec *iov, int iovcnt)
+{
+    if (server == NULL || server->peers == NULL || peer == NULL)
+    {
+        LOG_ERROR("invalid parameters");
+        return -1;
+    }
+
+    int framesize = peer->framesize > 0 ? peer->framesize : server->framesize;
+    int result = l2sap_sendv_addr(server, &peer->addr, framesize, 0, iov, iovcnt);
+    if (result >= 0)
+    {
+        peer->tx_frames++;
+    }
+    return result;
+}
+
+/* l2sap_note_sender records who sent a valid frame. A client makes
+ * the sender its peer address; a server looks up (or creates) the
+ * sender's L2Peer and stores it in peer. It returns -1 if a server has
+ * no room for a new peer, in which case the frame must be dropped.
+ */
+static int l2sap_note_sender(L2SAP *client, const struct sockaddr_in *sender_addr, L2Peer **peer)
+{
+    if (client->peers == NULL)
+    {
+        client->peer_addr = *sender_addr;
+        *peer = NULL;
+        return 0;
+    }
+
+    *peer = peertable_lookup(client->peers, sender_addr, 1);
+    if (*peer == NULL)
+    {
+        return -1;
+    }
+    (*peer)->rx_frames++;
+    return 0;
+}
+
+/* l2sap_send_control sends a control frame to addr.
+ */
+static int l2sap_send_control(L2SAP *client, struct sockaddr_in *addr, uint8_t kind, int framesize)
+{
+    L2Control control;
+    memset(&control, 0, sizeof(control));
+    control.kind = kind;
+    control.framesize = htonl(framesize);
+
+    struct iovec iov;
+    iov.iov_base = &control;
+    iov.iov_len = sizeof(control);
+
+    return l2sap_sendv_addr(client, addr, L2Minframesize, 1, &iov, 1);
+}
+
+/* l2sap_control handles a control frame with the given payload from
+ * sender_addr, which is peer on a server. An offer is answered with
+ * the smaller of the offered and the own frame size, and that size is
+ * used for the sender from now on. An answer to our own offer sets
+ * the agreed frame size.
+ */
+static void l2sap_control(L2SAP *client, const uint8_t *payload, int len,
+                          struct sockaddr_in *sender_addr, L2Peer *peer)
+{
+    L2Control control;
+    if (len < (int)sizeof(control))
+    {
+        LOG_RATELIMITED(LOG_LEVEL_WARN, 1000, "control frame too small (%d bytes)", len);
+        return;
+    }
+    memcpy(&control, payload, sizeof(control));
+
+    int framesize = ntohl(control.framesize);
+    if (framesize < L2Minframesize || framesize > L2Maxframesize)
+    {
+        LOG_RATELIMITED(LOG_LEVEL_WARN, 1000, "invalid frame size %d in control frame", framesize);
+        return;
+    }
+
+    switch (control.kind)
+    {
+    case L2_CONTROL_OFFER:
+        if (framesize > client->framesize)
+        {
+            framesize = client->framesize;
+        }
+        LOG_DEBUG("peer offers frame size %d, agreeing to %d", ntohl(control.framesize), framesize);
+        l2sap_send_control(client, sender_addr, L2_CONTROL_AGREE, framesize);
+        break;
+
+    case L2_CONTROL_AGREE:
+        if (framesize > client->framesize)
+        {
+            LOG_RATELIMITED(LOG_LEVEL_WARN, 1000, "peer agreed to frame size %d, more than offered", framesize);
+            return;
+        }
+        LOG_DEBUG("peer agreed to frame size %d", framesize);
+        break;
+
+    default:
+        LOG_RATELIMITED(LOG_LEVEL_WARN, 1000, "unknown control frame %d", control.kind);
+        return;
+    }
+
+    if (peer != NULL)
+    {
+        peer->framesize = framesize;
+    }
+    else
+    {
+        client->framesize = framesize;
+        client->framesize_agreed = 1;
+    }
+}
+
+/* l2sap_accept tests a frame of bytes_received bytes that arrived from
+ * sender_addr and notes the sender in the peer address or peer, see
+ * l2sap_note_sender. Control frames are handled here and count as
+ * invalid frames. Both backends receive through it.
+ * It returns the length of the payload behind the L2Header, or -1.
+ */
+static int l2sap_accept(L2SAP *client, uint8_t *frame, int bytes_received, struct sockaddr_in *sender_addr,
+                        L2Peer **peer)
+{
+    int payload_len = l2sap_check_frame(client, frame, bytes_received);
+    if (payload_len < 0)
+    {
+        return -1;
+    }
+
+    if (l2sap_note_sender(client, sender_addr, peer) < 0)
+    {
+        return -1;
+    }
+
+    if (((L2Header *)frame)->mbz == L2_MBZ_CONTROL)
+    {
+        l2sap_control(client, frame + sizeof(L2Header), payload_len, sender_addr, *peer);
+        return -1;
+    }
+    return payload_len;
+}
+
+/* l2sap_recv_raw reads one frame from the driver into frame, which
+ * holds the entity's frame size, stores the sender's address in
+ * sender_addr and tests it with l2sap_accept.
+ * With MSG_DONTWAIT in flags, it returns L2_AGAIN instead of waiting
+ * when no frame is queued.
+ * It returns the length of the payload behind the L2Header, or -1.
+ */
+static int l2sap_recv_raw(L2SAP *client, uint8_t *frame, struct sockaddr_in *sender_addr, L2Peer **peer,
+                          int flags)
+{
+    int bytes_received = client->driver->recv(client, frame, client->framesize, sender_addr, flags);
+    if (bytes_received < 0)
+    {
+        return bytes_received;
+    }
+
+    return l2sap_accept(client, frame, bytes_received, sender_addr, peer);
+}
+
+/* l2sap_recv_uring is l2sap_recv_raw for the io_uring backend. It takes
+ * the next frame that the io_uring has received, collecting the
+ * completions first if none is left, and tests it with l2sap_accept.
+ * It never waits. The frame stays in its buffer from the pool, at
+ * L2Uringheadroom, and frame is set to it; the buffer then belongs to
+ * the caller. An invalid frame's buffer goes back to the pool.
+ * If the io_uring has failed, it is destroyed, and client->uring is
+ * NULL when this returns, so that the caller can use the socket.
+ * It returns the length of the payload, L2_AGAIN or -1.
+ */
+static int l2sap_recv_uring(L2SAP *client, uint8_t **frame, struct sockaddr_in *sender_addr, L2Peer **peer)
+{
+    if (l2uring_pending(client->uring) == 0 && l2uring_poll(client->uring) < 0)
+    {
+        l2sap_uring_failed(client);
+        return L2_AGAIN;
+    }
+
+    int bytes_received;
+    uint8_t *buffer = l2uring_take(client->uring, &bytes_received, sender_addr);
+    if (buffer == NULL)
+    {
+        return L2_AGAIN;
+    }
+
+    *frame = buffer + L2Uringheadroom;
+    int payload_len = l2sap_accept(client, *frame, bytes_received, sender_addr, peer);
+    if (payload_len < 0)
+    {
+        framepool_put(client->pool, buffer);
+    }
+    return payload_len;
+}
+
+/* l2sap_recv_view_flags receives one frame like l2sap_recv_raw, but
+ * directly into a buffer from the entity's frame pool, and lends that
+ * buffer to the caller through view. The io_uring backend has received
+ * it into such a buffer already.
+ */
+static int l2sap_recv_view_flags(L2SAP *client, L2View *view, int flags)
+{
+    if (client->uring != NULL)
+    {
+        uint8_t *frame;
+        int payload_len = l2sap_recv_uring(client, &frame, &view->src, &view->peer);
+        if (client->uring != NULL)
+        {
+            if (payload_len < 0)
+            {
+                return payload_len;
+            }
+
+            client->rx_lent++;
+            view->payload = frame + sizeof(L2Header);
+            view->len = payload_len;
+            return payload_len;
+        }
+    }
+
+    /* After the io_uring failed, the buffers keep its headroom. */
+    uint8_t *buffer = framepool_get(client->pool);
+    if (buffer == NULL)
+    {
+        LOG_RATELIMITED(LOG_LEVEL_ERROR, 1000, "frame pool is exhausted (%d buffers lent here)",
+                        client->rx_lent);
+        return -1;
+    }
+
+    uint8_t *frame = buffer + l2sap_headroom(client);
+    int payload_len = l2sap_recv_raw(client, frame, &view->src, &view->peer, flags);
+    if (payload_len < 0)
+    {
+        framepool_put(client->pool, buffer);
+        return payload_len;
+    }
+
+    client->rx_lent++;
+    view->payload = frame + sizeof(L2Header);
+    view->len = payload_len;
+    return payload_len;
+}
+
+/* l2sap_recv_frame receives one frame like l2sap_recv_view_flags,
+ * into a buffer from the entity's frame pool, and copies its payload to
+ * data, up to len bytes. It is the second half of
+ * l2sap_recvfrom_timeout and l2sap_recvfrom_peer, and all of
+ * l2sap_recv_nowait.
+ */
+static int l2sap_recv_frame(L2SAP *client, uint8_t *data, int len, L2Peer **peer, int flags)
+{
+    L2View view;
+    int payload_len = l2sap_recv_view_flags(client, &view, flags);
+    if (payload_len < 0)
+    {
+        return payload_len;
+    }
+    *peer = view.peer;
+
+    int copy_len;
+
+    if (payload_len < len)
+    {
+        copy_len = payload_len;
+    }
+    else
+    {
+        copy_len = len;
+    }
+
+    if (copy_len > 0)
+    {
+        memcpy(data, view.payload, copy_len);
+        client->stats.rx_copy_bytes += copy_len;
+    }
+
+    l2sap_release_view(client, &view);
+    return copy_len;
+}
+
+/* l2sap_wait_until waits until the driver has a frame, but at most
+ * until deadline on CLOCK_MONOTONIC, or forever if deadline is NULL.
+ * The socket driver uses ppoll rather than select, because a server
+ * with thousands of clients in the same process has descriptors beyond
+ * FD_SETSIZE.
+ * With an impairment emulator, it wakes up whenever a delayed frame is
+ * due and sends it.
+ * With the io_uring backend, it waits on the io_uring's descriptor
+ * until a frame has been collected.
+ * It returns 1 if a frame can be read, L2_TIMEOUT or -1.
+ */
+static int l2sap_wait_until(L2SAP *client, const struct timespec *deadline)
+{
+    if (client->uring != NULL)
+    {
+        int ready = l2uring_poll(client->uring);
+        if (ready > 0)
+        {
+            return 1;
+        }
+        if (ready < 0)
+        {
+            l2sap_uring_failed(client);
+        }
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    while (1)
+    {
+        int64_t wait_ns = -1;
+        if (deadline != NULL)
+        {
+            wait_ns = (int64_t)(deadline->tv_sec - now.tv_sec) * 1000000000 + (deadline->tv_nsec - now.tv_nsec);
+            if (wait_ns < 0)
+            {
+                wait_ns = 0;
+            }
+        }
+
+        /* Sleep until the next delayed frame at the latest. */
+        int64_t due_ns = l2sap_flush_impaired(client);
+        int impaired = due_ns >= 0 && (wait_ns < 0 || due_ns < wait_ns);
+        if (impaired)
+        {
+            wait_ns = due_ns;
+        }
+
+        struct timespec wait_ts;
+        wait_ts.tv_sec = wait_ns / 1000000000;
+        wait_ts.tv_nsec = wait_ns % 1000000000;
+
+        int poll_result = client->driver->wait(client, wait_ns >= 0 ? &wait_ts : NULL);
+
+        LOG_DEBUG("poll result is %d", poll_result);
+
+        if (poll_result < 0)
+        {
+            LOG_ERROR("poll call failed");
+            return -1;
+        }
+
+        if (poll_result > 0 && client->uring != NULL)
+        {
+            /* Completions that carry no frame, e.g. of a receive
+             * request that ran out of buffers, wake it up as well.
+             */
+            int ready = l2uring_poll(client->uring);
+            if (ready > 0)
+            {
+                return 1;
+            }
+            if (ready < 0)
+            {
+                l2sap_uring_failed(client);
+            }
+        }
+        else if (poll_result > 0)
+        {
+            return 1;
+        }
+        else if (!impaired)
+        {
+            LOG_DEBUG("L2_TIMEOUT");
+            return L2_TIMEOUT;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    }
+}
+
+void l2sap_deadline(struct timespec *deadline, const struct timeval *timeout)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout->tv_sec;
+    deadline->tv_nsec += timeout->tv_usec * 1000;
+    if (deadline->tv_nsec >= 1000000000)
+    {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+/* l2sap_wait_readable is l2sap_wait_until with a deadline that is
+ * timeout from now.
+ */
+static int l2sap_wait_readable(L2SAP *client, struct timeval *timeout)
+{
+    if (timeout == NULL)
+    {
+        return l2sap_wait_until(client, NULL);
+    }
+
+    struct timespec deadline;
+    l2sap_deadline(&deadline, timeout);
+    return l2sap_wait_until(client, &deadline);
+}
+
+/* Convenience function. Calls l2sap_recvfrom_timeout with NULL timeout
+ * to make it waits endlessly.
+ */
+int l2sap_recvfrom(L2SAP *client, uint8_t *data, int len)
+{
+    return l2sap_recvfrom_timeout(client, data, len, NULL);
+}
 
-/* compute_checksum is a helper function for l2_sendto and
- * l2_recvfrom_timeout to compute the 1-byte checksum both
- * on sending and receiving and L2 frame.
+/* l2sap_recvfrom_timeout waits for data from a remote UDP sender, but
+ * waits at most timeout seconds.
+ * It is possible to pass NULL as timeout, in which case
+ * the function waits forever.
+ *
+ * If a frame arrives in the meantime, it stores the remote
+ * peer's address in peer_address and its size in peer_addr_sz.
+ * After removing the header, the data of the frame is stored
+ * in data, up to len bytes.
+ *
+ * If data is received, it returns the number of bytes.
+ * If no data is reveid before the timeout, it returns L2_TIMEOUT,
+ * which has the value 0.
+ * It returns -1 in case of error.
  */
-static uint8_t compute_checksum(const uint8_t *frame, int len)
+int l2sap_recvfrom_timeout(L2SAP *client, uint8_t *data, int len, struct timeval *timeout)
 {
-    uint8_t checksum = 0;
-    for (int i = 0; i < len; ++i)
+    if (client == NULL || data == NULL || len <= 0)
+    {
+        LOG_ERROR("invalid parameters.");
+        return -1;
+    }
+
+    int ready = l2sap_wait_readable(client, timeout);
+    if (ready <= 0)
     {
-        checksum ^= frame[i];
+        return ready;
     }
-    return checksum;
+
+    L2Peer *peer;
+    return l2sap_recv_frame(client, data, len, &peer, 0);
 }
 
-L2SAP *l2sap_create(const char *server_ip, int server_port)
+/* l2sap_recvfrom_peer is l2sap_recvfrom_timeout for a server. It also
+ * stores the sender's L2Peer in peer.
+ */
+int l2sap_recvfrom_peer(L2SAP *server, uint8_t *data, int len, L2Peer **peer, struct timeval *timeout)
 {
-    L2SAP *service_access_point = malloc(sizeof(struct L2SAP));
-    if (!service_access_point)
+    if (server == NULL || server->peers == NULL || data == NULL || len <= 0 || peer == NULL)
     {
-        fprintf(stderr, "%s: failed to allocate memory for service_access_point.\n", __FUNCTION__);
-        return NULL;
+        LOG_ERROR("invalid parameters.");
+        return -1;
     }
 
-    service_access_point->socket = socket(AF_INET, SOCK_DGRAM, 0);
-    if (service_access_point->socket < 0)
+    int ready = l2sap_wait_readable(server, timeout);
+    if (ready <= 0)
     {
-        fprintf(stderr, "%s: failed to create socket.\n", __FUNCTION__);
-        free(service_access_point);
-        return NULL;
+        return ready;
     }
 
-    memset(&service_access_point->peer_addr, 0, sizeof(service_access_point->peer_addr));
-    service_access_point->peer_addr.sin_family = AF_INET;
-    service_access_point->peer_addr.sin_port = htons(server_port);
+    return l2sap_recv_frame(server, data, len, peer, 0);
+}
 
-    int validIp = inet_pton(AF_INET, server_ip, &service_access_point->peer_addr.sin_addr);
-    if (validIp <= 0)
+/* l2sap_recv_nowait is l2sap_recvfrom_timeout without the wait.
+ * It is meant for callers that learn from epoll or a similar
+ * mechanism that the socket is readable.
+ * It returns the number of bytes stored in data, L2_AGAIN if no
+ * frame is queued, or -1 in case of error or if the frame is invalid.
+ */
+int l2sap_recv_nowait(L2SAP *client, uint8_t *data, int len)
+{
+    if (client == NULL || data == NULL || len <= 0)
     {
-        fprintf(stderr, "%s: Invalid IP address\n", __FUNCTION__);
-        close(service_access_point->socket);
-        free(service_access_point);
-        return NULL;
+        LOG_ERROR("invalid parameters.");
+        return -1;
     }
 
-    struct sockaddr_in local_addr;
-    memset(&local_addr, 0, sizeof(local_addr));
-    local_addr.sin_family = AF_INET;
-    local_addr.sin_addr.s_addr = INADDR_ANY;
-    local_addr.sin_port = 0;
+    L2Peer *peer;
+    return l2sap_recv_frame(client, data, len, &peer, MSG_DONTWAIT);
+}
 
-    int bindValue = bind(service_access_point->socket, (struct sockaddr *)&local_addr, sizeof(local_addr));
-    if (bindValue < 0)
+/* l2sap_recv_view waits like l2sap_recvfrom_timeout, but instead of
+ * copying the payload it lends the caller the receive buffer in which
+ * the frame arrived. The header and checksum of the frame have been
+ * tested, and view->payload and view->len describe the payload only.
+ * The buffer stays valid until l2sap_release_view is called. It comes
+ * from the entity's frame pool, so callers must not keep more views
+ * than the pool has buffers.
+ * It returns view->len, L2_TIMEOUT, or -1 in case of error.
+ */
+int l2sap_recv_view(L2SAP *client, L2View *view, struct timeval *timeout)
+{
+    if (client == NULL || view == NULL)
     {
-        fprintf(stderr, "%s: binding failed\n", __FUNCTION__);
-        close(service_access_point->socket);
-        free(service_access_point);
-        return NULL;
+        LOG_ERROR("invalid parameters.");
+        return -1;
     }
-    fprintf(stderr, "%s: bound socket to address %s\n", __FUNCTION__, inet_ntoa(local_addr.sin_addr));
 
-    return service_access_point;
+    int ready = l2sap_wait_readable(client, timeout);
+    if (ready <= 0)
+    {
+        return ready;
+    }
+
+    return l2sap_recv_view_flags(client, view, 0);
 }
 
-void l2sap_destroy(L2SAP *client)
+int l2sap_recvfrom_until(L2SAP *client, uint8_t *data, int len, const struct timespec *deadline)
 {
-    if (client == NULL)
+    if (client == NULL || data == NULL || len <= 0)
     {
-        fprintf(stderr, "%s: client was null\n", __FUNCTION__);
-        return;
+        LOG_ERROR("invalid parameters.");
+        return -1;
     }
 
-    if (client->socket >= 0)
+    int ready = l2sap_wait_until(client, deadline);
+    if (ready <= 0)
     {
-        fprintf(stderr, "%s: closing socket\n", __FUNCTION__);
-        close(client->socket);
+        return ready;
     }
 
-    fprintf(stderr, "%s: freeing client memory\n", __FUNCTION__);
-    free(client);
+    L2Peer *peer;
+    return l2sap_recv_frame(client, data, len, &peer, 0);
 }
 
-/* l2sap_sendto sends data over UDP, using the given UDP socket
- * sock, to a remote UDP receiver that is identified by
- * peer_address.
- * The parameter data points to payload that L3 wants to send
- * to the remote L3 entity. This payload is len bytes long.
- * l2_sendto must add an L2 header in front of this payload.
- * When the payload length and the L2Header together exceed
- * the maximum frame size L2Framesize, l2_sendto fails.
- */
-int l2sap_sendto(L2SAP *client, const uint8_t *data, int len)
+int l2sap_recv_view_until(L2SAP *client, L2View *view, const struct timespec *deadline)
 {
-    if (client == NULL || data == NULL || len < 0)
+    if (client == NULL || view == NULL)
     {
-        fprintf(stderr, "%s: invalid parameters\n", __FUNCTION__);
+        LOG_ERROR("invalid parameters.");
         return -1;
     }
 
-    if (len + sizeof(L2Header) > L2Framesize)
+    int ready = l2sap_wait_until(client, deadline);
+    if (ready <= 0)
     {
-        fprintf(stderr, "%s: payload is too large\n", __FUNCTION__);
-        return -1;
+        return ready;
     }
 
-    uint8_t frame[L2Framesize];
-    L2Header *header = (L2Header *)frame;
-
-    const int PACKET_SIZE = len + sizeof(L2Header);
+    return l2sap_recv_view_flags(client, view, 0);
+}
 
-    header->dst_addr = client->peer_addr.sin_addr.s_addr;
-    header->len = htons(PACKET_SIZE);
-    header->checksum = 0;
-    header->mbz = 0;
-    memcpy(frame + sizeof(L2Header), data, len);
-    uint8_t temp_checksum = compute_checksum(frame, sizeof(L2Header) + len);
-    header->checksum = temp_checksum;
+int l2sap_recv_view_nowait(L2SAP *client, L2View *view)
+{
+    if (client == NULL || view == NULL)
+    {
+        LOG_ERROR("invalid parameters.");
+        return -1;
+    }
 
-    fprintf(stderr, "%s: Size of payload+headerr: %d\n", __FUNCTION__, PACKET_SIZE);
+    return l2sap_recv_view_flags(client, view, MSG_DONTWAIT);
+}
 
-    int bytes_sent = sendto(client->socket, frame, PACKET_SIZE, 0,
-                            (struct sockaddr *)&client->peer_addr, sizeof(client->peer_addr));
+int l2sap_peer_count(L2SAP *server)
+{
+    if (server == NULL || server->peers == NULL)
+    {
+        return 0;
+    }
+    return peertable_count(server->peers);
+}
 
-    if (bytes_sent < 0)
+void l2sap_forget_peer(L2SAP *server, L2Peer *peer)
+{
+    if (server == NULL || server->peers == NULL || peer == NULL)
     {
-        fprintf(stderr, "%s: fail to send bytes, sent %d.\n", __FUNCTION__, bytes_sent);
-        return -1;
+        return;
     }
-    if (bytes_sent != PACKET_SIZE)
+    peertable_remove(server->peers, peer);
+}
+
+void l2sap_release_view(L2SAP *client, L2View *view)
+{
+    if (client == NULL || view == NULL || view->payload == NULL)
     {
-        fprintf(stderr, "%s: sent %d bytes,  expected %d\n", __FUNCTION__, bytes_sent, PACKET_SIZE);
-        return -1;
+        return;
     }
 
-    fprintf(stderr, "%s Sending frame of size %d to %s:%d\n", __FUNCTION__, bytes_sent,
-            inet_ntoa(client->peer_addr.sin_addr), ntohs(client->peer_addr.sin_port));
+    framepool_put(client->pool, view->payload - sizeof(L2Header) - l2sap_headroom(client));
+    if (client->uring != NULL && l2uring_refill(client->uring) < 0)
+    {
+        /* The receive request may have ended for lack of buffers, and
+         * no completion would wake up the caller to rearm it.
+         */
+        l2sap_uring_failed(client);
+    }
+    client->rx_lent--;
+    view->payload = NULL;
+}
 
-    return len;
+void l2sap_get_stats(const L2SAP *client, L2Stats *stats)
+{
+    *stats = client->stats;
 }
 
-/* Convenience function. Calls l2sap_recvfrom_timeout with NULL timeout
- * to make it waits endlessly.
+/* l2sap_dump_counter writes one counter in the text format of
+ * Prometheus.
  */
-int l2sap_recvfrom(L2SAP *client, uint8_t *data, int len)
+static void l2sap_dump_counter(FILE *out, const char *metric, const char *name, uint64_t value)
 {
-    return l2sap_recvfrom_timeout(client, data, len, NULL);
+    fprintf(out, "%s_total{endpoint=\"%s\"} %" PRIu64 "\n", metric, name, value);
 }
 
-/* l2sap_recvfrom_timeout waits for data from a remote UDP sender, but
- * waits at most timeout seconds.
- * It is possible to pass NULL as timeout, in which case
- * the function waits forever.
- *
- * If a frame arrives in the meantime, it stores the remote
- * peer's address in peer_address and its size in peer_addr_sz.
- * After removing the header, the data of the frame is stored
- * in data, up to len bytes.
- *
- * If data is received, it returns the number of bytes.
- * If no data is reveid before the timeout, it returns L2_TIMEOUT,
- * which has the value 0.
- * It returns -1 in case of error.
- */
-int l2sap_recvfrom_timeout(L2SAP *client, uint8_t *data, int len, struct timeval *timeout)
+void l2sap_dump_stats(const L2SAP *client, FILE *out, const char *name)
 {
-    if (client == NULL || data == NULL || len <= 0)
+    l2sap_dump_counter(out, "l2_tx_frames", name, client->stats.tx_frames);
+    l2sap_dump_counter(out, "l2_tx_bytes", name, client->stats.tx_bytes);
+    l2sap_dump_counter(out, "l2_tx_errors", name, client->stats.tx_errors);
+    l2sap_dump_counter(out, "l2_rx_frames", name, client->stats.rx_frames);
+    l2sap_dump_counter(out, "l2_rx_bytes", name, client->stats.rx_bytes);
+    l2sap_dump_counter(out, "l2_rx_length_errors", name, client->stats.rx_length_errors);
+    l2sap_dump_counter(out, "l2_rx_checksum_errors", name, client->stats.rx_checksum_errors);
+    l2sap_dump_counter(out, "l2_rx_copy_bytes", name, client->stats.rx_copy_bytes);
+    l2sap_dump_counter(out, "l2_tx_copy_bytes", name, client->stats.tx_copy_bytes);
+}
+
+int l2sap_offer_framesize(L2SAP *client)
+{
+    if (client == NULL || client->peers != NULL)
     {
-        fprintf(stderr, "%s: invalid parameters.\n", __FUNCTION__);
+        LOG_ERROR("invalid parameters");
         return -1;
     }
 
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(client->socket, &readfds);
-
-    struct timeval timeout_copy;
-    if (timeout != NULL)
+    client->framesize_agreed = 0;
+    if (l2sap_send_control(client, &client->peer_addr, L2_CONTROL_OFFER, client->framesize) < 0)
     {
-        timeout_copy = *timeout;
-        fprintf(stderr, "%s: setting timeout to %ld\n", __FUNCTION__, timeout->tv_sec);
+        return -1;
     }
+    return 0;
+}
 
-    int select_result = select(client->socket + 1, &readfds, NULL, NULL, timeout ? &timeout_copy : NULL);
-
-    fprintf(stderr, "%s: seleted result is %d\n", __FUNCTION__, select_result);
-
-    if (select_result < 0)
+int l2sap_negotiate_framesize(L2SAP *client, struct timeval *timeout)
+{
+    if (client == NULL || client->peers != NULL || timeout == NULL)
     {
-        fprintf(stderr, "%s: select call failed\n", __FUNCTION__);
+        LOG_ERROR("invalid parameters");
         return -1;
     }
 
-    if (select_result == 0)
+    for (int attempt = 0; attempt < 3; ++attempt)
     {
-        fprintf(stderr, "%s: L2_TIMEOUT\n", __FUNCTION__);
-        return L2_TIMEOUT;
-    }
+        if (l2sap_offer_framesize(client) < 0)
+        {
+            return -1;
+        }
 
-    uint8_t frame[L2Framesize];
+        /* Data frames do not extend the wait for the answer, and
+         * neither do frames that are dropped.
+         */
+        struct timespec deadline;
+        l2sap_deadline(&deadline, timeout);
+        while (!client->framesize_agreed)
+        {
+            int ready = l2sap_wait_until(client, &deadline);
+            if (ready < 0)
+            {
+                return -1;
+            }
+            if (ready == L2_TIMEOUT)
+            {
+                break;
+            }
 
-    struct sockaddr_in sender_addr;
-    socklen_t sender_addr_len = sizeof(sender_addr);
+            L2View view;
+            view.payload = NULL;
+            l2sap_recv_view_flags(client, &view, MSG_DONTWAIT);
+            l2sap_release_view(client, &view);
 
-    int bytes_received = recvfrom(client->socket, frame, L2Framesize, 0,
-                                  (struct sockaddr *)&sender_addr, &sender_addr_len);
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec))
+            {
+                break;
+            }
+        }
 
-    if (bytes_received < 0)
+        if (client->framesize_agreed)
+        {
+            LOG_INFO("agreed to frame size %d", client->framesize);
+            return client->framesize;
+        }
+    }
+
+    LOG_WARN("peer does not negotiate, using frame size %d", L2Framesize);
+    if (client->framesize > L2Framesize)
+    {
+        client->framesize = L2Framesize;
+    }
+    return L2_TIMEOUT;
+}
+
+/* l2sap_batch_frames returns how many frames of stride bytes fit into
+ * the scratch buffer of a batch call.
+ */
+static int l2sap_batch_frames(int stride)
+{
+    int n = L2Batchbytes / stride;
+    if (n > L2Batchsize)
+    {
+        n = L2Batchsize;
+    }
+    return n > 0 ? n : 1;
+}
+
+/* l2sap_sendto_batch builds and checksums count frames, exactly like
+ * l2sap_sendto does for one, and hands them to the driver L2Batchsize
+ * frames at a time (the socket driver sends them with one sendmmsg
+ * call), or with the io_uring backend as
+ * linked sendmsg requests with one io_uring_enter call.
+ * A payload that does not fit into a frame makes the whole batch fail
+ * before anything is sent.
+ * It returns the number of frames that were sent, or -1 in case of error.
+ */
+int l2sap_sendto_batch(L2SAP *client, const uint8_t *const data[], const int len[], int count)
+{
+    if (client == NULL || data == NULL || len == NULL || count < 0)
     {
-        fprintf(stderr, "%s: recvfrom call failed\n", __FUNCTION__);
+        LOG_ERROR("invalid parameters");
         return -1;
     }
 
-    if (bytes_received < sizeof(L2Header))
+    if (client->peers != NULL)
     {
-        fprintf(stderr, "%s: received frame too small (%d bytes)\n",
-                __FUNCTION__, bytes_received);
+        LOG_ERROR("a server must send to a peer");
         return -1;
     }
 
-    fprintf(stderr, "%s: recieved %d bytes\n", __FUNCTION__, bytes_received);
+    for (int i = 0; i < count; ++i)
+    {
+        if (data[i] == NULL || len[i] < 0 || len[i] > l2sap_max_payload(client, client->framesize))
+        {
+            LOG_ERROR("payload %d is invalid or too large", i);
+            return -1;
+        }
+    }
 
-    L2Header *header = (L2Header *)frame;
+    /* The frames are built side by side in one scratch buffer, so large
+     * frame sizes send fewer frames per call instead of needing more
+     * stack.
+     */
+    uint8_t scratch[L2Batchbytes];
+    int stride = (client->framesize + 7) & ~7;
+    int batch = l2sap_batch_frames(stride);
+    struct iovec iov[L2Batchsize];
+    struct mmsghdr msgs[L2Batchsize];
 
-    int total_len = ntohs(header->len);
+    int sent = 0;
+    while (sent < count)
+    {
+        int n = count - sent;
+        if (n > batch)
+        {
+            n = batch;
+        }
 
-    int payload_len = total_len - sizeof(L2Header);
+        if (client->impair != NULL)
+        {
+            impair_flush(client->impair, 0);
+            for (int i = 0; i < n; ++i)
+            {
+                int size = l2sap_build_frame(client, scratch, data[sent + i], len[sent + i]);
+                if (impair_send(client->impair, &client->peer_addr, scratch, size) < 0)
+                {
+                    client->stats.tx_errors++;
+                    return sent > 0 ? sent : -1;
+                }
+                client->stats.tx_frames++;
+                client->stats.tx_bytes += size;
+                sent++;
+            }
+            continue;
+        }
 
-    if (payload_len < 0)
-    {
-        fprintf(stderr, "%s: invalid payload length (%d)\n", __FUNCTION__, payload_len);
-        return -1;
+        memset(msgs, 0, n * sizeof(struct mmsghdr));
+        for (int i = 0; i < n; ++i)
+        {
+            iov[i].iov_base = scratch + i * stride;
+            iov[i].iov_len = l2sap_build_frame(client, iov[i].iov_base, data[sent + i], len[sent + i]);
+            msgs[i].msg_hdr.msg_name = &client->peer_addr;
+            msgs[i].msg_hdr.msg_namelen = sizeof(client->peer_addr);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int result;
+        if (client->uring != NULL)
+        {
+            struct msghdr hdrs[L2Batchsize];
+            for (int i = 0; i < n; ++i)
+            {
+                hdrs[i] = msgs[i].msg_hdr;
+            }
+            result = l2uring_sendmsg(client->uring, hdrs, n);
+            if (result < 0)
+            {
+                l2sap_uring_failed(client);
+            }
+        }
+        if (client->uring == NULL)
+        {
+            result = client->driver->send_batch(client, msgs, n);
+        }
+        if (result < 0)
+        {
+            LOG_RATELIMITED(LOG_LEVEL_ERROR, 1000, "sending failed after %d frames", sent);
+            client->stats.tx_errors++;
+            return sent > 0 ? sent : -1;
+        }
+        client->stats.tx_frames += result;
+        for (int i = 0; i < result; ++i)
+        {
+            client->stats.tx_bytes += iov[i].iov_len;
+        }
+
+        sent += result;
+        if (result < n)
+        {
+            LOG_RATELIMITED(LOG_LEVEL_WARN, 1000, "sent %d of %d frames", result, n);
+            break;
+        }
     }
 
-    if (total_len != bytes_received)
-    {
-        fprintf(stderr, "%s: header indicates total size %d, but received %d\n",
-                __FUNCTION__,
-                total_len,
-                (int)(bytes_received));
+    LOG_DEBUG("sent %d frames to %s:%d",
+              sent, inet_ntoa(client->peer_addr.sin_addr), ntohs(client->peer_addr.sin_port));
 
-        payload_len = bytes_received - sizeof(L2Header);
+    return sent;
+}
 
+/* l2sap_recv_batch_uring is the second half of l2sap_recv_batch for
+ * the io_uring backend. It takes up to count frames that the io_uring
+ * has collected, counting the invalid ones as recvmmsg would.
+ */
+static int l2sap_recv_batch_uring(L2SAP *client, uint8_t *data[], int len[], int count)
+{
+    int stored = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        uint8_t *frame;
+        struct sockaddr_in sender_addr;
+        L2Peer *peer;
+        int payload_len = l2sap_recv_uring(client, &frame, &sender_addr, &peer);
+        if (payload_len == L2_AGAIN || client->uring == NULL)
+        {
+            break;
+        }
         if (payload_len < 0)
         {
-            fprintf(stderr, "%s: calculated negative payload length\n", __FUNCTION__);
-            return -1;
+            continue;
+        }
+
+        int copy_len = payload_len < len[stored] ? payload_len : len[stored];
+        if (copy_len > 0)
+        {
+            memcpy(data[stored], frame + sizeof(L2Header), copy_len);
+            client->stats.rx_copy_bytes += copy_len;
         }
+        framepool_put(client->pool, frame - L2Uringheadroom);
+        len[stored] = copy_len;
+        stored++;
     }
 
-    fprintf(stderr, "%s: payload length (packet size - header size) is %d\n", __FUNCTION__, payload_len);
+    LOG_DEBUG("received %d valid frames", stored);
 
-    uint8_t received_checksum = header->checksum;
-    header->checksum = 0;
+    if (stored == 0)
+    {
+        return -1;
+    }
 
-    uint8_t calculated_checksum = compute_checksum(frame, bytes_received);
+    return stored;
+}
 
-    if (calculated_checksum != received_checksum)
+/* l2sap_recv_batch waits like l2sap_recvfrom_timeout until at least one
+ * frame can be read, and then takes all frames that are already waiting,
+ * up to count, L2Batchsize and the free buffers of the entity's frame
+ * pool, from the driver at once (the socket driver takes them with a
+ * single recvmmsg call).
+ * Every frame is checked on its own with l2sap_accept. Valid payloads are stored in order
+ * in data[0], data[1], ..., truncated to the buffer size passed in len[i],
+ * and len[i] is set to the number of bytes stored. Invalid frames are
+ * dropped and do not use up a buffer.
+ *
+ * It returns the number of payloads stored, L2_TIMEOUT if nothing arrived
+ * before the timeout, or -1 in case of error or if all frames that
+ * arrived were invalid.
+ */
+int l2sap_recv_batch(L2SAP *client, uint8_t *data[], int len[], int count, struct timeval *timeout)
+{
+    if (client == NULL || data == NULL || len == NULL || count <= 0)
     {
-        fprintf(stderr, "%s: checksum verification failed (got %d, expected %d)\n",
-                __FUNCTION__, calculated_checksum, received_checksum);
+        LOG_ERROR("invalid parameters.");
         return -1;
     }
 
-    client->peer_addr = sender_addr;
+    if (count > L2Batchsize)
+    {
+        count = L2Batchsize;
+    }
 
-    int copy_len;
+    int ready = l2sap_wait_readable(client, timeout);
+    if (ready <= 0)
+    {
+        return ready;
+    }
 
-    if (payload_len < len)
+    if (client->uring != NULL)
     {
-        copy_len = payload_len;
+        int stored = l2sap_recv_batch_uring(client, data, len, count);
+        if (client->uring != NULL || stored > 0)
+        {
+            return stored;
+        }
     }
-    else
+
+    /* The frames are received into buffers of the pool, as by
+     * l2sap_recv_frame; a frame larger than the own frame size is
+     * truncated and dropped.
+     */
+    uint8_t *buffers[L2Batchsize];
+    int taken = 0;
+    while (taken < count && (buffers[taken] = framepool_get(client->pool)) != NULL)
     {
-        copy_len = len;
+        taken++;
+    }
+    if (taken == 0)
+    {
+        LOG_RATELIMITED(LOG_LEVEL_ERROR, 1000, "frame pool is exhausted (%d buffers lent here)",
+                        client->rx_lent);
+        return -1;
     }
+    count = taken;
 
-    if (copy_len > 0)
+    struct sockaddr_in sender_addr[L2Batchsize];
+    struct iovec iov[L2Batchsize];
+    struct mmsghdr msgs[L2Batchsize];
+
+    memset(msgs, 0, count * sizeof(struct mmsghdr));
+    for (int i = 0; i < count; ++i)
     {
-        memcpy(data, frame + sizeof(L2Header), copy_len);
+        iov[i].iov_base = buffers[i] + l2sap_headroom(client);
+        iov[i].iov_len = client->framesize;
+        msgs[i].msg_hdr.msg_name = &sender_addr[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(sender_addr[i]);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
     }
 
-    return copy_len;
-}
\ No newline at end of file
+    int received = client->driver->recv_batch(client, msgs, count);
+    if (received < 0)
+    {
+        LOG_ERROR("receiving a batch failed");
+        received = 0;
+    }
+
+    int stored = 0;
+    for (int i = 0; i < received; ++i)
+    {
+        uint8_t *frame = iov[i].iov_base;
+        if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+        {
+            LOG_RATELIMITED(LOG_LEVEL_WARN, 1000, "received frame larger than frame size %d",
+                            (int)client->framesize);
+            client->stats.rx_frames++;
+            client->stats.rx_length_errors++;
+            continue;
+        }
+
+        L2Peer *peer;
+        int payload_len = l2sap_accept(client, frame, msgs[i].msg_len, &sender_addr[i], &peer);
+        if (payload_len < 0)
+        {
+            continue;
+        }
+
+        int copy_len = payload_len < len[stored] ? payload_len : len[stored];
+        if (copy_len > 0)
+        {
+            memcpy(data[stored], frame + sizeof(L2Header), copy_len);
+            client->stats.rx_copy_bytes += copy_len;
+        }
+        len[stored] = copy_len;
+        stored++;
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        framepool_put(client->pool, buffers[i]);
+    }
+
+    LOG_DEBUG("received %d frames, %d valid", received, stored);
+
+    if (stored == 0)
+    {
+        return -1;
+    }
+
+    return stored;
+}
@@ -2,21 +2,90 @@
 #define L2SAP_H
 
 #include <inttypes.h>
+#include <stdio.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/select.h>
+#include <sys/uio.h>
+#include <time.h>
 
-/* This is the maximum size of a frame in bytes.
- * Frames that are sent over our emulated network can never
- * be longer than this number.
- * The maximum size includes the L2Header.
+#include "framepool.h"
+#include "peertable.h"
+#include "impair.h"
+
+/* This is the default size of a frame in bytes.
+ * Frames that are sent over our emulated network are never
+ * longer than this number unless both peers have agreed on a
+ * larger frame size (see l2sap_set_framesize), which can be at
+ * most L2Maxframesize, the largest UDP payload over IPv4.
+ * The sizes include the L2Header.
  */
-#define L2Framesize   1024
-#define L2Headersize  (int)(sizeof(struct L2Header))
-#define L2Payloadsize (int)(L2Framesize-L2Headersize)
+#define L2Framesize    1024
+#define L2Maxframesize 65507
+#define L2Headersize   (int)(sizeof(struct L2Header))
+#define L2Payloadsize  (int)(L2Framesize-L2Headersize)
 
 #define L2_TIMEOUT    0
+#define L2_AGAIN      -2
+
+/* The value of the L2Header's mbz field in control frames, which L2
+ * entities exchange among themselves (for now only to negotiate the
+ * frame size) and never deliver as payload. Peers that predate them
+ * see a frame whose first payload byte is no valid L4 type.
+ */
+#define L2_MBZ_CONTROL 0x01
+
+/* This is the number of receive buffers in the private frame pool
+ * that an L2SAP creates for itself, and so the number of views it can
+ * lend at the same time unless it is given a shared pool with
+ * l2sap_set_pool.
+ */
+#define L2Rxframes    8
+
+/* The checksum modes of an L2SAP.
+ * L2_CHECKSUM_XOR is the 1-byte XOR checksum in the L2Header that
+ * every peer understands. L2_CHECKSUM_CRC32C additionally appends
+ * a 4-byte CRC32C in network byte order behind the payload; both
+ * peers must use it. The trailer is counted in the L2Header's len
+ * and covered by the XOR checksum, and it reduces the largest
+ * payload by L2Crcsize bytes.
+ */
+#define L2_CHECKSUM_XOR     0
+#define L2_CHECKSUM_CRC32C  1
+#define L2Crcsize           4
+
+/* This is the maximum number of frames that the batch functions
+ * l2sap_sendto_batch and l2sap_recv_batch move with a single
+ * system call. Larger batches are split into several calls.
+ */
+#define L2Batchsize   32
+
+/* This is the maximum number of payload segments that l2sap_sendv
+ * accepts for one frame.
+ */
+#define L2Maxsegments 8
+
+/* This is the maximum number of peers that an L2 server keeps state
+ * for. Frames from further peers are dropped.
+ */
+#define L2Maxpeers    65536
+
+/* The backends that move an entity's datagrams, see l2sap_set_backend.
+ * L2_BACKEND_SOCKET waits with ppoll and calls recvfrom and sendmsg
+ * for every frame. L2_BACKEND_URING receives through an io_uring (see
+ * l2uring.h) and sends batches with it.
+ */
+#define L2_BACKEND_SOCKET   0
+#define L2_BACKEND_URING    1
+
+/* The drivers that carry an entity's frames, see l2sap_create_driver.
+ * L2_DRIVER_SOCKET sends them as UDP datagrams. L2_DRIVER_SHM moves
+ * them through rings in POSIX shared memory (see l2shm.h) to entities
+ * of the same driver on the same host.
+ */
+#define L2_DRIVER_SOCKET    0
+#define L2_DRIVER_SHM       1
 
 typedef struct L2Header L2Header;
 
@@ -58,20 +127,337 @@ struct L2Header
     uint8_t  mbz;
 };
 
+/* A view of a received frame's payload inside a receive buffer from
+ * the L2SAP's frame pool, returned by l2sap_recv_view.
+ */
+typedef struct L2View L2View;
+
+struct L2View
+{
+    uint8_t*           payload;
+    int                len;
+    struct sockaddr_in src;
+
+    /* The sender's entry in the peer table of an L2 server, or NULL. */
+    L2Peer*            peer;
+};
+
+/* The counters of an L2 entity, see l2sap_get_stats. */
+typedef struct L2Stats L2Stats;
+struct L2Stats
+{
+    /* Frames and their bytes with the L2Header, as they were handed
+     * to the driver (or to the impairment emulator), and frames that
+     * could not be sent.
+     */
+    uint64_t tx_frames;
+    uint64_t tx_bytes;
+    uint64_t tx_errors;
+
+    /* Frames that arrived, valid or not, and the invalid ones among
+     * them: too short or with a broken length, or with a wrong XOR
+     * checksum or CRC32C.
+     */
+    uint64_t rx_frames;
+    uint64_t rx_bytes;
+    uint64_t rx_length_errors;
+    uint64_t rx_checksum_errors;
+
+    /* Payload bytes copied out of receive buffers, and into frames
+     * that are built in memory before sending.
+     */
+    uint64_t rx_copy_bytes;
+    uint64_t tx_copy_bytes;
+};
+
 typedef struct L2SAP L2SAP;
 
+struct L2Uring;
+struct L2Driver;
+
 struct L2SAP
 {
+    /* The driver that carries the frames (see l2driver.h), its UDP
+     * socket if it has one (-1 otherwise), and its other state.
+     */
+    const struct L2Driver* driver;
     int                socket;
+    void*              link;
+
     struct sockaddr_in peer_addr;
+    int                checksum_mode;
+
+    /* The largest frame that is sent to peer_addr, and whether the peer
+     * has agreed to it in a negotiation. Frames up to the size of the
+     * receive buffers are accepted.
+     */
+    int                framesize;
+    int                framesize_agreed;
+
+    /* The peers of an L2 server, or NULL for a client. A server does
+     * not overwrite peer_addr with the sender of each frame, but tags
+     * frames with their peer instead.
+     */
+    PeerTable*         peers;
+
+    /* The impairment emulator in the send path, or NULL. */
+    Impair*            impair;
+
+    /* The pool that the receive buffers come from, whether the L2SAP
+     * created it and destroys it, the number of buffers in a private
+     * pool, and the number of buffers that are lent through an L2View.
+     */
+    FramePool*         pool;
+    int                own_pool;
+    int                rxframes;
+    int                rx_lent;
+
+    /* The io_uring of the L2_BACKEND_URING backend, or NULL, and the
+     * room in front of the frames in the receive buffers, which it
+     * needs. The room stays after the io_uring failed, for the views
+     * that it has lent, until the pool is replaced.
+     */
+    struct L2Uring*    uring;
+    int                headroom;
+
+    L2Stats            stats;
 };
 
+/* Creates an L2 server that binds the given UDP port on all
+ * interfaces (0 picks a free port) and accepts frames from any number
+ * of peers over that one socket. Every valid frame is tagged with the
+ * L2Peer of its sender, which is created on its first frame.
+ * Servers send with l2sap_sendto_peer or l2sap_sendv_peer; the
+ * functions that send to peer_addr fail.
+ */
 struct L2SAP* l2sap_server_create( int port );
 
+/* Creates an L2 server like l2sap_server_create, but binds the port
+ * with SO_REUSEPORT, so that more servers of this user can bind it.
+ * The kernel then hands each datagram to one of them by a hash of the
+ * sender's address and port, so a peer keeps talking to the same
+ * server as long as the set of servers stays the same.
+ */
+struct L2SAP* l2sap_server_create_shared( int port );
+
 L2SAP* l2sap_create( const char* server_ip, int server_port );
+
+/* Versions of l2sap_create and l2sap_server_create that use the given
+ * driver, L2_DRIVER_SOCKET or L2_DRIVER_SHM, instead of the default.
+ * The default is the socket driver, or the one that the environment
+ * variable L2_DRIVER names ("socket" or "shm"), so that programs run
+ * over shared memory unchanged. With L2_DRIVER_SHM, the port is the
+ * name of the entity's inbox rather than a UDP port, and the IP address
+ * of the peer is not used; l2sap_server_create_shared is not supported.
+ */
+L2SAP* l2sap_create_driver( int driver, const char* server_ip, int server_port );
+L2SAP* l2sap_server_create_driver( int driver, int port );
+
+/* The driver of an entity, and the port that it is bound to, or -1.
+ */
+int  l2sap_driver( const L2SAP* client );
+int  l2sap_local_port( const L2SAP* client );
 void l2sap_destroy( L2SAP* client );
 int  l2sap_sendto( L2SAP* client, const uint8_t* data, int len );
 int  l2sap_recvfrom_timeout( L2SAP* client, uint8_t* data, int len, struct timeval* timeout );
 
+/* Scatter-gather version of l2sap_sendto. The payload of the frame is
+ * the concatenation of the iovcnt segments in iov (at most
+ * L2Maxsegments). The L2Header and the segments are handed to the
+ * kernel with one sendmsg call, without copying the payload, and the
+ * checksum is computed across the segments.
+ * It returns the payload length or -1 in case of error.
+ */
+int  l2sap_sendv( L2SAP* client, const struct iovec* iov, int iovcnt );
+
+/* Reads one frame that is already queued, without waiting.
+ * Returns the number of payload bytes stored in data, L2_AGAIN if
+ * no frame is queued, or -1 in case of error or an invalid frame.
+ */
+int  l2sap_recv_nowait( L2SAP* client, uint8_t* data, int len );
+
+/* Zero-copy receive. l2sap_recv_view waits like l2sap_recvfrom_timeout
+ * and l2sap_recv_view_nowait not at all; then they lend the buffer in
+ * which the next valid frame arrived instead of copying its payload.
+ * view->payload and view->len describe the payload, view->src the
+ * sender. They return view->len, L2_TIMEOUT or L2_AGAIN, or -1 in case
+ * of error or an invalid frame.
+ * Every view must be given back with l2sap_release_view.
+ */
+int  l2sap_recv_view( L2SAP* client, L2View* view, struct timeval* timeout );
+int  l2sap_recv_view_nowait( L2SAP* client, L2View* view );
+void l2sap_release_view( L2SAP* client, L2View* view );
+
+/* l2sap_get_stats copies the counters of an entity. They are plain
+ * counters of the thread that uses the entity, so another thread
+ * reads them only while it does not run.
+ * l2sap_dump_stats writes them to out in the text format of
+ * Prometheus, one line per counter such as
+ *   l2_tx_frames_total{endpoint="name"} 42
+ * so that a snapshot in a file can be scraped.
+ */
+void l2sap_get_stats( const L2SAP* client, L2Stats* stats );
+void l2sap_dump_stats( const L2SAP* client, FILE* out, const char* name );
+
+/* Versions of l2sap_recvfrom_timeout and l2sap_recv_view that wait
+ * until an absolute deadline on CLOCK_MONOTONIC (forever if it is NULL)
+ * instead of a relative timeout. A caller that waits for one particular
+ * frame and throws the others away keeps passing the same deadline, so
+ * unrelated frames cannot stretch the wait. l2sap_deadline computes
+ * the deadline that is timeout from now.
+ */
+int  l2sap_recvfrom_until( L2SAP* client, uint8_t* data, int len, const struct timespec* deadline );
+int  l2sap_recv_view_until( L2SAP* client, L2View* view, const struct timespec* deadline );
+void l2sap_deadline( struct timespec* deadline, const struct timeval* timeout );
+
+/* Server versions of l2sap_recvfrom_timeout, l2sap_sendto and
+ * l2sap_sendv. l2sap_recvfrom_peer also stores the sender in peer.
+ * The zero-copy functions store the sender in view->peer.
+ */
+int  l2sap_recvfrom_peer( L2SAP* server, uint8_t* data, int len, L2Peer** peer, struct timeval* timeout );
+int  l2sap_sendto_peer( L2SAP* server, L2Peer* peer, const uint8_t* data, int len );
+int  l2sap_sendv_peer( L2SAP* server, L2Peer* peer, const struct iovec* iov, int iovcnt );
+
+/* The number of peers of a server, and a function that drops the
+ * state of a peer, e.g. when the layer above closes its session.
+ * A frame that arrives from it later creates a new L2Peer.
+ */
+int  l2sap_peer_count( L2SAP* server );
+void l2sap_forget_peer( L2SAP* server, L2Peer* peer );
+
+/* Makes the L2 entity take its receive buffers from pool, whose
+ * buffers must have room for its frame size, instead of its
+ * private pool, which is freed. The pool can be shared by any number
+ * of entities and must outlive them. It cannot be changed while views
+ * are lent. Returns 0 or -1 in case of error.
+ */
+int  l2sap_set_pool( L2SAP* client, FramePool* pool );
+
+/* Gives the private pool count buffers instead of L2Rxframes, for a
+ * layer above that holds many views at the same time. An entity with
+ * a shared pool keeps it; that pool must be large enough. It cannot be
+ * changed while views are lent. Returns 0 or -1 in case of error.
+ */
+int  l2sap_set_rxframes( L2SAP* client, int count );
+
+/* Puts the impairment emulator (see impair.h) with the given profile
+ * into the send path of the entity, or removes it if profile is NULL.
+ * Frames that are delayed are sent while the entity waits in
+ * l2sap_recvfrom_timeout and the other receive functions, or while the
+ * reactor it is added to runs. Set it before the entity is added to a
+ * reactor.
+ * An entity also gets an emulator when it is created if the
+ * environment variable L2_IMPAIR holds a profile for impair_parse.
+ * Returns 0 or -1 in case of error.
+ */
+int  l2sap_set_impairment( L2SAP* client, const ImpairProfile* profile );
+
+/* Sends the frames that the emulator has delayed and that are due.
+ * Returns the nanoseconds until the next one is due, or -1 if there is
+ * none or the entity has no emulator.
+ */
+int64_t l2sap_flush_impaired( L2SAP* client );
+
+/* Sets the frame size of the entity, between 64 and L2Maxframesize
+ * bytes. Its receive buffers grow or shrink to match (a shared pool
+ * must have buffers of at least that size), and it sends frames of up
+ * to that size, so the peer must be configured alike or be asked with
+ * l2sap_negotiate_framesize. It cannot be changed while views are lent.
+ * With the shm driver, a frame size larger than the entity's inbox was
+ * made for re-creates the inbox, and the frames queued in it are lost.
+ * Returns 0 or -1 in case of error.
+ */
+int  l2sap_set_framesize( L2SAP* client, int framesize );
+
+/* The largest payload that one frame of this entity can carry, which
+ * depends on the frame size and the checksum mode.
+ */
+int  l2sap_payload_size( const L2SAP* client );
+
+/* Frame size negotiation. l2sap_offer_framesize sends a control frame
+ * that offers the entity's frame size to its peer. A peer that knows
+ * control frames answers with the smaller of the offer and its own
+ * frame size, and uses that size for its frames to this entity. When
+ * the answer arrives through any receive function, the entity's frame
+ * size becomes the agreed size and framesize_agreed is set. A server
+ * answers offers too, and remembers the agreed size per L2Peer.
+ *
+ * l2sap_negotiate_framesize offers and waits for the answer up to 3
+ * times with the given timeout each. Data frames that arrive meanwhile
+ * are dropped, so it is meant for the start of a conversation. If the
+ * peer does not answer, e.g. because it is an older implementation, the
+ * entity falls back to sending L2Framesize frames.
+ * It returns the agreed frame size, L2_TIMEOUT or -1 in case of error.
+ */
+int  l2sap_offer_framesize( L2SAP* client );
+int  l2sap_negotiate_framesize( L2SAP* client, struct timeval* timeout );
+
+/* Selects L2_CHECKSUM_XOR (the default) or L2_CHECKSUM_CRC32C for
+ * all frames that are sent or received afterwards.
+ * Returns 0, or -1 if the mode is unknown.
+ */
+int  l2sap_set_checksum( L2SAP* client, int mode );
+
+/* Selects the backend of the entity, L2_BACKEND_SOCKET or
+ * L2_BACKEND_URING. With L2_BACKEND_URING, frames are received through
+ * an io_uring with a multishot recvmsg request into buffers from the
+ * entity's pool, which then has L2Uringbuffers more buffers with room
+ * for L2Uringheadroom bytes in front of each frame (a shared pool gives
+ * the ring L2Rxframes of its buffers and must have that room, also
+ * when it is set later), and
+ * l2sap_sendto_batch submits its frames as linked sendmsg requests.
+ * Single frames are still sent with sendmsg, which is one system call
+ * either way. Frames are tested exactly as on the socket path.
+ * If the kernel cannot do it (multishot recvmsg needs Linux 6.0), or the
+ * entity does not use the socket driver, it stays with
+ * L2_BACKEND_SOCKET.
+ * An entity also gets the io_uring backend when it is created if the
+ * environment variable L2_BACKEND is "uring".
+ * If the io_uring fails later, the entity destroys it and goes on with
+ * the socket; the frames that it held are lost.
+ * It cannot be changed while views are lent. Set it before the entity
+ * is added to a reactor, which waits on l2sap_fd; the descriptor stays
+ * the same when the pool, the frame size or the number of receive
+ * buffers changes.
+ * Returns the backend in use, or -1 in case of error.
+ */
+int  l2sap_set_backend( L2SAP* client, int backend );
+int  l2sap_backend( const L2SAP* client );
+
+/* The descriptor that becomes readable when frames arrive: the socket,
+ * the io_uring's descriptor, or an eventfd of the shared-memory driver.
+ */
+int  l2sap_fd( const L2SAP* client );
+
+/* Counts the times that the descriptor of an entity changed because
+ * its io_uring failed, in all entities of the process, so that a
+ * reactor knows when to look for them.
+ */
+unsigned l2sap_fd_changes( void );
+
+/* The number of frames that the entity has received from the kernel
+ * but not handed out yet. The io_uring backend collects all frames
+ * that have arrived whenever it looks for one, and its descriptor
+ * does not report those again; a caller that stops reading before
+ * l2sap_recv_view_nowait returns L2_AGAIN must come back for them.
+ * The socket backend has none.
+ */
+int  l2sap_pending( const L2SAP* client );
+
+/* Batched versions of l2sap_sendto and l2sap_recvfrom_timeout.
+ * l2sap_sendto_batch sends count payloads, data[i] being len[i]
+ * bytes long, with one sendmmsg call per L2Batchsize frames. It
+ * returns the number of frames sent or -1 in case of error.
+ * l2sap_recv_batch waits at most timeout for the first frame and
+ * then takes up to count frames (at most L2Batchsize, and at most as
+ * many as the frame pool has free buffers) with one recvmmsg call.
+ * On input, len[i] is the size of the buffer data[i];
+ * on return it holds the payload size stored there. Frames that fail
+ * the header or checksum test are dropped. It returns the number of
+ * valid frames, L2_TIMEOUT or -1 in case of error.
+ */
+int  l2sap_sendto_batch( L2SAP* client, const uint8_t* const data[], const int len[], int count );
+int  l2sap_recv_batch( L2SAP* client, uint8_t* data[], int len[], int count, struct timeval* timeout );
+
 #endif
 
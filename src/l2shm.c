@@ -0,0 +1,937 @@
+/* syscall is a GNU extension. */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/futex.h>
+#include <arpa/inet.h>
+
+#include "l2shm.h"
+#include "log.h"
+
+#define L2SHM_MAGIC     0x4c32534du
+
+/* The flag in a ring's sender once its producer has let it go. */
+#define L2SHM_CLOSED    0x80000000u
+
+/* The ports that an entity without a port gets, as for UDP. */
+#define L2SHM_EPHEMERAL 49152
+#define L2SHM_PORTS     16384
+
+typedef struct L2ShmRing L2ShmRing;
+
+struct L2ShmRing
+{
+    /* The port of the producer, with L2SHM_CLOSED once it has let the
+     * ring go, or 0 if the ring is free. The consumer frees a closed
+     * ring when it is empty.
+     */
+    uint32_t sender;
+    uint32_t pid;
+
+    /* The producer writes the slot at tail and advances it, the
+     * consumer reads the slot at head and advances it. Both count up
+     * and wrap; tail - head frames are queued.
+     */
+    uint32_t tail __attribute__((aligned(64)));
+    uint32_t head __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
+typedef struct L2ShmInbox L2ShmInbox;
+
+struct L2ShmInbox
+{
+    uint32_t  magic;
+    uint32_t  port;
+    uint32_t  pid;
+    uint32_t  closed;
+
+    /* The number of rings and the frame size that the slots are made
+     * for, which give the layout, see l2shm_layout.
+     */
+    uint32_t  ring_count;
+    uint32_t  framesize;
+
+    /* The futex on which the consumer waits, and the number of its
+     * threads that wait. A producer bumps seq and wakes them after a
+     * frame if there are any.
+     */
+    uint32_t  seq __attribute__((aligned(64)));
+    uint32_t  waiters;
+
+    /* A bit for every ring that has a sender, so that the consumer
+     * only looks at those.
+     */
+    uint64_t  active[L2Shmserverrings / 64] __attribute__((aligned(64)));
+
+    L2ShmRing rings[];
+};
+
+#define L2SHM_PAGE 4096
+
+/* The layout of an inbox. The slots, a 4-byte length followed by the
+ * frame, are rounded up to cache lines. The slots of a ring start on a
+ * page, so that its pages can be allocated and given back at once, and
+ * the rings start on the page behind the header.
+ */
+typedef struct L2ShmLayout L2ShmLayout;
+
+struct L2ShmLayout
+{
+    int    rings;
+    int    framesize;
+    size_t slotsize;
+    size_t ringsize;
+    size_t data;
+    size_t size;
+};
+
+static void l2shm_layout(L2ShmLayout *layout, int rings, int framesize)
+{
+    layout->rings = rings;
+    layout->framesize = framesize;
+    layout->slotsize = (sizeof(uint32_t) + framesize + 63) & ~(size_t)63;
+    layout->ringsize = (L2Shmslots * layout->slotsize + L2SHM_PAGE - 1) & ~(size_t)(L2SHM_PAGE - 1);
+    layout->data = (offsetof(L2ShmInbox, rings) + rings * sizeof(L2ShmRing) + L2SHM_PAGE - 1) &
+                   ~(size_t)(L2SHM_PAGE - 1);
+    layout->size = layout->data + (size_t)rings * layout->ringsize;
+}
+
+/* A peer's inbox that the entity sends to, and the ring it claimed. */
+typedef struct L2ShmOut L2ShmOut;
+
+struct L2ShmOut
+{
+    L2ShmInbox* inbox;
+    L2ShmLayout layout;
+    int         port;
+    int         ring;
+    uint64_t    used;
+};
+
+typedef struct L2ShmLink L2ShmLink;
+
+struct L2ShmLink
+{
+    int         port;
+    char        name[32];
+    L2ShmInbox* inbox;
+    L2ShmLayout layout;
+
+    /* The inbox's descriptor, to give back the pages of freed rings. */
+    int         fd;
+
+    /* The ring that the consumer looks at first. */
+    int         next;
+
+    L2ShmOut    outs[L2Shmlinks];
+    uint64_t    clock;
+
+    /* The eventfd for epoll and the thread that signals it, see
+     * l2shm_fd. The thread waits for frames while armed is set.
+     */
+    int         event_fd;
+    pthread_t   doorbell;
+    uint32_t    armed;
+    int         stop;
+};
+
+static int l2shm_futex_wait(uint32_t *word, uint32_t value, const struct timespec *deadline)
+{
+    return syscall(SYS_futex, word, FUTEX_WAIT_BITSET, value, deadline, NULL, FUTEX_BITSET_MATCH_ANY);
+}
+
+static void l2shm_futex_wake(uint32_t *word)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static void l2shm_name(char *name, int port)
+{
+    snprintf(name, 32, "/l2shm-%d", port);
+}
+
+static int l2shm_alive(uint32_t pid)
+{
+    return kill((pid_t)pid, 0) == 0 || errno != ESRCH;
+}
+
+static uint8_t *l2shm_slot(L2ShmInbox *inbox, const L2ShmLayout *layout, int ring, uint32_t index)
+{
+    return (uint8_t *)inbox + layout->data + ring * layout->ringsize +
+           (index & (L2Shmslots - 1)) * layout->slotsize;
+}
+
+/* l2shm_reclaim looks at the inbox name that exists already. If its
+ * owner has died, it closes it for the producers that still have it
+ * mapped and removes the name, and returns 0. Otherwise the port is in
+ * use, and it returns -1.
+ */
+static int l2shm_reclaim(const char *name)
+{
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        return errno == ENOENT ? 0 : -1;
+
+    struct stat st;
+    L2ShmInbox *inbox = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(L2ShmInbox))
+        inbox = mmap(NULL, sizeof(L2ShmInbox), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    /* An inbox without a size or a pid is being created. */
+    int result = -1;
+    if (inbox != MAP_FAILED)
+    {
+        uint32_t pid = __atomic_load_n(&inbox->pid, __ATOMIC_ACQUIRE);
+        if (pid != 0 && (__atomic_load_n(&inbox->closed, __ATOMIC_ACQUIRE) || !l2shm_alive(pid)) &&
+            __atomic_compare_exchange_n(&inbox->pid, &pid, (uint32_t)getpid(), 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            LOG_DEBUG("reclaiming %s of process %u", name, pid);
+            __atomic_store_n(&inbox->closed, 1, __ATOMIC_RELEASE);
+            shm_unlink(name);
+            result = 0;
+        }
+        munmap(inbox, sizeof(L2ShmInbox));
+    }
+    if (result < 0)
+        errno = EADDRINUSE;
+    return result;
+}
+
+/* l2shm_bind creates the entity's inbox for port, with the given
+ * number of rings and slots for frames of framesize bytes. It fails
+ * with EADDRINUSE if another entity has it.
+ */
+static int l2shm_bind(L2ShmLink *link, int port, int rings, int framesize)
+{
+    l2shm_name(link->name, port);
+
+    int fd = -1;
+    for (int attempt = 0; attempt < 2 && fd < 0; attempt++)
+    {
+        fd = shm_open(link->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0 && (errno != EEXIST || l2shm_reclaim(link->name) < 0))
+            return -1;
+    }
+    if (fd < 0)
+    {
+        errno = EADDRINUSE;
+        return -1;
+    }
+
+    /* The rings stay sparse until producers claim them, but the header
+     * must not fault.
+     */
+    L2ShmLayout layout;
+    l2shm_layout(&layout, rings, framesize);
+    L2ShmInbox *inbox = MAP_FAILED;
+    if (ftruncate(fd, layout.size) == 0 && fallocate(fd, 0, 0, layout.data) == 0)
+        inbox = mmap(NULL, layout.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (inbox == MAP_FAILED)
+    {
+        LOG_ERROR("failed to size or map %s: %s", link->name, strerror(errno));
+        close(fd);
+        shm_unlink(link->name);
+        return -1;
+    }
+
+    inbox->port = port;
+    inbox->ring_count = rings;
+    inbox->framesize = framesize;
+    __atomic_store_n(&inbox->pid, (uint32_t)getpid(), __ATOMIC_RELEASE);
+    __atomic_store_n(&inbox->magic, L2SHM_MAGIC, __ATOMIC_RELEASE);
+
+    link->port = port;
+    link->inbox = inbox;
+    link->layout = layout;
+    link->fd = fd;
+    return 0;
+}
+
+/* l2shm_detach lets the ring in a peer's inbox go and unmaps it. */
+static void l2shm_detach(L2ShmOut *out)
+{
+    __atomic_or_fetch(&out->inbox->rings[out->ring].sender, L2SHM_CLOSED, __ATOMIC_RELEASE);
+    munmap(out->inbox, out->layout.size);
+    out->inbox = NULL;
+}
+
+/* l2shm_map maps the inbox behind fd and stores its layout. Returns
+ * the inbox, or NULL if it is not one or is not ready.
+ */
+static L2ShmInbox *l2shm_map(int fd, L2ShmLayout *layout)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(L2ShmInbox))
+        return NULL;
+
+    L2ShmInbox *inbox = mmap(NULL, sizeof(L2ShmInbox), PROT_READ, MAP_SHARED, fd, 0);
+    if (inbox == MAP_FAILED)
+        return NULL;
+    int ready = __atomic_load_n(&inbox->magic, __ATOMIC_ACQUIRE) == L2SHM_MAGIC;
+    int rings = inbox->ring_count;
+    int framesize = inbox->framesize;
+    munmap(inbox, sizeof(L2ShmInbox));
+
+    if (!ready || rings <= 0 || rings > L2Shmserverrings || rings % 64 != 0 || framesize <= 0 ||
+        framesize > L2Maxframesize)
+        return NULL;
+    l2shm_layout(layout, rings, framesize);
+    if (st.st_size != (off_t)layout->size)
+        return NULL;
+
+    inbox = mmap(NULL, layout->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    return inbox != MAP_FAILED ? inbox : NULL;
+}
+
+/* l2shm_attach maps the inbox of the entity at port and claims a free
+ * ring in it, whose pages it allocates. If there is no memory for
+ * them, the ring is let go. If none is free, rings whose producers
+ * have died are closed, so that their consumer frees them for a later
+ * attempt.
+ */
+static int l2shm_attach(L2ShmLink *link, L2ShmOut *out, int port)
+{
+    char name[32];
+    l2shm_name(name, port);
+
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        return -1;
+
+    L2ShmLayout layout;
+    L2ShmInbox *inbox = l2shm_map(fd, &layout);
+    if (inbox == NULL)
+    {
+        close(fd);
+        return -1;
+    }
+
+    if (__atomic_load_n(&inbox->closed, __ATOMIC_ACQUIRE))
+    {
+        munmap(inbox, layout.size);
+        close(fd);
+        return -1;
+    }
+
+    for (int w = 0; w < layout.rings / 64; w++)
+    {
+        uint64_t free_rings = ~__atomic_load_n(&inbox->active[w], __ATOMIC_ACQUIRE);
+        while (free_rings != 0)
+        {
+            int i = w * 64 + __builtin_ctzll(free_rings);
+            free_rings &= free_rings - 1;
+
+            L2ShmRing *ring = &inbox->rings[i];
+            uint32_t expected = 0;
+            if (!__atomic_compare_exchange_n(&ring->sender, &expected, (uint32_t)link->port, 0,
+                                             __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+                continue;
+
+            /* The ring is not active yet, so its consumer leaves it. */
+            if (fallocate(fd, 0, layout.data + i * layout.ringsize, layout.ringsize) < 0)
+            {
+                LOG_RATELIMITED(LOG_LEVEL_WARN, 1000, "no memory for a ring in the inbox of port %d: %s", port,
+                                strerror(errno));
+                __atomic_store_n(&ring->sender, 0, __ATOMIC_RELEASE);
+                munmap(inbox, layout.size);
+                close(fd);
+                return -1;
+            }
+            close(fd);
+
+            __atomic_store_n(&ring->pid, (uint32_t)getpid(), __ATOMIC_RELEASE);
+            __atomic_or_fetch(&inbox->active[w], 1ull << (i % 64), __ATOMIC_SEQ_CST);
+            out->inbox = inbox;
+            out->layout = layout;
+            out->port = port;
+            out->ring = i;
+            return 0;
+        }
+    }
+    close(fd);
+
+    for (int i = 0; i < layout.rings; i++)
+    {
+        L2ShmRing *ring = &inbox->rings[i];
+        uint32_t sender = __atomic_load_n(&ring->sender, __ATOMIC_ACQUIRE);
+        uint32_t pid = __atomic_load_n(&ring->pid, __ATOMIC_ACQUIRE);
+        if (sender != 0 && !(sender & L2SHM_CLOSED) && pid != 0 && !l2shm_alive(pid))
+            __atomic_or_fetch(&ring->sender, L2SHM_CLOSED, __ATOMIC_RELEASE);
+    }
+    LOG_RATELIMITED(LOG_LEVEL_WARN, 1000, "the inbox of port %d has no free ring", port);
+    munmap(inbox, layout.size);
+    return -1;
+}
+
+/* l2shm_out returns the peer at port with its ring, attaching to it if
+ * it is not mapped yet, or NULL if there is no entity at port. A peer
+ * that has closed its inbox is dropped, so that a new entity at the
+ * port is found.
+ */
+static L2ShmOut *l2shm_out(L2ShmLink *link, int port)
+{
+    L2ShmOut *victim = NULL;
+    for (int i = 0; i < L2Shmlinks; i++)
+    {
+        L2ShmOut *out = &link->outs[i];
+        if (out->inbox != NULL && out->port == port)
+        {
+            if (!__atomic_load_n(&out->inbox->closed, __ATOMIC_ACQUIRE))
+            {
+                out->used = ++link->clock;
+                return out;
+            }
+            l2shm_detach(out);
+        }
+        if (victim == NULL || (victim->inbox != NULL && (out->inbox == NULL || out->used < victim->used)))
+            victim = out;
+    }
+
+    if (victim->inbox != NULL)
+        l2shm_detach(victim);
+    if (l2shm_attach(link, victim, port) < 0)
+        return NULL;
+    victim->used = ++link->clock;
+    return victim;
+}
+
+/* l2shm_push copies one frame into the ring of out. Returns 0, or -1
+ * if the ring is full.
+ */
+static int l2shm_push(L2ShmOut *out, const struct iovec *iov, int iovcnt, uint32_t len)
+{
+    L2ShmRing *ring = &out->inbox->rings[out->ring];
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (tail - head >= L2Shmslots)
+        return -1;
+
+    uint8_t *slot = l2shm_slot(out->inbox, &out->layout, out->ring, tail);
+    memcpy(slot, &len, sizeof(len));
+    size_t offset = sizeof(len);
+    for (int i = 0; i < iovcnt; i++)
+    {
+        memcpy(slot + offset, iov[i].iov_base, iov[i].iov_len);
+        offset += iov[i].iov_len;
+    }
+
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* l2shm_wake wakes the consumer of the peer out if it waits. The fence
+ * orders the new tail before the look at waiters, against the consumer,
+ * which counts itself in before it looks at the tails. A peer that has
+ * been dropped in the meantime needs no wakeup.
+ */
+static void l2shm_wake(L2ShmOut *out)
+{
+    L2ShmInbox *inbox = out->inbox;
+    if (inbox == NULL)
+        return;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&inbox->waiters, __ATOMIC_RELAXED) > 0)
+    {
+        __atomic_add_fetch(&inbox->seq, 1, __ATOMIC_SEQ_CST);
+        l2shm_futex_wake(&inbox->seq);
+    }
+}
+
+/* l2shm_queue queues one frame for addr without waking its consumer,
+ * whose peer is left in *unwoken; the consumer of an earlier frame to
+ * another port is woken first. A frame that finds no entity, a full
+ * ring or slots that are too small is dropped. Returns the length of
+ * the frame.
+ */
+static int l2shm_queue(L2ShmLink *link, const struct sockaddr_in *addr, const struct iovec *iov, int iovcnt,
+                       L2ShmOut **unwoken)
+{
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+
+    int port = ntohs(addr->sin_port);
+    if (*unwoken != NULL && (*unwoken)->port != port)
+    {
+        l2shm_wake(*unwoken);
+        *unwoken = NULL;
+    }
+
+    L2ShmOut *out = l2shm_out(link, port);
+    if (out == NULL)
+    {
+        LOG_DEBUG("no entity at port %d, dropping frame", port);
+        return len;
+    }
+
+    if (len > (size_t)out->layout.framesize)
+    {
+        LOG_RATELIMITED(LOG_LEVEL_WARN, 1000, "frame of %zu bytes is too large for port %d (frame size %d)", len,
+                        port, out->layout.framesize);
+        return len;
+    }
+
+    if (l2shm_push(out, iov, iovcnt, len) < 0)
+    {
+        LOG_DEBUG("the ring to port %d is full, dropping frame", port);
+        if (!l2shm_alive(out->inbox->pid))
+            l2shm_detach(out);
+        return len;
+    }
+
+    *unwoken = out;
+    return len;
+}
+
+/* l2shm_ready tells whether a frame is queued in any ring. */
+static int l2shm_ready(L2ShmLink *link)
+{
+    for (int w = 0; w < link->layout.rings / 64; w++)
+    {
+        uint64_t bits = __atomic_load_n(&link->inbox->active[w], __ATOMIC_ACQUIRE);
+        while (bits != 0)
+        {
+            L2ShmRing *ring = &link->inbox->rings[w * 64 + __builtin_ctzll(bits)];
+            bits &= bits - 1;
+            if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != __atomic_load_n(&ring->head, __ATOMIC_RELAXED))
+                return 1;
+        }
+    }
+    return 0;
+}
+
+/* l2shm_take copies the next frame, up to size bytes, taking one from
+ * each ring in turn, and frees the closed rings that are empty, giving
+ * their pages back. Returns the length of the frame, more than size if
+ * it was truncated, or L2_AGAIN.
+ */
+static int l2shm_take(L2ShmLink *link, uint8_t *frame, int size, struct sockaddr_in *sender)
+{
+    L2ShmInbox *inbox = link->inbox;
+    const L2ShmLayout *layout = &link->layout;
+    int words = layout->rings / 64;
+    int first = link->next / 64;
+    uint64_t below = (1ull << (link->next % 64)) - 1;
+
+    /* The word of next is looked at twice: first the rings from next
+     * on, at the end the ones before it.
+     */
+    for (int k = 0; k <= words; k++)
+    {
+        int w = (first + k) % words;
+        uint64_t bits = __atomic_load_n(&inbox->active[w], __ATOMIC_ACQUIRE);
+        if (k == 0)
+            bits &= ~below;
+        else if (k == words)
+            bits &= below;
+
+        while (bits != 0)
+        {
+            int i = w * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+
+            L2ShmRing *ring = &inbox->rings[i];
+            uint32_t owner = __atomic_load_n(&ring->sender, __ATOMIC_ACQUIRE);
+            uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+            uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+            if (head == tail)
+            {
+                if (owner & L2SHM_CLOSED)
+                {
+                    if (fallocate(link->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                                  layout->data + i * layout->ringsize, layout->ringsize) < 0)
+                        LOG_RATELIMITED(LOG_LEVEL_WARN, 1000, "failed to free the pages of a ring");
+                    __atomic_store_n(&ring->head, 0, __ATOMIC_RELAXED);
+                    __atomic_store_n(&ring->tail, 0, __ATOMIC_RELAXED);
+                    __atomic_store_n(&ring->pid, 0, __ATOMIC_RELAXED);
+                    __atomic_and_fetch(&inbox->active[w], ~(1ull << (i % 64)), __ATOMIC_RELEASE);
+                    __atomic_store_n(&ring->sender, 0, __ATOMIC_RELEASE);
+                }
+                continue;
+            }
+
+            const uint8_t *slot = l2shm_slot(inbox, layout, i, head);
+            uint32_t len;
+            memcpy(&len, slot, sizeof(len));
+            memcpy(frame, slot + sizeof(len), (int)len < size ? (int)len : size);
+            __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+            memset(sender, 0, sizeof(*sender));
+            sender->sin_family = AF_INET;
+            sender->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            sender->sin_port = htons(owner & 0xffff);
+
+            link->next = (i + 1) % layout->rings;
+            return len;
+        }
+    }
+    return L2_AGAIN;
+}
+
+static int l2shm_wait(L2SAP *client, const struct timespec *timeout)
+{
+    L2ShmLink *link = client->link;
+    if (l2shm_ready(link))
+        return 1;
+
+    struct timespec deadline;
+    if (timeout != NULL)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout->tv_sec;
+        deadline.tv_nsec += timeout->tv_nsec;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    L2ShmInbox *inbox = link->inbox;
+    __atomic_add_fetch(&inbox->waiters, 1, __ATOMIC_SEQ_CST);
+
+    int result;
+    while (1)
+    {
+        uint32_t seq = __atomic_load_n(&inbox->seq, __ATOMIC_SEQ_CST);
+        if (l2shm_ready(link))
+        {
+            result = 1;
+            break;
+        }
+        if (l2shm_futex_wait(&inbox->seq, seq, timeout != NULL ? &deadline : NULL) < 0)
+        {
+            if (errno == ETIMEDOUT)
+            {
+                result = l2shm_ready(link);
+                break;
+            }
+            if (errno == EINTR)
+            {
+                result = -1;
+                break;
+            }
+        }
+    }
+
+    __atomic_sub_fetch(&inbox->waiters, 1, __ATOMIC_SEQ_CST);
+    return result;
+}
+
+static int l2shm_recv(L2SAP *client, uint8_t *frame, int size, struct sockaddr_in *sender, int flags)
+{
+    L2ShmLink *link = client->link;
+    while (1)
+    {
+        int len = l2shm_take(link, frame, size, sender);
+        if (len == L2_AGAIN && link->event_fd >= 0)
+        {
+            /* Clear the eventfd and arm the doorbell again before the
+             * last look, so that a frame that comes later signals it.
+             */
+            uint64_t count;
+            if (read(link->event_fd, &count, sizeof(count)) == sizeof(count))
+            {
+                __atomic_store_n(&link->armed, 1, __ATOMIC_SEQ_CST);
+                l2shm_futex_wake(&link->armed);
+                len = l2shm_take(link, frame, size, sender);
+            }
+        }
+        if (len != L2_AGAIN || (flags & MSG_DONTWAIT))
+            return len;
+        if (l2shm_wait(client, NULL) < 0)
+            return -1;
+    }
+}
+
+static int l2shm_recv_batch(L2SAP *client, struct mmsghdr *msgs, int count)
+{
+    int received = 0;
+    while (received < count)
+    {
+        struct msghdr *hdr = &msgs[received].msg_hdr;
+        int len = l2shm_recv(client, hdr->msg_iov[0].iov_base, hdr->msg_iov[0].iov_len, hdr->msg_name,
+                             MSG_DONTWAIT);
+        if (len == L2_AGAIN)
+            break;
+        hdr->msg_flags = len > (int)hdr->msg_iov[0].iov_len ? MSG_TRUNC : 0;
+        msgs[received].msg_len = hdr->msg_flags ? hdr->msg_iov[0].iov_len : (unsigned)len;
+        received++;
+    }
+
+    if (received == 0)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    return received;
+}
+
+static int l2shm_send(L2SAP *client, const struct sockaddr_in *addr, const struct iovec *iov, int iovcnt)
+{
+    L2ShmOut *unwoken = NULL;
+    int len = l2shm_queue(client->link, addr, iov, iovcnt, &unwoken);
+    if (unwoken != NULL)
+        l2shm_wake(unwoken);
+    return len;
+}
+
+/* A batch wakes each consumer once, after its last frame. */
+static int l2shm_send_batch(L2SAP *client, struct mmsghdr *msgs, int count)
+{
+    L2ShmOut *unwoken = NULL;
+    int sent = 0;
+    while (sent < count)
+    {
+        const struct msghdr *hdr = &msgs[sent].msg_hdr;
+        int len = l2shm_queue(client->link, hdr->msg_name, hdr->msg_iov, hdr->msg_iovlen, &unwoken);
+        if (len < 0)
+            break;
+        msgs[sent].msg_len = len;
+        sent++;
+    }
+
+    if (unwoken != NULL)
+        l2shm_wake(unwoken);
+    return sent > 0 || count == 0 ? sent : -1;
+}
+
+/* The doorbell thread waits like a consumer until a frame is queued,
+ * signals the eventfd and disarms itself. l2shm_recv arms it again when
+ * it has found the rings empty and cleared the eventfd, so producers
+ * only wake the thread while the eventfd is clear.
+ */
+static void *l2shm_doorbell(void *arg)
+{
+    L2ShmLink *link = arg;
+    L2ShmInbox *inbox = link->inbox;
+
+    while (!__atomic_load_n(&link->stop, __ATOMIC_ACQUIRE))
+    {
+        if (!__atomic_load_n(&link->armed, __ATOMIC_SEQ_CST))
+        {
+            l2shm_futex_wait(&link->armed, 0, NULL);
+            continue;
+        }
+
+        __atomic_add_fetch(&inbox->waiters, 1, __ATOMIC_SEQ_CST);
+        while (!__atomic_load_n(&link->stop, __ATOMIC_ACQUIRE))
+        {
+            uint32_t seq = __atomic_load_n(&inbox->seq, __ATOMIC_SEQ_CST);
+            if (l2shm_ready(link))
+                break;
+            l2shm_futex_wait(&inbox->seq, seq, NULL);
+        }
+        __atomic_sub_fetch(&inbox->waiters, 1, __ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(&link->stop, __ATOMIC_ACQUIRE))
+            break;
+        __atomic_store_n(&link->armed, 0, __ATOMIC_SEQ_CST);
+        uint64_t one = 1;
+        if (write(link->event_fd, &one, sizeof(one)) < 0)
+            LOG_RATELIMITED(LOG_LEVEL_ERROR, 1000, "failed to signal the eventfd");
+    }
+    return NULL;
+}
+
+/* l2shm_ring_doorbell starts the doorbell thread on the current inbox,
+ * armed. Returns 0 or -1.
+ */
+static int l2shm_ring_doorbell(L2ShmLink *link)
+{
+    link->stop = 0;
+    link->armed = 1;
+    if (pthread_create(&link->doorbell, NULL, l2shm_doorbell, link) != 0)
+    {
+        LOG_ERROR("failed to start the doorbell thread");
+        return -1;
+    }
+    return 0;
+}
+
+/* l2shm_silence_doorbell stops the doorbell thread. Changing both
+ * futex words keeps it from sleeping on either of them again.
+ */
+static void l2shm_silence_doorbell(L2ShmLink *link)
+{
+    __atomic_store_n(&link->stop, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&link->armed, 1, __ATOMIC_SEQ_CST);
+    l2shm_futex_wake(&link->armed);
+    __atomic_add_fetch(&link->inbox->seq, 1, __ATOMIC_SEQ_CST);
+    l2shm_futex_wake(&link->inbox->seq);
+    pthread_join(link->doorbell, NULL);
+}
+
+/* The futex cannot be given to epoll, so the descriptor is an eventfd
+ * that a thread signals. It is only started when it is asked for.
+ */
+static int l2shm_fd(const L2SAP *client)
+{
+    L2ShmLink *link = client->link;
+    if (link->event_fd >= 0)
+        return link->event_fd;
+
+    link->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (link->event_fd < 0)
+    {
+        LOG_ERROR("failed to create an eventfd");
+        return -1;
+    }
+    if (l2shm_ring_doorbell(link) < 0)
+    {
+        close(link->event_fd);
+        link->event_fd = -1;
+        return -1;
+    }
+    return link->event_fd;
+}
+
+static int l2shm_open(L2SAP *client, int local_port, int reuseport)
+{
+    if (reuseport)
+    {
+        LOG_ERROR("the shm driver cannot share a port");
+        return -1;
+    }
+
+    L2ShmLink *link = calloc(1, sizeof(L2ShmLink));
+    if (link == NULL)
+    {
+        LOG_ERROR("failed to allocate memory for the shm driver");
+        return -1;
+    }
+    link->event_fd = -1;
+
+    /* Only a server is sent to by entities that it has not sent to. */
+    int rings = client->peer_addr.sin_port == 0 ? L2Shmserverrings : L2Shmrings;
+    int result = -1;
+    if (local_port != 0)
+    {
+        result = l2shm_bind(link, local_port, rings, client->framesize);
+        if (result < 0)
+            LOG_ERROR("failed to create the inbox of port %d: %s", local_port, strerror(errno));
+    }
+    else
+    {
+        static unsigned next;
+        unsigned start = (unsigned)getpid() + __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED) * 7919u;
+        for (int i = 0; i < L2SHM_PORTS && result < 0; i++)
+        {
+            result = l2shm_bind(link, L2SHM_EPHEMERAL + (start + i) % L2SHM_PORTS, rings, client->framesize);
+            if (result < 0 && errno != EADDRINUSE)
+                break;
+        }
+        if (result < 0)
+            LOG_ERROR("failed to create an inbox: %s", strerror(errno));
+    }
+
+    if (result < 0)
+    {
+        free(link);
+        return -1;
+    }
+
+    LOG_DEBUG("created inbox %s", link->name);
+    client->link = link;
+    return 0;
+}
+
+static void l2shm_close(L2SAP *client)
+{
+    L2ShmLink *link = client->link;
+    if (link == NULL)
+        return;
+
+    if (link->event_fd >= 0)
+    {
+        l2shm_silence_doorbell(link);
+        close(link->event_fd);
+    }
+
+    for (int i = 0; i < L2Shmlinks; i++)
+    {
+        if (link->outs[i].inbox != NULL)
+            l2shm_detach(&link->outs[i]);
+    }
+
+    LOG_DEBUG("removing inbox %s", link->name);
+    __atomic_store_n(&link->inbox->closed, 1, __ATOMIC_RELEASE);
+    shm_unlink(link->name);
+    munmap(link->inbox, link->layout.size);
+    close(link->fd);
+    free(link);
+    client->link = NULL;
+}
+
+static int l2shm_port(const L2SAP *client)
+{
+    const L2ShmLink *link = client->link;
+    return link != NULL ? link->port : -1;
+}
+
+/* Larger frames need a new inbox at the same port. Its old one is
+ * closed first, so that producers drop it and attach to the new one;
+ * the frames in it are lost. The eventfd stays.
+ */
+static int l2shm_set_framesize(L2SAP *client, int framesize)
+{
+    L2ShmLink *link = client->link;
+    if (framesize <= link->layout.framesize)
+        return 0;
+
+    if (link->event_fd >= 0)
+        l2shm_silence_doorbell(link);
+
+    L2ShmInbox *inbox = link->inbox;
+    L2ShmLayout layout = link->layout;
+    int fd = link->fd;
+    __atomic_store_n(&inbox->closed, 1, __ATOMIC_RELEASE);
+    shm_unlink(link->name);
+
+    int result = l2shm_bind(link, link->port, layout.rings, framesize);
+    if (result < 0)
+    {
+        LOG_ERROR("failed to create the inbox of port %d again: %s", link->port, strerror(errno));
+        __atomic_store_n(&inbox->closed, 0, __ATOMIC_RELEASE);
+    }
+    else
+    {
+        LOG_DEBUG("created %s again for frames of %d bytes", link->name, framesize);
+        munmap(inbox, layout.size);
+        close(fd);
+    }
+
+    if (link->event_fd >= 0 && l2shm_ring_doorbell(link) < 0)
+        result = -1;
+    return result;
+}
+
+const L2Driver l2shm_driver = {
+    .name = "shm",
+    .open = l2shm_open,
+    .close = l2shm_close,
+    .send = l2shm_send,
+    .send_batch = l2shm_send_batch,
+    .recv = l2shm_recv,
+    .recv_batch = l2shm_recv_batch,
+    .wait = l2shm_wait,
+    .fd = l2shm_fd,
+    .port = l2shm_port,
+    .set_framesize = l2shm_set_framesize,
+};
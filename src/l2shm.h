@@ -0,0 +1,54 @@
+#ifndef L2SHM_H
+#define L2SHM_H
+
+#include "l2driver.h"
+
+/* The shared-memory driver, for L2 entities on the same host.
+ *
+ * Every entity has an inbox: a POSIX shared memory object named
+ * "/l2shm-<port>", where the port plays the role of the UDP port, so
+ * peers address each other with a struct sockaddr_in as before (the
+ * IP address is not used). An inbox has L2Shmrings rings, and every
+ * entity that sends to it claims one of them, so each ring has one
+ * producer and one consumer and needs no locks: the producer copies a
+ * frame into the slot at the ring's tail and then advances the tail,
+ * the consumer reads the slot at the head and then advances the head.
+ * A frame is copied once on either side, and no system call is made
+ * while both sides are busy.
+ *
+ * A consumer that waits announces itself in the inbox and sleeps on a
+ * futex in it, which producers wake after a frame; the futex works
+ * across processes. For epoll (the reactor, see l2sap_fd), a thread
+ * of the entity waits on the futex instead and signals an eventfd.
+ *
+ * Like UDP, the driver drops a frame when there is no entity at the
+ * port or its ring is full, and loses the frames that are queued when
+ * an entity is destroyed. An inbox whose owner has died is reused.
+ *
+ * The slots of an inbox are as large as the entity's frame size when
+ * the inbox is created; a frame that is larger is dropped by its
+ * sender, as its receiver would drop it. Raising the frame size with
+ * l2sap_set_framesize re-creates the inbox with larger slots. The
+ * object is sparse: a producer allocates the pages of its ring when it
+ * claims it, and drops its frames if there is no memory for them
+ * rather than fault on a page later, and the consumer gives the pages
+ * back when it frees the ring.
+ */
+
+/* The number of entities that can send to one inbox at the same time,
+ * for an entity with a peer and for a server. Both are multiples of 64.
+ */
+#define L2Shmrings       64
+#define L2Shmserverrings 1024
+
+/* The number of frames that one ring holds. */
+#define L2Shmslots       64
+
+/* The number of peers whose inboxes an entity keeps mapped. Sending to
+ * a further peer unmaps the one that was used least recently.
+ */
+#define L2Shmlinks       16
+
+extern const L2Driver l2shm_driver;
+
+#endif /* L2SHM_H */
@@ -0,0 +1,535 @@
+/* syscall is a GNU extension. */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "l2uring.h"
+#include "log.h"
+
+/* The user_data of the requests. */
+#define L2URING_RECV    1
+#define L2URING_SEND    2
+#define L2URING_CANCEL  3
+
+/* The buffer group of the provided buffers. */
+#define L2URING_GROUP   0
+
+/* Submission queue entries: a batch of sends, the receive request and
+ * a cancel. Every receive buffer and every send has at most one
+ * completion queued, so the completion queue cannot overflow.
+ */
+#define L2URING_ENTRIES    64
+#define L2URING_CQ_ENTRIES 256
+
+struct L2Uring
+{
+    int                       fd;
+    int                       socket;
+    FramePool*                pool;
+
+    /* The rings that are shared with the kernel. */
+    void*                     sq_map;
+    size_t                    sq_map_size;
+    void*                     cq_map;
+    size_t                    cq_map_size;
+    struct io_uring_sqe*      sqes;
+    size_t                    sqes_size;
+    unsigned*                 sq_head;
+    unsigned*                 sq_tail;
+    unsigned*                 sq_mask;
+    unsigned*                 sq_array;
+    unsigned                  sq_entries;
+    unsigned                  sq_local_tail;
+    unsigned*                 cq_head;
+    unsigned*                 cq_tail;
+    unsigned*                 cq_mask;
+    struct io_uring_cqe*      cqes;
+
+    /* The provided buffers: the ring through which they are handed to
+     * the kernel, and the pool buffer of every buffer id, or NULL if
+     * the id is free and waits for a buffer.
+     */
+    struct io_uring_buf_ring* br;
+    size_t                    br_size;
+    uint16_t                  br_tail;
+    int                       buffers;
+    int                       missing;
+    int                       room;
+    uint8_t*                  bufs[L2Uringbuffers];
+
+    /* The receive request, which asks for the sender's address only. */
+    struct msghdr             msg;
+    int                       armed;
+    int                       failed;
+
+    /* Received datagrams that were not taken yet, oldest first. */
+    uint16_t                  ready_bid[L2Uringbuffers];
+    int                       ready_len[L2Uringbuffers];
+    int                       ready_head;
+    int                       ready_count;
+
+    int                       sends_done;
+    int                       sends_ok;
+};
+
+static int l2uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int l2uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* l2uring_enter submits the queued entries and waits for min_complete
+ * completions. It returns the number submitted or -1.
+ */
+static int l2uring_enter(L2Uring *uring, unsigned min_complete)
+{
+    __atomic_store_n(uring->sq_tail, uring->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned submit = uring->sq_local_tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    return (int)syscall(__NR_io_uring_enter, uring->fd, submit, min_complete, flags, NULL, 0);
+}
+
+/* l2uring_sqe returns a cleared submission queue entry, or NULL if the
+ * queue is full.
+ */
+static struct io_uring_sqe *l2uring_sqe(L2Uring *uring)
+{
+    unsigned head = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+    if (uring->sq_local_tail - head >= uring->sq_entries)
+        return NULL;
+
+    unsigned index = uring->sq_local_tail++ & *uring->sq_mask;
+    uring->sq_array[index] = index;
+    struct io_uring_sqe *sqe = &uring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/* l2uring_fill hands pool buffers to the kernel for the buffer ids
+ * that have none.
+ */
+static void l2uring_fill(L2Uring *uring)
+{
+    int added = 0;
+    for (int bid = 0; bid < uring->buffers && uring->missing > 0; bid++)
+    {
+        if (uring->bufs[bid] != NULL)
+            continue;
+
+        uint8_t *buffer = framepool_get(uring->pool);
+        if (buffer == NULL)
+            break;
+
+        uring->bufs[bid] = buffer;
+        struct io_uring_buf *buf = &uring->br->bufs[uring->br_tail & (L2Uringbuffers - 1)];
+        buf->addr = (uintptr_t)buffer;
+        buf->len = uring->room;
+        buf->bid = bid;
+        uring->br_tail++;
+        uring->missing--;
+        added++;
+    }
+
+    if (added > 0)
+        __atomic_store_n(&uring->br->tail, uring->br_tail, __ATOMIC_RELEASE);
+}
+
+/* l2uring_arm queues the multishot receive request if none is armed
+ * and the kernel has buffers to receive into.
+ */
+static void l2uring_arm(L2Uring *uring)
+{
+    if (uring->armed || uring->failed || uring->br == MAP_FAILED || uring->missing == uring->buffers)
+        return;
+
+    struct io_uring_sqe *sqe = l2uring_sqe(uring);
+    if (sqe == NULL)
+        return;
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = uring->socket;
+    sqe->addr = (uintptr_t)&uring->msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = L2URING_GROUP;
+    sqe->user_data = L2URING_RECV;
+    uring->armed = 1;
+}
+
+/* l2uring_reap collects all completions. A receive completion without
+ * IORING_CQE_F_MORE ends the request: when the buffers ran out
+ * (ENOBUFS), after a cancel, or on an error.
+ */
+static void l2uring_reap(L2Uring *uring)
+{
+    unsigned head = *uring->cq_head;
+    unsigned tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++)
+    {
+        struct io_uring_cqe *cqe = &uring->cqes[head & *uring->cq_mask];
+        if (cqe->user_data == L2URING_SEND)
+        {
+            uring->sends_done++;
+            if (cqe->res >= 0)
+                uring->sends_ok++;
+            continue;
+        }
+        if (cqe->user_data != L2URING_RECV)
+            continue;
+
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            uring->armed = 0;
+
+        if (cqe->flags & IORING_CQE_F_BUFFER)
+        {
+            int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            int slot = (uring->ready_head + uring->ready_count++) % L2Uringbuffers;
+            uring->ready_bid[slot] = bid;
+            uring->ready_len[slot] = cqe->res;
+        }
+        else if (cqe->res == -EINVAL)
+        {
+            /* The kernel knows no multishot recvmsg. */
+            uring->failed = 1;
+        }
+        else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED)
+        {
+            errno = -cqe->res;
+            LOG_RATELIMITED(LOG_LEVEL_WARN, 1000, "receive request ended with error %d", -cqe->res);
+        }
+    }
+    __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* l2uring_provide maps and registers an empty ring of provided
+ * buffers. It returns 0 or -1.
+ */
+static int l2uring_provide(L2Uring *uring)
+{
+    /* The buffer ring must start on a page. */
+    uring->br_size = L2Uringbuffers * sizeof(struct io_uring_buf);
+    uring->br = mmap(NULL, uring->br_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (uring->br == MAP_FAILED)
+    {
+        LOG_ERROR("failed to map the buffer ring");
+        return -1;
+    }
+    uring->br_tail = 0;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)uring->br;
+    reg.ring_entries = L2Uringbuffers;
+    reg.bgid = L2URING_GROUP;
+    if (l2uring_register(uring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        LOG_INFO("the kernel has no io_uring buffer rings");
+        munmap(uring->br, uring->br_size);
+        uring->br = MAP_FAILED;
+        return -1;
+    }
+    return 0;
+}
+
+/* l2uring_release ends the receive request and waits until it has
+ * ended, so that the kernel is done with the buffers, gives all of them
+ * back to the pool, also the filled ones that were not taken, and
+ * unregisters the buffer ring.
+ */
+static void l2uring_release(L2Uring *uring)
+{
+    if (uring->armed)
+    {
+        struct io_uring_sqe *sqe = l2uring_sqe(uring);
+        if (sqe != NULL)
+        {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = L2URING_RECV;
+            sqe->user_data = L2URING_CANCEL;
+        }
+        for (int i = 0; i < 100 && uring->armed; i++)
+        {
+            if (l2uring_enter(uring, 1) < 0 && errno != EINTR)
+                break;
+            l2uring_reap(uring);
+        }
+    }
+
+    for (int bid = 0; bid < uring->buffers; bid++)
+    {
+        if (uring->bufs[bid] != NULL)
+        {
+            framepool_put(uring->pool, uring->bufs[bid]);
+            uring->bufs[bid] = NULL;
+        }
+    }
+    uring->missing = uring->buffers;
+    uring->ready_head = 0;
+    uring->ready_count = 0;
+
+    if (uring->br != MAP_FAILED)
+    {
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.bgid = L2URING_GROUP;
+        l2uring_register(uring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        munmap(uring->br, uring->br_size);
+        uring->br = MAP_FAILED;
+    }
+}
+
+L2Uring *l2uring_create(int socket, FramePool *pool, int buffers)
+{
+    if (pool == NULL || buffers <= 0 || buffers > L2Uringbuffers || framepool_framesize(pool) <= L2Uringheadroom)
+    {
+        LOG_ERROR("invalid parameters");
+        return NULL;
+    }
+
+    L2Uring *uring = calloc(1, sizeof(L2Uring));
+    if (uring == NULL)
+    {
+        LOG_ERROR("failed to allocate memory for io_uring");
+        return NULL;
+    }
+    uring->socket = socket;
+    uring->pool = pool;
+    uring->buffers = buffers;
+    uring->missing = buffers;
+    uring->room = framepool_framesize(pool);
+    uring->msg.msg_namelen = sizeof(struct sockaddr_in);
+    uring->sq_map = MAP_FAILED;
+    uring->cq_map = MAP_FAILED;
+    uring->sqes = MAP_FAILED;
+    uring->br = MAP_FAILED;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = L2URING_CQ_ENTRIES;
+    uring->fd = l2uring_setup(L2URING_ENTRIES, &params);
+    if (uring->fd < 0)
+    {
+        LOG_INFO("io_uring is not available");
+        free(uring);
+        return NULL;
+    }
+
+    uring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    uring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (uring->cq_map_size > uring->sq_map_size)
+            uring->sq_map_size = uring->cq_map_size;
+        uring->cq_map_size = uring->sq_map_size;
+    }
+    uring->sq_map = mmap(NULL, uring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         uring->fd, IORING_OFF_SQ_RING);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        uring->cq_map = uring->sq_map;
+    else
+        uring->cq_map = mmap(NULL, uring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             uring->fd, IORING_OFF_CQ_RING);
+    uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       uring->fd, IORING_OFF_SQES);
+    if (uring->sq_map == MAP_FAILED || uring->cq_map == MAP_FAILED || uring->sqes == MAP_FAILED)
+    {
+        LOG_ERROR("failed to map the io_uring rings");
+        l2uring_destroy(uring);
+        return NULL;
+    }
+
+    uint8_t *sq = uring->sq_map;
+    uint8_t *cq = uring->cq_map;
+    uring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    uring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    uring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    uring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    uring->sq_entries = params.sq_entries;
+    uring->sq_local_tail = *uring->sq_tail;
+    uring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    uring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    uring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    if (l2uring_provide(uring) < 0)
+    {
+        l2uring_destroy(uring);
+        return NULL;
+    }
+
+    /* A kernel without multishot recvmsg rejects the request when it
+     * is submitted, so its completion is there at once.
+     */
+    if (l2uring_poll(uring) < 0)
+    {
+        LOG_INFO("the kernel has no multishot recvmsg");
+        l2uring_destroy(uring);
+        return NULL;
+    }
+    return uring;
+}
+
+void l2uring_destroy(L2Uring *uring)
+{
+    if (uring == NULL)
+        return;
+
+    if (uring->sqes != MAP_FAILED)
+        l2uring_release(uring);
+    if (uring->sqes != MAP_FAILED)
+        munmap(uring->sqes, uring->sqes_size);
+    if (uring->cq_map != MAP_FAILED && uring->cq_map != uring->sq_map)
+        munmap(uring->cq_map, uring->cq_map_size);
+    if (uring->sq_map != MAP_FAILED)
+        munmap(uring->sq_map, uring->sq_map_size);
+    close(uring->fd);
+    free(uring);
+}
+
+int l2uring_set_pool(L2Uring *uring, FramePool *pool, int buffers)
+{
+    if (pool == NULL || buffers <= 0 || buffers > L2Uringbuffers || framepool_framesize(pool) <= L2Uringheadroom)
+    {
+        LOG_ERROR("invalid parameters");
+        return -1;
+    }
+
+    l2uring_release(uring);
+    uring->pool = pool;
+    uring->buffers = buffers;
+    uring->missing = buffers;
+    uring->room = framepool_framesize(pool);
+    if (l2uring_provide(uring) < 0)
+    {
+        uring->failed = 1;
+        return -1;
+    }
+    return l2uring_refill(uring);
+}
+
+int l2uring_fd(const L2Uring *uring)
+{
+    return uring->fd;
+}
+
+int l2uring_pending(const L2Uring *uring)
+{
+    return uring->ready_count;
+}
+
+int l2uring_refill(L2Uring *uring)
+{
+    if (uring->missing > 0)
+        l2uring_fill(uring);
+    l2uring_arm(uring);
+    if (uring->sq_local_tail != __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE))
+    {
+        if (l2uring_enter(uring, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            LOG_ERROR("io_uring_enter failed");
+            uring->failed = 1;
+        }
+    }
+    return uring->failed ? -1 : 0;
+}
+
+int l2uring_poll(L2Uring *uring)
+{
+    l2uring_refill(uring);
+    l2uring_reap(uring);
+
+    if (uring->failed)
+        return -1;
+    return uring->ready_count;
+}
+
+uint8_t *l2uring_take(L2Uring *uring, int *len, struct sockaddr_in *sender)
+{
+    if (uring->ready_count == 0)
+        return NULL;
+
+    int bid = uring->ready_bid[uring->ready_head];
+    int bytes = uring->ready_len[uring->ready_head];
+    uring->ready_head = (uring->ready_head + 1) % L2Uringbuffers;
+    uring->ready_count--;
+
+    uint8_t *buffer = uring->bufs[bid];
+    uring->bufs[bid] = NULL;
+    uring->missing++;
+
+    /* A datagram that did not fit keeps only the part that did, so its
+     * full length is reported, which is more than the room and makes
+     * the caller drop it.
+     */
+    struct io_uring_recvmsg_out out;
+    memcpy(&out, buffer, sizeof(out));
+    int room = bytes - L2Uringheadroom;
+    int frame_len = out.payloadlen;
+    if ((out.flags & MSG_TRUNC) && frame_len <= room)
+        frame_len = room + 1;
+    *len = frame_len;
+
+    memset(sender, 0, sizeof(*sender));
+    if (out.namelen >= sizeof(*sender))
+        memcpy(sender, buffer + sizeof(out), sizeof(*sender));
+    return buffer;
+}
+
+int l2uring_sendmsg(L2Uring *uring, struct msghdr *msgs, int count)
+{
+    if (count <= 0 || count > L2Uringsends)
+        return count == 0 ? 0 : -1;
+
+    int queued = 0;
+    for (int i = 0; i < count; i++)
+    {
+        struct io_uring_sqe *sqe = l2uring_sqe(uring);
+        if (sqe == NULL)
+            break;
+
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = uring->socket;
+        sqe->addr = (uintptr_t)&msgs[i];
+        sqe->len = 1;
+        sqe->user_data = L2URING_SEND;
+        /* Linked, so that they go out in order, and a failure cancels
+         * the rest.
+         */
+        if (i + 1 < count)
+            sqe->flags = IOSQE_IO_LINK;
+        queued++;
+    }
+    if (queued == 0)
+        return -1;
+    if (queued < count)
+        uring->sqes[(uring->sq_local_tail - 1) & *uring->sq_mask].flags &= ~IOSQE_IO_LINK;
+
+    /* The messages belong to the caller, so wait for all of them. */
+    uring->sends_done = 0;
+    uring->sends_ok = 0;
+    while (uring->sends_done < queued)
+    {
+        if (l2uring_enter(uring, queued - uring->sends_done) < 0 && errno != EINTR && errno != EAGAIN &&
+            errno != EBUSY)
+        {
+            LOG_ERROR("io_uring_enter failed");
+            uring->failed = 1;
+            return -1;
+        }
+        l2uring_reap(uring);
+    }
+    return uring->sends_ok;
+}
@@ -0,0 +1,97 @@
+#ifndef L2URING_H
+#define L2URING_H
+
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "framepool.h"
+
+/* The io_uring receive and send path of an L2 entity, used through
+ * the io_uring system calls directly.
+ *
+ * One multishot recvmsg request stays armed on the socket. The kernel
+ * takes a buffer from a ring of provided buffers for every datagram,
+ * writes the sender's address and the datagram into it and posts a
+ * completion, so receiving costs no system call while completions are
+ * queued, and waiting is a poll on the ring's descriptor. The buffers
+ * come from the entity's frame pool; a received buffer is the
+ * caller's, and the ring is refilled from the pool.
+ *
+ * In a buffer, the frame starts L2Uringheadroom bytes in, behind the
+ * io_uring_recvmsg_out header and the sender's address.
+ *
+ * Batches of frames are sent as linked sendmsg requests with one
+ * io_uring_enter call, so they leave in order.
+ *
+ * Multishot recvmsg needs Linux 6.0 and buffer rings 5.19; on older
+ * kernels, or where io_uring is disabled, l2uring_create fails and the
+ * entity keeps its socket path.
+ */
+
+typedef struct L2Uring L2Uring;
+
+/* 16 bytes of struct io_uring_recvmsg_out and the sockaddr_in. */
+#define L2Uringheadroom 32
+
+/* The most receive buffers that the ring holds. */
+#define L2Uringbuffers  64
+
+/* The most frames that l2uring_sendmsg takes at once. */
+#define L2Uringsends    32
+
+/* Creates a ring for socket that keeps up to buffers (at most
+ * L2Uringbuffers) receive buffers from pool, whose buffers must have
+ * room for L2Uringheadroom bytes in front of the frames, and arms the
+ * receive request. Returns NULL if the kernel cannot do it.
+ */
+L2Uring* l2uring_create( int socket, FramePool* pool, int buffers );
+
+/* Gives all buffers back to the old pool, including the received ones
+ * that were not taken, and takes up to buffers receive buffers from
+ * pool instead. The ring and its descriptor stay. Buffers that were
+ * taken must have gone back to the old pool before.
+ * Returns 0 or -1 in case of error.
+ */
+int      l2uring_set_pool( L2Uring* uring, FramePool* pool, int buffers );
+
+/* Cancels the receive request, gives all buffers that the ring holds
+ * or has filled back to the pool, and frees the ring.
+ */
+void     l2uring_destroy( L2Uring* uring );
+
+/* The ring's descriptor, which is readable when completions are queued.
+ */
+int      l2uring_fd( const L2Uring* uring );
+
+/* The number of datagrams that have been collected but not taken.
+ * Their completions are gone, so the descriptor does not report them.
+ */
+int      l2uring_pending( const L2Uring* uring );
+
+/* Gives the buffer ring new buffers from the pool for those that were
+ * taken, and rearms the receive request if it ended for lack of them.
+ * Returns 0, or -1 if the ring failed.
+ */
+int      l2uring_refill( L2Uring* uring );
+
+/* Refills the buffer ring like l2uring_refill and collects the
+ * completions. Returns the number of datagrams that can be
+ * taken, or -1 if the ring failed.
+ */
+int      l2uring_poll( L2Uring* uring );
+
+/* Takes the oldest received datagram. Returns its buffer, which now
+ * belongs to the caller, and stores the frame's length and the sender,
+ * or returns NULL if none is queued. The length of a datagram that did
+ * not fit in the buffer is its full length, more than the buffer holds.
+ */
+uint8_t* l2uring_take( L2Uring* uring, int* len, struct sockaddr_in* sender );
+
+/* Sends count messages (at most L2Uringsends) in order and waits until
+ * the kernel is done with them. Returns the number sent, which is
+ * less than count after the first failure, or -1.
+ */
+int      l2uring_sendmsg( L2Uring* uring, struct msghdr* msgs, int count );
+
+#endif /* L2URING_H */
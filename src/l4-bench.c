@@ -0,0 +1,1506 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "l4sap.h"
+#include "l4server.h"
+#include "l4shards.h"
+#include "bench.h"
+#include "log.h"
+
+void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-n <messages>] [-s <size>] [-f <framesize>] [-i <impairment>] [-w <windows>]\n"
+                    "       %*s [-d <dupthresh>]\n"
+                    "       %s -a <ackdelay> [-n <messages>] [-s <size>]\n"
+                    "       %s -m <msgsize> [-n <messages>] [-f <framesize>]\n"
+                    "       %s -F <interval>\n"
+                    "       %s -c <connections> [-n <messages>] [-s <size>]\n"
+                    "       %s -S <sessions>\n"
+                    "       %s -W <clients> [-n <messages>]\n"
+                    "       %s -C <rates> [-n <messages>] [-i <impairment>]\n"
+                    "       %s -Q <sizes> [-n <messages>]\n"
+                    "       messages   - number of messages per run (default 20000)\n"
+                    "       size       - message size in bytes (default: as large as a frame allows)\n"
+                    "       framesize  - L2 frame size that both ends offer (default %d, at most %d)\n"
+                    "       impairment - network profile for both directions, e.g.\n"
+                    "                    loss=0.01,delay=5ms,jitter=1ms,dist=pareto,seed=3\n"
+                    "       windows    - comma-separated window sizes; compares Go-Back-N and\n"
+                    "                    Selective Repeat at each instead of the default runs\n"
+                    "       dupthresh  - duplicate ACKs before a fast retransmit with -w (default %d, 0 off)\n"
+                    "       ackdelay   - compares immediate ACKs with ACKs delayed by up to ackdelay\n"
+                    "                    microseconds on request/response exchanges\n"
+                    "       msgsize    - sends messages of msgsize bytes with l4sap_send_msg, in\n"
+                    "                    stop-and-wait and Selective Repeat mode (default 4 messages)\n"
+                    "       interval   - microseconds between the stale ACKs with which a peer floods\n"
+                    "                    a sender that never gets its ACK; checks that it gives up in time\n"
+                    "       connections - drives that many loopback connections from one thread with\n"
+                    "                    l4sap_submit_send and completions\n"
+                    "       sessions   - clients that open a session each with an L4 server, at\n"
+                    "                    1 to 512 at a time\n"
+                    "       clients    - sends messages from that many clients to an L4 service\n"
+                    "                    with 1, 2, 4 and 8 SO_REUSEPORT workers\n"
+                    "       rates      - comma-separated bottleneck rates in Mbit/s; compares Selective\n"
+                    "                    Repeat without congestion control, with Reno and with Reno\n"
+                    "                    and pacing (default 2000 messages, impairment delay=2ms)\n"
+                    "       sizes      - comma-separated small message sizes; compares sending them\n"
+                    "                    one per packet with the coalescing send queue\n",
+            name, (int)strlen(name), "", name, name, name, name, name, name, name, name, L2Framesize, L2Maxframesize, L4Dupthresh);
+    exit(-1);
+}
+
+/* Payload bytes that the L2 and L4 entities of both peers copied out
+ * of receive buffers, and into frames before sending.
+ */
+static uint64_t rx_copied(L4SAP *a, L4SAP *b)
+{
+    return a->l2->stats.rx_copy_bytes + a->stats.rx_copy_bytes +
+           b->l2->stats.rx_copy_bytes + b->stats.rx_copy_bytes;
+}
+
+static uint64_t tx_copied(L4SAP *a, L4SAP *b)
+{
+    return a->l2->stats.tx_copy_bytes + a->stats.tx_copy_bytes +
+           b->l2->stats.tx_copy_bytes + b->stats.tx_copy_bytes;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Sends messages from tx to rx, which receives them either with
+ * l4sap_recv or with l4sap_recv_view. Both run on one reactor, so
+ * rx's frames are handled while tx waits for its ACKs.
+ */
+static void run(const char *name, L4SAP *tx, L4SAP *rx, int messages, int size, int zero_copy)
+{
+    uint8_t *payload = malloc(size);
+    uint8_t *buffer = malloc(size);
+
+    /* The time from l4sap_send until the message is received. */
+    double *latency = malloc(messages * sizeof(double));
+    if (payload == NULL || buffer == NULL || latency == NULL)
+    {
+        free(payload);
+        free(buffer);
+        free(latency);
+        return;
+    }
+    memset(payload, 0x5a, size);
+
+    uint64_t rx_bytes = rx_copied(tx, rx);
+    uint64_t tx_bytes = tx_copied(tx, rx);
+    int delivered = 0;
+
+    double start = bench_now();
+    for (int i = 0; i < messages; i++)
+    {
+        double sent = bench_now();
+        if (l4sap_send(tx, payload, size) != L4_ACK_RECEIVED)
+            continue;
+
+        int before = delivered;
+        if (zero_copy)
+        {
+            L4View view;
+            if (l4sap_recv_view(rx, &view) == size)
+                delivered++;
+            l4sap_release_view(rx, &view);
+        }
+        else if (l4sap_recv(rx, buffer, size) == size)
+        {
+            delivered++;
+        }
+
+        if (delivered > before)
+            latency[before] = bench_now() - sent;
+    }
+    double elapsed = bench_now() - start;
+
+    rx_bytes = rx_copied(tx, rx) - rx_bytes;
+    tx_bytes = tx_copied(tx, rx) - tx_bytes;
+    int n = delivered ? delivered : 1;
+    printf("%-16s: %8.0f messages/sec, bytes copied per message: %7.1f receive, %7.1f send\n",
+           name, delivered / elapsed, (double)rx_bytes / n, (double)tx_bytes / n);
+
+    if (delivered > 0)
+    {
+        qsort(latency, delivered, sizeof(double), compare_double);
+        printf("%-16s  goodput %.2f MB/s, %d of %d delivered, latency ms: p50 %.3f p99 %.3f max %.3f\n",
+               "", delivered * (double)size / elapsed / 1e6, delivered, messages,
+               latency[delivered / 2] * 1e3, latency[(int)(delivered * 0.99)] * 1e3,
+               latency[delivered - 1] * 1e3);
+    }
+    free(latency);
+    free(payload);
+    free(buffer);
+}
+
+/* negotiate lets tx offer its frame size to rx and handles the offer
+ * and the answer, before the entities are attached to the reactor.
+ * Returns the agreed frame size or -1.
+ */
+static int negotiate(L4SAP *tx, L4SAP *rx)
+{
+    if (l2sap_offer_framesize(tx->l2) < 0)
+        return -1;
+
+    /* Control frames are consumed by the receive functions. */
+    L2View view;
+    struct timeval timeout = {1, 0};
+    view.payload = NULL;
+    l2sap_recv_view(rx->l2, &view, &timeout);
+    l2sap_release_view(rx->l2, &view);
+
+    timeout.tv_sec = 1;
+    timeout.tv_usec = 0;
+    l2sap_recv_view(tx->l2, &view, &timeout);
+    l2sap_release_view(tx->l2, &view);
+
+    return tx->l2->framesize_agreed ? tx->l2->framesize : -1;
+}
+
+typedef struct
+{
+    L4SAP*  rx;
+    int     size;
+    int     delivered;
+
+    /* If not NULL, the time from l4sap_send until delivery of up to
+     * capacity messages, which carry their send time.
+     */
+    double* latency;
+    int     capacity;
+
+    /* Messages whose bytes were not the ones sent. */
+    int     errors;
+} Receiver;
+
+static void *receive(void *arg)
+{
+    Receiver *r = arg;
+    uint8_t *buffer = malloc(r->size);
+
+    /* Receiving goes on until the RESET of l4sap_destroy, because the
+     * delayed ACKs are only sent while the receiver waits.
+     */
+    while (buffer != NULL)
+    {
+        int result = l4sap_recv(r->rx, buffer, r->size);
+        if (result < 0)
+            break;
+        if (r->latency != NULL && r->delivered < r->capacity && result >= (int)sizeof(double))
+        {
+            double sent;
+            memcpy(&sent, buffer, sizeof(sent));
+            r->latency[r->delivered] = bench_now() - sent;
+        }
+        r->delivered++;
+    }
+    free(buffer);
+    return NULL;
+}
+
+/* Sends messages from tx to rx in one windowed mode. The receiver
+ * runs on its own thread without a reactor, so that it takes packets
+ * while l4sap_send keeps the window full. Goodput is measured until
+ * l4sap_flush has seen the last ACK.
+ */
+static void run_window(int mode, int window, int messages, int size, int framesize, int dupthresh,
+                       const ImpairProfile *impairment)
+{
+    L4SAP *tx;
+    L4SAP *rx;
+    if (bench_l4_pair(&tx, &rx) < 0)
+    {
+        LOG_ERROR("Failed to create loopback L4 entities");
+        return;
+    }
+
+    if (l2sap_set_framesize(tx->l2, framesize) < 0 || l2sap_set_framesize(rx->l2, framesize) < 0 ||
+        l4sap_set_window(tx, mode, window) < 0 || l4sap_set_window(rx, mode, window) < 0 ||
+        l4sap_set_dupthresh(tx, dupthresh) < 0)
+    {
+        LOG_ERROR("Failed to set up window %d", window);
+        l4sap_destroy(tx);
+        l4sap_destroy(rx);
+        return;
+    }
+
+    if (impairment != NULL)
+    {
+        ImpairProfile profile = *impairment;
+        l2sap_set_impairment(tx->l2, &profile);
+        profile.seed++;
+        l2sap_set_impairment(rx->l2, &profile);
+    }
+
+    uint8_t *payload = calloc(1, size);
+    double *latency = malloc(messages * sizeof(double));
+    Receiver receiver = {rx, size, 0, latency, messages, 0};
+    pthread_t thread;
+    if (payload == NULL || latency == NULL || pthread_create(&thread, NULL, receive, &receiver) != 0)
+    {
+        free(payload);
+        free(latency);
+        l4sap_destroy(tx);
+        l4sap_destroy(rx);
+        return;
+    }
+
+    double start = bench_now();
+    int result = 0;
+    for (int i = 0; i < messages && result >= 0; i++)
+    {
+        /* The latency includes waiting for room in the window. */
+        double sent = bench_now();
+        memcpy(payload, &sent, sizeof(sent));
+        result = l4sap_send(tx, payload, size);
+    }
+    if (result >= 0)
+        result = l4sap_flush(tx);
+    double elapsed = bench_now() - start;
+
+    /* The RESET also ends a receiver that is still waiting. */
+    l4sap_destroy(tx);
+    pthread_join(thread, NULL);
+
+    L4Rtt rtt;
+    l4sap_get_rtt(tx, &rtt);
+    int measured = receiver.delivered < messages ? receiver.delivered : messages;
+    double p50 = 0;
+    double p99 = 0;
+    if (measured > 0)
+    {
+        qsort(latency, measured, sizeof(double), compare_double);
+        p50 = latency[measured / 2];
+        p99 = latency[(int)(measured * 0.99)];
+    }
+    printf("%-17s %6d  %9.2f  %9d  %11" PRIu64 "  %4" PRIu64 "  %7.2f  %7.2f  %7.2f  %7.2f%s\n",
+           mode == L4_GO_BACK_N ? "Go-Back-N" : "Selective Repeat", window,
+           receiver.delivered * (double)size / elapsed / 1e6, receiver.delivered,
+           tx->stats.retransmits, tx->stats.fast_retransmits, rtt.srtt_us / 1e3, rtt.rto_us / 1e3,
+           p50 * 1e3, p99 * 1e3, result < 0 ? "  (gave up)" : "");
+
+    l4sap_destroy(rx);
+    free(latency);
+    free(payload);
+}
+
+/* The bytes of message number n. */
+static uint8_t message_byte(int n, int i)
+{
+    return (uint8_t)(i % 251 + n);
+}
+
+static void *receive_msgs(void *arg)
+{
+    Receiver *r = arg;
+
+    while (1)
+    {
+        uint8_t *message;
+        int result = l4sap_recv_msg_alloc(r->rx, &message);
+        if (result < 0)
+            break;
+
+        int i = 0;
+        while (i < result && message[i] == message_byte(r->delivered, i))
+            i++;
+        if (result != r->size || i < result)
+            r->errors++;
+        r->delivered++;
+        free(message);
+    }
+    return NULL;
+}
+
+/* Sends messages of size bytes, far more than one packet, with
+ * l4sap_send_msg to a receiver thread that reassembles each with
+ * l4sap_recv_msg_alloc and checks its bytes. window 0 is stop-and-wait.
+ */
+static int run_msg(int window, int messages, int size, int framesize)
+{
+    L4SAP *tx;
+    L4SAP *rx;
+    if (bench_l4_pair(&tx, &rx) < 0)
+    {
+        LOG_ERROR("Failed to create loopback L4 entities");
+        return -1;
+    }
+
+    uint8_t *payload = malloc(size > 0 ? size : 1);
+    Receiver receiver = {rx, size, 0, NULL, 0, 0};
+    pthread_t thread;
+    if (payload == NULL || l2sap_set_framesize(tx->l2, framesize) < 0 || l2sap_set_framesize(rx->l2, framesize) < 0 ||
+        (window > 0 && (l4sap_set_window(tx, L4_SELECTIVE_REPEAT, window) < 0 ||
+                        l4sap_set_window(rx, L4_SELECTIVE_REPEAT, window) < 0)) ||
+        pthread_create(&thread, NULL, receive_msgs, &receiver) != 0)
+    {
+        free(payload);
+        l4sap_destroy(tx);
+        l4sap_destroy(rx);
+        return -1;
+    }
+
+    double start = bench_now();
+    int result = 0;
+    for (int n = 0; n < messages && result >= 0; n++)
+    {
+        for (int i = 0; i < size; i++)
+            payload[i] = message_byte(n, i);
+        result = l4sap_send_msg(tx, payload, size);
+    }
+    if (result >= 0 && window > 0)
+        result = l4sap_flush(tx);
+    double elapsed = bench_now() - start;
+
+    l4sap_destroy(tx);
+    pthread_join(thread, NULL);
+
+    int chunk = l4sap_payload_size(rx) - (int)sizeof(L4Fragment);
+    int fragments = size > 0 ? (size + chunk - 1) / chunk : 1;
+    int ok = receiver.delivered == messages && receiver.errors == 0;
+    printf("%-17s %6d  %9d  %9.2f  %9d  %11" PRIu64 "  %6d%s\n", window > 0 ? "Selective Repeat" : "Stop-and-wait",
+           window, fragments, receiver.delivered * (double)size / elapsed / 1e6, receiver.delivered,
+           tx->stats.retransmits, receiver.errors, ok ? "" : "  (FAILED)");
+
+    l4sap_destroy(rx);
+    free(payload);
+    return ok ? 0 : -1;
+}
+
+static int run_msgs(int messages, int size, int framesize)
+{
+    printf("messages of %d bytes, frame size %d bytes, %d messages\n", size, framesize, messages);
+    printf("%-17s %6s  %9s  %9s  %9s  %11s  %6s\n", "mode", "window", "fragments", "MB/s", "delivered",
+           "retransmits", "errors");
+    /* A window of large frames overflows the receiver's socket
+     * buffer, so it holds about 128 KiB.
+     */
+    int window = 131072 / framesize;
+    if (window < 2)
+        window = 2;
+    if (window > 64)
+        window = 64;
+
+    int result = 0;
+    result |= run_msg(0, messages, size, framesize);
+    result |= run_msg(window, messages, size, framesize);
+    return result;
+}
+
+static void *receive_records(void *arg)
+{
+    Receiver *r = arg;
+    uint8_t *buffer = malloc(r->size + 1);
+
+    while (buffer != NULL)
+    {
+        int result = l4sap_recv(r->rx, buffer, r->size + 1);
+        if (result < 0)
+            break;
+
+        int i = 0;
+        while (i < result && buffer[i] == message_byte(r->delivered, i))
+            i++;
+        if (result != r->size || i < result)
+            r->errors++;
+        r->delivered++;
+    }
+    free(buffer);
+    return NULL;
+}
+
+/* Sends messages of size bytes with l4sap_send to a receiver thread
+ * that checks them, one per packet or, if delay_us is not 0, through
+ * the coalescing send queue. window 0 is stop-and-wait.
+ */
+static int run_coalesce(int window, int size, int delay_us, int messages)
+{
+    L4SAP *tx;
+    L4SAP *rx;
+    if (bench_l4_pair(&tx, &rx) < 0)
+    {
+        LOG_ERROR("Failed to create loopback L4 entities");
+        return -1;
+    }
+
+    uint8_t *payload = malloc(size);
+    Receiver receiver = {rx, size, 0, NULL, 0, 0};
+    pthread_t thread;
+    if (payload == NULL ||
+        (window > 0 && (l4sap_set_window(tx, L4_SELECTIVE_REPEAT, window) < 0 ||
+                        l4sap_set_window(rx, L4_SELECTIVE_REPEAT, window) < 0)) ||
+        l4sap_set_coalescing(tx, delay_us) < 0 || pthread_create(&thread, NULL, receive_records, &receiver) != 0)
+    {
+        free(payload);
+        l4sap_destroy(tx);
+        l4sap_destroy(rx);
+        return -1;
+    }
+
+    double start = bench_now();
+    int result = 0;
+    for (int n = 0; n < messages && (result >= 0 || result == L4_ACK_RECEIVED); n++)
+    {
+        for (int i = 0; i < size; i++)
+            payload[i] = message_byte(n, i);
+        result = l4sap_send(tx, payload, size);
+    }
+    if (result >= 0 || result == L4_ACK_RECEIVED)
+        result = l4sap_flush(tx);
+    double elapsed = bench_now() - start;
+    uint64_t packets = delay_us > 0 ? tx->stats.coalesced_packets : (uint64_t)messages;
+    uint64_t retransmits = tx->stats.retransmits;
+
+    l4sap_destroy(tx);
+    pthread_join(thread, NULL);
+
+    int ok = receiver.delivered == messages && receiver.errors == 0;
+    printf("%-17s %6d  %8s  %9.0f  %9d  %9" PRIu64 "  %8.1f  %11" PRIu64 "  %6d%s\n",
+           window > 0 ? "Selective Repeat" : "Stop-and-wait", size, delay_us > 0 ? "on" : "off",
+           receiver.delivered / elapsed, receiver.delivered, packets, packets > 0 ? (double)messages / packets : 0,
+           retransmits, receiver.errors, ok ? "" : "  (FAILED)");
+
+    l4sap_destroy(rx);
+    free(payload);
+    return ok ? 0 : -1;
+}
+
+static int run_coalescing(char *sizes, int messages)
+{
+    printf("%d messages, coalescing delay 1 ms\n", messages);
+    printf("%-17s %6s  %8s  %9s  %9s  %9s  %8s  %11s  %6s\n", "mode", "size", "coalesce", "msgs/sec", "delivered",
+           "packets", "per pkt", "retransmits", "errors");
+
+    int result = 0;
+    char *save;
+    for (char *item = strtok_r(sizes, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save))
+    {
+        int size = atoi(item);
+        if (size <= 0 || size > L4Payloadsize - L4Recordheader)
+            return -1;
+        for (int window = 0; window <= 64; window += 64)
+        {
+            result |= run_coalesce(window, size, 0, messages);
+            result |= run_coalesce(window, size, 1000, messages);
+        }
+    }
+    return result;
+}
+
+static void *echo(void *arg)
+{
+    Receiver *r = arg;
+    uint8_t *buffer = malloc(r->size);
+
+    while (buffer != NULL)
+    {
+        int result = l4sap_recv(r->rx, buffer, r->size);
+        if (result < 0 || l4sap_send(r->rx, buffer, result) == L4_QUIT)
+            break;
+        r->delivered++;
+    }
+    free(buffer);
+    return NULL;
+}
+
+/* Exchanges requests and replies like transport-test-client and the
+ * test server do, both blocking in stop-and-wait mode, and counts the
+ * frames that both sides send per exchange. With immediate ACKs, that
+ * is request, ACK, reply, ACK; with delayed ACKs, the reply carries the
+ * ACK of the request and the next request that of the reply.
+ */
+static void run_exchange(int delay_us, int messages, int size)
+{
+    L4SAP *tx;
+    L4SAP *rx;
+    if (bench_l4_pair(&tx, &rx) < 0)
+    {
+        LOG_ERROR("Failed to create loopback L4 entities");
+        return;
+    }
+    l4sap_set_delayed_ack(tx, delay_us);
+    l4sap_set_delayed_ack(rx, delay_us);
+
+    uint8_t *request = calloc(1, size);
+    uint8_t *reply = malloc(size);
+    Receiver server = {rx, size, 0, NULL, 0, 0};
+    pthread_t thread;
+    if (request == NULL || reply == NULL || pthread_create(&thread, NULL, echo, &server) != 0)
+    {
+        free(request);
+        free(reply);
+        l4sap_destroy(tx);
+        l4sap_destroy(rx);
+        return;
+    }
+
+    int exchanges = 0;
+    double start = bench_now();
+    for (int i = 0; i < messages; i++)
+    {
+        if (l4sap_send(tx, request, size) != L4_ACK_RECEIVED || l4sap_recv(tx, reply, size) != size)
+            break;
+        exchanges++;
+    }
+    double elapsed = bench_now() - start;
+
+    /* Read the counters before the RESET ends the server. */
+    uint64_t acks = tx->stats.acks + rx->stats.acks;
+    uint64_t piggybacked = tx->stats.piggybacked + rx->stats.piggybacked;
+    uint64_t retransmits = tx->stats.retransmits + rx->stats.retransmits;
+    l4sap_destroy(tx);
+    pthread_join(thread, NULL);
+
+    int n = exchanges ? exchanges : 1;
+    printf("%-16s  %9.0f  %9d  %8.2f  %10.2f  %11.2f  %11" PRIu64 "\n",
+           delay_us ? "delayed" : "immediate", exchanges / elapsed, exchanges,
+           (2.0 * exchanges + retransmits + acks) / n, (double)acks / n, (double)piggybacked / n, retransmits);
+
+    l4sap_destroy(rx);
+    free(request);
+    free(reply);
+}
+
+static int run_exchanges(int delay_us, int messages, int size)
+{
+    printf("request and reply of %d bytes, %d exchanges, ACK delay %d us\n", size, messages, delay_us);
+    printf("%-16s  %9s  %9s  %8s  %10s  %11s  %11s\n", "ACKs", "exch/sec", "exchanges", "frames", "bare ACKs",
+           "piggybacked", "retransmits");
+    run_exchange(0, messages, size);
+    run_exchange(delay_us, messages, size);
+    return 0;
+}
+
+typedef struct
+{
+    L2SAP*       l2;
+    int          interval_us;
+    volatile int stop;
+    uint64_t     sent;
+} Flooder;
+
+/* flood sends ACKs that acknowledge nothing: a fresh stop-and-wait
+ * sender waits for ackno 1, and a fresh window starts at 0, so
+ * ackno 0 and seqno 255 are stale for every mode.
+ */
+static void *flood(void *arg)
+{
+    Flooder *f = arg;
+    L4Header header;
+    header.type = L4_ACK;
+    header.seqno = 255;
+    header.ackno = 0;
+    header.mbz = 0;
+
+    struct timespec interval;
+    interval.tv_sec = f->interval_us / 1000000;
+    interval.tv_nsec = f->interval_us % 1000000 * 1000;
+    while (!f->stop)
+    {
+        if (l2sap_sendto(f->l2, (uint8_t *)&header, sizeof(header)) >= 0)
+            f->sent++;
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+/* Sends one message that is never acknowledged while the peer floods
+ * the sender with stale ACKs, and measures how long the sender takes
+ * to give up. Every wait for an ACK ends at a fixed deadline, so that
+ * is at most L4Maxtimeouts times the largest RTO, however many stale
+ * frames arrive. Returns 0 if it stayed within that bound plus
+ * FLOOD_SLACK_MS for scheduling and the timer of the last wait.
+ */
+#define FLOOD_SLACK_MS 5
+
+static int run_flood(int mode, int interval_us)
+{
+    const int min_rto_us = 10000;
+    const int max_rto_us = 20000;
+
+    L4SAP *tx;
+    L4SAP *rx;
+    if (bench_l4_pair(&tx, &rx) < 0)
+    {
+        LOG_ERROR("Failed to create loopback L4 entities");
+        return -1;
+    }
+
+    int result = -1;
+    Flooder flooder = {rx->l2, interval_us, 0, 0};
+    pthread_t thread;
+    if ((mode != L4_STOP_AND_WAIT && l4sap_set_window(tx, mode, 8) < 0) ||
+        l4sap_set_rto_bounds(tx, min_rto_us, max_rto_us) < 0 ||
+        pthread_create(&thread, NULL, flood, &flooder) != 0)
+    {
+        l4sap_destroy(tx);
+        l4sap_destroy(rx);
+        return -1;
+    }
+
+    uint8_t payload[64] = {0};
+    double start = bench_now();
+    result = l4sap_send(tx, payload, sizeof(payload));
+    if (mode != L4_STOP_AND_WAIT && result >= 0)
+        result = l4sap_flush(tx);
+    double elapsed = bench_now() - start;
+
+    flooder.stop = 1;
+    pthread_join(thread, NULL);
+
+    double bound = L4Maxtimeouts * max_rto_us / 1e3;
+    int within = result == L4_SEND_FAILED && elapsed * 1e3 <= bound + FLOOD_SLACK_MS;
+    printf("%-17s  gave up after %7.2f ms (bound %.0f ms), %" PRIu64 " stale ACKs, %" PRIu64
+           " retransmits%s\n", mode == L4_STOP_AND_WAIT ? "Stop-and-wait" :
+           mode == L4_GO_BACK_N ? "Go-Back-N" : "Selective Repeat", elapsed * 1e3, bound,
+           flooder.sent, tx->stats.retransmits, within ? "" : "  (FAILED)");
+
+    l4sap_destroy(tx);
+    l4sap_destroy(rx);
+    return within ? 0 : -1;
+}
+
+static int run_floods(int interval_us)
+{
+    printf("stale ACK every %d us\n", interval_us);
+    int result = 0;
+    result |= run_flood(L4_STOP_AND_WAIT, interval_us);
+    result |= run_flood(L4_GO_BACK_N, interval_us);
+    result |= run_flood(L4_SELECTIVE_REPEAT, interval_us);
+    return result;
+}
+
+typedef struct
+{
+    L4SAP*   tx;
+    L4SAP*   rx;
+    uint8_t* payload;
+    int      size;
+    int      messages;
+    int      submitted;
+    int      sent;
+    int      received;
+    int      failed;
+} Connection;
+
+/* Submits the next message of the connection, if any is left. */
+static void submit_next(Connection *c)
+{
+    if (c->submitted < c->messages && l4sap_submit_send(c->tx, c->payload, c->size, c) >= 0)
+        c->submitted++;
+}
+
+/* The completion callback of both ends of a connection: the sender
+ * submits the next message when one is acknowledged, and the receiver
+ * counts what arrives.
+ */
+static int completed(void *arg, L4SAP *l4, L4Completion *completion)
+{
+    (void)l4;
+    Connection *c = arg;
+    if (completion->type == L4_SEND_DONE)
+    {
+        if (completion->result < 0)
+            c->failed++;
+        else
+            c->sent++;
+        submit_next(c);
+    }
+    else if (completion->type == L4_RECV_DONE)
+    {
+        c->received++;
+    }
+    return 0;
+}
+
+/* Drives connections loopback pairs from one thread on one reactor
+ * with the asynchronous API. Every sender keeps depth messages
+ * submitted, so in stop-and-wait mode one is in flight and the next
+ * one waits, and with a window, depth fill the window.
+ */
+static int run_connections(int mode, int connections, int messages, int size)
+{
+    const int depth = mode == L4_STOP_AND_WAIT ? 2 : 8;
+
+    Reactor *reactor = reactor_create();
+    Connection *conns = calloc(connections, sizeof(Connection));
+    uint8_t *payload = calloc(1, size);
+    if (reactor == NULL || conns == NULL || payload == NULL)
+    {
+        reactor_destroy(reactor);
+        free(conns);
+        free(payload);
+        return -1;
+    }
+
+    int result = 0;
+    int created = 0;
+    for (; created < connections; created++)
+    {
+        Connection *c = &conns[created];
+        if (bench_l4_pair(&c->tx, &c->rx) < 0)
+        {
+            LOG_ERROR("Failed to create loopback L4 entities for connection %d", created);
+            result = -1;
+            break;
+        }
+        c->payload = payload;
+        c->size = size;
+        c->messages = messages / connections + (created < messages % connections);
+        if ((mode != L4_STOP_AND_WAIT && (l4sap_set_window(c->tx, mode, depth) < 0 ||
+                                           l4sap_set_window(c->rx, mode, depth) < 0)) ||
+            l4sap_set_completion(c->tx, completed, c) < 0 || l4sap_set_completion(c->rx, completed, c) < 0 ||
+            l4sap_attach(c->tx, reactor) < 0 || l4sap_attach(c->rx, reactor) < 0)
+        {
+            created++;
+            result = -1;
+            break;
+        }
+    }
+
+    int received = 0;
+    int failed = 0;
+    double start = bench_now();
+    if (result == 0)
+    {
+        for (int i = 0; i < connections; i++)
+            for (int n = 0; n < depth; n++)
+                submit_next(&conns[i]);
+
+        /* Until everything arrived, or nothing happened for a second. */
+        while (received + failed < messages && reactor_run_once(reactor, 1000) > 0)
+        {
+            received = 0;
+            failed = 0;
+            for (int i = 0; i < connections; i++)
+            {
+                received += conns[i].received;
+                failed += conns[i].failed;
+            }
+        }
+    }
+    double elapsed = bench_now() - start;
+
+    uint64_t retransmits = 0;
+    for (int i = 0; i < created; i++)
+        retransmits += conns[i].tx->stats.retransmits;
+    if (result == 0)
+    {
+        printf("%-17s  %10.0f  %9d  %9d  %11" PRIu64 "%s\n",
+               mode == L4_STOP_AND_WAIT ? "Stop-and-wait" : "Selective Repeat", received / elapsed, received,
+               failed, retransmits, received == messages ? "" : "  (INCOMPLETE)");
+        if (received != messages)
+            result = -1;
+    }
+
+    for (int i = 0; i < created; i++)
+    {
+        l4sap_destroy(conns[i].tx);
+        l4sap_destroy(conns[i].rx);
+    }
+    reactor_destroy(reactor);
+    free(conns);
+    free(payload);
+    return result;
+}
+
+static int run_connections_modes(int connections, int messages, int size)
+{
+    printf("%d connections on one thread, %d messages of %d bytes\n", connections, messages, size);
+    printf("%-17s  %10s  %9s  %9s  %11s\n", "mode", "msgs/sec", "received", "failed", "retransmits");
+    int result = 0;
+    result |= run_connections(L4_STOP_AND_WAIT, connections, messages, size);
+    result |= run_connections(L4_SELECTIVE_REPEAT, connections, messages, size);
+    return result;
+}
+
+typedef struct
+{
+    L4Server*    server;
+    volatile int stop;
+    int          peak;
+    uint8_t      reply[64];
+} Service;
+
+/* The server's callback answers every request with a reply. */
+static int serve(void *arg, L4Server *server, L4Session *session, L4Completion *completion)
+{
+    Service *service = arg;
+    if (completion->type == L4_SESSION_OPEN && l4server_session_count(server) > service->peak)
+        service->peak = l4server_session_count(server);
+    else if (completion->type == L4_RECV_DONE)
+        l4server_send(server, session, service->reply, sizeof(service->reply));
+    return 0;
+}
+
+static void *run_service(void *arg)
+{
+    Service *service = arg;
+    while (!service->stop)
+        l4server_run(service->server, 100);
+    return NULL;
+}
+
+typedef struct
+{
+    L4SAP* l4;
+    int    acked;
+    int    replied;
+    int    failed;
+} Client;
+
+static int client_completed(void *arg, L4SAP *l4, L4Completion *completion)
+{
+    (void)l4;
+    Client *client = arg;
+    if (completion->type == L4_SEND_DONE && completion->result >= 0)
+        client->acked = 1;
+    else if (completion->type == L4_RECV_DONE)
+        client->replied = 1;
+    else
+        client->failed = 1;
+    return 0;
+}
+
+/* Starts a client with its own socket that sends one request. */
+static int start_client(Client *client, Reactor *reactor, int port, const uint8_t *request)
+{
+    memset(client, 0, sizeof(Client));
+    client->l4 = l4sap_create("127.0.0.1", port);
+    if (client->l4 == NULL || l4sap_set_completion(client->l4, client_completed, client) < 0 ||
+        l4sap_attach(client->l4, reactor) < 0 || l4sap_submit_send(client->l4, request, 64, NULL) < 0)
+    {
+        l4sap_destroy(client->l4);
+        client->l4 = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/* One L4 server on a thread of its own serves sessions clients, which
+ * run concurrency at a time on one reactor on this thread. Every
+ * client is an L4SAP with a socket of its own: it opens a session with
+ * a request, waits for the reply and ends the session with L4_RESET.
+ */
+static int run_sessions(int sessions, int concurrency)
+{
+    Service service;
+    memset(&service, 0, sizeof(service));
+    service.server = l4server_create(0);
+    Reactor *reactor = reactor_create();
+    Client *clients = calloc(concurrency, sizeof(Client));
+    pthread_t thread;
+    if (service.server == NULL || reactor == NULL || clients == NULL ||
+        l4server_set_callback(service.server, serve, &service) < 0 ||
+        pthread_create(&thread, NULL, run_service, &service) != 0)
+    {
+        LOG_ERROR("Failed to start the L4 server");
+        l4server_destroy(service.server);
+        reactor_destroy(reactor);
+        free(clients);
+        return -1;
+    }
+
+    int port = l2sap_local_port(service.server->l2);
+    uint8_t request[64] = {0};
+    int started = 0;
+    int completed = 0;
+    int failed = 0;
+
+    double start = bench_now();
+    for (int i = 0; i < concurrency && started < sessions; i++, started++)
+        if (start_client(&clients[i], reactor, port, request) < 0)
+            failed++;
+
+    while (completed + failed < sessions)
+    {
+        if (reactor_run_once(reactor, 1000) <= 0)
+        {
+            LOG_WARN("no progress for a second");
+            break;
+        }
+
+        for (int i = 0; i < concurrency; i++)
+        {
+            Client *client = &clients[i];
+            if (client->l4 == NULL || !(client->failed || (client->acked && client->replied)))
+                continue;
+
+            if (client->failed)
+                failed++;
+            else
+                completed++;
+            l4sap_destroy(client->l4);
+            client->l4 = NULL;
+
+            if (started < sessions)
+            {
+                started++;
+                if (start_client(client, reactor, port, request) < 0)
+                    failed++;
+            }
+        }
+    }
+    double elapsed = bench_now() - start;
+
+    for (int i = 0; i < concurrency; i++)
+        l4sap_destroy(clients[i].l4);
+
+    /* The server thread sees the last RESETs. */
+    usleep(200000);
+    service.stop = 1;
+    pthread_join(thread, NULL);
+
+    printf("%-12d  %12.0f  %9d  %9d  %9d  %11" PRIu64 "  %11" PRIu64 "\n", concurrency, completed / elapsed,
+           completed, failed, service.peak, service.server->stats.reset, service.server->stats.retransmits);
+
+    int left = l4server_session_count(service.server);
+    if (left != 0)
+        LOG_WARN("%d sessions are left", left);
+
+    l4server_destroy(service.server);
+    reactor_destroy(reactor);
+    free(clients);
+    return completed == sessions ? 0 : -1;
+}
+
+static int run_sessions_levels(int sessions)
+{
+    printf("%d sessions of one 64-byte request and reply each\n", sessions);
+    printf("memory per session: %zu bytes L4Session + %zu bytes L2Peer + 16-32 bytes of peer table slots\n",
+           sizeof(L4Session), sizeof(L2Peer));
+    printf("%-12s  %12s  %9s  %9s  %9s  %11s  %11s\n", "concurrency", "sessions/sec", "completed", "failed",
+           "peak", "resets", "retransmits");
+    int result = 0;
+    for (int concurrency = 1; concurrency <= 1024; concurrency *= 8)
+        result |= run_sessions(sessions, concurrency < sessions ? concurrency : sessions);
+    return result;
+}
+
+/* Messages that each worker received, a cache line per worker so that
+ * the workers do not share one.
+ */
+typedef struct
+{
+    uint64_t received;
+    uint8_t  pad[56];
+} WorkerCount;
+
+static int count_worker(void *arg, L4Server *server, L4Session *session, L4Completion *completion)
+{
+    (void)session;
+    WorkerCount *counts = arg;
+    if (completion->type == L4_RECV_DONE)
+        counts[server->shard].received++;
+    return 0;
+}
+
+typedef struct
+{
+    int port;
+    int connections;
+    int messages;
+    int sent;
+    int failed;
+} Loader;
+
+static const uint8_t load_request[64];
+
+typedef struct
+{
+    L4SAP*  l4;
+    Loader* loader;
+    int     submitted;
+    int     messages;
+} LoadClient;
+
+static int load_completed(void *arg, L4SAP *l4, L4Completion *completion)
+{
+    LoadClient *client = arg;
+    if (completion->type != L4_SEND_DONE)
+        return 0;
+
+    if (completion->result < 0)
+        client->loader->failed++;
+    else
+        client->loader->sent++;
+    if (client->submitted < client->messages && l4sap_submit_send(l4, load_request, sizeof(load_request), NULL) >= 0)
+        client->submitted++;
+    return 0;
+}
+
+/* A client thread: connections clients on one reactor, each of which
+ * keeps two messages submitted until its share is sent.
+ */
+static void *load(void *arg)
+{
+    Loader *loader = arg;
+    Reactor *reactor = reactor_create();
+    LoadClient *clients = calloc(loader->connections, sizeof(LoadClient));
+    if (reactor == NULL || clients == NULL)
+    {
+        reactor_destroy(reactor);
+        free(clients);
+        loader->failed = loader->messages;
+        return NULL;
+    }
+
+    for (int i = 0; i < loader->connections; i++)
+    {
+        LoadClient *client = &clients[i];
+        client->loader = loader;
+        client->messages = loader->messages / loader->connections + (i < loader->messages % loader->connections);
+        client->l4 = l4sap_create("127.0.0.1", loader->port);
+        if (client->l4 == NULL || l4sap_set_completion(client->l4, load_completed, client) < 0 ||
+            l4sap_attach(client->l4, reactor) < 0)
+        {
+            loader->failed += client->messages;
+            continue;
+        }
+        for (int n = 0; n < 2 && client->submitted < client->messages; n++)
+            if (l4sap_submit_send(client->l4, load_request, sizeof(load_request), NULL) >= 0)
+                client->submitted++;
+    }
+
+    while (loader->sent + loader->failed < loader->messages && reactor_run_once(reactor, 1000) > 0)
+        ;
+
+    for (int i = 0; i < loader->connections; i++)
+        l4sap_destroy(clients[i].l4);
+    reactor_destroy(reactor);
+    free(clients);
+    return NULL;
+}
+
+/* Sends messages from connections clients on threads client threads
+ * to a service with workers shards. Returns 0 if all were sent.
+ */
+static int run_shards(int workers, int threads, int connections, int messages)
+{
+    WorkerCount *counts = calloc(workers, sizeof(WorkerCount));
+    Loader *loaders = calloc(threads, sizeof(Loader));
+    pthread_t *thread = calloc(threads, sizeof(pthread_t));
+    L4Shards *shards = counts == NULL ? NULL : l4shards_create(0, workers, count_worker, counts);
+    if (loaders == NULL || thread == NULL || shards == NULL || l4shards_start(shards) < 0)
+    {
+        LOG_ERROR("Failed to start %d workers", workers);
+        l4shards_destroy(shards);
+        free(counts);
+        free(loaders);
+        free(thread);
+        return -1;
+    }
+
+    int started = 0;
+    double start = bench_now();
+    for (int i = 0; i < threads; i++, started++)
+    {
+        loaders[i].port = l4shards_port(shards);
+        loaders[i].connections = connections / threads + (i < connections % threads);
+        loaders[i].messages = messages / threads + (i < messages % threads);
+        if (pthread_create(&thread[i], NULL, load, &loaders[i]) != 0)
+            break;
+    }
+
+    int sent = 0;
+    int failed = 0;
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(thread[i], NULL);
+        sent += loaders[i].sent;
+        failed += loaders[i].failed;
+    }
+    double elapsed = bench_now() - start;
+
+    /* The RESETs of the last clients end their sessions. */
+    usleep(200000);
+    l4shards_stop(shards);
+
+    uint64_t least = UINT64_MAX;
+    uint64_t most = 0;
+    for (int i = 0; i < workers; i++)
+    {
+        if (counts[i].received < least)
+            least = counts[i].received;
+        if (counts[i].received > most)
+            most = counts[i].received;
+    }
+    printf("%-8d  %10.0f  %9d  %9d  %9" PRIu64 "  %9" PRIu64 "\n", workers, sent / elapsed, sent, failed, least,
+           most);
+
+    l4shards_destroy(shards);
+    free(counts);
+    free(loaders);
+    free(thread);
+    return sent == messages ? 0 : -1;
+}
+
+static int run_shard_levels(int connections, int messages)
+{
+    const int threads = 4;
+    if (connections < threads)
+        connections = threads;
+
+    printf("%d connections on %d client threads, %d messages of 64 bytes, %ld CPUs\n", connections, threads,
+           messages, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%-8s  %10s  %9s  %9s  %9s  %9s\n", "workers", "msgs/sec", "sent", "failed", "least", "most");
+    int result = 0;
+    for (int workers = 1; workers <= 8; workers *= 2)
+        result |= run_shards(workers, threads, connections, messages);
+    return result;
+}
+
+/* The ways in which run_bottleneck sends. */
+#define BOTTLENECK_NONE   0
+#define BOTTLENECK_RENO   1
+#define BOTTLENECK_PACED  2
+
+/* Sends messages with Selective Repeat and a window of 64 through a
+ * bottleneck of rate_mbit Mbit/s with a queue of 32 kB in the data
+ * direction, which holds less than a window. Without congestion
+ * control, the sender overflows the queue again and again; with it,
+ * it should keep close to the rate with few losses.
+ */
+static void run_bottleneck(double rate_mbit, int control, int messages, const ImpairProfile *impairment)
+{
+    const int window = 64;
+    L4SAP *tx;
+    L4SAP *rx;
+    if (bench_l4_pair(&tx, &rx) < 0)
+    {
+        LOG_ERROR("Failed to create loopback L4 entities");
+        return;
+    }
+
+    if (l4sap_set_window(tx, L4_SELECTIVE_REPEAT, window) < 0 || l4sap_set_window(rx, L4_SELECTIVE_REPEAT, window) < 0 ||
+        (control != BOTTLENECK_NONE && l4sap_set_congestion(tx, &l4_reno, control == BOTTLENECK_PACED) < 0))
+    {
+        LOG_ERROR("Failed to set up the sender");
+        l4sap_destroy(tx);
+        l4sap_destroy(rx);
+        return;
+    }
+
+    /* The ACKs go back without the bottleneck. */
+    ImpairProfile profile = *impairment;
+    profile.rate_bps = (uint64_t)(rate_mbit * 1e6);
+    profile.limit_bytes = 32000;
+    l2sap_set_impairment(tx->l2, &profile);
+    profile = *impairment;
+    profile.seed++;
+    l2sap_set_impairment(rx->l2, &profile);
+
+    int size = l4sap_payload_size(tx);
+    uint8_t *payload = calloc(1, size);
+    Receiver receiver = {rx, size, 0, NULL, 0, 0};
+    pthread_t thread;
+    if (payload == NULL || pthread_create(&thread, NULL, receive, &receiver) != 0)
+    {
+        free(payload);
+        l4sap_destroy(tx);
+        l4sap_destroy(rx);
+        return;
+    }
+
+    double start = bench_now();
+    int result = 0;
+    for (int i = 0; i < messages && result >= 0; i++)
+        result = l4sap_send(tx, payload, size);
+    if (result >= 0)
+        result = l4sap_flush(tx);
+    double elapsed = bench_now() - start;
+
+    L4CongestionStats congestion;
+    l4sap_get_congestion(tx, &congestion);
+    ImpairStats data;
+    impair_get_stats(tx->l2->impair, &data);
+    L4Rtt rtt;
+    l4sap_get_rtt(tx, &rtt);
+    uint64_t retransmits = tx->stats.retransmits;
+
+    l4sap_destroy(tx);
+    pthread_join(thread, NULL);
+
+    static const char *names[] = {"none", "reno", "reno+pacing"};
+    printf("%8.1f  %-12s %9.2f  %9d  %6.2f%%  %11" PRIu64 "  %6" PRIu64 "  %4d  %9.2f  %7" PRIu64 "  %7.2f%s\n",
+           rate_mbit, names[control], receiver.delivered * (double)size * 8 / elapsed / 1e6, receiver.delivered,
+           data.frames > 0 ? 100.0 * data.queue_drops / data.frames : 0, retransmits,
+           congestion.loss_events, congestion.cwnd, congestion.pacing_rate_Bps * 8 / 1e6, congestion.paced,
+           rtt.srtt_us / 1e3, result < 0 ? "  (gave up)" : "");
+
+    l4sap_destroy(rx);
+    free(payload);
+}
+
+static int run_bottlenecks(char *rates, int messages, const char *impairment, const ImpairProfile *profile)
+{
+    printf("window 64, %d messages of %d bytes, bottleneck queue 32 kB, impairment %s\n", messages,
+           L4Payloadsize, impairment);
+    printf("%8s  %-12s %9s  %9s  %7s  %11s  %6s  %4s  %9s  %7s  %7s\n", "Mbit/s", "control", "goodput",
+           "delivered", "drops", "retransmits", "losses", "cwnd", "pace Mb/s", "paced", "srtt ms");
+
+    char *save;
+    for (char *item = strtok_r(rates, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save))
+    {
+        double rate = atof(item);
+        if (rate <= 0)
+            return -1;
+        for (int control = BOTTLENECK_NONE; control <= BOTTLENECK_PACED; control++)
+            run_bottleneck(rate, control, messages, profile);
+    }
+    return 0;
+}
+
+static int run_windows(char *windows, int messages, int size, int framesize, int dupthresh,
+                       const char *impairment, const ImpairProfile *profile)
+{
+    printf("frame size %d bytes, message size %d bytes, %d messages, impairment %s, dupthresh %d\n",
+           framesize, size, messages, impairment != NULL ? impairment : "none", dupthresh);
+    printf("%-17s %6s  %9s  %9s  %11s  %4s  %7s  %7s  %7s  %7s\n", "mode", "window", "MB/s", "delivered",
+           "retransmits", "fast", "srtt ms", "rto ms", "p50 ms", "p99 ms");
+
+    char *save;
+    for (char *item = strtok_r(windows, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save))
+    {
+        int window = atoi(item);
+        run_window(L4_GO_BACK_N, window, messages, size, framesize, dupthresh, profile);
+        run_window(L4_SELECTIVE_REPEAT, window, messages, size, framesize, dupthresh, profile);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int messages = -1;
+    int size = 0;
+    int framesize = L2Framesize;
+    const char *impairment = NULL;
+    char *windows = NULL;
+    int flood_us = -1;
+    int ack_delay_us = -1;
+    int dupthresh = L4Dupthresh;
+    int msgsize = -1;
+    int connections = 0;
+    int sessions = 0;
+    int shard_connections = 0;
+    char *rates = NULL;
+    char *sizes = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:f:i:w:d:F:a:m:c:S:W:C:Q:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            messages = atoi(optarg);
+            break;
+        case 's':
+            size = atoi(optarg);
+            break;
+        case 'f':
+            framesize = atoi(optarg);
+            break;
+        case 'i':
+            impairment = optarg;
+            break;
+        case 'w':
+            windows = optarg;
+            break;
+        case 'd':
+            dupthresh = atoi(optarg);
+            if (dupthresh < 0)
+                usage(argv[0]);
+            break;
+        case 'm':
+            msgsize = atoi(optarg);
+            if (msgsize < 0 || msgsize > L4Maxmessage)
+                usage(argv[0]);
+            break;
+        case 'a':
+            ack_delay_us = atoi(optarg);
+            if (ack_delay_us <= 0)
+                usage(argv[0]);
+            break;
+        case 'c':
+            connections = atoi(optarg);
+            if (connections <= 0)
+                usage(argv[0]);
+            break;
+        case 'S':
+            sessions = atoi(optarg);
+            if (sessions <= 0)
+                usage(argv[0]);
+            break;
+        case 'W':
+            shard_connections = atoi(optarg);
+            if (shard_connections <= 0)
+                usage(argv[0]);
+            break;
+        case 'C':
+            rates = optarg;
+            break;
+        case 'Q':
+            sizes = optarg;
+            break;
+        case 'F':
+            flood_us = atoi(optarg);
+            if (flood_us < 0)
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (messages < 0)
+        messages = msgsize >= 0 ? 4 : rates != NULL ? 2000 : 20000;
+    if (messages <= 0 || size < 0 || framesize <= 0 || framesize > L2Maxframesize)
+        usage(argv[0]);
+
+    if (flood_us >= 0)
+        return run_floods(flood_us) < 0 ? 1 : 0;
+    if (sessions > 0)
+        return run_sessions_levels(sessions) < 0 ? 1 : 0;
+    if (shard_connections > 0)
+        return run_shard_levels(shard_connections, messages) < 0 ? 1 : 0;
+    if (connections > 0)
+    {
+        if (size == 0)
+            size = 64;
+        if (size > L4Payloadsize || messages < connections)
+            usage(argv[0]);
+        return run_connections_modes(connections, messages, size) < 0 ? 1 : 0;
+    }
+    if (sizes != NULL)
+        return run_coalescing(sizes, messages) < 0 ? 1 : 0;
+    if (msgsize >= 0)
+        return run_msgs(messages, msgsize, framesize) < 0 ? 1 : 0;
+    if (ack_delay_us > 0)
+    {
+        if (size == 0)
+            size = 64;
+        if (size > L4Payloadsize)
+            usage(argv[0]);
+        return run_exchanges(ack_delay_us, messages, size);
+    }
+
+    ImpairProfile profile;
+    if (impairment != NULL && impair_parse(&profile, impairment) < 0)
+        usage(argv[0]);
+
+    if (rates != NULL)
+    {
+        if (impairment == NULL)
+        {
+            impairment = "delay=2ms";
+            impair_parse(&profile, impairment);
+        }
+        return run_bottlenecks(rates, messages, impairment, &profile) < 0 ? 1 : 0;
+    }
+
+    if (windows != NULL)
+    {
+        int largest = framesize - L2Headersize - L4Headersize;
+        if (size == 0)
+            size = largest;
+        if (size > largest || size < (int)sizeof(double))
+            usage(argv[0]);
+        return run_windows(windows, messages, size, framesize, dupthresh, impairment,
+                           impairment != NULL ? &profile : NULL);
+    }
+
+    L4SAP *tx;
+    L4SAP *rx;
+    Reactor *reactor = reactor_create();
+    if (reactor == NULL || bench_l4_pair(&tx, &rx) < 0)
+    {
+        LOG_ERROR("Failed to create loopback L4 entities");
+        return -1;
+    }
+
+    /* Both ends receive into one shared pool. rx is configured for
+     * the same frame size as tx, which it accepts when tx offers it.
+     */
+    FramePool *pool = framepool_create(2 * L2Rxframes, framesize);
+    if (pool == NULL || l2sap_set_framesize(tx->l2, framesize) < 0 || l2sap_set_framesize(rx->l2, framesize) < 0 ||
+        l2sap_set_pool(tx->l2, pool) < 0 || l2sap_set_pool(rx->l2, pool) < 0)
+    {
+        LOG_ERROR("Failed to set up frames of %d bytes", framesize);
+        return -1;
+    }
+    if (negotiate(tx, rx) != framesize)
+    {
+        LOG_ERROR("Failed to negotiate the frame size");
+        return -1;
+    }
+
+    if (size == 0)
+        size = l4sap_payload_size(tx);
+    if (size > l4sap_payload_size(tx))
+        usage(argv[0]);
+
+    /* The emulator must be in place before the entities are attached. */
+    if (impairment != NULL)
+    {
+        /* The ACK direction gets the next seed, so that its losses
+         * are not the same as those of the data direction.
+         */
+        if (l2sap_set_impairment(tx->l2, &profile) < 0)
+            usage(argv[0]);
+        profile.seed++;
+        if (l2sap_set_impairment(rx->l2, &profile) < 0)
+            usage(argv[0]);
+    }
+
+    l4sap_attach(tx, reactor);
+    l4sap_attach(rx, reactor);
+
+    printf("frame size %d bytes, message size %d bytes, %d messages\n", framesize, size, messages);
+    run("l4sap_recv", tx, rx, messages, size, 0);
+    run("l4sap_recv_view", tx, rx, messages, size, 1);
+
+    FramePoolStats stats;
+    framepool_get_stats(pool, &stats);
+    printf("frame pool      : %d of %d buffers used at most, %" PRIu64 " times exhausted\n",
+           stats.high_water, stats.capacity, stats.exhausted);
+
+    L4Rtt rtt;
+    l4sap_get_rtt(tx, &rtt);
+    printf("sender rtt      : srtt %.3f ms, rttvar %.3f ms, rto %.3f ms, %" PRIu64 " samples, %" PRIu64
+           " retransmissions\n", rtt.srtt_us / 1e3, rtt.rttvar_us / 1e3, rtt.rto_us / 1e3, rtt.samples,
+           tx->stats.retransmits);
+
+    L4Stats sender;
+    l4sap_get_stats(tx, &sender);
+    printf("sender acks     : %" PRIu64 " DATA packets, time to ACK p50 <= %" PRIu64 " us, p99 <= %" PRIu64
+           " us, max %" PRIu64 " us; %" PRIu64 " stale ACKs\n", sender.data_sent,
+           l4sap_histogram_percentile(&sender.ack_latency, 0.5), l4sap_histogram_percentile(&sender.ack_latency, 0.99),
+           sender.ack_latency.max_us, sender.stale_acks);
+
+    if (impairment != NULL)
+    {
+        ImpairStats data;
+        ImpairStats acks;
+        impair_get_stats(tx->l2->impair, &data);
+        impair_get_stats(rx->l2->impair, &acks);
+        printf("impairment      : %s\n", impairment);
+        printf("  data frames %" PRIu64 ": lost %" PRIu64 ", duplicated %" PRIu64 ", reordered %" PRIu64
+               ", corrupted %" PRIu64 "\n", data.frames, data.lost, data.duplicated, data.reordered, data.corrupted);
+        printf("  ack frames  %" PRIu64 ": lost %" PRIu64 ", duplicated %" PRIu64 ", reordered %" PRIu64
+               ", corrupted %" PRIu64 "\n", acks.frames, acks.lost, acks.duplicated, acks.reordered, acks.corrupted);
+    }
+
+    l4sap_destroy(tx);
+    l4sap_destroy(rx);
+    reactor_destroy(reactor);
+    framepool_destroy(pool);
+    return 0;
+}
@@ -0,0 +1,101 @@
+#include "l4cc.h"
+
+/* RFC 5681 allows an initial window of 2 to 4 segments. */
+#define L4Initialcwnd 4
+
+static void reno_init(L4Congestion *cc)
+{
+    cc->cwnd = L4Initialcwnd < cc->max_cwnd ? L4Initialcwnd : cc->max_cwnd;
+    cc->ssthresh = cc->max_cwnd;
+    cc->acked = 0;
+}
+
+static void reno_on_ack(L4Congestion *cc, int acked, int64_t srtt_ns)
+{
+    (void)srtt_ns;
+
+    /* Slow start: one packet more per packet acknowledged. */
+    while (acked > 0 && cc->cwnd < cc->ssthresh)
+    {
+        cc->cwnd++;
+        acked--;
+    }
+
+    /* Congestion avoidance: one packet more per window. */
+    cc->acked += acked;
+    while (cc->acked >= cc->cwnd)
+    {
+        cc->acked -= cc->cwnd;
+        cc->cwnd++;
+    }
+
+    if (cc->cwnd > cc->max_cwnd)
+        cc->cwnd = cc->max_cwnd;
+}
+
+static void reno_on_loss(L4Congestion *cc, int in_flight, int timeout)
+{
+    cc->ssthresh = in_flight / 2 > 2 ? in_flight / 2 : 2;
+    cc->cwnd = timeout ? 1 : cc->ssthresh;
+    cc->acked = 0;
+}
+
+const L4CongestionOps l4_reno = {"reno", reno_init, reno_on_ack, reno_on_loss};
+
+/* l4pacer_refill adds the tokens that accumulated since the last call. */
+static void l4pacer_refill(L4Pacer *pacer, uint64_t now_ns)
+{
+    if (now_ns <= pacer->last_ns)
+        return;
+
+    /* A longer time fills the bucket anyway, and the product would
+     * overflow after a few seconds at loopback rates.
+     */
+    uint64_t elapsed = now_ns - pacer->last_ns;
+    uint64_t full = pacer->burst * 1000000000u / pacer->rate_Bps + 1;
+    if (elapsed > full)
+        elapsed = full;
+
+    uint64_t tokens = elapsed * pacer->rate_Bps / 1000000000u;
+    if (tokens == 0)
+        return;
+
+    pacer->tokens = pacer->tokens + tokens > pacer->burst ? pacer->burst : pacer->tokens + tokens;
+    pacer->last_ns = now_ns;
+}
+
+void l4pacer_set_rate(L4Pacer *pacer, uint64_t rate_Bps, uint64_t burst, uint64_t now_ns)
+{
+    if (pacer->rate_Bps == 0)
+    {
+        pacer->tokens = burst;
+        pacer->last_ns = now_ns;
+    }
+    else
+    {
+        /* The tokens so far accumulated at the old rate. */
+        l4pacer_refill(pacer, now_ns);
+        if (pacer->tokens > burst)
+            pacer->tokens = burst;
+    }
+    pacer->rate_Bps = rate_Bps;
+    pacer->burst = burst;
+}
+
+uint64_t l4pacer_delay(L4Pacer *pacer, uint64_t bytes, uint64_t now_ns)
+{
+    if (pacer->rate_Bps == 0)
+        return 0;
+
+    l4pacer_refill(pacer, now_ns);
+    if (pacer->tokens >= bytes)
+        return 0;
+
+    uint64_t delay = (bytes - pacer->tokens) * 1000000000u / pacer->rate_Bps;
+    return delay > 0 ? delay : 1;
+}
+
+void l4pacer_take(L4Pacer *pacer, uint64_t bytes)
+{
+    pacer->tokens = pacer->tokens > bytes ? pacer->tokens - bytes : 0;
+}
@@ -0,0 +1,87 @@
+#ifndef L4CC_H
+#define L4CC_H
+
+#include <inttypes.h>
+
+/* Congestion control for the windowed modes of the L4 layer (see
+ * l4sap_set_congestion). An algorithm is a table of callbacks that
+ * keeps the congestion window cwnd, in packets, in an L4Congestion;
+ * the sender never has more than cwnd packets in flight. l4_reno is
+ * the classic AIMD of TCP Reno: slow start up to ssthresh, then one
+ * packet more per window of ACKs, and half the window on a loss.
+ * Another algorithm fills in its own L4CongestionOps and may keep its
+ * state in priv.
+ */
+typedef struct L4Congestion L4Congestion;
+typedef struct L4CongestionOps L4CongestionOps;
+
+struct L4CongestionOps
+{
+    const char* name;
+
+    /* Sets the initial window. */
+    void (*init)( L4Congestion* cc );
+
+    /* acked packets were acknowledged for the first time. srtt_ns is
+     * the smoothed RTT, or 0 before the first sample.
+     */
+    void (*on_ack)( L4Congestion* cc, int acked, int64_t srtt_ns );
+
+    /* A loss was detected with in_flight packets in flight, by a
+     * retransmission timeout if timeout is set and else by duplicate
+     * ACKs. It is reported once per window of data.
+     */
+    void (*on_loss)( L4Congestion* cc, int in_flight, int timeout );
+};
+
+struct L4Congestion
+{
+    const L4CongestionOps* ops;
+
+    /* The congestion window and slow start threshold in packets, at
+     * most max_cwnd.
+     */
+    int      cwnd;
+    int      ssthresh;
+    int      max_cwnd;
+
+    /* ACKed packets that count towards the next increase in
+     * congestion avoidance.
+     */
+    int      acked;
+
+    uint64_t priv[4];
+};
+
+extern const L4CongestionOps l4_reno;
+
+/* A token bucket that spreads the packets of a window over the RTT
+ * instead of sending them in one burst. Tokens are bytes; they
+ * accumulate at rate_Bps up to burst bytes.
+ */
+typedef struct L4Pacer L4Pacer;
+
+struct L4Pacer
+{
+    uint64_t rate_Bps;
+    uint64_t burst;
+    uint64_t tokens;
+    uint64_t last_ns;
+};
+
+/* Sets the rate in bytes per second and the depth of the bucket. The
+ * bucket starts full.
+ */
+void     l4pacer_set_rate( L4Pacer* pacer, uint64_t rate_Bps, uint64_t burst, uint64_t now_ns );
+
+/* Returns 0 if bytes can be sent at now_ns, and else the nanoseconds
+ * until there are tokens for them. A pacer without a rate never waits.
+ */
+uint64_t l4pacer_delay( L4Pacer* pacer, uint64_t bytes, uint64_t now_ns );
+
+/* Takes the tokens for bytes that are sent; a packet that was sent
+ * with too few tokens (a retransmission) empties the bucket.
+ */
+void     l4pacer_take( L4Pacer* pacer, uint64_t bytes );
+
+#endif /* L4CC_H */
@@ -4,9 +4,11 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "l4sap.h"
 #include "l2sap.h"
+#include "log.h"
 
 /* Create an L4 client.
  * It returns a dynamically allocated struct L4SAP that contains the
@@ -29,32 +31,1225 @@ L4SAP *l4sap_create(const char *server_ip, int server_port)
         return NULL;
     }
 
+    l4->reactor = NULL;
     l4->next_send_seq = 0;
     l4->expected_recv_seq = 0;
     l4->is_terminating = 0;
+    l4->send_state.prefix = NULL;
+    l4->send_state.prefix_length = 0;
+    l4->send_state.data = NULL;
     l4->send_state.length = 0;
     l4->send_state.last_ack_recieved = 0;
+    l4->send_state.waiting = 0;
+    l4->send_state.acked = 0;
     l4->recv_state.last_seqno_recieved = 0;
     l4->recv_state.last_ack_sent = 0;
+    l4->recv_state.data = NULL;
+    l4->recv_state.len = 0;
+    l4->recv_state.view = NULL;
+    l4->recv_state.result = -1;
+    l4->recv_state.pending.payload = NULL;
+    memset(&l4->stats, 0, sizeof(l4->stats));
+    memset(&l4->ack, 0, sizeof(l4->ack));
+    memset(&l4->async, 0, sizeof(l4->async));
+    memset(&l4->send_state.header, 0, sizeof(l4->send_state.header));
+    memset(&l4->window, 0, sizeof(l4->window));
+    l4->window.mode = L4_STOP_AND_WAIT;
+    l4->window.dupthresh = L4Dupthresh;
 
-    memset(l4->send_state.buffer, 0, sizeof(l4->send_state.buffer));
+    memset(&l4->rtt, 0, sizeof(l4->rtt));
+    l4->rtt.rto_ns = (int64_t)L4Initialrto * 1000;
+    l4->rtt.min_rto_ns = (int64_t)L4Minrto * 1000;
+    l4->rtt.max_rto_ns = (int64_t)L4Maxrto * 1000;
+
+    memset(&l4->congestion, 0, sizeof(l4->congestion));
+    memset(&l4->coalesce, 0, sizeof(l4->coalesce));
     return l4;
 }
 
+static uint64_t l4sap_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* l4sap_deadline converts a time in l4sap_now_ns nanoseconds into a
+ * deadline for the L2 and reactor wait functions.
+ */
+static void l4sap_deadline(struct timespec *deadline, uint64_t ns)
+{
+    deadline->tv_sec = ns / 1000000000u;
+    deadline->tv_nsec = ns % 1000000000u;
+}
+
+/* l4sap_histogram_add counts a time of ns nanoseconds in a histogram. */
+static void l4sap_histogram_add(L4Histogram *histogram, int64_t ns)
+{
+    uint64_t us = ns > 0 ? (uint64_t)ns / 1000 : 0;
+    int bucket = us > 0 ? 64 - __builtin_clzll(us) : 0;
+    if (bucket >= L4Histbuckets)
+        bucket = L4Histbuckets - 1;
+
+    histogram->bucket[bucket]++;
+    histogram->count++;
+    histogram->sum_us += us;
+    if (us > histogram->max_us)
+        histogram->max_us = us;
+}
+
+/* l4sap_rtt_sample feeds one round-trip time into the estimator of
+ * RFC 6298 and computes a new RTO, which also ends a backoff.
+ */
+static void l4sap_rtt_sample(L4SAP *l4, int64_t rtt_ns)
+{
+    l4sap_histogram_add(&l4->stats.rtt, rtt_ns);
+
+    if (l4->rtt.samples++ == 0)
+    {
+        l4->rtt.srtt_ns = rtt_ns;
+        l4->rtt.rttvar_ns = rtt_ns / 2;
+    }
+    else
+    {
+        int64_t error = l4->rtt.srtt_ns - rtt_ns;
+        if (error < 0)
+            error = -error;
+        l4->rtt.rttvar_ns = (3 * l4->rtt.rttvar_ns + error) / 4;
+        l4->rtt.srtt_ns = (7 * l4->rtt.srtt_ns + rtt_ns) / 8;
+    }
+
+    /* The clock granularity G of RFC 6298 is 1 microsecond here. */
+    int64_t variation = 4 * l4->rtt.rttvar_ns;
+    if (variation < 1000)
+        variation = 1000;
+    l4->rtt.rto_ns = l4->rtt.srtt_ns + variation;
+    if (l4->rtt.rto_ns < l4->rtt.min_rto_ns)
+        l4->rtt.rto_ns = l4->rtt.min_rto_ns;
+    if (l4->rtt.rto_ns > l4->rtt.max_rto_ns)
+        l4->rtt.rto_ns = l4->rtt.max_rto_ns;
+}
+
+/* l4sap_rtt_backoff doubles the RTO after a timeout.
+ */
+static void l4sap_rtt_backoff(L4SAP *l4)
+{
+    l4->rtt.rto_ns *= 2;
+    if (l4->rtt.rto_ns > l4->rtt.max_rto_ns)
+        l4->rtt.rto_ns = l4->rtt.max_rto_ns;
+}
+
+/* l4sap_ack_clear forgets the delayed ACK, because a packet with the
+ * current acknowledgement is going out.
+ */
+static void l4sap_ack_clear(L4SAP *l4)
+{
+    if (l4->reactor != NULL)
+        reactor_timer_disarm(l4->reactor, &l4->ack.timer);
+    l4->ack.pending = 0;
+}
+
+/* l4sap_ackno is the acknowledgement that goes into every packet:
+ * the next DATA packet that is expected from the peer.
+ */
+static uint8_t l4sap_ackno(const L4SAP *l4)
+{
+    return l4->window.mode == L4_STOP_AND_WAIT ? l4->expected_recv_seq : l4->window.rx_next;
+}
+
+/* l4sap_send_ack sends a bare L4_ACK packet with the given seqno and
+ * ackno. ackno is always the current acknowledgement, so it replaces
+ * a delayed ACK.
+ */
+static void l4sap_send_ack(L4SAP *l4, uint8_t seqno, uint8_t ackno)
+{
+    l4sap_ack_clear(l4);
+    l4->stats.acks++;
+
+    uint8_t ack_frame[sizeof(L4Header)];
+    L4Header *ack_header = (L4Header *)ack_frame;
+    ack_header->type = L4_ACK;
+    ack_header->seqno = seqno;
+    ack_header->ackno = ackno;
+    ack_header->mbz = 0;
+
+    l2sap_sendto(l4->l2, ack_frame, sizeof(L4Header));
+}
+
+static int l4sap_coalesce_flush(L4SAP *l4);
+
+/* l4sap_coalesce_due sends the coalescing queue when its oldest record
+ * has waited delay_ns, unless it is being sent already or l4sap_send
+ * waits for an ACK. An error is kept for the next call that sends.
+ */
+static void l4sap_coalesce_due(L4SAP *l4)
+{
+    if (l4->coalesce.used == 0 || l4->coalesce.sending || l4->send_state.waiting ||
+        l4sap_now_ns() - l4->coalesce.queued_ns < (uint64_t)l4->coalesce.delay_ns)
+        return;
+
+    int result = l4sap_coalesce_flush(l4);
+    if (result < 0)
+        l4->coalesce.error = result;
+}
+
+/* If the queue could not be sent yet, the timer tries again later. */
+static void l4sap_coalesce_timer(void *arg)
+{
+    L4SAP *l4 = arg;
+    l4sap_coalesce_due(l4);
+    if (l4->coalesce.used > 0 && l4->reactor != NULL)
+        reactor_timer_arm(l4->reactor, &l4->coalesce.timer, l4->coalesce.delay_ns);
+}
+
+/* l4sap_ack_flush sends the delayed ACK now, if there is one.
+ */
+static void l4sap_ack_flush(L4SAP *l4)
+{
+    if (l4->ack.pending)
+        l4sap_send_ack(l4, l4->ack.seqno, l4sap_ackno(l4));
+}
+
+static void l4sap_ack_timer(void *arg)
+{
+    L4SAP *l4 = arg;
+    l4sap_ack_flush(l4);
+}
+
+/* l4sap_ack acknowledges the DATA packet seqno that was just taken.
+ * If delay is set and delayed ACKs are on, the ACK is held back,
+ * unless another one is already, which is sent now with both.
+ */
+static void l4sap_ack(L4SAP *l4, uint8_t seqno, int delay)
+{
+    if (!delay || l4->ack.delay_ns == 0 || l4->ack.pending)
+    {
+        l4sap_send_ack(l4, seqno, l4sap_ackno(l4));
+        return;
+    }
+
+    l4->ack.pending = 1;
+    l4->ack.seqno = seqno;
+    l4->ack.due_ns = l4sap_now_ns() + l4->ack.delay_ns;
+    if (l4->reactor != NULL)
+        reactor_timer_arm(l4->reactor, &l4->ack.timer, l4->ack.delay_ns);
+}
+
+/* l4sap_ack_sent notes that a DATA packet carried the current
+ * acknowledgement, which makes a delayed ACK unnecessary.
+ */
+static void l4sap_ack_sent(L4SAP *l4)
+{
+    if (!l4->ack.pending)
+        return;
+    l4->stats.piggybacked++;
+    l4sap_ack_clear(l4);
+}
+
+/* l4sap_fill_view makes an L4View of the payload behind the L4Header
+ * in an L2 view.
+ */
+static void l4sap_fill_view(L4View *l4view, const L2View *l2view)
+{
+    l4view->l2 = *l2view;
+    l4view->data = l2view->payload + sizeof(L4Header);
+    l4view->len = l2view->len - sizeof(L4Header);
+}
+
+/* l4sap_next_record copies the next record of the packet in
+ * coalesce.rx to data, up to len bytes, and returns the length of the
+ * copy. The packet is released after its last record.
+ */
+static int l4sap_next_record(L4SAP *l4, uint8_t *data, int len)
+{
+    const uint8_t *record = l4->coalesce.rx.payload + l4->coalesce.rx_offset;
+    int copy_len = record[0] << 8 | record[1];
+    l4->coalesce.rx_offset += L4Recordheader + copy_len;
+    if (copy_len > len)
+        copy_len = len;
+    memcpy(data, record + L4Recordheader, copy_len);
+    l4->stats.rx_copy_bytes += copy_len;
+
+    if (l4->coalesce.rx_offset >= (int)l4->coalesce.rx.len)
+        l2sap_release_view(l4->l2, &l4->coalesce.rx);
+    return copy_len;
+}
+
+int l4sap_is_records(const L2View *packet)
+{
+    if (((const L4Header *)packet->payload)->mbz != L4_MBZ_RECORDS)
+        return 0;
+
+    int offset = sizeof(L4Header);
+    while (offset + L4Recordheader <= (int)packet->len)
+        offset += L4Recordheader + (packet->payload[offset] << 8 | packet->payload[offset + 1]);
+    if (offset == (int)packet->len && offset > (int)sizeof(L4Header))
+        return 1;
+
+    LOG_RATELIMITED(LOG_LEVEL_WARN, 1000, "packet of %d bytes has no valid records", (int)packet->len);
+    return 0;
+}
+
+int l4sap_record_view(L2View *packet, int *offset, L4View *view)
+{
+    uint8_t *record = packet->payload + *offset;
+    int len = record[0] << 8 | record[1];
+    *offset += L4Recordheader + len;
+
+    view->l2 = *packet;
+    view->len = len;
+    if (*offset >= (int)packet->len)
+    {
+        view->data = record + L4Recordheader;
+        packet->payload = NULL;
+        return len;
+    }
+
+    view->l2.payload = NULL;
+    view->data = malloc(len > 0 ? len : 1);
+    if (view->data == NULL)
+    {
+        LOG_ERROR("failed to allocate %d bytes for a record", len);
+        return -1;
+    }
+    memcpy(view->data, record + L4Recordheader, len);
+    return len;
+}
+
+/* l4sap_next_record_view hands the next record of the packet in
+ * coalesce.rx to view, like l4sap_next_record.
+ */
+static int l4sap_next_record_view(L4SAP *l4, L4View *view)
+{
+    int len = l4sap_record_view(&l4->coalesce.rx, &l4->coalesce.rx_offset, view);
+    if (len > 0 && view->l2.payload == NULL)
+        l4->stats.rx_copy_bytes += len;
+    return len;
+}
+
+/* l4sap_copy_payload copies the payload behind the L4Header in an L2
+ * view to data, up to len bytes, and returns the number of bytes.
+ * Of a packet of records, it copies the first record and keeps the
+ * view in coalesce.rx for the next l4sap_recv; view->payload is then
+ * NULL.
+ */
+static int l4sap_copy_payload(L4SAP *l4, L2View *view, uint8_t *data, int len)
+{
+    if (l4sap_is_records(view))
+    {
+        l4->coalesce.rx = *view;
+        l4->coalesce.rx_offset = sizeof(L4Header);
+        view->payload = NULL;
+        return l4sap_next_record(l4, data, len);
+    }
+
+    int copy_len = view->len - sizeof(L4Header);
+    if (copy_len > len)
+        copy_len = len;
+    memcpy(data, view->payload + sizeof(L4Header), copy_len);
+    l4->stats.rx_copy_bytes += copy_len;
+    return copy_len;
+}
+
+/* l4sap_view_payload is l4sap_copy_payload for l4sap_recv_view: view
+ * takes over the payload, or the first record of a packet of records,
+ * whose other records stay in coalesce.rx. packet->payload is NULL
+ * afterwards.
+ */
+static int l4sap_view_payload(L4SAP *l4, L2View *packet, L4View *view)
+{
+    if (l4sap_is_records(packet))
+    {
+        l4->coalesce.rx = *packet;
+        l4->coalesce.rx_offset = sizeof(L4Header);
+        packet->payload = NULL;
+        return l4sap_next_record_view(l4, view);
+    }
+
+    l4sap_fill_view(view, packet);
+    packet->payload = NULL;
+    return view->len;
+}
+
+/* l4sap_window_transmit sends the packet in slot (again), with the
+ * current cumulative acknowledgement for the peer.
+ */
+static void l4sap_window_transmit(L4SAP *l4, L4Slot *slot)
+{
+    slot->header.ackno = l4->window.rx_next;
+    l4sap_ack_sent(l4);
+    if (slot->transmits++ > 0)
+        l4->stats.retransmits++;
+    l4->stats.data_sent++;
+    slot->sent_ns = l4sap_now_ns();
+
+    struct iovec iov[2];
+    iov[0].iov_base = &slot->header;
+    iov[0].iov_len = sizeof(L4Header);
+    iov[1].iov_base = slot->data;
+    iov[1].iov_len = slot->length;
+
+    /* A packet that cannot be sent counts as lost. */
+    l2sap_sendv(l4->l2, iov, 2);
+}
+
+/* l4sap_congestion_loss reports a loss to the congestion control,
+ * but not the losses of packets that were in flight at the last one,
+ * whether duplicate ACKs or timeouts find them: a burst that
+ * overflowed a queue is one loss event.
+ */
+static void l4sap_congestion_loss(L4SAP *l4, int timeout)
+{
+    L4Congestion *cc = &l4->congestion.cc;
+    if (cc->ops == NULL || (l4->congestion.recovering))
+        return;
+
+    cc->ops->on_loss(cc, (uint8_t)(l4->window.snd_next - l4->window.snd_base), timeout);
+    l4->congestion.loss_events++;
+    l4->congestion.recovering = 1;
+    l4->congestion.recover = l4->window.snd_next;
+}
+
+/* l4sap_window_dupack counts the ACKs that acknowledge nothing new
+ * while packets are in flight. The receiver sends them for packets
+ * that arrive behind a gap, so after dupthresh of them the oldest
+ * packet is taken as lost and sent again at once instead of after its
+ * timeout (fast retransmit); with Go-Back-N, the packets behind it as
+ * well, because the receiver dropped them. This happens once until
+ * the window moves.
+ */
+static void l4sap_window_dupack(L4SAP *l4, uint8_t ackno)
+{
+    if (l4->window.dupthresh == 0 || l4->window.failed || ackno != l4->window.snd_base ||
+        l4->window.snd_base == l4->window.snd_next)
+        return;
+
+    if (++l4->window.dupacks != l4->window.dupthresh)
+        return;
+
+    LOG_DEBUG("%d duplicate ACKs for %d, sending it again", l4->window.dupacks, ackno);
+    l4->stats.fast_retransmits++;
+    l4sap_congestion_loss(l4, 0);
+    if (l4->window.mode == L4_GO_BACK_N)
+    {
+        for (uint8_t n = ackno; n != l4->window.snd_next; ++n)
+            l4sap_window_transmit(l4, &l4->window.tx[n % L4Maxwindow]);
+    }
+    else
+    {
+        l4sap_window_transmit(l4, &l4->window.tx[ackno % L4Maxwindow]);
+    }
+}
+
+/* l4sap_window_acked processes a cumulative acknowledgement: all
+ * packets in flight before ackno have arrived, and their slots are
+ * freed.
+ */
+static void l4sap_window_acked(L4SAP *l4, uint8_t ackno)
+{
+    uint8_t in_flight = l4->window.snd_next - l4->window.snd_base;
+    uint8_t count = ackno - l4->window.snd_base;
+    if (count == 0 || count > in_flight)
+        return;
+
+    uint64_t now = l4sap_now_ns();
+    while (l4->window.snd_base != ackno)
+    {
+        L4Slot *slot = &l4->window.tx[l4->window.snd_base % L4Maxwindow];
+        if (!slot->acked)
+            l4sap_histogram_add(&l4->stats.ack_latency, now - slot->first_ns);
+        if (slot->submitted)
+        {
+            L4Submit *done = &l4->async.done[l4->async.done_count++];
+            done->data = NULL;
+            done->len = slot->length;
+            done->user = slot->user;
+            slot->submitted = 0;
+        }
+        framepool_put(l4->window.pool, slot->data);
+        slot->data = NULL;
+        slot->acked = 0;
+        l4->window.snd_base++;
+    }
+    l4->window.dupacks = 0;
+
+    L4Congestion *cc = &l4->congestion.cc;
+    if (cc->ops != NULL)
+    {
+        cc->ops->on_ack(cc, count, l4->rtt.srtt_ns);
+        /* The loss is over when all packets that were in flight at
+         * the time are acknowledged.
+         */
+        uint8_t left = l4->congestion.recover - l4->window.snd_base;
+        if (left == 0 || left > (uint8_t)(l4->window.snd_next - l4->window.snd_base))
+            l4->congestion.recovering = 0;
+    }
+}
+
+/* l4sap_window_sacked marks the packet seqno as arrived (Selective
+ * Repeat), and slides the window over the packets at its start that
+ * have all arrived.
+ */
+static void l4sap_window_sacked(L4SAP *l4, uint8_t seqno)
+{
+    uint8_t in_flight = l4->window.snd_next - l4->window.snd_base;
+    if ((uint8_t)(seqno - l4->window.snd_base) >= in_flight)
+        return;
+
+    L4Slot *slot = &l4->window.tx[seqno % L4Maxwindow];
+    if (!slot->acked)
+        l4sap_histogram_add(&l4->stats.ack_latency, l4sap_now_ns() - slot->first_ns);
+    slot->acked = 1;
+
+    uint8_t ackno = l4->window.snd_base;
+    while (ackno != l4->window.snd_next && l4->window.tx[ackno % L4Maxwindow].acked)
+        ackno++;
+    l4sap_window_acked(l4, ackno);
+}
+
+/* l4sap_complete reports one completion to the callback of the
+ * asynchronous API and returns what the callback returned.
+ */
+static int l4sap_complete(L4SAP *l4, int type, int result, void *user, const L4View *view)
+{
+    L4Completion completion;
+    memset(&completion, 0, sizeof(completion));
+    completion.type = type;
+    completion.result = result;
+    completion.user = user;
+    if (view != NULL)
+        completion.view = *view;
+
+    l4->async.completions++;
+    return l4->async.fn(l4->async.arg, l4, &completion);
+}
+
+/* l4sap_complete_data reports the payload of a DATA packet as
+ * L4_RECV_DONE, one completion per record of a packet of records, after
+ * the records that l4sap_recv has left in coalesce.rx. It takes the
+ * packet over and releases the views that the callback does not keep.
+ */
+static void l4sap_complete_data(L4SAP *l4, L2View *packet)
+{
+    L4View view;
+    while (l4->coalesce.rx.payload != NULL)
+    {
+        int len = l4sap_next_record_view(l4, &view);
+        if (len >= 0 && !l4sap_complete(l4, L4_RECV_DONE, len, NULL, &view))
+            l4sap_release_view(l4, &view);
+    }
+
+    if (!l4sap_is_records(packet))
+    {
+        l4sap_fill_view(&view, packet);
+        packet->payload = NULL;
+        if (!l4sap_complete(l4, L4_RECV_DONE, view.len, NULL, &view))
+            l4sap_release_view(l4, &view);
+        return;
+    }
+
+    int offset = sizeof(L4Header);
+    while (packet->payload != NULL)
+    {
+        int len = l4sap_record_view(packet, &offset, &view);
+        if (len > 0 && view.l2.payload == NULL)
+            l4->stats.rx_copy_bytes += len;
+        if (len >= 0 && !l4sap_complete(l4, L4_RECV_DONE, len, NULL, &view))
+            l4sap_release_view(l4, &view);
+    }
+}
+
+/* l4sap_window_deliver hands the oldest packet that arrived in order
+ * to the waiting l4sap_recv or l4sap_recv_view, if there is both.
+ * If nobody waits, the asynchronous API gets all of them.
+ */
+static void l4sap_window_deliver(L4SAP *l4)
+{
+    if (l4->window.rx_base == l4->window.rx_next)
+        return;
+
+    L2View *held = &l4->window.rx[l4->window.rx_base % L4Maxwindow];
+    if (l4->recv_state.view == NULL && l4->recv_state.data == NULL && l4->async.fn != NULL)
+    {
+        while (l4->window.rx_base != l4->window.rx_next)
+        {
+            held = &l4->window.rx[l4->window.rx_base % L4Maxwindow];
+            L2View view = *held;
+            held->payload = NULL;
+            l4->window.rx_base++;
+            l4sap_complete_data(l4, &view);
+        }
+        return;
+    }
+
+    if (l4->recv_state.view != NULL)
+    {
+        l4->recv_state.result = l4sap_view_payload(l4, held, l4->recv_state.view);
+        l4->recv_state.view = NULL;
+    }
+    else if (l4->recv_state.data != NULL)
+    {
+        l4->recv_state.result = l4sap_copy_payload(l4, held, l4->recv_state.data, l4->recv_state.len);
+        l4->recv_state.data = NULL;
+        l2sap_release_view(l4->l2, held);
+    }
+    else
+    {
+        return;
+    }
+    l4->window.rx_base++;
+}
+
+/* l4sap_window_input is l4sap_input for the windowed modes.
+ */
+static int l4sap_window_input(L4SAP *l4, const L4Header *header, L2View *view)
+{
+    switch (header->type)
+    {
+    case L4_ACK:
+    {
+        /* Karn's rule: only a packet that was sent once tells how
+         * long the round trip took.
+         */
+        uint8_t in_flight = l4->window.snd_next - l4->window.snd_base;
+        L4Slot *slot = &l4->window.tx[header->seqno % L4Maxwindow];
+        if ((uint8_t)(header->seqno - l4->window.snd_base) < in_flight && !slot->acked && slot->transmits == 1)
+            l4sap_rtt_sample(l4, l4sap_now_ns() - slot->sent_ns);
+
+        uint8_t snd_base = l4->window.snd_base;
+        int sacked = l4->window.mode == L4_SELECTIVE_REPEAT &&
+                     (uint8_t)(header->seqno - snd_base) < in_flight && !slot->acked;
+        if (l4->window.mode == L4_SELECTIVE_REPEAT)
+            l4sap_window_sacked(l4, header->seqno);
+        l4sap_window_acked(l4, header->ackno);
+        if (l4->window.snd_base == snd_base)
+        {
+            if (!sacked)
+                l4->stats.stale_acks++;
+            l4sap_window_dupack(l4, header->ackno);
+        }
+        return 0;
+    }
+
+    case L4_DATA:
+        break;
+
+    default:
+        LOG_RATELIMITED(LOG_LEVEL_WARN, 1000, "unknown / uninitalized packet type %d", header->type);
+        return 0;
+    }
+
+    /* DATA carries the peer's cumulative acknowledgement as well. */
+    l4sap_window_acked(l4, header->ackno);
+
+    uint8_t seqno = header->seqno;
+    uint8_t offset = seqno - l4->window.rx_base;
+    if (offset >= l4->window.size)
+    {
+        /* A retransmission of a packet that was taken already, whose
+         * ACK got lost, is acknowledged again. Packets beyond the
+         * window are dropped; the sender tries again later.
+         */
+        if ((uint8_t)(l4->window.rx_base - seqno) <= l4->window.size)
+        {
+            l4->stats.duplicates++;
+            l4sap_send_ack(l4, seqno, l4->window.rx_next);
+        }
+        return 0;
+    }
+
+    L2View *slot = &l4->window.rx[seqno % L4Maxwindow];
+    if (slot->payload != NULL ||
+        (l4->window.mode == L4_GO_BACK_N && seqno != l4->window.rx_next))
+    {
+        if (slot->payload != NULL)
+            l4->stats.duplicates++;
+        l4sap_send_ack(l4, seqno, l4->window.rx_next);
+        return 0;
+    }
+
+    *slot = *view;
+    uint8_t rx_next = l4->window.rx_next;
+    while ((uint8_t)(l4->window.rx_next - l4->window.rx_base) < l4->window.size &&
+           l4->window.rx[l4->window.rx_next % L4Maxwindow].payload != NULL)
+        l4->window.rx_next++;
+
+    /* Only a packet that arrived in order and filled no gap may wait
+     * for its ACK.
+     */
+    l4sap_ack(l4, seqno, seqno == rx_next && l4->window.rx_next == (uint8_t)(rx_next + 1));
+    l4sap_window_deliver(l4);
+    return 1;
+}
+
+/* l4sap_input processes one packet that arrived from the peer, no
+ * matter whether an l4sap_send or an l4sap_recv is waiting:
+ * - a RESET sets is_terminating,
+ * - the ACK that l4sap_send waits for sets send_state.acked,
+ * - the next DATA packet is delivered to the waiting l4sap_recv or
+ *   l4sap_recv_view (or kept in recv_state.pending, see l4sap_attach)
+ *   and acknowledged,
+ * - any other DATA packet is acknowledged and discarded.
+ * The waiting function learns from these fields what happened.
+ * It returns 1 if it kept the L2 view of the packet, and 0 if the
+ * caller must release it.
+ */
+static int l4sap_input(L4SAP *l4, L2View *view)
+{
+    if (view->len < sizeof(L4Header))
+        return 0;
+
+    const L4Header *header = (const L4Header *)view->payload;
+    int kept = 0;
+    int completion = 0;
+    int fresh = 0;
+
+    if (header->type == L4_RESET)
+    {
+        l4->stats.resets_received++;
+        l4->is_terminating = 1;
+        return 0;
+    }
+    if (header->type == L4_DATA)
+        l4->stats.data_received++;
+
+    if (l4->window.mode != L4_STOP_AND_WAIT)
+        return l4sap_window_input(l4, header, view);
+
+    /* An ACK acknowledges the packet that l4sap_send waits for, and so
+     * does DATA with delayed ACKs, which carries the peer's current
+     * acknowledgement as well. Without them the peer may be one that
+     * sets the ackno of DATA once and retransmits it unchanged, so the
+     * ackno of DATA can be stale and is not taken.
+     */
+    if ((header->type == L4_ACK || (header->type == L4_DATA && l4->ack.delay_ns != 0)) &&
+        header->ackno == (1 - l4->next_send_seq))
+    {
+        l4->send_state.last_ack_recieved = header->ackno;
+        if (l4->send_state.waiting)
+        {
+            l4->next_send_seq = 1 - l4->next_send_seq;
+            l4->send_state.waiting = 0;
+            l4->send_state.acked = 1;
+            fresh = 1;
+        }
+    }
+
+    switch (header->type)
+    {
+    case L4_ACK:
+        if (!fresh)
+            l4->stats.stale_acks++;
+        return 0;
+
+    case L4_DATA:
+        /* Without a reactor, DATA that nobody waits for is dropped,
+         * unless ACKs are delayed: then the reply to a request is
+         * expected while l4sap_send still waits for its ACK, or a
+         * completion callback takes it.
+         */
+        if (header->seqno != l4->expected_recv_seq)
+            l4->stats.duplicates++;
+        if (header->seqno != l4->expected_recv_seq ||
+            (l4->recv_state.data == NULL && l4->recv_state.view == NULL && l4->reactor == NULL &&
+             l4->ack.delay_ns == 0 && l4->async.fn == NULL))
+        {
+            l4sap_send_ack(l4, l4->next_send_seq, 1 - header->seqno);
+            LOG_DEBUG("sending ack for data");
+            return 0;
+        }
+
+        if (l4->recv_state.view != NULL)
+        {
+            l4->recv_state.result = l4sap_view_payload(l4, view, l4->recv_state.view);
+            l4->recv_state.view = NULL;
+            kept = 1;
+        }
+        else if (l4->recv_state.data != NULL)
+        {
+            l4->recv_state.result = l4sap_copy_payload(l4, view, l4->recv_state.data, l4->recv_state.len);
+            l4->recv_state.data = NULL;
+        }
+        else if (l4->async.fn != NULL)
+        {
+            completion = 1;
+        }
+        else if (l4->recv_state.pending.payload == NULL)
+        {
+            l4->recv_state.pending = *view;
+            kept = 1;
+        }
+        else
+        {
+            LOG_DEBUG("no room for DATA %d, not acknowledging it", header->seqno);
+            return 0;
+        }
+
+        l4->expected_recv_seq = 1 - l4->expected_recv_seq;
+        l4->recv_state.last_ack_sent = header->seqno;
+        l4sap_ack(l4, l4->next_send_seq, 1);
+
+        if (completion)
+        {
+            l4sap_complete_data(l4, view);
+            kept = 1;
+        }
+        return kept;
+
+    default:
+        LOG_RATELIMITED(LOG_LEVEL_WARN, 1000, "unknown / uninitalized packet type %d", header->type);
+        return 0;
+    }
+}
+
+/* l4sap_wait waits like l2sap_recv_view_until for the next frame and
+ * passes it to l4sap_input, or until a delayed ACK is due and sends
+ * it. With a reactor, it runs the reactor instead, which may dispatch
+ * frames of other endpoints as well.
+ * The deadline is absolute, so a caller that loops until a particular
+ * packet arrives passes the same deadline every time and the frames
+ * it is not waiting for do not extend the wait.
+ * It returns L2_TIMEOUT if the deadline passed, and a value != 0 if
+ * something was received or sent.
+ */
+static int l4sap_wait(L4SAP *l4, const struct timespec *deadline)
+{
+    if (l4->reactor != NULL)
+    {
+        return reactor_run_until(l4->reactor, deadline);
+    }
+
+    /* The wait ends early to send a delayed ACK or the coalescing
+     * queue when it is due.
+     */
+    struct timespec early_deadline;
+    int early = 0;
+    uint64_t due_ns = 0;
+    if (l4->ack.pending)
+        due_ns = l4->ack.due_ns;
+    if (l4->coalesce.used > 0 && !l4->coalesce.sending && !l4->send_state.waiting &&
+        (due_ns == 0 || l4->coalesce.queued_ns + l4->coalesce.delay_ns < due_ns))
+        due_ns = l4->coalesce.queued_ns + l4->coalesce.delay_ns;
+    if (due_ns != 0 &&
+        (deadline == NULL || due_ns < (uint64_t)deadline->tv_sec * 1000000000u + deadline->tv_nsec))
+    {
+        l4sap_deadline(&early_deadline, due_ns);
+        deadline = &early_deadline;
+        early = 1;
+    }
+
+    L2View view;
+    view.payload = NULL;
+    int recv_res = l2sap_recv_view_until(l4->l2, &view, deadline);
+    if (l4->ack.pending && l4sap_now_ns() >= l4->ack.due_ns)
+        l4sap_ack_flush(l4);
+    if (view.payload == NULL)
+    {
+        l4sap_coalesce_due(l4);
+        return early && recv_res == L2_TIMEOUT ? 1 : recv_res;
+    }
+
+    if (!l4sap_input(l4, &view))
+        l2sap_release_view(l4->l2, &view);
+    return 1;
+}
+
+/* l4sap_transmit sends the DATA packet that l4sap_send keeps in
+ * send_state. The L4Header and the caller's payload are passed to
+ * L2 as two segments, so neither the first transmission nor a
+ * retransmission copies the payload into a frame.
+ */
+static int l4sap_transmit(L4SAP *l4)
+{
+    /* Every transmission carries the current acknowledgement. */
+    l4->send_state.header.ackno = l4sap_ackno(l4);
+    l4sap_ack_sent(l4);
+    l4->stats.data_sent++;
+
+    struct iovec iov[3];
+    int iovcnt = 0;
+    iov[iovcnt].iov_base = &l4->send_state.header;
+    iov[iovcnt++].iov_len = sizeof(L4Header);
+    if (l4->send_state.prefix != NULL)
+    {
+        iov[iovcnt].iov_base = (void *)l4->send_state.prefix;
+        iov[iovcnt++].iov_len = l4->send_state.prefix_length;
+    }
+    iov[iovcnt].iov_base = (void *)l4->send_state.data;
+    iov[iovcnt++].iov_len = l4->send_state.length;
+
+    return l2sap_sendv(l4->l2, iov, iovcnt);
+}
+
+/* l4sap_window_retransmit sends the packets whose timeout expired
+ * again: with Go-Back-N all packets in flight when the oldest one
+ * expired, with Selective Repeat every expired packet by itself.
+ * It returns the nanoseconds until the next timeout, or -1 if nothing
+ * is in flight or the sender gave up.
+ */
+static int64_t l4sap_window_retransmit(L4SAP *l4)
+{
+    if (l4->window.failed || l4->window.snd_base == l4->window.snd_next)
+        return -1;
+
+    uint64_t rto = l4->rtt.rto_ns;
+    uint64_t now = l4sap_now_ns();
+    int64_t next = -1;
+    int expired = 0;
+
+    for (uint8_t seqno = l4->window.snd_base; seqno != l4->window.snd_next; ++seqno)
+    {
+        L4Slot *slot = &l4->window.tx[seqno % L4Maxwindow];
+        if (slot->acked)
+            continue;
+
+        if (slot->sent_ns + rto > now)
+        {
+            int64_t left = slot->sent_ns + rto - now;
+            if (next < 0 || left < next)
+                next = left;
+            /* With Go-Back-N, the later packets were sent later. */
+            if (l4->window.mode == L4_GO_BACK_N)
+                break;
+            continue;
+        }
+
+        /* With Go-Back-N, the packets behind the oldest one are sent
+         * again with it, but only the oldest one's timeouts count.
+         */
+        if (++slot->timeouts >= L4Maxtimeouts)
+        {
+            LOG_WARN("packet %d was not acknowledged after %d timeouts", seqno, slot->timeouts);
+            l4->window.failed = 1;
+            return -1;
+        }
+
+        /* One backoff per round of timeouts, and the packets that are
+         * sent again in this round wait for the longer RTO.
+         */
+        if (!expired)
+        {
+            l4sap_rtt_backoff(l4);
+            rto = l4->rtt.rto_ns;
+            expired = 1;
+            l4sap_congestion_loss(l4, 1);
+        }
+
+        if (l4->window.mode == L4_GO_BACK_N)
+        {
+            for (uint8_t n = seqno; n != l4->window.snd_next; ++n)
+                l4sap_window_transmit(l4, &l4->window.tx[n % L4Maxwindow]);
+            return rto;
+        }
+
+        l4sap_window_transmit(l4, slot);
+        if (next < 0 || (int64_t)rto < next)
+            next = rto;
+    }
+    return next;
+}
+
+/* l4sap_window_fit makes the buffers of the slots as large as a
+ * payload again when the payload size changed since l4sap_set_window,
+ * e.g. with l2sap_set_framesize. The pool can only be replaced while
+ * no packet is in flight, so until then it returns -1 and nothing may
+ * be sent. If no new pool can be made, the old one stays. Returns 0
+ * otherwise.
+ */
+static int l4sap_window_fit(L4SAP *l4, int in_flight)
+{
+    int size = l4sap_payload_size(l4);
+    if (framepool_framesize(l4->window.pool) == size)
+        return 0;
+    if (in_flight > 0)
+        return -1;
+
+    FramePool *pool = framepool_create(l4->window.size, size);
+    if (pool == NULL)
+        return 0;
+    framepool_destroy(l4->window.pool);
+    l4->window.pool = pool;
+    return 0;
+}
+
+/* l4sap_window_room returns 0 if the next packet can be sent now,
+ * the nanoseconds until the pacer lets it go, or -1 if the window or
+ * the congestion window is full, or the window waits for the packets
+ * in flight before it fits the payload size (see l4sap_window_fit).
+ */
+static int64_t l4sap_window_room(L4SAP *l4)
+{
+    L4Congestion *cc = &l4->congestion.cc;
+    int in_flight = (uint8_t)(l4->window.snd_next - l4->window.snd_base);
+    if (in_flight >= l4->window.size || (cc->ops != NULL && in_flight >= cc->cwnd) ||
+        l4sap_window_fit(l4, in_flight) < 0)
+        return -1;
+    if (cc->ops == NULL || !l4->congestion.pacing || l4->rtt.srtt_ns <= 0)
+        return 0;
+
+    /* cwnd full frames per SRTT, with a gain of 2 in slow start and
+     * 1.25 after it.
+     */
+    uint64_t frame = framepool_framesize(l4->window.pool) + sizeof(L4Header);
+    uint64_t gain = cc->cwnd < cc->ssthresh ? 200 : 125;
+    uint64_t rate = (uint64_t)cc->cwnd * frame * gain * 10000000u / l4->rtt.srtt_ns;
+    uint64_t now = l4sap_now_ns();
+    l4pacer_set_rate(&l4->congestion.pacer, rate, 2 * frame, now);
+
+    int64_t delay = l4pacer_delay(&l4->congestion.pacer, frame, now);
+    if (delay > 0)
+        l4->congestion.held = 1;
+    return delay;
+}
+
+/* l4sap_window_wait retransmits what is due, and then waits like
+ * l4sap_wait for the next frame, but not beyond the next timeout or,
+ * if pace_ns is positive, beyond the time when the pacer lets the
+ * next packet go.
+ */
+static int l4sap_window_wait(L4SAP *l4, int64_t pace_ns)
+{
+    int64_t next = l4sap_window_retransmit(l4);
+    if (pace_ns > 0 && (next < 0 || pace_ns < next))
+        next = pace_ns;
+    if (next < 0)
+        return l4sap_wait(l4, NULL);
+
+    struct timespec deadline;
+    l4sap_deadline(&deadline, l4sap_now_ns() + next);
+    return l4sap_wait(l4, &deadline);
+}
+
+/* l4sap_window_send is l4sap_send for the windowed modes. It waits
+ * for room in the window, copies the prefix and the payload into the
+ * next slot and sends it.
+ */
+static int l4sap_window_send(L4SAP *l4, const uint8_t *prefix, int prefix_len, const uint8_t *data, int len)
+{
+    while (1)
+    {
+        if (l4->is_terminating)
+            return L4_QUIT;
+        if (l4->window.failed)
+            return L4_SEND_FAILED;
+        int64_t room = l4sap_window_room(l4);
+        if (room == 0)
+            break;
+        l4sap_window_wait(l4, room);
+    }
+
+    L4Slot *slot = &l4->window.tx[l4->window.snd_next % L4Maxwindow];
+    slot->data = framepool_get(l4->window.pool);
+    if (slot->data == NULL)
+        return -1;
+
+    if (prefix_len + len > framepool_framesize(l4->window.pool))
+        len = framepool_framesize(l4->window.pool) - prefix_len;
+    if (prefix_len > 0)
+        memcpy(slot->data, prefix, prefix_len);
+    memcpy(slot->data + prefix_len, data, len);
+    l4->stats.tx_copy_bytes += len;
+
+    slot->header.type = L4_DATA;
+    slot->header.seqno = l4->window.snd_next++;
+    slot->header.mbz = l4->coalesce.sending ? L4_MBZ_RECORDS : 0;
+    slot->length = prefix_len + len;
+    slot->acked = 0;
+    slot->transmits = 0;
+    slot->timeouts = 0;
+    slot->submitted = 0;
+    slot->user = NULL;
+    slot->first_ns = l4sap_now_ns();
+
+    l4sap_window_transmit(l4, slot);
+    if (l4->congestion.pacing)
+        l4pacer_take(&l4->congestion.pacer, sizeof(L4Header) + slot->length);
+    if (l4->congestion.held)
+    {
+        l4->congestion.paced++;
+        l4->congestion.held = 0;
+    }
+    return len;
+}
+
+int l4sap_payload_size(L4SAP *l4)
+{
+    return l2sap_payload_size(l4->l2) - L4Headersize;
+}
+
+/* l4sap_packet_room is the most that one DATA packet carries, prefix
+ * included: l4sap_payload_size, or less in the windowed modes while
+ * the buffers of the send window are smaller (see l4sap_window_fit).
+ */
+static int l4sap_packet_room(L4SAP *l4)
+{
+    int room = l4sap_payload_size(l4);
+    if (l4->window.mode != L4_STOP_AND_WAIT && framepool_framesize(l4->window.pool) < room)
+        room = framepool_framesize(l4->window.pool);
+    return room;
+}
+
+/* l4sap_send_prefixed is l4sap_send with prefix_len bytes in prefix
+ * in front of the payload, which count against l4sap_packet_room.
+ * It returns the number of payload bytes sent (without the prefix) or
+ * L4_ACK_RECEIVED, which means all of len up to that room.
+ */
+static int l4sap_send_prefixed(L4SAP *l4, const uint8_t *prefix, int prefix_len, const uint8_t *data, int len)
+{
+    if (len > l4sap_packet_room(l4) - prefix_len)
+        len = l4sap_packet_room(l4) - prefix_len;
+
+    if (l4->window.mode != L4_STOP_AND_WAIT)
+        return l4sap_window_send(l4, prefix, prefix_len, data, len);
+
+    if (l4->is_terminating)
+        return L4_QUIT;
+
+    L4Header *header = &l4->send_state.header;
+    header->type = L4_DATA;
+    header->seqno = l4->next_send_seq;
+    header->ackno = l4->expected_recv_seq;
+    header->mbz = l4->coalesce.sending ? L4_MBZ_RECORDS : 0;
+
+    l4->send_state.prefix = prefix;
+    l4->send_state.prefix_length = prefix_len;
+    l4->send_state.data = data;
+    l4->send_state.length = len;
+
+    // 1 transmission + 4 retries according to assignment
+    const int max_attempts = L4Maxtimeouts;
+    int attempts = 0;
+
+    l4->send_state.waiting = 1;
+    l4->send_state.acked = 0;
+    uint64_t first_ns = l4sap_now_ns();
+
+    while (attempts < max_attempts)
+    {
+        if (attempts > 0)
+            l4->stats.retransmits++;
+
+        /* Everything that arrives before the ACK, such as stale ACKs
+         * or DATA from the peer, is handled without moving the
+         * deadline, so retransmissions happen on time however busy
+         * the peer is.
+         */
+        uint64_t sent_ns = l4sap_now_ns();
+        struct timespec deadline;
+        l4sap_deadline(&deadline, sent_ns + l4->rtt.rto_ns);
+
+        int send_res = l4sap_transmit(l4);
+        if (send_res < 0)
+        {
+            attempts++;
+            continue;
+        }
+
+        while (1)
+        {
+            int recv_res = l4sap_wait(l4, &deadline);
+
+            // expecting caller to free L4 when L4_QUIT is returned as in transport-test-client
+            if (l4->is_terminating)
+            {
+                l4->send_state.waiting = 0;
+                l4->send_state.data = NULL;
+                return L4_QUIT;
+            }
+            if (l4->send_state.acked)
+            {
+                /* Karn's rule: an ACK after a retransmission may
+                 * belong to either transmission.
+                 */
+                if (attempts == 0)
+                    l4sap_rtt_sample(l4, l4sap_now_ns() - sent_ns);
+                l4sap_histogram_add(&l4->stats.ack_latency, l4sap_now_ns() - first_ns);
+                l4->send_state.data = NULL;
+                return L4_ACK_RECEIVED;
+            }
+            if (recv_res == L2_TIMEOUT)
+                break;
+        }
+        l4sap_rtt_backoff(l4);
+        attempts++;
+    }
+
+    l4->send_state.waiting = 0;
+    l4->send_state.data = NULL;
+    return L4_SEND_FAILED;
+}
+
+/* l4sap_coalesce_flush sends the records in the coalescing queue in
+ * one packet. Returns 0, or what l4sap_send_prefixed returned if that
+ * failed.
+ */
+static int l4sap_coalesce_flush(L4SAP *l4)
+{
+    int error = l4->coalesce.error;
+    l4->coalesce.error = 0;
+    if (error < 0)
+        return error;
+    if (l4->coalesce.used == 0 || l4->coalesce.sending)
+        return 0;
+
+    l4->coalesce.sending = 1;
+    int result = l4sap_send_prefixed(l4, NULL, 0, l4->coalesce.buffer, l4->coalesce.used);
+    l4->coalesce.sending = 0;
+    l4->coalesce.used = 0;
+    if (l4->reactor != NULL)
+        reactor_timer_disarm(l4->reactor, &l4->coalesce.timer);
+    l4->stats.coalesced_packets++;
+    return result < 0 && result != L4_ACK_RECEIVED ? result : 0;
+}
+
+/* l4sap_coalesce is l4sap_send with the coalescing queue. */
+static int l4sap_coalesce(L4SAP *l4, const uint8_t *data, int len)
+{
+    int room = l4sap_payload_size(l4);
+    if (room > l4->coalesce.capacity)
+        room = l4->coalesce.capacity;
+
+    int result = 0;
+    uint64_t now = l4sap_now_ns();
+    if (l4->coalesce.used > 0 &&
+        (l4->coalesce.used + L4Recordheader + len > room || now - l4->coalesce.queued_ns >= (uint64_t)l4->coalesce.delay_ns))
+        result = l4sap_coalesce_flush(l4);
+    if (result < 0)
+        return result;
+
+    if (L4Recordheader + len > room)
+        return l4sap_send_prefixed(l4, NULL, 0, data, len);
+
+    uint8_t *record = l4->coalesce.buffer + l4->coalesce.used;
+    record[0] = len >> 8;
+    record[1] = len & 0xff;
+    memcpy(record + L4Recordheader, data, len);
+    l4->stats.tx_copy_bytes += len;
+    if (l4->coalesce.used == 0)
+    {
+        l4->coalesce.queued_ns = now;
+        if (l4->reactor != NULL)
+            reactor_timer_arm(l4->reactor, &l4->coalesce.timer, l4->coalesce.delay_ns);
+    }
+    l4->coalesce.used += L4Recordheader + len;
+    l4->stats.coalesced++;
+    return len;
+}
+
 /* The functions sends a packet to the network. The packet's payload
- * is copied from the buffer that it is passed as an argument from
- * the caller at L5.
+ * is taken from the buffer that it is passed as an argument from
+ * the caller at L5, which is not copied.
  * If the length of that buffer, which is indicated by len, is larger
- * than L4Payloadsize, the function truncates the message to L4Payloadsize.
+ * than l4sap_payload_size, the function truncates the message to that size.
  *
  * The function does not return until the correct ACK from the peer entity
  * has been received.
  * When a suitable ACK arrives, the function returns the number of bytes
  * that were accepted for sending (the potentially truncated packet length).
  *
- * Waiting for a correct ACK may fail after a timeout of 1 second
- * (timeval.tv_sec = 1, timeval.tv_usec = 0). The function retransmits
- * the packet in that case.
+ * Waiting for a correct ACK may fail after the retransmission timeout,
+ * which is 1 second until the first RTT sample and then follows the
+ * measured RTT. The function retransmits the packet in that case.
  * The function attempts up to 4 retransmissions. If the last retransmission
  * fails with a timeout as well, the function returns L4_SEND_FAILED.
  *
@@ -67,87 +1262,269 @@ int l4sap_send(L4SAP *l4, const uint8_t *data, int len)
     if (l4 == NULL || data == NULL || len < 0)
         return -1;
 
-    if (len > L4Payloadsize)
-        len = L4Payloadsize;
+    /* The submitted sends own the sequence numbers until they are done. */
+    if (l4->async.count > 0 || l4->async.inflight)
+        return -1;
+
+    if (l4->coalesce.buffer != NULL)
+        return l4sap_coalesce(l4, data, len);
+    return l4sap_send_prefixed(l4, NULL, 0, data, len);
+}
 
-    uint8_t frame[L4Framesize];
-    L4Header *header = (L4Header *)frame;
+/* l4sap_async_start sends the oldest submitted packet with
+ * stop-and-wait, from send_state like l4sap_send.
+ */
+static void l4sap_async_start(L4SAP *l4)
+{
+    L4Submit *submit = &l4->async.queue[l4->async.head];
+
+    L4Header *header = &l4->send_state.header;
     header->type = L4_DATA;
     header->seqno = l4->next_send_seq;
-    header->ackno = l4->expected_recv_seq;
     header->mbz = 0;
 
-    memcpy(frame + sizeof(L4Header), data, len);
-    l4->send_state.length = len;
-    memcpy(l4->send_state.buffer, data, len);
+    l4->send_state.prefix = NULL;
+    l4->send_state.prefix_length = 0;
+    l4->send_state.data = submit->data;
+    l4->send_state.length = submit->len;
+    l4->send_state.waiting = 1;
+    l4->send_state.acked = 0;
+
+    l4->async.inflight = 1;
+    l4->async.transmits = 1;
+    l4->async.timeouts = 0;
+    l4->async.sent_ns = l4sap_now_ns();
+    l4->async.first_ns = l4->async.sent_ns;
+    l4sap_transmit(l4);
+}
+
+/* l4sap_async_pop removes the oldest submitted packet from the queue
+ * and returns it.
+ */
+static L4Submit l4sap_async_pop(L4SAP *l4)
+{
+    L4Submit submit = l4->async.queue[l4->async.head];
+    l4->async.head = (l4->async.head + 1) % L4Maxsubmits;
+    l4->async.count--;
+    return submit;
+}
+
+/* l4sap_async_fail completes every submitted packet with result,
+ * the ones in flight first.
+ */
+static void l4sap_async_fail(L4SAP *l4, int result)
+{
+    if (l4->window.mode != L4_STOP_AND_WAIT)
+    {
+        for (uint8_t seqno = l4->window.snd_base; seqno != l4->window.snd_next; ++seqno)
+        {
+            L4Slot *slot = &l4->window.tx[seqno % L4Maxwindow];
+            if (!slot->submitted)
+                continue;
+            slot->submitted = 0;
+            l4sap_complete(l4, L4_SEND_DONE, result, slot->user, NULL);
+        }
+    }
+    else if (l4->async.inflight)
+    {
+        l4->async.inflight = 0;
+        l4->send_state.waiting = 0;
+        l4->send_state.data = NULL;
+        L4Submit submit = l4sap_async_pop(l4);
+        l4sap_complete(l4, L4_SEND_DONE, result, submit.user, NULL);
+    }
+
+    while (l4->async.count > 0)
+    {
+        L4Submit submit = l4sap_async_pop(l4);
+        l4sap_complete(l4, L4_SEND_DONE, result, submit.user, NULL);
+    }
+}
+
+/* l4sap_async_window moves submitted packets into the window while
+ * there is room, and reports the ones that were acknowledged.
+ * It returns the nanoseconds until the next retransmission, or -1.
+ */
+static int64_t l4sap_async_window(L4SAP *l4)
+{
+    while (l4->async.done_count > 0)
+    {
+        L4Submit done = l4->async.done[0];
+        memmove(&l4->async.done[0], &l4->async.done[1], --l4->async.done_count * sizeof(L4Submit));
+        l4sap_complete(l4, L4_SEND_DONE, done.len, done.user, NULL);
+    }
+
+    int64_t next = l4sap_window_retransmit(l4);
+    if (l4->window.failed)
+    {
+        l4sap_async_fail(l4, L4_SEND_FAILED);
+        return -1;
+    }
+
+    int64_t room = 0;
+    while (l4->async.count > 0 && (room = l4sap_window_room(l4)) == 0)
+    {
+        L4Submit submit = l4sap_async_pop(l4);
+        int sent = l4sap_window_send(l4, NULL, 0, submit.data, submit.len);
+        if (sent < 0)
+        {
+            l4sap_complete(l4, L4_SEND_DONE, sent, submit.user, NULL);
+            continue;
+        }
+
+        L4Slot *slot = &l4->window.tx[(uint8_t)(l4->window.snd_next - 1) % L4Maxwindow];
+        slot->submitted = 1;
+        slot->user = submit.user;
+        if (next < 0)
+            next = l4->rtt.rto_ns;
+    }
+    if (l4->async.count > 0 && room > 0 && (next < 0 || room < next))
+        next = room;
+    return next;
+}
+
+/* l4sap_async_stop_and_wait completes the packet in flight when it
+ * was acknowledged, or retransmits it when its timeout expired, and
+ * then starts the next one.
+ * It returns the nanoseconds until the next timeout, or -1.
+ */
+static int64_t l4sap_async_stop_and_wait(L4SAP *l4)
+{
+    uint64_t now = l4sap_now_ns();
+
+    if (l4->async.inflight && l4->send_state.acked)
+    {
+        /* Karn's rule, as in l4sap_send. */
+        if (l4->async.transmits == 1)
+            l4sap_rtt_sample(l4, now - l4->async.sent_ns);
+        l4sap_histogram_add(&l4->stats.ack_latency, now - l4->async.first_ns);
+        l4->async.inflight = 0;
+        l4->send_state.data = NULL;
+        L4Submit submit = l4sap_async_pop(l4);
+        l4sap_complete(l4, L4_SEND_DONE, submit.len, submit.user, NULL);
+    }
+    else if (l4->async.inflight && now >= l4->async.sent_ns + l4->rtt.rto_ns)
+    {
+        l4sap_rtt_backoff(l4);
+        if (++l4->async.timeouts >= L4Maxtimeouts)
+        {
+            l4sap_async_fail(l4, L4_SEND_FAILED);
+            return -1;
+        }
+        l4->stats.retransmits++;
+        l4->async.transmits++;
+        l4->async.sent_ns = now;
+        l4sap_transmit(l4);
+    }
+
+    /* The callback may have submitted the next one already. */
+    if (!l4->async.inflight && l4->async.count > 0)
+        l4sap_async_start(l4);
+
+    if (!l4->async.inflight)
+        return -1;
+    now = l4sap_now_ns();
+    return l4->async.sent_ns + l4->rtt.rto_ns > now ? (int64_t)(l4->async.sent_ns + l4->rtt.rto_ns - now) : 0;
+}
 
-    // 1 transmission + 4 retries according to assignment
-    const int max_attempts = 5;
-    int attempts = 0;
-    struct timeval timeout;
-    timeout.tv_sec = 1;
-    timeout.tv_usec = 0;
+/* l4sap_async_progress does everything that became due for the
+ * submitted packets. Completions may submit more packets, so it
+ * repeats until nothing changes.
+ * It returns the nanoseconds until the next timeout, or -1.
+ */
+static int64_t l4sap_async_progress(L4SAP *l4)
+{
+    int64_t next = -1;
+    uint64_t completions;
 
-    while (attempts < max_attempts)
+    l4->async.busy = 1;
+    do
     {
-        int send_res = l2sap_sendto(l4->l2, frame, sizeof(L4Header) + len);
-        if (send_res < 0)
+        completions = l4->async.completions;
+        if (l4->is_terminating)
         {
-            attempts++;
-            continue;
+            l4sap_async_fail(l4, L4_QUIT);
+            if (!l4->async.reset_reported)
+            {
+                l4->async.reset_reported = 1;
+                l4sap_complete(l4, L4_RESET_DONE, L4_QUIT, NULL, NULL);
+            }
+            next = -1;
         }
+        else if (l4->window.mode != L4_STOP_AND_WAIT)
+            next = l4sap_async_window(l4);
+        else
+            next = l4sap_async_stop_and_wait(l4);
+    } while (completions != l4->async.completions);
+    l4->async.busy = 0;
 
-        uint8_t recv_buf[L4Framesize];
-        int recv_res;
+    l4->async.due_ns = next < 0 ? 0 : l4sap_now_ns() + next;
+    return next;
+}
 
-        while (1)
-        {
-            recv_res = l2sap_recvfrom_timeout(l4->l2, recv_buf, L4Framesize, &timeout);
-            if (recv_res == L2_TIMEOUT)
-                break;
-            if (recv_res < sizeof(L4Header))
-                continue;
+/* l4sap_async_run calls l4sap_async_progress unless it runs already,
+ * and with a reactor, sets the timer that calls it again at the next
+ * timeout. It is that timer's callback as well.
+ */
+static void l4sap_async_run(void *arg)
+{
+    L4SAP *l4 = (L4SAP *)arg;
+    if (l4->async.fn == NULL || l4->async.busy)
+        return;
 
-            L4Header *rcv = (L4Header *)recv_buf;
+    int64_t next = l4sap_async_progress(l4);
+    if (l4->reactor == NULL)
+        return;
 
-            switch (rcv->type)
-            {
-                // expecting caller to free L4 when L4_QUIT is returned as in transport-test-client
-            case L4_RESET:
-                l4->is_terminating = 1;
-                return L4_QUIT;
+    if (next >= 0)
+        reactor_timer_arm(l4->reactor, &l4->async.timer, next);
+    else
+        reactor_timer_disarm(l4->reactor, &l4->async.timer);
+}
 
-            case L4_ACK:
-                if (rcv->ackno == (1 - l4->next_send_seq))
-                {
-                    l4->send_state.last_ack_recieved = rcv->ackno;
-                    l4->next_send_seq = 1 - l4->next_send_seq;
-                    return L4_ACK_RECEIVED;
-                }
-                continue;
+/* The callback through which the reactor delivers this entity's
+ * frames. What they acknowledge is completed afterwards, so the
+ * completion callbacks do not run inside l4sap_input.
+ */
+static int l4sap_reactor_input(void *arg, L2SAP *l2, L2View *view)
+{
+    (void)l2;
+    L4SAP *l4 = (L4SAP *)arg;
+    int busy = l4->async.busy;
+    l4->async.busy = 1;
+    int kept = l4sap_input(l4, view);
+    l4->async.busy = busy;
+    l4sap_async_run(l4);
+    return kept;
+}
 
-            case L4_DATA:
-            {
-                uint8_t ack_frame[sizeof(L4Header)];
-                L4Header *ack_header = (L4Header *)ack_frame;
-                ack_header->type = L4_ACK;
-                ack_header->seqno = l4->next_send_seq;
-                ack_header->ackno = (1 - rcv->seqno);
-                ack_header->mbz = 0;
-
-                l2sap_sendto(l4->l2, ack_frame, sizeof(L4Header));
-                fprintf(stderr, "%s: sending ack for data\n", __FUNCTION__);
-                continue;
-            }
-            default:
-                fprintf(stderr, "%s: unknown / uninitalized packet type %d\n", __FUNCTION__, rcv->type);
-                continue;
-            }
+/* l4sap_recv_wait waits until l4sap_input has delivered a DATA packet
+ * to recv_state.data or recv_state.view, or a RESET has arrived.
+ * With a reactor, the RESET may have been dispatched already while
+ * another endpoint was waiting, so the flags are tested first.
+ */
+static int l4sap_recv_wait(L4SAP *l4)
+{
+    l4->recv_state.result = -1;
+    if (l4->window.mode != L4_STOP_AND_WAIT)
+        l4sap_window_deliver(l4);
+
+    while (1)
+    {
+        if (l4->is_terminating)
+        {
+            l4->recv_state.data = NULL;
+            l4->recv_state.view = NULL;
+            return L4_QUIT;
         }
-        attempts++;
-    }
+        if (l4->recv_state.result >= 0)
+            return l4->recv_state.result;
 
-    return L4_SEND_FAILED;
+        if (l4->window.mode != L4_STOP_AND_WAIT)
+            l4sap_window_wait(l4, -1);
+        else
+            l4sap_wait(l4, NULL);
+    }
 }
 
 /* The functions receives a packet from the network. The packet's
@@ -166,70 +1543,571 @@ int l4sap_recv(L4SAP *l4, uint8_t *data, int len)
     if (l4 == NULL || data == NULL || len <= 0)
         return -1;
 
-    uint8_t frame[L4Framesize];
+    if (l4->coalesce.rx.payload != NULL)
+        return l4sap_next_record(l4, data, len);
 
-    while (1)
+    /* The peer may wait for these before it replies. */
+    int result = l4sap_coalesce_flush(l4);
+    if (result < 0)
+        return result;
+
+    if (l4->recv_state.pending.payload != NULL)
     {
-        int recv_result = l2sap_recvfrom_timeout(l4->l2, frame, L4Framesize, NULL);
-        if (recv_result < 0)
-            continue;
-        if (recv_result < sizeof(L4Header))
-            continue;
+        int copy_len = l4sap_copy_payload(l4, &l4->recv_state.pending, data, len);
+        l2sap_release_view(l4->l2, &l4->recv_state.pending);
+        return copy_len;
+    }
 
-        L4Header *recv_header = (L4Header *)frame;
+    l4->recv_state.data = data;
+    l4->recv_state.len = len;
 
-        switch (recv_header->type)
-        {
-        case L4_RESET:
-            l4->is_terminating = 1;
-            return L4_QUIT;
+    return l4sap_recv_wait(l4);
+}
+
+/* Like l4sap_recv, but the payload is not copied. view->data points
+ * to the payload inside the L2 entity's receive buffer until
+ * l4sap_release_view is called.
+ */
+int l4sap_recv_view(L4SAP *l4, L4View *view)
+{
+    if (l4 == NULL || view == NULL)
+        return -1;
+
+    view->data = NULL;
+    view->l2.payload = NULL;
+    if (l4->coalesce.rx.payload != NULL)
+        return l4sap_next_record_view(l4, view);
+
+    int result = l4sap_coalesce_flush(l4);
+    if (result < 0)
+        return result;
+
+    if (l4->recv_state.pending.payload != NULL)
+        return l4sap_view_payload(l4, &l4->recv_state.pending, view);
+
+    l4->recv_state.view = view;
+
+    return l4sap_recv_wait(l4);
+}
+
+void l4sap_release_view(L4SAP *l4, L4View *view)
+{
+    if (l4 == NULL || view == NULL)
+        return;
+
+    /* A record that l4sap_record_view copied has no L2 buffer. */
+    if (view->l2.payload == NULL)
+        free(view->data);
+    else
+        l2sap_release_view(l4->l2, &view->l2);
+    view->data = NULL;
+}
+
+int l4sap_send_msg(L4SAP *l4, const uint8_t *data, int len)
+{
+    if (l4 == NULL || data == NULL || len < 0 || len > L4Maxmessage)
+        return -1;
+
+    int result = l4sap_coalesce_flush(l4);
+    if (result < 0)
+        return result;
+
+    /* Every fragment but the last fills a packet. A message of 0
+     * bytes is one empty fragment. The room is looked at again for
+     * every fragment, since the send window may grow its buffers in
+     * between, and the offset moves by what was actually sent.
+     */
+    int offset = 0;
+    do
+    {
+        int chunk = l4sap_packet_room(l4) - (int)sizeof(L4Fragment);
+        int bytes = len - offset < chunk ? len - offset : chunk;
+
+        L4Fragment fragment;
+        fragment.length = htonl(len);
+        fragment.offset = htonl(offset);
+        result = l4sap_send_prefixed(l4, (const uint8_t *)&fragment, sizeof(fragment), data + offset, bytes);
+        if (result < 0 && result != L4_ACK_RECEIVED)
+            return result;
+        offset += result >= 0 ? result : bytes;
+    } while (offset < len);
+
+    return len;
+}
+
+/* l4sap_recv_fragments receives the fragments of the next message and
+ * copies them in place. With alloc, the buffer is allocated when the
+ * first fragment tells the length and returned in *alloc; otherwise
+ * at most len bytes are stored in data.
+ */
+static int l4sap_recv_fragments(L4SAP *l4, uint8_t *data, int len, uint8_t **alloc)
+{
+    int started = 0;
+    uint32_t length = 0;
+    uint32_t offset = 0;
 
-        case L4_DATA:
-            if (recv_header->seqno == l4->expected_recv_seq)
+    while (1)
+    {
+        L4View view;
+        int result = l4sap_recv_view(l4, &view);
+        if (result < 0)
+        {
+            if (alloc != NULL)
             {
-                int copy_len = recv_result - sizeof(L4Header);
-                if (copy_len > len)
-                    copy_len = len;
-                memcpy(data, frame + sizeof(L4Header), copy_len);
-
-                uint8_t ack_frame[sizeof(L4Header)];
-                L4Header *ack_header = (L4Header *)ack_frame;
-                ack_header->type = L4_ACK;
-                ack_header->seqno = l4->next_send_seq;
-                ack_header->ackno = (1 - l4->expected_recv_seq);
-                ack_header->mbz = 0;
-
-                l2sap_sendto(l4->l2, ack_frame, sizeof(L4Header));
-
-                l4->expected_recv_seq = 1 - l4->expected_recv_seq;
-                l4->recv_state.last_ack_sent = recv_header->seqno;
-                return copy_len;
+                free(*alloc);
+                *alloc = NULL;
             }
-            else
+            return result;
+        }
+
+        L4Fragment fragment;
+        int bytes = view.len - (int)sizeof(L4Fragment);
+        if (bytes < 0)
+        {
+            LOG_WARN("packet of %d bytes is no fragment", view.len);
+            l4sap_release_view(l4, &view);
+            continue;
+        }
+        memcpy(&fragment, view.data, sizeof(fragment));
+        uint32_t fragment_length = ntohl(fragment.length);
+        uint32_t fragment_offset = ntohl(fragment.offset);
+
+        if (fragment_offset == 0 && fragment_length <= L4Maxmessage)
+        {
+            if (started)
+                LOG_WARN("message of %u bytes ended after %u bytes", length, offset);
+            started = 1;
+            length = fragment_length;
+            offset = 0;
+
+            if (alloc != NULL)
             {
-                uint8_t ack_frame[sizeof(L4Header)];
-                L4Header *ack_header = (L4Header *)ack_frame;
-                ack_header->type = L4_ACK;
-                ack_header->seqno = l4->next_send_seq;
-                ack_header->ackno = (1 - recv_header->seqno);
-                ack_header->mbz = 0;
-
-                l2sap_sendto(l4->l2, ack_frame, sizeof(L4Header));
-                continue;
+                free(*alloc);
+                *alloc = malloc(length > 0 ? length : 1);
+                if (*alloc == NULL)
+                {
+                    LOG_ERROR("failed to allocate %u bytes for a message", length);
+                    l4sap_release_view(l4, &view);
+                    return -1;
+                }
+                data = *alloc;
+                len = length;
             }
+        }
 
-        case L4_ACK:
-            if (recv_header->ackno == (1 - l4->next_send_seq))
-                l4->send_state.last_ack_recieved = recv_header->ackno;
+        if (!started || fragment_length != length || fragment_offset != offset ||
+            (uint32_t)bytes > length - offset)
+        {
+            LOG_DEBUG("skipping fragment at %u of a message of %u bytes", fragment_offset, fragment_length);
+            started = 0;
+            l4sap_release_view(l4, &view);
             continue;
+        }
 
-        default:
-            fprintf(stderr, "%s: unknown / uninitalized packet type %d\n", __FUNCTION__, recv_header->type);
-            continue;
+        if (offset < (uint32_t)len)
+        {
+            int copy_len = (uint32_t)bytes < len - offset ? bytes : (int)(len - offset);
+            memcpy(data + offset, view.data + sizeof(L4Fragment), copy_len);
+            l4->stats.rx_copy_bytes += copy_len;
+        }
+        offset += bytes;
+        l4sap_release_view(l4, &view);
+
+        if (offset == length)
+            return length;
+    }
+}
+
+int l4sap_recv_msg(L4SAP *l4, uint8_t *data, int len)
+{
+    if (l4 == NULL || data == NULL || len < 0)
+        return -1;
+
+    return l4sap_recv_fragments(l4, data, len, NULL);
+}
+
+int l4sap_recv_msg_alloc(L4SAP *l4, uint8_t **data)
+{
+    if (l4 == NULL || data == NULL)
+        return -1;
+
+    *data = NULL;
+    return l4sap_recv_fragments(l4, NULL, 0, data);
+}
+
+int l4sap_set_window(L4SAP *l4, int mode, int size)
+{
+    if (l4 == NULL || mode < L4_STOP_AND_WAIT || mode > L4_SELECTIVE_REPEAT ||
+        (mode != L4_STOP_AND_WAIT && (size <= 0 || size > L4Maxwindow)))
+        return -1;
+
+    if (l4->window.snd_base != l4->window.snd_next || l4->window.rx_base != l4->window.rx_next ||
+        l4->recv_state.pending.payload != NULL)
+    {
+        LOG_ERROR("cannot change the window while packets are in flight or held");
+        return -1;
+    }
+
+    /* The slots are kept from one windowed mode to the next; nothing
+     * is in flight or held in them.
+     */
+    FramePool *pool = NULL;
+    L4Slot *tx = l4->window.tx;
+    L2View *rx = l4->window.rx;
+    if (mode != L4_STOP_AND_WAIT)
+    {
+        pool = framepool_create(size, l4sap_payload_size(l4));
+        if (tx == NULL)
+            tx = calloc(L4Maxwindow, sizeof(L4Slot));
+        if (rx == NULL)
+            rx = calloc(L4Maxwindow, sizeof(L2View));
+    }
+    if ((mode != L4_STOP_AND_WAIT && (pool == NULL || tx == NULL || rx == NULL)) ||
+        l2sap_set_rxframes(l4->l2, mode == L4_STOP_AND_WAIT ? L2Rxframes : L2Rxframes + size) < 0)
+    {
+        framepool_destroy(pool);
+        if (tx != l4->window.tx)
+            free(tx);
+        if (rx != l4->window.rx)
+            free(rx);
+        return -1;
+    }
+
+    framepool_destroy(l4->window.pool);
+    if (mode == L4_STOP_AND_WAIT)
+    {
+        free(tx);
+        free(rx);
+        tx = NULL;
+        rx = NULL;
+    }
+    int dupthresh = l4->window.dupthresh;
+    memset(&l4->window, 0, sizeof(l4->window));
+    l4->window.dupthresh = dupthresh;
+    l4->window.mode = mode;
+    l4->window.size = size;
+    l4->window.pool = pool;
+    l4->window.tx = tx;
+    l4->window.rx = rx;
+
+    /* The congestion window starts over within the new bounds. */
+    if (l4->congestion.cc.ops != NULL)
+        l4sap_set_congestion(l4, mode == L4_STOP_AND_WAIT ? NULL : l4->congestion.cc.ops, l4->congestion.pacing);
+    return 0;
+}
+
+int l4sap_set_rto_bounds(L4SAP *l4, int min_us, int max_us)
+{
+    if (l4 == NULL || min_us <= 0 || max_us < min_us)
+        return -1;
+
+    l4->rtt.min_rto_ns = (int64_t)min_us * 1000;
+    l4->rtt.max_rto_ns = (int64_t)max_us * 1000;
+    if (l4->rtt.rto_ns < l4->rtt.min_rto_ns)
+        l4->rtt.rto_ns = l4->rtt.min_rto_ns;
+    if (l4->rtt.rto_ns > l4->rtt.max_rto_ns)
+        l4->rtt.rto_ns = l4->rtt.max_rto_ns;
+    return 0;
+}
+
+void l4sap_get_rtt(const L4SAP *l4, L4Rtt *rtt)
+{
+    rtt->srtt_us = l4->rtt.srtt_ns / 1000;
+    rtt->rttvar_us = l4->rtt.rttvar_ns / 1000;
+    rtt->rto_us = l4->rtt.rto_ns / 1000;
+    rtt->samples = l4->rtt.samples;
+}
+
+int l4sap_set_dupthresh(L4SAP *l4, int dupthresh)
+{
+    if (l4 == NULL || dupthresh < 0)
+        return -1;
+
+    l4->window.dupthresh = dupthresh;
+    return 0;
+}
+
+int l4sap_set_congestion(L4SAP *l4, const L4CongestionOps *ops, int pacing)
+{
+    if (l4 == NULL || (ops != NULL && l4->window.mode == L4_STOP_AND_WAIT))
+        return -1;
+
+    memset(&l4->congestion, 0, sizeof(l4->congestion));
+    if (ops == NULL)
+        return 0;
+
+    l4->congestion.cc.ops = ops;
+    l4->congestion.cc.max_cwnd = l4->window.size;
+    l4->congestion.pacing = pacing;
+    ops->init(&l4->congestion.cc);
+    return 0;
+}
+
+void l4sap_get_congestion(const L4SAP *l4, L4CongestionStats *stats)
+{
+    stats->cwnd = l4->congestion.cc.ops != NULL ? l4->congestion.cc.cwnd : l4->window.size;
+    stats->ssthresh = l4->congestion.cc.ssthresh;
+    stats->pacing_rate_Bps = l4->congestion.pacing ? l4->congestion.pacer.rate_Bps : 0;
+    stats->loss_events = l4->congestion.loss_events;
+    stats->paced = l4->congestion.paced;
+}
+
+int l4sap_set_delayed_ack(L4SAP *l4, int delay_us)
+{
+    if (l4 == NULL || delay_us < 0)
+        return -1;
+
+    if (delay_us == 0)
+        l4sap_ack_flush(l4);
+    l4->ack.delay_ns = (int64_t)delay_us * 1000;
+    return 0;
+}
+
+void l4sap_get_stats(const L4SAP *l4, L4Stats *stats)
+{
+    *stats = l4->stats;
+}
+
+/* l4sap_dump_histogram writes a histogram like a Prometheus histogram:
+ * the buckets up to the longest time that occurred, cumulative and
+ * with their upper bound as le, then the rest as +Inf.
+ */
+static void l4sap_dump_histogram(FILE *out, const char *metric, const char *name, const L4Histogram *histogram)
+{
+    uint64_t count = 0;
+    for (int i = 0; i < L4Histbuckets - 1 && count < histogram->count; i++)
+    {
+        count += histogram->bucket[i];
+        fprintf(out, "%s_bucket{endpoint=\"%s\",le=\"%" PRIu64 "\"} %" PRIu64 "\n", metric, name,
+                ((uint64_t)1 << i) - 1, count);
+    }
+    fprintf(out, "%s_bucket{endpoint=\"%s\",le=\"+Inf\"} %" PRIu64 "\n", metric, name, histogram->count);
+    fprintf(out, "%s_sum{endpoint=\"%s\"} %" PRIu64 "\n", metric, name, histogram->sum_us);
+    fprintf(out, "%s_count{endpoint=\"%s\"} %" PRIu64 "\n", metric, name, histogram->count);
+}
+
+void l4sap_dump_stats(const L4SAP *l4, FILE *out, const char *name)
+{
+    const struct {
+        const char *metric;
+        uint64_t value;
+    } counters[] = {
+        {"l4_data_sent", l4->stats.data_sent},
+        {"l4_data_received", l4->stats.data_received},
+        {"l4_retransmits", l4->stats.retransmits},
+        {"l4_fast_retransmits", l4->stats.fast_retransmits},
+        {"l4_duplicates", l4->stats.duplicates},
+        {"l4_stale_acks", l4->stats.stale_acks},
+        {"l4_acks", l4->stats.acks},
+        {"l4_piggybacked", l4->stats.piggybacked},
+        {"l4_resets_sent", l4->stats.resets_sent},
+        {"l4_resets_received", l4->stats.resets_received},
+        {"l4_coalesced", l4->stats.coalesced},
+        {"l4_coalesced_packets", l4->stats.coalesced_packets},
+        {"l4_rx_copy_bytes", l4->stats.rx_copy_bytes},
+        {"l4_tx_copy_bytes", l4->stats.tx_copy_bytes},
+    };
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++)
+        fprintf(out, "%s_total{endpoint=\"%s\"} %" PRIu64 "\n", counters[i].metric, name, counters[i].value);
+
+    l4sap_dump_histogram(out, "l4_rtt_us", name, &l4->stats.rtt);
+    l4sap_dump_histogram(out, "l4_ack_latency_us", name, &l4->stats.ack_latency);
+    l2sap_dump_stats(l4->l2, out, name);
+}
+
+uint64_t l4sap_histogram_percentile(const L4Histogram *histogram, double fraction)
+{
+    if (histogram == NULL || histogram->count == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t)(fraction * histogram->count);
+    if (rank >= histogram->count)
+        rank = histogram->count - 1;
+
+    uint64_t count = 0;
+    for (int i = 0; i < L4Histbuckets - 1; i++)
+    {
+        count += histogram->bucket[i];
+        if (count > rank)
+        {
+            uint64_t bound = ((uint64_t)1 << i) - 1;
+            return bound < histogram->max_us ? bound : histogram->max_us;
+        }
+    }
+    return histogram->max_us;
+}
+
+int l4sap_set_coalescing(L4SAP *l4, int delay_us)
+{
+    if (l4 == NULL || delay_us < 0)
+        return -1;
+
+    int result = l4sap_coalesce_flush(l4);
+    if (delay_us == 0)
+    {
+        free(l4->coalesce.buffer);
+        l4->coalesce.buffer = NULL;
+        l4->coalesce.capacity = 0;
+        l4->coalesce.delay_ns = 0;
+        return result;
+    }
+
+    if (l4->coalesce.capacity != l4sap_payload_size(l4))
+    {
+        uint8_t *buffer = realloc(l4->coalesce.buffer, l4sap_payload_size(l4));
+        if (buffer == NULL)
+            return -1;
+        l4->coalesce.buffer = buffer;
+        l4->coalesce.capacity = l4sap_payload_size(l4);
+    }
+    l4->coalesce.delay_ns = (int64_t)delay_us * 1000;
+    return 0;
+}
+
+int l4sap_flush(L4SAP *l4)
+{
+    if (l4 == NULL)
+        return -1;
+
+    int result = l4sap_coalesce_flush(l4);
+    if (result < 0)
+        return result;
+
+    while (l4->window.snd_base != l4->window.snd_next)
+    {
+        if (l4->is_terminating)
+            return L4_QUIT;
+        if (l4->window.failed)
+            return L4_SEND_FAILED;
+        l4sap_window_wait(l4, -1);
+    }
+    return 0;
+}
+
+int l4sap_attach(L4SAP *l4, Reactor *reactor)
+{
+    if (l4 == NULL || reactor == NULL)
+        return -1;
+
+    if (reactor_add(reactor, l4->l2, l4sap_reactor_input, l4) < 0)
+        return -1;
+
+    /* A delayed ACK from before has no timer. */
+    l4sap_ack_flush(l4);
+
+    l4->reactor = reactor;
+    reactor_timer_init(&l4->ack.timer, l4sap_ack_timer, l4);
+    reactor_timer_init(&l4->async.timer, l4sap_async_run, l4);
+    reactor_timer_init(&l4->coalesce.timer, l4sap_coalesce_timer, l4);
+    if (l4->coalesce.used > 0)
+        reactor_timer_arm(reactor, &l4->coalesce.timer, 0);
+    l4sap_async_run(l4);
+    return 0;
+}
+
+void l4sap_detach(L4SAP *l4)
+{
+    if (l4 == NULL || l4->reactor == NULL)
+        return;
+
+    /* Its timer goes with the reactor. */
+    l4sap_ack_flush(l4);
+    reactor_timer_disarm(l4->reactor, &l4->async.timer);
+    reactor_timer_disarm(l4->reactor, &l4->coalesce.timer);
+    reactor_remove(l4->reactor, l4->l2);
+    l4->reactor = NULL;
+}
+
+int l4sap_set_completion(L4SAP *l4, L4CompletionFn fn, void *arg)
+{
+    if (l4 == NULL)
+        return -1;
+
+    /* Completions for submitted packets must have somewhere to go. */
+    if (fn == NULL && (l4->async.count > 0 || l4->async.inflight))
+        return -1;
+
+    l4->async.fn = fn;
+    l4->async.arg = arg;
+    return 0;
+}
+
+int l4sap_submit_send(L4SAP *l4, const uint8_t *data, int len, void *user)
+{
+    if (l4 == NULL || data == NULL || len < 0 || l4->async.fn == NULL)
+        return -1;
+    if (l4->is_terminating)
+        return L4_QUIT;
+    if (l4->async.count == L4Maxsubmits)
+        return L4_QUEUE_FULL;
+
+    if (l4->async.queue == NULL)
+    {
+        l4->async.queue = malloc(L4Maxsubmits * sizeof(L4Submit));
+        l4->async.done = malloc(L4Maxwindow * sizeof(L4Submit));
+        if (l4->async.queue == NULL || l4->async.done == NULL)
+        {
+            free(l4->async.queue);
+            free(l4->async.done);
+            l4->async.queue = NULL;
+            l4->async.done = NULL;
+            return -1;
         }
     }
 
-    return -1;
+    if (len > l4sap_payload_size(l4))
+        len = l4sap_payload_size(l4);
+
+    L4Submit *submit = &l4->async.queue[(l4->async.head + l4->async.count++) % L4Maxsubmits];
+    submit->data = data;
+    submit->len = len;
+    submit->user = user;
+
+    l4sap_async_run(l4);
+    return len;
+}
+
+int l4sap_drive(L4SAP *l4, int timeout_ms)
+{
+    if (l4 == NULL || l4->async.fn == NULL || l4->async.busy)
+        return -1;
+
+    uint64_t before = l4->async.completions;
+    if (l4->reactor != NULL)
+    {
+        /* The reactor's timers and l4sap_reactor_input do the work. */
+        l4sap_async_run(l4);
+        if (reactor_run_once(l4->reactor, timeout_ms) < 0)
+            return -1;
+        return (int)(l4->async.completions - before);
+    }
+
+    uint64_t end_ns = timeout_ms < 0 ? 0 : l4sap_now_ns() + (uint64_t)timeout_ms * 1000000;
+    while (1)
+    {
+        l4sap_async_progress(l4);
+        if (l4->async.completions != before)
+            return (int)(l4->async.completions - before);
+
+        uint64_t now = l4sap_now_ns();
+        if (timeout_ms >= 0 && now >= end_ns)
+            return 0;
+
+        /* Wait for a frame, but not beyond the next retransmission. */
+        uint64_t due = end_ns;
+        if (l4->async.due_ns != 0 && (due == 0 || l4->async.due_ns < due))
+            due = l4->async.due_ns;
+
+        struct timespec deadline;
+        if (due != 0)
+            l4sap_deadline(&deadline, due);
+
+        l4->async.busy = 1;
+        int res = l4sap_wait(l4, due != 0 ? &deadline : NULL);
+        l4->async.busy = 0;
+        if (res < 0 && res != L2_TIMEOUT)
+            return -1;
+    }
 }
 
 /** This function is called to terminate the L4 entity and
@@ -243,8 +2121,15 @@ void l4sap_destroy(L4SAP *l4)
     if (l4 == NULL)
         return;
 
+    /* Queued records go out before the RESET. */
+    if (l4->l2 != NULL && !l4->is_terminating)
+        l4sap_coalesce_flush(l4);
+
     if (l4->l2 != NULL && !l4->is_terminating)
     {
+        /* The peer may still wait for this ACK. */
+        l4sap_ack_flush(l4);
+
         uint8_t reset_frame[sizeof(L4Header)];
         L4Header *reset_header = (L4Header *)reset_frame;
         reset_header->type = L4_RESET;
@@ -256,8 +2141,28 @@ void l4sap_destroy(L4SAP *l4)
         {
             l2sap_sendto(l4->l2, reset_frame, sizeof(L4Header));
         }
+        l4->stats.resets_sent += 3;
+    }
+
+    l4sap_detach(l4);
+
+    if (l4->l2 != NULL)
+    {
+        l2sap_release_view(l4->l2, &l4->recv_state.pending);
+        l2sap_release_view(l4->l2, &l4->coalesce.rx);
+        for (int i = 0; l4->window.rx != NULL && i < L4Maxwindow; i++)
+            l2sap_release_view(l4->l2, &l4->window.rx[i]);
     }
 
+    for (int i = 0; l4->window.tx != NULL && i < L4Maxwindow; i++)
+        framepool_put(l4->window.pool, l4->window.tx[i].data);
+    framepool_destroy(l4->window.pool);
+    free(l4->window.tx);
+    free(l4->window.rx);
+    free(l4->async.queue);
+    free(l4->async.done);
+    free(l4->coalesce.buffer);
+
     if (l4->l2 != NULL)
     {
         l2sap_destroy(l4->l2);
@@ -5,6 +5,8 @@
 #include <netinet/in.h>
 
 #include "l2sap.h"
+#include "reactor.h"
+#include "l4cc.h"
 
 #define L4Framesize   (int)L2Payloadsize
 #define L4Headersize  (int)(sizeof(L4Header))
@@ -27,6 +29,55 @@
 #define L4_DATA_RECEIVED    -103
 #define L4_NODATA_RECEIVED  -104
 
+/* l4sap_submit_send cannot take another send. */
+#define L4_QUEUE_FULL       -105
+
+/* The modes of l4sap_set_window. */
+#define L4_STOP_AND_WAIT     0
+#define L4_GO_BACK_N         1
+#define L4_SELECTIVE_REPEAT  2
+
+/* The largest window. Sequence numbers are 8 bits, and Selective
+ * Repeat can tell a new packet from an old one only if the window is
+ * at most half of the sequence number space.
+ */
+#define L4Maxwindow    128
+
+/* How often the timeout of one packet may expire before the sender
+ * gives up.
+ */
+#define L4Maxtimeouts  5
+
+/* How many sends l4sap_submit_send queues per entity. */
+#define L4Maxsubmits   256
+
+/* The types of L4Completion. */
+#define L4_SEND_DONE   1
+#define L4_RECV_DONE   2
+#define L4_RESET_DONE  3
+
+/* How many duplicate ACKs make a windowed sender send the oldest
+ * packet again before its timeout, see l4sap_set_dupthresh.
+ */
+#define L4Dupthresh    3
+
+/* The retransmission timeout (RTO) in microseconds before the first
+ * RTT sample, the assignment's 1 second, and its default bounds.
+ */
+#define L4Initialrto   1000000
+#define L4Minrto       10000
+#define L4Maxrto       2000000
+
+/* The value of the L4Header's mbz field in DATA packets that carry
+ * the records of coalesced messages (see l4sap_set_coalescing). A
+ * record is the message's length in L4Recordheader bytes in network
+ * byte order, followed by the message. Peers that predate records
+ * see an mbz that is not 0, and never get such packets unless they
+ * are sent to them.
+ */
+#define L4_MBZ_RECORDS 0x01
+#define L4Recordheader 2
+
 
 /* The design of the L4 layer is the following:
  *
@@ -77,11 +128,179 @@ struct L4Header
  * You can add any number of data structures that are convenient for you.
  */
 
+/* A DATA packet in the send window of the windowed modes: the header,
+ * a copy of the payload, when it was sent last (0 if not yet), and
+ * how often its timeout expired.
+ */
+typedef struct L4Slot L4Slot;
+struct L4Slot
+{
+    L4Header header;
+    uint8_t* data;
+    int      length;
+    int      acked;
+    int      transmits;
+    int      timeouts;
+    uint64_t sent_ns;
+
+    /* Set if the packet came from l4sap_submit_send, with its user
+     * pointer.
+     */
+    int      submitted;
+    void*    user;
+
+    /* When it was sent first. */
+    uint64_t first_ns;
+};
+
+/* The header in front of every fragment of a message that
+ * l4sap_send_msg sends, in network byte order: the length of the whole
+ * message and where the fragment's bytes start in it.
+ */
+typedef struct L4Fragment L4Fragment;
+struct L4Fragment
+{
+    uint32_t length;
+    uint32_t offset;
+};
+
+/* The largest message of l4sap_send_msg. */
+#define L4Maxmessage   (1 << 30)
+
+/* The round-trip time estimate of an L4 entity, see l4sap_get_rtt. */
+typedef struct L4Rtt L4Rtt;
+struct L4Rtt
+{
+    int      srtt_us;
+    int      rttvar_us;
+    int      rto_us;
+    uint64_t samples;
+};
+
+/* The number of buckets of an L4Histogram. */
+#define L4Histbuckets  32
+
+/* A histogram of times in microseconds whose buckets grow by powers
+ * of 2: bucket 0 counts times under 1 us, bucket i from 2^(i-1) to
+ * 2^i - 1 us, and the last bucket all longer times as well.
+ */
+typedef struct L4Histogram L4Histogram;
+struct L4Histogram
+{
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t max_us;
+    uint64_t bucket[L4Histbuckets];
+};
+
+/* The counters of an L4 entity, see l4sap_get_stats. */
+typedef struct L4Stats L4Stats;
+struct L4Stats
+{
+    /* Payload bytes copied into the callers' buffers, and into
+     * the send window.
+     */
+    uint64_t rx_copy_bytes;
+    uint64_t tx_copy_bytes;
+
+    /* DATA packets sent again, and how often duplicate ACKs
+     * started that before the timeout.
+     */
+    uint64_t retransmits;
+    uint64_t fast_retransmits;
+
+    /* Bare ACK packets sent, and delayed ACKs that went out with
+     * a DATA packet instead.
+     */
+    uint64_t acks;
+    uint64_t piggybacked;
+
+    /* Messages that were sent as records, and the packets that
+     * carried them.
+     */
+    uint64_t coalesced;
+    uint64_t coalesced_packets;
+
+    /* DATA packets sent, retransmissions included, and received;
+     * received ones that had arrived before; ACKs that acknowledged
+     * nothing new; RESET packets sent and received.
+     */
+    uint64_t data_sent;
+    uint64_t data_received;
+    uint64_t duplicates;
+    uint64_t stale_acks;
+    uint64_t resets_sent;
+    uint64_t resets_received;
+
+    /* The RTT samples (see l4sap_get_rtt), and the times from the
+     * first transmission of a DATA packet until its ACK, which include
+     * the retransmissions.
+     */
+    L4Histogram rtt;
+    L4Histogram ack_latency;
+};
+
+/* The congestion state of an L4 entity, see l4sap_get_congestion. */
+typedef struct L4CongestionStats L4CongestionStats;
+struct L4CongestionStats
+{
+    int      cwnd;
+    int      ssthresh;
+    uint64_t pacing_rate_Bps;
+    uint64_t loss_events;
+    uint64_t paced;
+};
+
+/* A view of a received L4 payload that stays in the L2 entity's
+ * receive buffer, or of a copied record (see l4sap_record_view),
+ * returned by l4sap_recv_view.
+ */
+typedef struct L4View L4View;
+struct L4View
+{
+    uint8_t* data;
+    int      len;
+    L2View   l2;
+};
+
 /* The data structure for maintaining the L4 entity should
  * be called L4SAP.
  */
 typedef struct L4SAP L4SAP;
 
+/* What the asynchronous API reports (see l4sap_submit_send):
+ * - L4_SEND_DONE: a submitted send with the given user pointer
+ *   completed; result is the number of bytes sent, L4_SEND_FAILED or
+ *   L4_QUIT.
+ * - L4_RECV_DONE: a DATA packet, or a record of one, arrived; view
+ *   describes its payload as with l4sap_recv_view, and result is its
+ *   length.
+ * - L4_RESET_DONE: the peer sent L4_RESET.
+ */
+typedef struct L4Completion L4Completion;
+struct L4Completion
+{
+    int     type;
+    int     result;
+    void*   user;
+    L4View  view;
+};
+
+/* The completion callback. For L4_RECV_DONE, it returns 1 if it keeps
+ * the view, which it must give back with l4sap_release_view later,
+ * and 0 if the view can be released when it returns.
+ */
+typedef int (*L4CompletionFn)( void* arg, L4SAP* l4, L4Completion* completion );
+
+/* A send that l4sap_submit_send queued, or a completed one. */
+typedef struct L4Submit L4Submit;
+struct L4Submit
+{
+    const uint8_t* data;
+    int            len;
+    void*          user;
+};
+
 /*
  * This is the data structure that manages all data that is required to
  * manage your L4 entity. It is very likely that it contains a pointer to
@@ -91,21 +310,189 @@ struct L4SAP
 {
     L2SAP* l2;
 
+    /* The reactor that l4sap_attach added l2 to, or NULL.
+     */
+    Reactor* reactor;
+
     uint8_t next_send_seq;
     uint8_t expected_recv_seq;
 
     int is_terminating;
 
     struct {
-        uint8_t buffer[L4Payloadsize];
+        /* The L4Header of the DATA packet that l4sap_send is sending,
+         * and the caller's payload, which stays valid while
+         * l4sap_send blocks. Retransmissions send them again without
+         * copying the payload. prefix goes in front of the payload,
+         * e.g. an L4Fragment, or is NULL.
+         */
+        L4Header header;
+        const uint8_t* prefix;
+        int prefix_length;
+        const uint8_t* data;
         int length;
         uint8_t last_ack_recieved;
+
+        /* Set while l4sap_send waits for an ACK, and when it came. */
+        int waiting;
+        int acked;
     } send_state;
 
     struct{
         uint8_t last_seqno_recieved;
         uint8_t last_ack_sent;
+
+        /* The buffer of the l4sap_recv or the view of the
+         * l4sap_recv_view that is waiting, or NULL, and the number of
+         * bytes delivered (-1 until then).
+         */
+        uint8_t* data;
+        int len;
+        L4View* view;
+        int result;
+
+        /* With a reactor or delayed ACKs, the L2 view of one DATA
+         * packet that arrives while nobody waits in l4sap_recv is kept
+         * here. Its payload is NULL if the slot is empty.
+         */
+        L2View pending;
     } recv_state;
+
+    /* The sliding window of L4_GO_BACK_N and L4_SELECTIVE_REPEAT
+     * (see l4sap_set_window). The slot of sequence number n is
+     * n % L4Maxwindow in both directions. The L4Maxwindow slots of tx
+     * and rx are allocated by l4sap_set_window, and NULL in
+     * stop-and-wait mode.
+     */
+    struct {
+        int mode;
+        int size;
+
+        /* Set when the timeout of a packet expired L4Maxtimeouts
+         * times.
+         */
+        int failed;
+
+        /* ACKs in a row that acknowledged nothing new, and how many
+         * of them trigger a fast retransmit (0 never).
+         */
+        int dupacks;
+        int dupthresh;
+
+        /* The packets snd_base .. snd_next - 1 are in flight. Their
+         * payload copies come from pool.
+         */
+        uint8_t snd_base;
+        uint8_t snd_next;
+        FramePool* pool;
+        L4Slot* tx;
+
+        /* The packets rx_base .. rx_next - 1 arrived in order and wait
+         * for l4sap_recv; with Selective Repeat, packets behind a gap
+         * wait in their slots up to rx_base + size - 1. All are held
+         * as L2 views.
+         */
+        uint8_t rx_base;
+        uint8_t rx_next;
+        L2View* rx;
+    } window;
+
+    /* The RTT estimator of RFC 6298 in nanoseconds. rto_ns is the
+     * current retransmission timeout, including the backoff.
+     */
+    struct {
+        int64_t srtt_ns;
+        int64_t rttvar_ns;
+        int64_t rto_ns;
+        int64_t min_rto_ns;
+        int64_t max_rto_ns;
+        uint64_t samples;
+    } rtt;
+
+    /* Congestion control of the windowed modes (see
+     * l4sap_set_congestion); cc.ops is NULL while it is off. While
+     * recovering is set, a loss was reported and the packets sent
+     * before recover are not acknowledged yet, so duplicate ACKs for
+     * them are not another loss. paced counts the packets that waited
+     * for the pacer; held is set while the next one does.
+     */
+    struct {
+        L4Congestion cc;
+        L4Pacer pacer;
+        int pacing;
+        int held;
+        int recovering;
+        uint8_t recover;
+        uint64_t loss_events;
+        uint64_t paced;
+    } congestion;
+
+    /* The coalescing send queue (see l4sap_set_coalescing). buffer
+     * holds used bytes of records, the oldest queued at queued_ns.
+     * With a reactor, timer sends them when they are due. sending is
+     * set while they go out, and error keeps the result of sending
+     * them that way until a call can return it. rx is the packet of
+     * records that l4sap_recv takes apart, whose next record starts
+     * at rx_offset.
+     */
+    struct {
+        int64_t delay_ns;
+        uint8_t* buffer;
+        int capacity;
+        int used;
+        uint64_t queued_ns;
+        ReactorTimer timer;
+        int sending;
+        int error;
+        L2View rx;
+        int rx_offset;
+    } coalesce;
+
+    /* A delayed ACK (see l4sap_set_delayed_ack). While pending is
+     * set, the ACK of a DATA packet waits for the next DATA packet
+     * that goes out, but at most until due_ns, when a bare ACK with
+     * seqno is sent. With a reactor, timer sends it.
+     */
+    struct {
+        int64_t delay_ns;
+        int pending;
+        uint8_t seqno;
+        uint64_t due_ns;
+        ReactorTimer timer;
+    } ack;
+
+    /* The asynchronous API (see l4sap_submit_send).
+     * queue holds the submitted sends that were not started yet, from
+     * head on; in stop-and-wait mode, the one at head is in flight
+     * while inflight is set. done holds the windowed sends whose ACK
+     * came, until their completions are reported. due_ns is the next
+     * retransmission timeout (0 if none), and timer the reactor timer
+     * for it. busy is set while frames are processed, when a
+     * submission from a callback is only queued. queue (L4Maxsubmits
+     * entries) and done (L4Maxwindow) are allocated by the first
+     * l4sap_submit_send.
+     */
+    struct {
+        L4CompletionFn fn;
+        void* arg;
+        L4Submit* queue;
+        int head;
+        int count;
+        int inflight;
+        int transmits;
+        int timeouts;
+        uint64_t first_ns;
+        uint64_t sent_ns;
+        L4Submit* done;
+        int done_count;
+        uint64_t due_ns;
+        ReactorTimer timer;
+        int busy;
+        int reset_reported;
+        uint64_t completions;
+    } async;
+
+    L4Stats stats;
 };
 
 
@@ -121,12 +508,14 @@ L4SAP* l4sap_create( const char* server_ip, int server_port );
  * been received.
  *
  * Send an L4_DATA packet with the given data of length len as
- * payload. If len exceed L4Payloadsize, the send is truncated
- * to L4Payloadsize. The rest is ignored.
+ * payload. If len exceeds l4sap_payload_size, the send is truncated
+ * to that size. The rest is ignored.
  *
- * l4sap_send resends up to 5 times after a timeout of 1
- * second if it does not receive a correct ACK. After that, it
- * gives up and returns L4_TIMEOUT as an error code.
+ * l4sap_send resends up to 4 times after a timeout if it does not
+ * receive a correct ACK. The timeout is 1 second until the first RTT
+ * sample and adapts to the measured RTT afterwards (see
+ * l4sap_get_rtt). After that, it gives up and returns L4_SEND_FAILED
+ * as an error code.
  *
  * While l4sap_send waits for a suitable ACK, it can also
  * receive DATA and RESET packets.
@@ -136,9 +525,40 @@ L4SAP* l4sap_create( const char* server_ip, int server_port );
  * the error code L4_QUIT.
  *
  * DATA packets must be handled to achieve a full duplex operation.
+ *
+ * In the windowed modes, l4sap_send does not wait for the ACK; see
+ * l4sap_set_window.
  */
 int l4sap_send( L4SAP* l4, const uint8_t* data, int len );
 
+/* The largest message that l4sap_send sends in one packet. It is
+ * L4Payloadsize unless the frame size or the checksum mode of the L2
+ * entity was changed.
+ */
+int l4sap_payload_size( L4SAP* l4 );
+
+/* Message API for messages of any length up to L4Maxmessage.
+ * l4sap_send_msg splits the len bytes in data into fragments that
+ * each fill a packet behind an L4Fragment header, and sends them with
+ * l4sap_send. It returns len when all fragments were sent (in the
+ * windowed modes: accepted into the window, see l4sap_flush), or the
+ * first error of l4sap_send.
+ *
+ * l4sap_recv_msg receives the fragments of the next message and
+ * reassembles them in data. It returns the length of the whole message,
+ * which may be more than len; then only the first len bytes were
+ * stored. l4sap_recv_msg_alloc stores the message in a buffer that it
+ * allocates with malloc and returns in *data, which the caller frees.
+ * Both return L4_QUIT or a value < 0 like l4sap_recv. Fragments of a
+ * message whose start was missed are skipped.
+ *
+ * Both peers must use the message API for all their messages, because
+ * l4sap_recv cannot tell a fragment from a packet of l4sap_send.
+ */
+int l4sap_send_msg( L4SAP* l4, const uint8_t* data, int len );
+int l4sap_recv_msg( L4SAP* l4, uint8_t* data, int len );
+int l4sap_recv_msg_alloc( L4SAP* l4, uint8_t** data );
+
 /* l4sap_recv is a blocking function that receives data from
  * its peer entity.
  *
@@ -163,6 +583,233 @@ int l4sap_send( L4SAP* l4, const uint8_t* data, int len );
  */
 int l4sap_recv( L4SAP* l4, uint8_t* data, int len );
 
+/* Selects the protocol. L4_STOP_AND_WAIT, the default, is the
+ * protocol of the assignment with the sequence numbers 0 and 1, which
+ * the test servers speak. L4_GO_BACK_N and L4_SELECTIVE_REPEAT keep up
+ * to size (at most L4Maxwindow) DATA packets in flight and use all 256
+ * sequence numbers:
+ *
+ * - l4sap_send copies the payload into the send window and returns the
+ *   number of bytes accepted as soon as there is room in the window.
+ *   l4sap_flush waits until everything sent is acknowledged. A packet
+ *   that is not acknowledged within the RTO is sent again. When that
+ *   happened L4Maxtimeouts times to one packet, l4sap_send and
+ *   l4sap_flush return L4_SEND_FAILED.
+ * - An ACK's ackno is the next sequence number that the receiver
+ *   expects, which acknowledges all packets before it. With Selective
+ *   Repeat, its seqno also acknowledges the DATA packet that caused it,
+ *   and the receiver keeps packets that arrive behind a gap, so only
+ *   lost packets are sent again. With Go-Back-N, the receiver drops
+ *   them, and the sender sends all packets in flight again when the
+ *   oldest one times out.
+ * - The receiver holds up to size packets that l4sap_recv has not
+ *   taken yet, so its L2 entity gets that many more receive buffers.
+ * - The copies in the send window are as large as l4sap_payload_size.
+ *   If it changes later (l2sap_set_framesize or a checksum mode), the
+ *   next l4sap_send first waits until the packets in flight are
+ *   acknowledged and then makes the copies fit.
+ *
+ * Retransmissions happen while l4sap_send, l4sap_flush or l4sap_recv
+ * of this entity wait. Both peers must select the same mode and size
+ * before the first packet. Returns 0 or -1 in case of error.
+ */
+int l4sap_set_window( L4SAP* l4, int mode, int size );
+
+/* Every DATA packet that is acknowledged without having been sent
+ * again is an RTT sample (Karn's rule); in the windowed modes, the
+ * sample is the packet named by the ACK's seqno. The samples give a
+ * smoothed RTT and its variation, and the RTO is SRTT + 4 * RTTVAR
+ * within the bounds. Every timeout doubles the RTO up to the upper
+ * bound, until the next sample.
+ *
+ * l4sap_set_rto_bounds sets the bounds in microseconds (by default
+ * L4Minrto and L4Maxrto) and returns 0 or -1 in case of error.
+ * l4sap_get_rtt reads the current estimate; srtt_us and rttvar_us are
+ * 0 until the first sample.
+ */
+int  l4sap_set_rto_bounds( L4SAP* l4, int min_us, int max_us );
+void l4sap_get_rtt( const L4SAP* l4, L4Rtt* rtt );
+
+/* Every DATA packet carries the sender's current acknowledgement in
+ * its ackno, so in request/response traffic the reply can acknowledge
+ * the request. l4sap_set_delayed_ack holds back the ACK of a DATA
+ * packet that arrived in order for up to delay_us microseconds (0,
+ * the default, acknowledges at once). If this entity sends DATA in the
+ * meantime, the ACK rides on it; only if the delay expires first is a
+ * bare ACK sent. Duplicates, packets out of order and a second packet
+ * while an ACK is held back are acknowledged at once. In stop-and-wait
+ * mode, the ackno of incoming DATA only counts as an acknowledgement
+ * while delayed ACKs are on, since a peer without them may retransmit
+ * DATA with the ackno it had when it was first sent.
+ *
+ * With a reactor, a timer sends the delayed ACK (at most one tick of
+ * the reactor's timer wheel late). Without one, it is sent when the
+ * delay expires while l4sap_send, l4sap_recv or l4sap_flush wait, so
+ * an entity that does not call them again soon makes its peer
+ * retransmit. Like with a
+ * reactor, one DATA packet that arrives while l4sap_send waits is
+ * then kept for the next l4sap_recv instead of being dropped.
+ * Returns 0 or -1 in case of error.
+ */
+int  l4sap_set_delayed_ack( L4SAP* l4, int delay_us );
+
+/* In the windowed modes, the receiver acknowledges every packet that
+ * arrives behind a gap with the same ackno. After dupthresh such
+ * duplicate ACKs (L4Dupthresh by default, 0 turns it off), the sender
+ * takes the oldest packet in flight as lost and sends it again at once
+ * (with Go-Back-N, all packets from there), instead of waiting for
+ * its timeout. Stop-and-wait has a single packet in flight, whose loss
+ * causes no ACKs at all, so it only has the timeout.
+ * Returns 0 or -1 in case of error.
+ */
+int  l4sap_set_dupthresh( L4SAP* l4, int dupthresh );
+
+/* Turns on congestion control for the windowed modes with the
+ * algorithm ops (such as l4_reno, see l4cc.h), or turns it off if ops
+ * is NULL, which is the default. The sender then has at most
+ * min(size, cwnd) packets in flight; the size of l4sap_set_window is
+ * the upper bound of cwnd, and setting the window starts cwnd over
+ * (stop-and-wait turns congestion control off). A loss
+ * detected by duplicate ACKs or by a timeout shrinks cwnd, once per
+ * window of data.
+ *
+ * With pacing, the packets of a window are not sent in one burst but
+ * at cwnd packets per smoothed RTT (twice that in slow start, and a
+ * quarter more after it, so the window can still grow), with bursts
+ * of at most 2 packets. Pacing starts with the first RTT sample.
+ *
+ * l4sap_get_congestion reads cwnd, ssthresh, the pacing rate (0 if
+ * none), the number of loss events and of packets that waited for the
+ * pacer. Returns 0 or -1 in case of error.
+ */
+int  l4sap_set_congestion( L4SAP* l4, const L4CongestionOps* ops, int pacing );
+void l4sap_get_congestion( const L4SAP* l4, L4CongestionStats* stats );
+
+/* l4sap_get_stats copies the counters and histograms of an entity.
+ * Like the entity, they belong to the thread that uses it, so another
+ * thread reads them only while it does not run.
+ *
+ * l4sap_dump_stats writes the counters of the entity and of its L2
+ * entity (see l2sap_dump_stats) to out in the text format of
+ * Prometheus, and the histograms as cumulative buckets, for example
+ *   l4_ack_latency_us_bucket{endpoint="name",le="1023"} 17
+ * with _sum and _count, so that a snapshot in a file can be scraped.
+ *
+ * l4sap_histogram_percentile returns the upper bound in microseconds
+ * of the bucket that holds the given fraction (0 to 1) of the times,
+ * at most the longest time, or 0 for an empty histogram.
+ */
+void     l4sap_get_stats( const L4SAP* l4, L4Stats* stats );
+void     l4sap_dump_stats( const L4SAP* l4, FILE* out, const char* name );
+uint64_t l4sap_histogram_percentile( const L4Histogram* histogram, double fraction );
+
+/* Turns on the coalescing send queue, or turns it off if delay_us is
+ * 0, which is the default. l4sap_send then does not send a message
+ * that fits into a packet at once, but queues it as a record and
+ * returns its length; the records go out together in one DATA packet
+ * (marked with L4_MBZ_RECORDS) when the next message does not fit any
+ * more, when the oldest record has been queued for delay_us
+ * microseconds, before l4sap_recv, l4sap_recv_view or l4sap_send_msg
+ * and with l4sap_flush or l4sap_destroy. A larger message is sent by
+ * itself after the queue.
+ *
+ * With a reactor (see l4sap_attach), a timer sends the queue when it
+ * is due (at most one tick of the reactor's timer wheel late), from
+ * within the reactor; in stop-and-wait mode, it runs the reactor until
+ * the ACK comes. Without one, the queue is sent when it is due while
+ * l4sap_send, l4sap_recv or l4sap_flush wait, or by the next
+ * l4sap_send, so an entity that stops calling them calls l4sap_flush.
+ * If sending the queue fails where no call can return it, the next
+ * l4sap_send, l4sap_send_msg or l4sap_flush returns the error.
+ *
+ * The records take L4Recordheader bytes each, and a queue as large as
+ * the payload of the moment (set the frame size first). The receiver
+ * gets the records of such a packet one by one, whether or not
+ * coalescing is on there, from l4sap_recv, l4sap_recv_view and as
+ * completions alike; a view of a record other than the last of its
+ * packet holds a copy of it.
+ * Returns 0, or L4_SEND_FAILED, L4_QUIT or -1 if the queue could not
+ * be sent when coalescing was turned off.
+ */
+int  l4sap_set_coalescing( L4SAP* l4, int delay_us );
+
+/* Sends the coalescing queue and then waits until all packets sent in
+ * a windowed mode are acknowledged.
+ * Returns 0, L4_SEND_FAILED, L4_QUIT or -1 in case of error.
+ */
+int l4sap_flush( L4SAP* l4 );
+
+/* Runs this L4 entity on top of a reactor: its L2 entity is added to
+ * the reactor, and l4sap_send and l4sap_recv wait by running the
+ * reactor instead of polling the L2 socket. Meanwhile, the
+ * reactor also dispatches frames and timers of all other endpoints.
+ *
+ * In this mode, a DATA packet that arrives while no l4sap_recv is
+ * waiting is acknowledged and kept for the next l4sap_recv. A second
+ * one is not acknowledged, so the peer retransmits it later.
+ *
+ * Returns 0 or -1 in case of error.
+ */
+int l4sap_attach( L4SAP* l4, Reactor* reactor );
+
+/* Removes the L4 entity from its reactor again.
+ */
+void l4sap_detach( L4SAP* l4 );
+
+/* Asynchronous API, so that one thread can drive many transfers.
+ *
+ * l4sap_set_completion sets the callback that reports completed
+ * sends, arriving DATA packets and the peer's RESET (see
+ * L4Completion). Returns 0 or -1.
+ *
+ * l4sap_submit_send queues a send of len bytes in data (truncated to
+ * l4sap_payload_size) and returns the number of bytes it will send
+ * at once, or L4_QUEUE_FULL if
+ * L4Maxsubmits sends are queued, L4_QUIT after a RESET, or -1. data
+ * must stay valid until the L4_SEND_DONE completion with user. Sends
+ * complete in the order of submission. In stop-and-wait mode, one is
+ * in flight at a time; in the windowed modes, they are copied into the
+ * window when there is room and complete when they are acknowledged.
+ * An entity that has submitted sends must not call l4sap_send.
+ *
+ * Frames and timeouts are processed while something drives the
+ * entity: with a reactor, every reactor_run_once or reactor_run_until,
+ * which drives all its entities; without one, l4sap_drive, which waits
+ * at most timeout_ms milliseconds (-1 forever) for the next frame or
+ * timeout of this entity. With a reactor, l4sap_drive is one
+ * reactor_run_once. It returns the number of completions of this
+ * entity that were reported, 0 if there were none, or -1.
+ *
+ * DATA that arrives while l4sap_recv or l4sap_recv_view waits still
+ * goes there; otherwise it is reported as L4_RECV_DONE.
+ */
+int l4sap_set_completion( L4SAP* l4, L4CompletionFn fn, void* arg );
+int l4sap_submit_send( L4SAP* l4, const uint8_t* data, int len, void* user );
+int l4sap_drive( L4SAP* l4, int timeout_ms );
+
+/* Zero-copy version of l4sap_recv. Instead of copying the payload,
+ * it sets view->data and view->len to the payload inside the L2
+ * entity's receive buffer, which is writable and stays valid until
+ * l4sap_release_view is called. It returns view->len or the same
+ * error codes as l4sap_recv.
+ */
+int l4sap_recv_view( L4SAP* l4, L4View* view );
+void l4sap_release_view( L4SAP* l4, L4View* view );
+
+/* How the view-based receive paths, here and in l4server, split a
+ * packet of records. l4sap_is_records tells if a DATA packet is marked
+ * with L4_MBZ_RECORDS and consists of whole records, at least one.
+ * l4sap_record_view sets view to the record at *offset in packet
+ * (sizeof(L4Header) for the first) and moves *offset past it. The last
+ * record takes over the packet's buffer, and packet->payload becomes
+ * NULL; the others are copied to memory of their own, with
+ * view->l2.payload NULL, so that the views can be released in any
+ * order. It returns the length of the record, or -1 if there is no
+ * memory for the copy.
+ */
+int  l4sap_is_records( const L2View* packet );
+int  l4sap_record_view( L2View* packet, int* offset, L4View* view );
+
 /* Send the L4_RESET message to the peer (OK to send it several
  * times, then delete the L2 and L4 entities and all memory
  * associated with them.
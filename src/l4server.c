@@ -0,0 +1,552 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+#include "l4server.h"
+#include "log.h"
+
+/* How many frames l4server_run takes without waiting after the first. */
+#define L4Serverbatch 64
+
+/* The receive buffer that the server's socket asks for. Thousands of
+ * clients that send at once overflow the default of about 200 KiB,
+ * and every lost frame costs its sender a retransmission timeout.
+ * The kernel caps it at net.core.rmem_max.
+ */
+#define L4Serverrcvbuf (4 << 20)
+
+static uint64_t l4server_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* l4server_init makes a server of the L2 server l2. */
+static L4Server *l4server_init(L2SAP *l2)
+{
+    if (l2 == NULL)
+        return NULL;
+
+    L4Server *server = calloc(1, sizeof(L4Server));
+    if (server == NULL)
+    {
+        l2sap_destroy(l2);
+        return NULL;
+    }
+    server->l2 = l2;
+
+    int rcvbuf = L4Serverrcvbuf;
+    if (server->l2->socket >= 0 &&
+        setsockopt(server->l2->socket, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0)
+        LOG_WARN("failed to enlarge the receive buffer");
+
+    server->timers = timerwheel_create(L4Servertick, l4server_now_ns());
+    if (server->timers == NULL)
+    {
+        l2sap_destroy(l2);
+        free(server);
+        return NULL;
+    }
+
+    server->idle_ns = (uint64_t)L4Sessiontimeout * 1000000;
+    return server;
+}
+
+L4Server *l4server_create(int port)
+{
+    return l4server_init(l2sap_server_create(port));
+}
+
+L4Server *l4server_create_shared(int port)
+{
+    return l4server_init(l2sap_server_create_shared(port));
+}
+
+/* l4server_alloc takes a session from the free list, which is filled
+ * a block at a time, so that sessions lie close together and cost no
+ * allocator overhead each.
+ */
+static L4Session *l4server_alloc(L4Server *server)
+{
+    if (server->free == NULL)
+    {
+        L4Session **blocks = realloc(server->blocks, (server->block_count + 1) * sizeof(L4Session *));
+        if (blocks == NULL)
+            return NULL;
+        server->blocks = blocks;
+
+        /* Zeroed, so that l4server_destroy finds no open session among
+         * the ones that were never used.
+         */
+        L4Session *block = calloc(L4Sessionblock, sizeof(L4Session));
+        if (block == NULL)
+            return NULL;
+        blocks[server->block_count++] = block;
+
+        for (int i = L4Sessionblock - 1; i >= 0; i--)
+        {
+            block[i].next = server->free;
+            server->free = &block[i];
+        }
+    }
+
+    L4Session *session = server->free;
+    server->free = session->next;
+    return session;
+}
+
+/* l4server_session is the session whose timer this is. */
+static L4Session *l4server_session(TimerWheelTimer *timer)
+{
+    return (L4Session *)((char *)timer - offsetof(L4Session, timer));
+}
+
+/* l4server_idle notes that the session has no DATA packet in flight
+ * any more, which makes its timer the idle timeout.
+ */
+static void l4server_idle(L4Server *server, L4Session *session)
+{
+    session->waiting = 0;
+    session->data = NULL;
+    timerwheel_arm(server->timers, &session->timer, session->active_ns + server->idle_ns);
+}
+
+static int l4server_complete(L4Server *server, L4Session *session, int type, int result, const L4View *view)
+{
+    L4Completion completion;
+    memset(&completion, 0, sizeof(completion));
+    completion.type = type;
+    completion.result = result;
+    completion.user = session->user;
+    if (view != NULL)
+        completion.view = *view;
+
+    if (server->fn == NULL)
+        return 0;
+    return server->fn(server->arg, server, session, &completion);
+}
+
+/* l4server_complete_data reports the payload of a DATA packet as
+ * L4_RECV_DONE, one completion per record of a packet of records, as
+ * long as the session stays open. It takes the packet over, unless it
+ * is left with records that were not reported, and releases the views
+ * that the callback does not keep. It returns the number of
+ * completions.
+ */
+static int l4server_complete_data(L4Server *server, L4Session *session, L2View *packet)
+{
+    L4View view;
+    if (!l4sap_is_records(packet))
+    {
+        view.data = packet->payload + sizeof(L4Header);
+        view.len = packet->len - sizeof(L4Header);
+        view.l2 = *packet;
+        packet->payload = NULL;
+        if (!l4server_complete(server, session, L4_RECV_DONE, view.len, &view))
+            l4server_release_view(server, &view);
+        return 1;
+    }
+
+    int completions = 0;
+    int offset = sizeof(L4Header);
+    while (packet->payload != NULL && session->open)
+    {
+        int len = l4sap_record_view(packet, &offset, &view);
+        if (len < 0)
+            continue;
+        if (!l4server_complete(server, session, L4_RECV_DONE, len, &view))
+            l4server_release_view(server, &view);
+        completions++;
+    }
+    return completions;
+}
+
+/* l4server_open creates the session of a new client. */
+static L4Session *l4server_open(L4Server *server, L2Peer *peer, uint64_t now)
+{
+    L4Session *session = l4server_alloc(server);
+    if (session == NULL)
+    {
+        LOG_ERROR("failed to allocate a session");
+        return NULL;
+    }
+
+    memset(session, 0, sizeof(L4Session));
+    session->peer = peer;
+    session->open = 1;
+    session->rto_us = L4Initialrto;
+    session->active_ns = now;
+    timerwheel_timer_init(&session->timer);
+    timerwheel_arm(server->timers, &session->timer, now + server->idle_ns);
+    server->count++;
+    server->stats.opened++;
+
+    peer->user = session;
+    return session;
+}
+
+/* l4server_free ends a session without telling its client. A packet
+ * in flight completes with L4_QUIT, and the callback hears of the end
+ * with type.
+ */
+static int l4server_free(L4Server *server, L4Session *session, int type)
+{
+    /* From here on, the callbacks can neither send nor close. */
+    session->open = 0;
+
+    int completions = 0;
+    if (session->waiting)
+    {
+        session->waiting = 0;
+        session->data = NULL;
+        l4server_complete(server, session, L4_SEND_DONE, L4_QUIT, NULL);
+        completions++;
+    }
+    if (type != 0)
+    {
+        l4server_complete(server, session, type, L4_QUIT, NULL);
+        completions++;
+    }
+
+    timerwheel_cancel(server->timers, &session->timer);
+    server->count--;
+    l2sap_forget_peer(server->l2, session->peer);
+
+    session->next = server->free;
+    server->free = session;
+    return completions;
+}
+
+static void l4server_send_header(L4Server *server, L4Session *session, uint8_t type)
+{
+    L4Header header;
+    header.type = type;
+    header.seqno = session->next_send_seq;
+    header.ackno = session->expected_recv_seq;
+    header.mbz = 0;
+    l2sap_sendto_peer(server->l2, session->peer, (const uint8_t *)&header, sizeof(header));
+}
+
+/* l4server_transmit sends the session's DATA packet, with the header
+ * and the caller's payload as two segments.
+ */
+static void l4server_transmit(L4Server *server, L4Session *session, uint64_t now)
+{
+    L4Header header;
+    header.type = L4_DATA;
+    header.seqno = session->next_send_seq;
+    header.ackno = session->expected_recv_seq;
+    header.mbz = 0;
+
+    struct iovec iov[2];
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void *)session->data;
+    iov[1].iov_len = session->length;
+    l2sap_sendv_peer(server->l2, session->peer, iov, 2);
+
+    session->sent_ns = now;
+    timerwheel_arm(server->timers, &session->timer, now + (uint64_t)session->rto_us * 1000);
+}
+
+/* l4server_rtt_sample is l4sap's RFC 6298 estimator in microseconds. */
+static void l4server_rtt_sample(L4Session *session, uint32_t rtt_us)
+{
+    if (!session->sampled)
+    {
+        session->srtt_us = rtt_us;
+        session->rttvar_us = rtt_us / 2;
+        session->sampled = 1;
+    }
+    else
+    {
+        uint32_t error = session->srtt_us > rtt_us ? session->srtt_us - rtt_us : rtt_us - session->srtt_us;
+        session->rttvar_us = (3 * session->rttvar_us + error) / 4;
+        session->srtt_us = (7 * session->srtt_us + rtt_us) / 8;
+    }
+
+    uint32_t variation = 4 * session->rttvar_us;
+    if (variation < 1)
+        variation = 1;
+    session->rto_us = session->srtt_us + variation;
+    if (session->rto_us < L4Minrto)
+        session->rto_us = L4Minrto;
+    if (session->rto_us > L4Maxrto)
+        session->rto_us = L4Maxrto;
+}
+
+/* l4server_input handles one frame of a client, like l4sap_input
+ * does in stop-and-wait mode. The memory of sessions is only freed by
+ * l4server_destroy, so after a callback, a session that it closed is
+ * still valid with open cleared until a new client reuses its slot.
+ * It returns the number of completions in the upper bits and whether
+ * the view was kept in bit 0.
+ */
+static int l4server_input(L4Server *server, L2View *view, uint64_t now)
+{
+    if (view->len < (int)sizeof(L4Header) || view->peer == NULL)
+        return 0;
+
+    const L4Header *header = (const L4Header *)view->payload;
+    L4Session *session = view->peer->user;
+    int completions = 0;
+
+    if (session == NULL)
+    {
+        /* A RESET or an ACK does not open a session. */
+        if (header->type != L4_DATA)
+        {
+            l2sap_forget_peer(server->l2, view->peer);
+            return 0;
+        }
+        session = l4server_open(server, view->peer, now);
+        if (session == NULL)
+            return 0;
+        l4server_complete(server, session, L4_SESSION_OPEN, 0, NULL);
+        completions++;
+        if (!session->open)
+            return completions << 1;
+    }
+
+    if (header->type == L4_RESET)
+    {
+        server->stats.reset++;
+        completions += l4server_free(server, session, L4_RESET_DONE);
+        return completions << 1;
+    }
+
+    session->active_ns = now;
+
+    /* An ACK, or DATA with the same acknowledgement, for the packet in flight. */
+    if ((header->type == L4_ACK || header->type == L4_DATA) && session->waiting &&
+        header->ackno == (uint8_t)(1 - session->next_send_seq))
+    {
+        /* Karn's rule. */
+        if (session->transmits == 1)
+            l4server_rtt_sample(session, (uint32_t)((now - session->sent_ns) / 1000));
+        int length = session->length;
+        session->next_send_seq = 1 - session->next_send_seq;
+        l4server_idle(server, session);
+        l4server_complete(server, session, L4_SEND_DONE, length, NULL);
+        completions++;
+
+        /* The callback may have closed the session. */
+        if (!session->open)
+            return completions << 1;
+    }
+
+    if (header->type != L4_DATA)
+        return completions << 1;
+
+    if (header->seqno != session->expected_recv_seq)
+    {
+        /* A retransmission whose ACK was lost. */
+        l4server_send_header(server, session, L4_ACK);
+        return completions << 1;
+    }
+
+    session->expected_recv_seq = 1 - session->expected_recv_seq;
+    l4server_send_header(server, session, L4_ACK);
+
+    completions += l4server_complete_data(server, session, view);
+    return completions << 1 | (view->payload == NULL ? 1 : 0);
+}
+
+/* l4server_timeouts retransmits the DATA packets whose timeout
+ * expired, fails those that expired too often and expires idle
+ * sessions. It returns the number of completions.
+ */
+static int l4server_timeouts(L4Server *server, uint64_t now)
+{
+    int completions = 0;
+    TimerWheelTimer *timer;
+    while ((timer = timerwheel_expire(server->timers, now)) != NULL)
+    {
+        L4Session *session = l4server_session(timer);
+        if (!session->waiting)
+        {
+            /* The session was active since its timer was armed. */
+            if (now < session->active_ns + server->idle_ns)
+            {
+                timerwheel_arm(server->timers, &session->timer, session->active_ns + server->idle_ns);
+                continue;
+            }
+            server->stats.expired++;
+            completions += l4server_free(server, session, L4_SESSION_EXPIRED);
+        }
+        else if (++session->timeouts >= L4Maxtimeouts)
+        {
+            /* A session with a packet in flight is not idle; if its
+             * client is gone, the packet fails here, and the session
+             * expires once its last frame is the idle timeout old.
+             */
+            LOG_WARN("session %u: packet %d was not acknowledged after %d timeouts", session->peer->id,
+                     session->next_send_seq, session->timeouts);
+            l4server_idle(server, session);
+            l4server_complete(server, session, L4_SEND_DONE, L4_SEND_FAILED, NULL);
+            completions++;
+        }
+        else
+        {
+            session->rto_us = session->rto_us * 2 > L4Maxrto ? L4Maxrto : session->rto_us * 2;
+            session->transmits++;
+            server->stats.retransmits++;
+            l4server_transmit(server, session, now);
+        }
+    }
+    return completions;
+}
+
+void l4server_destroy(L4Server *server)
+{
+    if (server == NULL)
+        return;
+
+    for (int i = 0; i < server->block_count; i++)
+    {
+        for (int j = 0; j < L4Sessionblock; j++)
+            l4server_close(server, &server->blocks[i][j]);
+    }
+
+    for (int i = 0; i < server->block_count; i++)
+        free(server->blocks[i]);
+    free(server->blocks);
+    timerwheel_destroy(server->timers);
+    l2sap_destroy(server->l2);
+    free(server);
+}
+
+int l4server_set_callback(L4Server *server, L4ServerFn fn, void *arg)
+{
+    if (server == NULL)
+        return -1;
+
+    server->fn = fn;
+    server->arg = arg;
+    return 0;
+}
+
+int l4server_set_idle_timeout(L4Server *server, int timeout_ms)
+{
+    if (server == NULL || timeout_ms <= 0)
+        return -1;
+
+    server->idle_ns = (uint64_t)timeout_ms * 1000000;
+
+    /* Move the idle timeouts that are armed already. */
+    for (int i = 0; i < server->block_count; i++)
+    {
+        for (int j = 0; j < L4Sessionblock; j++)
+        {
+            L4Session *session = &server->blocks[i][j];
+            if (session->open && !session->waiting)
+                timerwheel_arm(server->timers, &session->timer, session->active_ns + server->idle_ns);
+        }
+    }
+    return 0;
+}
+
+int l4server_send(L4Server *server, L4Session *session, const uint8_t *data, int len)
+{
+    if (server == NULL || session == NULL || data == NULL || len < 0 || !session->open)
+        return -1;
+    if (session->waiting)
+        return L4_QUEUE_FULL;
+
+    int payload = l2sap_payload_size(server->l2) - L4Headersize;
+    if (session->peer->framesize > 0)
+        payload = session->peer->framesize - L2Headersize - L4Headersize;
+    if (len > payload)
+        len = payload;
+
+    session->data = data;
+    session->length = len;
+    session->waiting = 1;
+    session->transmits = 1;
+    session->timeouts = 0;
+
+    uint64_t now = l4server_now_ns();
+    session->active_ns = now;
+    l4server_transmit(server, session, now);
+    return len;
+}
+
+void l4server_close(L4Server *server, L4Session *session)
+{
+    if (server == NULL || session == NULL || !session->open)
+        return;
+
+    /* Several, as l4sap_destroy sends, in case some are lost. */
+    for (int i = 0; i < 3; i++)
+        l4server_send_header(server, session, L4_RESET);
+
+    server->stats.closed++;
+    l4server_free(server, session, 0);
+}
+
+int l4server_run(L4Server *server, int timeout_ms)
+{
+    if (server == NULL)
+        return -1;
+
+    uint64_t now = l4server_now_ns();
+    uint64_t end_ns = timeout_ms < 0 ? 0 : now + (uint64_t)timeout_ms * 1000000;
+    int completions = l4server_timeouts(server, now);
+
+    while (completions == 0)
+    {
+        /* Wait for a frame, but not beyond the next timeout. */
+        uint64_t due = end_ns;
+        uint64_t next = timerwheel_next(server->timers);
+        if (next != 0 && (due == 0 || next < due))
+            due = next;
+
+        struct timespec deadline;
+        deadline.tv_sec = due / 1000000000u;
+        deadline.tv_nsec = due % 1000000000u;
+
+        L2View view;
+        view.payload = NULL;
+        l2sap_recv_view_until(server->l2, &view, due != 0 ? &deadline : NULL);
+
+        for (int n = 0; view.payload != NULL; n++)
+        {
+            int result = l4server_input(server, &view, l4server_now_ns());
+            if (!(result & 1))
+                l2sap_release_view(server->l2, &view);
+            completions += result >> 1;
+
+            view.payload = NULL;
+            if (n + 1 < L4Serverbatch)
+                l2sap_recv_view_nowait(server->l2, &view);
+        }
+
+        now = l4server_now_ns();
+        completions += l4server_timeouts(server, now);
+        if (timeout_ms >= 0 && now >= end_ns)
+            break;
+    }
+    return completions;
+}
+
+void l4server_release_view(L4Server *server, L4View *view)
+{
+    if (server == NULL || view == NULL)
+        return;
+
+    /* A record that l4sap_record_view copied has no L2 buffer. */
+    if (view->l2.payload == NULL)
+        free(view->data);
+    else
+        l2sap_release_view(server->l2, &view->l2);
+    view->data = NULL;
+}
+
+int l4server_session_count(const L4Server *server)
+{
+    return server == NULL ? 0 : server->count;
+}
@@ -0,0 +1,170 @@
+#ifndef L4SERVER_H
+#define L4SERVER_H
+
+#include "l4sap.h"
+#include "timerwheel.h"
+
+/* The L4 server engine serves any number of stop-and-wait clients,
+ * which are ordinary L4SAP entities, over one UDP port. It keeps an
+ * L4Session per client with the client's sequence numbers, the DATA
+ * packet in flight and its retransmission state, found through the
+ * L2Peer that the L2 server tags every frame with. A session is
+ * created by the first packet of a new client and ends when the
+ * client sends L4_RESET, when the server closes it, or when it was
+ * idle for the idle timeout.
+ *
+ * Everything that happens is reported to one callback with an
+ * L4Completion whose user field is the session's user pointer:
+ * - L4_SESSION_OPEN: a new client; the callback may set session->user.
+ * - L4_RECV_DONE: a DATA packet, or a record of one, arrived, as with
+ *   l4sap_submit_send.
+ * - L4_SEND_DONE: the ACK for l4server_send came; result is the
+ *   number of bytes sent, L4_SEND_FAILED or L4_QUIT.
+ * - L4_RESET_DONE: the client sent L4_RESET.
+ * - L4_SESSION_EXPIRED: the session was idle for too long.
+ * After L4_RESET_DONE and L4_SESSION_EXPIRED, the session is freed.
+ * A callback may send on its session and close it, but must not
+ * close other sessions.
+ */
+
+/* The types of L4Completion that only the server reports. */
+#define L4_SESSION_OPEN     4
+#define L4_SESSION_EXPIRED  5
+
+/* The default idle timeout of a session in milliseconds. */
+#define L4Sessiontimeout    30000
+
+/* Sessions are allocated in blocks of this many. */
+#define L4Sessionblock      256
+
+/* The tick of the server's timer wheel in nanoseconds. */
+#define L4Servertick        100000
+
+typedef struct L4Server L4Server;
+typedef struct L4Session L4Session;
+
+/* The state of one client, kept small because a server has thousands
+ * of them. The RTT estimator of RFC 6298 runs in microseconds.
+ */
+struct L4Session
+{
+    L2Peer*        peer;
+
+    /* The next free session. */
+    L4Session*     next;
+
+    /* The session's one timer: the retransmission timeout while a
+     * DATA packet is in flight, and otherwise the idle timeout, which
+     * is armed for active_ns plus the timeout when the session became
+     * idle and moves on when it expires while the session was active.
+     */
+    TimerWheelTimer timer;
+
+    void*          user;
+
+    /* The payload in flight, which stays the caller's. */
+    const uint8_t* data;
+
+    uint64_t       active_ns;
+    uint64_t       sent_ns;
+
+    uint32_t       srtt_us;
+    uint32_t       rttvar_us;
+    uint32_t       rto_us;
+
+    uint16_t       length;
+    uint8_t        next_send_seq;
+    uint8_t        expected_recv_seq;
+    uint8_t        waiting;
+    uint8_t        transmits;
+    uint8_t        timeouts;
+    uint8_t        sampled;
+    uint8_t        open;
+};
+
+typedef int (*L4ServerFn)( void* arg, L4Server* server, L4Session* session, L4Completion* completion );
+
+struct L4Server
+{
+    L2SAP*      l2;
+
+    L4ServerFn  fn;
+    void*       arg;
+
+    /* The index of the server among the workers of an L4Shards. */
+    int         shard;
+
+    int         count;
+
+    /* Free sessions, and the blocks they come from. */
+    L4Session*  free;
+    L4Session** blocks;
+    int         block_count;
+
+    uint64_t    idle_ns;
+
+    /* The timers of all sessions. */
+    TimerWheel* timers;
+
+    struct {
+        uint64_t opened;
+        uint64_t reset;
+        uint64_t expired;
+        uint64_t closed;
+        uint64_t retransmits;
+    } stats;
+};
+
+/* Creates a server on the given UDP port (0 picks a free one).
+ * Returns NULL in case of error.
+ */
+L4Server* l4server_create( int port );
+
+/* Creates a server whose socket shares the port with other servers
+ * through SO_REUSEPORT (see l2sap_server_create_shared). The kernel
+ * keeps each client with one of them, so each can have a session
+ * table of its own.
+ */
+L4Server* l4server_create_shared( int port );
+
+/* Sends L4_RESET to all clients and frees the server and its sessions.
+ */
+void l4server_destroy( L4Server* server );
+
+/* Sets the callback. Returns 0 or -1.
+ */
+int  l4server_set_callback( L4Server* server, L4ServerFn fn, void* arg );
+
+/* Sets the idle timeout of the sessions, in milliseconds.
+ * Returns 0 or -1.
+ */
+int  l4server_set_idle_timeout( L4Server* server, int timeout_ms );
+
+/* Sends len bytes in data (truncated to the payload size) to the
+ * session's client. data must stay valid until the L4_SEND_DONE
+ * completion. A session has one packet in flight at a time.
+ * Returns the number of bytes that will be sent, L4_QUEUE_FULL if a
+ * packet is in flight, or -1.
+ */
+int  l4server_send( L4Server* server, L4Session* session, const uint8_t* data, int len );
+
+/* Sends L4_RESET to the session's client and frees the session. A
+ * packet in flight completes with L4_QUIT first.
+ */
+void l4server_close( L4Server* server, L4Session* session );
+
+/* Receives and handles frames, retransmits what is due and expires
+ * idle sessions, waiting at most timeout_ms milliseconds (-1 forever)
+ * for the first frame or timeout. Returns the number of completions
+ * reported, 0 if there were none, or -1 in case of error.
+ */
+int  l4server_run( L4Server* server, int timeout_ms );
+
+/* Gives back the view of an L4_RECV_DONE completion whose callback
+ * returned 1.
+ */
+void l4server_release_view( L4Server* server, L4View* view );
+
+int  l4server_session_count( const L4Server* server );
+
+#endif /* L4SERVER_H */
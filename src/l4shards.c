@@ -0,0 +1,153 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "l4shards.h"
+#include "log.h"
+
+/* How long a worker waits for frames before it looks at the stop flag. */
+#define L4Shardpoll 100
+
+typedef struct L4Shard L4Shard;
+
+struct L4Shard
+{
+    L4Shards* shards;
+    L4Server* server;
+    pthread_t thread;
+};
+
+struct L4Shards
+{
+    int        workers;
+    int        port;
+    L4Shard*   shard;
+    int        running;
+    atomic_int stop;
+};
+
+L4Shards *l4shards_create(int port, int workers, L4ServerFn fn, void *arg)
+{
+    if (port < 0 || port > 65535 || workers <= 0)
+        return NULL;
+
+    L4Shards *shards = calloc(1, sizeof(L4Shards));
+    if (shards == NULL)
+        return NULL;
+
+    shards->shard = calloc(workers, sizeof(L4Shard));
+    if (shards->shard == NULL)
+    {
+        free(shards);
+        return NULL;
+    }
+    atomic_init(&shards->stop, 0);
+
+    /* The first server picks the port if it is 0, and the others bind
+     * the same one. All sockets exist before any client is served, so
+     * the kernel's choice of socket for a client does not change.
+     */
+    for (int i = 0; i < workers; i++)
+    {
+        L4Server *server = l4server_create_shared(port);
+        if (server == NULL)
+        {
+            LOG_ERROR("failed to create worker %d on port %d", i, port);
+            l4shards_destroy(shards);
+            return NULL;
+        }
+        server->shard = i;
+        l4server_set_callback(server, fn, arg);
+        shards->shard[i].shards = shards;
+        shards->shard[i].server = server;
+        shards->workers++;
+
+        if (port == 0)
+        {
+            port = l2sap_local_port(server->l2);
+            if (port < 0)
+            {
+                l4shards_destroy(shards);
+                return NULL;
+            }
+        }
+    }
+    shards->port = port;
+    return shards;
+}
+
+/* The thread of a worker. The stop flag is the only thing that the
+ * workers share, and it is read between two waits.
+ */
+static void *l4shards_run(void *arg)
+{
+    L4Shard *shard = arg;
+    while (!atomic_load_explicit(&shard->shards->stop, memory_order_relaxed))
+    {
+        if (l4server_run(shard->server, L4Shardpoll) < 0)
+        {
+            LOG_ERROR("worker %d failed", shard->server->shard);
+            break;
+        }
+    }
+    return NULL;
+}
+
+int l4shards_start(L4Shards *shards)
+{
+    if (shards == NULL || shards->running > 0)
+        return -1;
+
+    atomic_store(&shards->stop, 0);
+    for (int i = 0; i < shards->workers; i++)
+    {
+        if (pthread_create(&shards->shard[i].thread, NULL, l4shards_run, &shards->shard[i]) != 0)
+        {
+            LOG_ERROR("failed to start worker %d", i);
+            l4shards_stop(shards);
+            return -1;
+        }
+        shards->running++;
+    }
+    return 0;
+}
+
+void l4shards_stop(L4Shards *shards)
+{
+    if (shards == NULL)
+        return;
+
+    atomic_store(&shards->stop, 1);
+    for (int i = 0; i < shards->running; i++)
+        pthread_join(shards->shard[i].thread, NULL);
+    shards->running = 0;
+}
+
+void l4shards_destroy(L4Shards *shards)
+{
+    if (shards == NULL)
+        return;
+
+    l4shards_stop(shards);
+    for (int i = 0; i < shards->workers; i++)
+        l4server_destroy(shards->shard[i].server);
+    free(shards->shard);
+    free(shards);
+}
+
+int l4shards_port(const L4Shards *shards)
+{
+    return shards == NULL ? -1 : shards->port;
+}
+
+int l4shards_workers(const L4Shards *shards)
+{
+    return shards == NULL ? 0 : shards->workers;
+}
+
+L4Server *l4shards_server(L4Shards *shards, int worker)
+{
+    if (shards == NULL || worker < 0 || worker >= shards->workers)
+        return NULL;
+    return shards->shard[worker].server;
+}
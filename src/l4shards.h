@@ -0,0 +1,43 @@
+#ifndef L4SHARDS_H
+#define L4SHARDS_H
+
+#include "l4server.h"
+
+/* An L4 service on several cores. Each worker thread runs an
+ * L4Server of its own, with its own socket, frame pool, peer table and
+ * sessions, and all sockets share one UDP port through SO_REUSEPORT.
+ * The kernel hashes every datagram's source address and port to one
+ * socket, so a client always reaches the same worker, and the workers
+ * share nothing: there are no locks on the path of a packet.
+ *
+ * The callback runs on the worker of the session; server->shard tells
+ * the workers apart, e.g. to count per worker.
+ */
+typedef struct L4Shards L4Shards;
+
+/* Creates workers servers on port (0 picks a free one) with the given
+ * callback. They do not run before l4shards_start, so they can still
+ * be configured through l4shards_server.
+ * Returns NULL in case of error.
+ */
+L4Shards* l4shards_create( int port, int workers, L4ServerFn fn, void* arg );
+
+/* Starts a thread per worker that runs l4server_run until
+ * l4shards_stop. Returns 0 or -1 in case of error.
+ */
+int       l4shards_start( L4Shards* shards );
+
+/* Stops the threads and waits for them. The servers stay, so that
+ * their stats can be read.
+ */
+void      l4shards_stop( L4Shards* shards );
+
+/* Stops the threads if they run and frees the servers.
+ */
+void      l4shards_destroy( L4Shards* shards );
+
+int       l4shards_port( const L4Shards* shards );
+int       l4shards_workers( const L4Shards* shards );
+L4Server* l4shards_server( L4Shards* shards, int worker );
+
+#endif /* L4SHARDS_H */
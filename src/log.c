@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "log.h"
+
+int log_level = LOG_LEVEL_INFO;
+
+static const char *level_names[] = {"none", "error", "warn", "info", "debug"};
+
+int log_level_parse(const char *str)
+{
+    if (str == NULL)
+        return -1;
+
+    for (int i = LOG_LEVEL_NONE; i <= LOG_LEVEL_DEBUG; ++i)
+    {
+        if (strcasecmp(str, level_names[i]) == 0)
+            return i;
+    }
+
+    char *end;
+    long level = strtol(str, &end, 10);
+    if (*str == '\0' || *end != '\0' || level < LOG_LEVEL_NONE || level > LOG_LEVEL_DEBUG)
+        return -1;
+    return (int)level;
+}
+
+/* Reads the environment variable LOG_LEVEL before main is called,
+ * so that the programs need no code to support it.
+ */
+__attribute__((constructor)) static void log_init(void)
+{
+    int level = log_level_parse(getenv("LOG_LEVEL"));
+    if (level >= 0)
+        log_level = level;
+}
+
+int log_set_level(int level)
+{
+    int previous = log_level;
+    if (level >= LOG_LEVEL_NONE && level <= LOG_LEVEL_DEBUG)
+        log_level = level;
+    return previous;
+}
+
+/* The line is formatted into a local buffer first and written with a
+ * single call, so that concurrent messages are not interleaved.
+ */
+void log_write(int level, const char *func, const char *fmt, ...)
+{
+    char line[1024];
+    int used = snprintf(line, sizeof(line), "%s: %s: ", level_names[level], func);
+
+    va_list args;
+    va_start(args, fmt);
+    if (used < (int)sizeof(line))
+        used += vsnprintf(line + used, sizeof(line) - used, fmt, args);
+    va_end(args);
+
+    if (used > (int)sizeof(line) - 2)
+        used = sizeof(line) - 2;
+    line[used] = '\n';
+    line[used + 1] = '\0';
+
+    fputs(line, stderr);
+}
+
+int log_ratelimit(LogRatelimit *rl, const char *func, int interval_ms)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+
+    /* Of the threads that find the interval over, only the one that
+     * moves next_ns on writes its message.
+     */
+    uint64_t next = atomic_load_explicit(&rl->next_ns, memory_order_relaxed);
+    if (now < next ||
+        !atomic_compare_exchange_strong_explicit(&rl->next_ns, &next, now + (uint64_t)interval_ms * 1000000u,
+                                                 memory_order_relaxed, memory_order_relaxed))
+    {
+        atomic_fetch_add_explicit(&rl->suppressed, 1, memory_order_relaxed);
+        return 0;
+    }
+
+    unsigned suppressed = atomic_exchange_explicit(&rl->suppressed, 0, memory_order_relaxed);
+    if (suppressed > 0)
+        log_write(LOG_LEVEL_WARN, func, "%u similar messages suppressed", suppressed);
+    return 1;
+}
@@ -0,0 +1,113 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <inttypes.h>
+#include <stdatomic.h>
+
+/* Leveled logging for the L2 and L4 layers, the maze code and the
+ * clients.
+ *
+ * A message is written to stderr as one line, prefixed with its level
+ * and the name of the function that logs it, if its level passes two
+ * tests:
+ *
+ * - LOG_COMPILE_LEVEL decides at compile time which levels exist at
+ *   all. Calls above it expand to nothing, so neither the call nor
+ *   its arguments (e.g. inet_ntoa) cost anything. CMake sets it from
+ *   the cache variable of the same name.
+ * - log_level decides at runtime. It starts at LOG_LEVEL_INFO, or at
+ *   the value of the environment variable LOG_LEVEL (a number or one
+ *   of none, error, warn, info, debug), and can be changed with
+ *   log_set_level.
+ *
+ * Per-frame messages use LOG_DEBUG. Per-frame errors, which a broken
+ * or hostile peer can trigger at line rate, use LOG_RATELIMITED.
+ */
+
+#define LOG_LEVEL_NONE   0
+#define LOG_LEVEL_ERROR  1
+#define LOG_LEVEL_WARN   2
+#define LOG_LEVEL_INFO   3
+#define LOG_LEVEL_DEBUG  4
+
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+extern int log_level;
+
+/* Sets the runtime level. Returns the previous one.
+ */
+int  log_set_level( int level );
+
+/* Converts a name or number as accepted in the environment variable
+ * LOG_LEVEL. Returns -1 if str is not a level.
+ */
+int  log_level_parse( const char* str );
+
+void log_write( int level, const char* func, const char* fmt, ... )
+    __attribute__((format(printf, 3, 4)));
+
+/* State of one rate-limited call site. It is atomic because every
+ * thread that reaches the call site shares it.
+ */
+typedef struct LogRatelimit LogRatelimit;
+
+struct LogRatelimit
+{
+    _Atomic uint64_t next_ns;
+    _Atomic unsigned suppressed;
+};
+
+/* Returns 1 if a message may be written now, at most once every
+ * interval_ms milliseconds, and 0 if it must be suppressed. Reports
+ * the number of suppressed messages when the next one is allowed.
+ */
+int  log_ratelimit( LogRatelimit* rl, const char* func, int interval_ms );
+
+#define LOG_ENABLED(level) \
+    ((level) <= LOG_COMPILE_LEVEL && (level) <= log_level)
+
+#define LOG_AT(level, ...) \
+    do { \
+        if (LOG_ENABLED(level)) \
+            log_write((level), __FUNCTION__, __VA_ARGS__); \
+    } while (0)
+
+#define LOG_NOTHING() do { } while (0)
+
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) LOG_NOTHING()
+#endif
+
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...)  LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...)  LOG_NOTHING()
+#endif
+
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...)  LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...)  LOG_NOTHING()
+#endif
+
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) LOG_NOTHING()
+#endif
+
+/* Like LOG_AT, but writes at most one message per interval_ms from
+ * this call site.
+ */
+#define LOG_RATELIMITED(level, interval_ms, ...) \
+    do { \
+        static LogRatelimit log_rl_; \
+        if (LOG_ENABLED(level) && log_ratelimit(&log_rl_, __FUNCTION__, (interval_ms))) \
+            log_write((level), __FUNCTION__, __VA_ARGS__); \
+    } while (0)
+
+#endif /* LOG_H */
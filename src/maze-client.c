@@ -5,6 +5,7 @@
 
 #include "l4sap.h"
 #include "maze.h"
+#include "log.h"
 
 #define MAZE_HEADER_LEN (6 * sizeof(uint32_t))
 
@@ -33,7 +34,7 @@ int main(int argc, char *argv[])
     L4SAP *l4 = l4sap_create(argv[1], atoi(argv[2]));
     if (!l4)
     {
-        fprintf(stderr, "%s: Failed to create server\n", __FUNCTION__);
+        LOG_ERROR("Failed to create server");
         return -1;
     }
 
@@ -42,48 +43,51 @@ int main(int argc, char *argv[])
     char buffer[1024];
     snprintf(buffer, 1024, "MAZE %ld", maze_seed);
 
-    fprintf(stderr, "%s: Client sends: %s\n", __FUNCTION__, buffer);
+    LOG_INFO("Client sends: %s", buffer);
 
     int retval = l4sap_send(l4, (uint8_t *)buffer, strlen(buffer) + 1);
     if (retval < 0)
     {
-        fprintf(stderr, "%s: Failed to send data\n", __FUNCTION__);
+        LOG_ERROR("Failed to send data");
     }
 
-    retval = l4sap_recv(l4, (uint8_t *)buffer, 1024);
+    /* The maze is received, solved and sent back in place, inside the
+     * L2 receive buffer that l4sap_recv_view lends us.
+     */
+    L4View view;
+    retval = l4sap_recv_view(l4, &view);
     if (retval < 0)
     {
-        fprintf(stderr, "%s: Failed to receive data (error)\n", __FUNCTION__);
+        LOG_ERROR("Failed to receive data (error)");
     }
     else if (retval == 0)
     {
-        fprintf(stderr, "%s: Failed to receive data (timeout)\n", __FUNCTION__);
+        LOG_WARN("Failed to receive data (timeout)");
     }
     else
     {
-        fprintf(stderr, "%s: Received a message of length %d\n", __FUNCTION__, retval);
+        LOG_INFO("Received a message of length %d", retval);
 
         if (retval < 8)
         {
-            fprintf(stderr, "%s: Message too small, cannot contain a Maze\n", __FUNCTION__);
+            LOG_ERROR("Message too small, cannot contain a Maze");
         }
         else
         {
             Maze *maze = (Maze *)malloc(sizeof(Maze));
             if (maze == NULL)
             {
-                fprintf(stderr, "%s: Could not allocate a Maze structure\n", __FUNCTION__);
+                LOG_ERROR("Could not allocate a Maze structure");
             }
             else
             {
-                uint32_t *header = (uint32_t *)buffer;
+                uint32_t *header = (uint32_t *)view.data;
                 maze->edgeLen = ntohl(header[0]);
                 maze->size = ntohl(header[1]);
                 if (retval != maze->size + MAZE_HEADER_LEN)
                 {
-                    fprintf(stderr,
-                            "%s: Message size should be %d, but it is %d, not processing\n",
-                            __FUNCTION__, (int)(maze->size + MAZE_HEADER_LEN), retval);
+                    LOG_ERROR("Message size should be %d, but it is %d, not processing",
+                              (int)(maze->size + MAZE_HEADER_LEN), retval);
                 }
                 else
                 {
@@ -91,39 +95,33 @@ int main(int argc, char *argv[])
                     maze->startY = ntohl(header[3]);
                     maze->endX = ntohl(header[4]);
                     maze->endY = ntohl(header[5]);
-                    maze->maze = (char *)malloc(maze->size);
-                    if (maze->maze == NULL)
-                    {
-                        fprintf(stderr, "%s: Could not allocate a Maze data\n", __FUNCTION__);
-                    }
-                    else
-                    {
-                        memcpy(maze->maze, &buffer[MAZE_HEADER_LEN], maze->size);
-
-                        mazePlot(maze);
-
-                        mazeSolve(maze);
-
-                        uint32_t *header = (uint32_t *)buffer;
-                        header[0] = htonl(maze->edgeLen);
-                        header[1] = htonl(maze->size);
-                        header[2] = htonl(maze->startX);
-                        header[3] = htonl(maze->startY);
-                        header[4] = htonl(maze->endX);
-                        header[5] = htonl(maze->endY);
-                        memcpy(&buffer[MAZE_HEADER_LEN], maze->maze, maze->size);
-
-                        l4sap_send(l4, (uint8_t *)buffer, maze->size + MAZE_HEADER_LEN);
-
-                        free(maze->maze);
-                    }
+                    maze->maze = (char *)&view.data[MAZE_HEADER_LEN];
+
+                    mazePlot(maze);
+
+                    mazeSolve(maze);
+
+                    l4sap_send(l4, view.data, maze->size + MAZE_HEADER_LEN);
                 }
                 free(maze);
             }
         }
+        l4sap_release_view(l4, &view);
     }
 
     l4sap_send(l4, (uint8_t *)"QUIT", 5);
 
+    /* A snapshot of the counters for monitoring, see l4sap_dump_stats. */
+    const char *stats_file = getenv("L4_STATS");
+    if (stats_file != NULL)
+    {
+        FILE *out = fopen(stats_file, "w");
+        if (out != NULL)
+        {
+            l4sap_dump_stats(l4, out, "maze-client");
+            fclose(out);
+        }
+    }
+
     l4sap_destroy(l4);
 }
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include <string.h>
 
 #include "maze.h"
+#include "log.h"
 
 // queue
 typedef struct
@@ -19,14 +20,14 @@ static int solveMazeBFS(struct Maze *maze)
     char *visited = calloc(maze->size, sizeof(char));
     if (!visited)
     {
-        fprintf(stderr, "%s: memory allocation failed for visited\n", __FUNCTION__);
+        LOG_ERROR("memory allocation failed for visited");
         return 0;
     }
 
     Cell *queue = malloc(maze->size * sizeof(Cell));
     if (!queue)
     {
-        fprintf(stderr, "%s: memory allocation failed for queue\n", __FUNCTION__);
+        LOG_ERROR("memory allocation failed for queue");
         free(visited);
         return 0;
     }
@@ -124,7 +125,7 @@ void mazeSolve(struct Maze *maze)
 
     if (!maze)
     {
-        fprintf(stderr, "%s: null maze pointer\n", __FUNCTION__);
+        LOG_ERROR("null maze pointer");
         return;
     }
 
@@ -138,13 +139,13 @@ void mazeSolve(struct Maze *maze)
 
     if (!hasValidMazeDimensions)
     {
-        fprintf(stderr, "%s: invalid maze dimensions\n", __FUNCTION__);
+        LOG_ERROR("invalid maze dimensions");
         return;
     }
 
     if (!hasValidStartEndCoordinates)
     {
-        fprintf(stderr, "%s: invalid start or end position\n", __FUNCTION__);
+        LOG_ERROR("invalid start or end position");
         return;
     }
 
@@ -156,5 +157,5 @@ void mazeSolve(struct Maze *maze)
         maze->maze[i] &= ~tmark;
     }
 
-    fprintf(stderr, "%s: solved maze! ;D\n", __FUNCTION__);
+    LOG_INFO("solved maze! ;D");
 }
\ No newline at end of file
@@ -0,0 +1,209 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "peertable.h"
+#include "log.h"
+
+struct PeerTable
+{
+    L2Peer** slots;
+    uint32_t mask;
+    int      count;
+    int      max_peers;
+    uint32_t next_id;
+
+    /* Mixed into every hash, so that peers cannot pick source ports
+     * that collide on purpose.
+     */
+    uint64_t seed;
+};
+
+static uint32_t peertable_hash(const PeerTable *table, const struct sockaddr_in *addr)
+{
+    uint64_t key = ((uint64_t)addr->sin_addr.s_addr << 16) | addr->sin_port;
+    uint64_t h = (key ^ table->seed) * 0x9E3779B97F4A7C15ull;
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+static int peertable_same(const L2Peer *peer, const struct sockaddr_in *addr)
+{
+    return peer->addr.sin_addr.s_addr == addr->sin_addr.s_addr && peer->addr.sin_port == addr->sin_port;
+}
+
+/* peertable_resize moves all peers into a slot array of the given
+ * size, which is a power of 2.
+ */
+static int peertable_resize(PeerTable *table, uint32_t size)
+{
+    L2Peer **slots = calloc(size, sizeof(L2Peer *));
+    if (slots == NULL)
+    {
+        LOG_ERROR("failed to allocate %u peer slots", size);
+        return -1;
+    }
+
+    for (uint32_t i = 0; table->slots != NULL && i <= table->mask; ++i)
+    {
+        L2Peer *peer = table->slots[i];
+        if (peer == NULL)
+            continue;
+
+        uint32_t j = peertable_hash(table, &peer->addr) & (size - 1);
+        while (slots[j] != NULL)
+            j = (j + 1) & (size - 1);
+        slots[j] = peer;
+    }
+
+    free(table->slots);
+    table->slots = slots;
+    table->mask = size - 1;
+    return 0;
+}
+
+PeerTable *peertable_create(int max_peers)
+{
+    if (max_peers <= 0)
+    {
+        LOG_ERROR("invalid parameters");
+        return NULL;
+    }
+
+    PeerTable *table = calloc(1, sizeof(PeerTable));
+    if (table == NULL)
+    {
+        LOG_ERROR("failed to allocate memory for peer table");
+        return NULL;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    table->seed = ((uint64_t)ts.tv_nsec << 32) ^ ts.tv_sec ^ (uintptr_t)table;
+    table->max_peers = max_peers;
+    table->next_id = 1;
+
+    if (peertable_resize(table, 16) < 0)
+    {
+        free(table);
+        return NULL;
+    }
+    return table;
+}
+
+void peertable_destroy(PeerTable *table)
+{
+    if (table == NULL)
+        return;
+
+    for (uint32_t i = 0; i <= table->mask; ++i)
+        free(table->slots[i]);
+    free(table->slots);
+    free(table);
+}
+
+L2Peer *peertable_lookup(PeerTable *table, const struct sockaddr_in *addr, int create)
+{
+    uint32_t i = peertable_hash(table, addr) & table->mask;
+    while (table->slots[i] != NULL)
+    {
+        if (peertable_same(table->slots[i], addr))
+            return table->slots[i];
+        i = (i + 1) & table->mask;
+    }
+
+    if (!create)
+        return NULL;
+
+    if (table->count >= table->max_peers)
+    {
+        LOG_RATELIMITED(LOG_LEVEL_WARN, 1000, "peer table is full (%d peers)", table->count);
+        return NULL;
+    }
+
+    L2Peer *peer = calloc(1, sizeof(L2Peer));
+    if (peer == NULL)
+    {
+        LOG_ERROR("failed to allocate memory for peer");
+        return NULL;
+    }
+    peer->addr = *addr;
+    peer->id = table->next_id++;
+
+    /* Keep the table at most half full, so that probe sequences stay
+     * short. Growing moves the slots, so the free slot is searched
+     * again afterwards.
+     */
+    if (2 * (table->count + 1) > (int)(table->mask + 1))
+    {
+        if (peertable_resize(table, 2 * (table->mask + 1)) < 0)
+        {
+            free(peer);
+            return NULL;
+        }
+        i = peertable_hash(table, addr) & table->mask;
+        while (table->slots[i] != NULL)
+            i = (i + 1) & table->mask;
+    }
+
+    table->slots[i] = peer;
+    table->count++;
+    return peer;
+}
+
+void peertable_remove(PeerTable *table, L2Peer *peer)
+{
+    if (table == NULL || peer == NULL)
+        return;
+
+    uint32_t i = peertable_hash(table, &peer->addr) & table->mask;
+    while (table->slots[i] != peer)
+    {
+        if (table->slots[i] == NULL)
+        {
+            LOG_ERROR("peer is not in this table");
+            return;
+        }
+        i = (i + 1) & table->mask;
+    }
+
+    table->slots[i] = NULL;
+    table->count--;
+    free(peer);
+
+    /* Backward-shift deletion: move every following peer of the same
+     * cluster into the hole unless its home slot lies cyclically after
+     * the hole, so that lookups never stop at a hole too early.
+     */
+    uint32_t j = i;
+    while (1)
+    {
+        j = (j + 1) & table->mask;
+        if (table->slots[j] == NULL)
+            break;
+
+        uint32_t home = peertable_hash(table, &table->slots[j]->addr) & table->mask;
+        if (((j - home) & table->mask) >= ((j - i) & table->mask))
+        {
+            table->slots[i] = table->slots[j];
+            table->slots[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+int peertable_count(const PeerTable *table)
+{
+    return table->count;
+}
+
+L2Peer *peertable_next(const PeerTable *table, int *pos)
+{
+    while ((uint32_t)*pos <= table->mask)
+    {
+        L2Peer *peer = table->slots[(*pos)++];
+        if (peer != NULL)
+            return peer;
+    }
+    return NULL;
+}
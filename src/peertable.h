@@ -0,0 +1,64 @@
+#ifndef PEERTABLE_H
+#define PEERTABLE_H
+
+#include <inttypes.h>
+#include <netinet/in.h>
+
+/* The state that an L2 server keeps for every peer that it has received
+ * a valid frame from. A peer is identified by its IPv4 address and UDP
+ * port. The structure stays at the same address until the peer is
+ * forgotten, so the layers above can keep pointers to it.
+ */
+typedef struct L2Peer L2Peer;
+
+struct L2Peer
+{
+    struct sockaddr_in addr;
+
+    /* A number that no other peer of the same server had before. */
+    uint32_t           id;
+
+    /* Free for the layer above, e.g. for its per-peer session. */
+    void*              user;
+
+    /* The frame size that the peer agreed to, or 0 if it did not
+     * negotiate, in which case the server's frame size applies.
+     */
+    int                framesize;
+
+    uint64_t           rx_frames;
+    uint64_t           tx_frames;
+};
+
+/* A peer table is an open-addressing hash table (linear probing, at
+ * most half full) from sender addresses to L2Peer structures. Finding
+ * a known peer hashes the address and usually compares one slot.
+ */
+typedef struct PeerTable PeerTable;
+
+/* Creates a table that holds at most max_peers peers.
+ */
+PeerTable* peertable_create( int max_peers );
+
+/* Frees the table and all its peers.
+ */
+void       peertable_destroy( PeerTable* table );
+
+/* Returns the peer with the given address. If there is none and create
+ * is set, a new peer is added, unless the table is full.
+ * Returns NULL if the peer is not found or cannot be added.
+ */
+L2Peer*    peertable_lookup( PeerTable* table, const struct sockaddr_in* addr, int create );
+
+/* Removes a peer and frees it.
+ */
+void       peertable_remove( PeerTable* table, L2Peer* peer );
+
+int        peertable_count( const PeerTable* table );
+
+/* Iterates over all peers. Start with *pos = 0; returns NULL at the
+ * end. The table must not change during the iteration.
+ */
+L2Peer*    peertable_next( const PeerTable* table, int* pos );
+
+#endif /* PEERTABLE_H */
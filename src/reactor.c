@@ -0,0 +1,584 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "reactor.h"
+#include "log.h"
+
+/* The number of epoll events that are fetched per call, and the number
+ * of frames that are read from one socket before the others get their
+ * turn.
+ */
+#define REACTOR_EVENTS  64
+#define REACTOR_BUDGET  64
+
+typedef struct ReactorEndpoint ReactorEndpoint;
+
+struct ReactorEndpoint
+{
+    L2SAP*           l2;
+    int              fd;
+    ReactorFrameFn   fn;
+    void*            arg;
+    int              removed;
+    int              impaired;
+    int              backlog;
+    ReactorEndpoint* next;
+};
+
+/* The id of a timer of reactor_timer_add has the index of the timer
+ * in its low bits and the number of times that the timer was taken
+ * in the high bits, so that an old id does not cancel a new timer.
+ */
+#define REACTOR_TIMER_BITS   20
+#define REACTOR_TIMER_MAX    (1 << REACTOR_TIMER_BITS)
+#define REACTOR_TIMER_ROUNDS 2047
+
+struct Reactor
+{
+    int              epoll_fd;
+    int              timer_fd;
+
+    /* All endpoints, including removed ones that are freed at the end
+     * of reactor_run_once because an epoll event may still point to
+     * them.
+     */
+    ReactorEndpoint* endpoints;
+
+    /* The number of reactor_poll calls under way. A callback that runs
+     * the reactor again polls within the outer one, whose events must
+     * keep their endpoints until it is done.
+     */
+    int              depth;
+
+    /* The number of endpoints whose L2 entity had an impairment
+     * emulator when it was added. Only then the reactor has to look
+     * for delayed frames.
+     */
+    int              impaired;
+
+    /* The number of endpoints that stopped reading at their budget
+     * while their L2 entity held frames that epoll does not report
+     * again (see l2sap_pending).
+     */
+    int              backlog;
+
+    /* The value of l2sap_fd_changes when the descriptors of the
+     * endpoints were last compared with l2sap_fd.
+     */
+    unsigned         fd_changes;
+
+    TimerWheel*      wheel;
+    uint64_t         armed_ns;
+
+    /* The timers of reactor_timer_add, which are allocated one by one
+     * so that they stay where the wheel links them, and the indices
+     * of those that are not in use.
+     */
+    ReactorTimer**   timers;
+    int              timer_count;
+    int              timer_capacity;
+    int*             free_timers;
+    int              free_count;
+};
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+Reactor *reactor_create(void)
+{
+    Reactor *reactor = calloc(1, sizeof(Reactor));
+    if (reactor == NULL)
+    {
+        LOG_ERROR("failed to allocate memory for reactor");
+        return NULL;
+    }
+
+    reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    reactor->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    reactor->wheel = timerwheel_create(REACTOR_TICK_NS, monotonic_ns());
+    if (reactor->epoll_fd < 0 || reactor->timer_fd < 0 || reactor->wheel == NULL)
+    {
+        LOG_ERROR("failed to create epoll or timer descriptor");
+        reactor_destroy(reactor);
+        return NULL;
+    }
+
+    /* The timerfd is told apart from the endpoints by its NULL pointer. */
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->timer_fd, &ev) < 0)
+    {
+        LOG_ERROR("failed to add timer descriptor");
+        reactor_destroy(reactor);
+        return NULL;
+    }
+
+    reactor->fd_changes = l2sap_fd_changes();
+    return reactor;
+}
+
+void reactor_destroy(Reactor *reactor)
+{
+    if (reactor == NULL)
+        return;
+
+    while (reactor->endpoints != NULL)
+    {
+        ReactorEndpoint *ep = reactor->endpoints;
+        reactor->endpoints = ep->next;
+        free(ep);
+    }
+
+    if (reactor->epoll_fd >= 0)
+        close(reactor->epoll_fd);
+    if (reactor->timer_fd >= 0)
+        close(reactor->timer_fd);
+    timerwheel_destroy(reactor->wheel);
+    for (int i = 0; i < reactor->timer_count; ++i)
+        free(reactor->timers[i]);
+    free(reactor->timers);
+    free(reactor->free_timers);
+    free(reactor);
+}
+
+static ReactorEndpoint *reactor_find(Reactor *reactor, L2SAP *l2)
+{
+    for (ReactorEndpoint *ep = reactor->endpoints; ep != NULL; ep = ep->next)
+    {
+        if (ep->l2 == l2 && !ep->removed)
+            return ep;
+    }
+    return NULL;
+}
+
+int reactor_add(Reactor *reactor, L2SAP *l2, ReactorFrameFn fn, void *arg)
+{
+    if (reactor == NULL || l2 == NULL || fn == NULL)
+    {
+        LOG_ERROR("invalid parameters");
+        return -1;
+    }
+
+    ReactorEndpoint *ep = reactor_find(reactor, l2);
+    if (ep != NULL)
+    {
+        ep->fn = fn;
+        ep->arg = arg;
+        return 0;
+    }
+
+    ep = calloc(1, sizeof(ReactorEndpoint));
+    if (ep == NULL)
+    {
+        LOG_ERROR("failed to allocate memory for endpoint");
+        return -1;
+    }
+    ep->l2 = l2;
+    ep->fd = l2sap_fd(l2);
+    ep->fn = fn;
+    ep->arg = arg;
+    ep->impaired = l2->impair != NULL;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = ep;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, ep->fd, &ev) < 0)
+    {
+        LOG_ERROR("epoll_ctl failed for descriptor %d", ep->fd);
+        free(ep);
+        return -1;
+    }
+
+    ep->next = reactor->endpoints;
+    reactor->endpoints = ep;
+    reactor->impaired += ep->impaired;
+    return 0;
+}
+
+int reactor_remove(Reactor *reactor, L2SAP *l2)
+{
+    if (reactor == NULL || l2 == NULL)
+        return -1;
+
+    ReactorEndpoint *ep = reactor_find(reactor, l2);
+    if (ep == NULL)
+        return -1;
+
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, l2sap_fd(l2), NULL);
+    ep->removed = 1;
+    reactor->impaired -= ep->impaired;
+    reactor->backlog -= ep->backlog;
+    ep->backlog = 0;
+    return 0;
+}
+
+/* Frees the endpoints that were removed. Called when no epoll event
+ * can refer to them any more.
+ */
+static void reactor_collect(Reactor *reactor)
+{
+    ReactorEndpoint **link = &reactor->endpoints;
+    while (*link != NULL)
+    {
+        ReactorEndpoint *ep = *link;
+        if (ep->removed)
+        {
+            *link = ep->next;
+            free(ep);
+        }
+        else
+        {
+            link = &ep->next;
+        }
+    }
+}
+
+/* Arms the timerfd for the next tick at which the wheel has something
+ * to do, or disarms it.
+ */
+static void reactor_arm(Reactor *reactor)
+{
+    uint64_t next = timerwheel_next(reactor->wheel);
+    if (next == reactor->armed_ns)
+        return;
+
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = next / 1000000000u;
+    its.it_value.tv_nsec = next % 1000000000u;
+    timerfd_settime(reactor->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+    reactor->armed_ns = next;
+}
+
+void reactor_timer_init(ReactorTimer *timer, ReactorTimerFn fn, void *arg)
+{
+    timerwheel_timer_init(&timer->entry);
+    timer->fn = fn;
+    timer->arg = arg;
+    timer->id = 0;
+}
+
+int reactor_timer_arm(Reactor *reactor, ReactorTimer *timer, uint64_t delay_ns)
+{
+    if (reactor == NULL || timer == NULL || timer->fn == NULL)
+    {
+        LOG_ERROR("invalid parameters");
+        return -1;
+    }
+
+    timerwheel_arm(reactor->wheel, &timer->entry, monotonic_ns() + delay_ns);
+    reactor_arm(reactor);
+    return 0;
+}
+
+void reactor_timer_disarm(Reactor *reactor, ReactorTimer *timer)
+{
+    if (reactor == NULL || timer == NULL)
+        return;
+
+    /* The timerfd stays armed; if it fires for nothing, it is armed
+     * again for what is left.
+     */
+    timerwheel_cancel(reactor->wheel, &timer->entry);
+}
+
+/* Gives a timer of reactor_timer_add back. */
+static void reactor_timer_release(Reactor *reactor, ReactorTimer *timer)
+{
+    timer->fn = NULL;
+    reactor->free_timers[reactor->free_count++] = timer->id & (REACTOR_TIMER_MAX - 1);
+}
+
+int reactor_timer_add(Reactor *reactor, int delay_ms, ReactorTimerFn fn, void *arg)
+{
+    if (reactor == NULL || fn == NULL || delay_ms < 0)
+    {
+        LOG_ERROR("invalid parameters");
+        return -1;
+    }
+
+    int index;
+    if (reactor->free_count > 0)
+    {
+        index = reactor->free_timers[--reactor->free_count];
+    }
+    else
+    {
+        if (reactor->timer_count == REACTOR_TIMER_MAX)
+        {
+            LOG_ERROR("too many timers");
+            return -1;
+        }
+        if (reactor->timer_count == reactor->timer_capacity)
+        {
+            int capacity = reactor->timer_capacity ? 2 * reactor->timer_capacity : 16;
+            ReactorTimer **timers = realloc(reactor->timers, capacity * sizeof(ReactorTimer *));
+            if (timers != NULL)
+                reactor->timers = timers;
+            int *free_timers = realloc(reactor->free_timers, capacity * sizeof(int));
+            if (free_timers != NULL)
+                reactor->free_timers = free_timers;
+            if (timers == NULL || free_timers == NULL)
+            {
+                LOG_ERROR("failed to allocate memory for timers");
+                return -1;
+            }
+            reactor->timer_capacity = capacity;
+        }
+
+        ReactorTimer *timer = malloc(sizeof(ReactorTimer));
+        if (timer == NULL)
+        {
+            LOG_ERROR("failed to allocate memory for timers");
+            return -1;
+        }
+        reactor_timer_init(timer, fn, arg);
+        index = reactor->timer_count;
+        reactor->timers[reactor->timer_count++] = timer;
+    }
+
+    ReactorTimer *timer = reactor->timers[index];
+    int round = (timer->id >> REACTOR_TIMER_BITS) % REACTOR_TIMER_ROUNDS + 1;
+    timer->fn = fn;
+    timer->arg = arg;
+    timer->id = round << REACTOR_TIMER_BITS | index;
+
+    reactor_timer_arm(reactor, timer, (uint64_t)delay_ms * 1000000u);
+    return timer->id;
+}
+
+void reactor_timer_cancel(Reactor *reactor, int id)
+{
+    if (reactor == NULL || id <= 0)
+        return;
+
+    int index = id & (REACTOR_TIMER_MAX - 1);
+    if (index >= reactor->timer_count)
+        return;
+
+    ReactorTimer *timer = reactor->timers[index];
+    if (timer->id != id || timer->fn == NULL)
+        return;
+
+    reactor_timer_disarm(reactor, timer);
+    reactor_timer_release(reactor, timer);
+}
+
+/* Calls all timers that have expired. A timer is taken off the wheel
+ * before its callback runs, so that the callback can arm timers again.
+ */
+static int reactor_expire(Reactor *reactor)
+{
+    uint64_t expirations;
+    while (read(reactor->timer_fd, &expirations, sizeof(expirations)) > 0)
+        ;
+
+    int fired = 0;
+    uint64_t now = monotonic_ns();
+    TimerWheelTimer *entry;
+    while ((entry = timerwheel_expire(reactor->wheel, now)) != NULL)
+    {
+        ReactorTimer *timer = (ReactorTimer *)entry;
+        ReactorTimerFn fn = timer->fn;
+        void *arg = timer->arg;
+        if (timer->id != 0)
+            reactor_timer_release(reactor, timer);
+        fn(arg);
+        fired++;
+    }
+
+    reactor->armed_ns = 0;
+    reactor_arm(reactor);
+    return fired;
+}
+
+/* Reads up to REACTOR_BUDGET frames from one endpoint. Level-triggered
+ * epoll reports the socket again if frames are left. Frames that an
+ * io_uring has collected already are not reported, so the endpoint is
+ * put on the backlog instead.
+ */
+static int reactor_drain(Reactor *reactor, ReactorEndpoint *ep)
+{
+    reactor->backlog -= ep->backlog;
+    ep->backlog = 0;
+
+    int dispatched = 0;
+    for (int i = 0; i < REACTOR_BUDGET && !ep->removed; ++i)
+    {
+        L2View view;
+        int len = l2sap_recv_view_nowait(ep->l2, &view);
+        if (len == L2_AGAIN)
+            break;
+        if (len < 0)
+            continue;
+
+        L2SAP *l2 = ep->l2;
+        if (!ep->fn(ep->arg, l2, &view))
+            l2sap_release_view(l2, &view);
+        dispatched++;
+    }
+
+    if (!ep->removed && l2sap_pending(ep->l2) > 0)
+    {
+        ep->backlog = 1;
+        reactor->backlog++;
+    }
+    return dispatched;
+}
+
+/* Sends the frames that the impairment emulators of the endpoints have
+ * delayed and that are due. Returns the milliseconds until the next one
+ * is due, or -1 if none is waiting.
+ */
+static int reactor_flush_impaired(Reactor *reactor)
+{
+    int64_t next_ns = -1;
+    for (ReactorEndpoint *ep = reactor->endpoints; ep != NULL; ep = ep->next)
+    {
+        if (!ep->impaired || ep->removed)
+            continue;
+
+        int64_t due_ns = l2sap_flush_impaired(ep->l2);
+        if (due_ns >= 0 && (next_ns < 0 || due_ns < next_ns))
+            next_ns = due_ns;
+    }
+
+    if (next_ns < 0)
+        return -1;
+    return (int)((next_ns + 999999) / 1000000);
+}
+
+/* Waits on the new descriptor of every endpoint whose L2 entity went
+ * back to its socket after its io_uring failed. Closing the io_uring
+ * has taken the old one out of the epoll set.
+ */
+static void reactor_refresh(Reactor *reactor)
+{
+    unsigned changes = l2sap_fd_changes();
+    if (changes == reactor->fd_changes)
+        return;
+    reactor->fd_changes = changes;
+
+    for (ReactorEndpoint *ep = reactor->endpoints; ep != NULL; ep = ep->next)
+    {
+        int fd = l2sap_fd(ep->l2);
+        if (ep->removed || fd == ep->fd)
+            continue;
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = ep;
+        if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+            LOG_ERROR("epoll_ctl failed for descriptor %d", fd);
+        ep->fd = fd;
+    }
+}
+
+/* Waits once for events and dispatches them.
+ */
+static int reactor_poll(Reactor *reactor, int timeout_ms)
+{
+    reactor_refresh(reactor);
+
+    /* The endpoints on the backlog take their turn after the events,
+     * and until then nothing must wait.
+     */
+    int backlog = reactor->backlog > 0;
+    if (backlog)
+        timeout_ms = 0;
+
+    struct epoll_event events[REACTOR_EVENTS];
+    int n = epoll_wait(reactor->epoll_fd, events, REACTOR_EVENTS, timeout_ms);
+    if (n < 0)
+    {
+        if (errno == EINTR)
+            return 0;
+        LOG_ERROR("epoll_wait failed");
+        return -1;
+    }
+
+    int dispatched = 0;
+    reactor->depth++;
+    for (int i = 0; i < n; ++i)
+    {
+        ReactorEndpoint *ep = events[i].data.ptr;
+        if (ep == NULL)
+            dispatched += reactor_expire(reactor);
+        else if (!ep->removed)
+            dispatched += reactor_drain(reactor, ep);
+    }
+
+    for (ReactorEndpoint *ep = reactor->endpoints; backlog && ep != NULL; ep = ep->next)
+    {
+        if (ep->backlog && !ep->removed)
+            dispatched += reactor_drain(reactor, ep);
+    }
+    reactor->depth--;
+
+    if (reactor->depth == 0)
+        reactor_collect(reactor);
+    return dispatched;
+}
+
+int reactor_run_until(Reactor *reactor, const struct timespec *deadline)
+{
+    if (reactor == NULL)
+        return -1;
+
+    uint64_t deadline_ns = 0;
+    if (deadline != NULL)
+        deadline_ns = (uint64_t)deadline->tv_sec * 1000000000u + deadline->tv_nsec;
+
+    /* Wake up when a delayed frame is due, and whenever epoll_wait
+     * returns without dispatching anything (a signal, or only invalid
+     * frames), but only return early if something was dispatched.
+     * epoll_wait counts in milliseconds, so the wait is rounded up
+     * rather than spinning through the last fraction of one.
+     */
+    while (1)
+    {
+        int wait_ms = -1;
+        if (deadline != NULL)
+        {
+            uint64_t now = monotonic_ns();
+            wait_ms = now < deadline_ns ? (int)((deadline_ns - now + 999999) / 1000000) : 0;
+        }
+
+        int due_ms = reactor->impaired > 0 ? reactor_flush_impaired(reactor) : -1;
+        int early = due_ms >= 0 && (wait_ms < 0 || due_ms < wait_ms);
+        if (early)
+            wait_ms = due_ms;
+
+        int dispatched = reactor_poll(reactor, wait_ms);
+        if (dispatched != 0 || (wait_ms == 0 && !early))
+            return dispatched;
+    }
+}
+
+int reactor_run_once(Reactor *reactor, int timeout_ms)
+{
+    if (reactor == NULL)
+        return -1;
+
+    if (timeout_ms < 0)
+        return reactor_run_until(reactor, NULL);
+
+    uint64_t deadline_ns = monotonic_ns() + (uint64_t)timeout_ms * 1000000u;
+    struct timespec deadline;
+    deadline.tv_sec = deadline_ns / 1000000000u;
+    deadline.tv_nsec = deadline_ns % 1000000000u;
+    return reactor_run_until(reactor, &deadline);
+}
@@ -0,0 +1,115 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "l2sap.h"
+#include "timerwheel.h"
+
+/* The reactor multiplexes any number of L2 entities and timers on
+ * one thread. It is built on epoll, so it has no FD_SETSIZE limit and
+ * does not rebuild a descriptor set for every frame, and on a timerfd
+ * that is armed for the earliest pending timer.
+ *
+ * Every L2SAP that is added has a callback. When its descriptor (see
+ * l2sap_fd) becomes readable, the reactor reads the frames that are
+ * queued (through l2sap_recv_view_nowait, so with the usual header and
+ * checksum tests and without copying) and passes each valid frame to
+ * the callback as an L2View. If the callback returns 0, the reactor releases the view
+ * afterwards. If it returns 1, the callback keeps the view and must
+ * release it with l2sap_release_view later. A callback that destroys
+ * its L2SAP must return 1.
+ *
+ * Callbacks may add and remove L2 entities and timers, including the
+ * one that is being dispatched, and may run the reactor themselves
+ * (as a blocking l4sap_send does), which dispatches further events
+ * before the callback returns.
+ *
+ * When the io_uring of an entity fails and it goes back to its socket
+ * (see l2sap_set_backend), the reactor waits on the socket from its
+ * next wait on.
+ *
+ * The timers are kept on a timer wheel (see timerwheel.h) with ticks
+ * of REACTOR_TICK_NS, so arming and cancelling them costs the same
+ * with a hundred thousand timers as with one, and the timerfd is armed
+ * for the next tick at which the wheel has something to do. A timer
+ * fires at most one tick late.
+ */
+
+#define REACTOR_TICK_NS 100000
+
+typedef struct Reactor Reactor;
+
+typedef int  (*ReactorFrameFn)( void* arg, L2SAP* l2, L2View* view );
+typedef void (*ReactorTimerFn)( void* arg );
+
+typedef struct ReactorTimer ReactorTimer;
+
+/* A timer that is embedded in the caller's structure, so that arming
+ * it allocates nothing and needs no id. reactor_timer_add uses them
+ * as well.
+ */
+struct ReactorTimer
+{
+    TimerWheelTimer entry;
+    ReactorTimerFn  fn;
+    void*           arg;
+
+    /* The id of a timer of reactor_timer_add, or 0. */
+    int             id;
+};
+
+Reactor* reactor_create( void );
+
+/* Frees the reactor. The L2 entities that are still added are not
+ * destroyed.
+ */
+void     reactor_destroy( Reactor* reactor );
+
+/* Adds l2 to the reactor, or replaces its callback if it was added
+ * before. Returns 0 or -1 in case of error.
+ */
+int      reactor_add( Reactor* reactor, L2SAP* l2, ReactorFrameFn fn, void* arg );
+
+/* Removes l2 from the reactor. Returns 0, or -1 if it was not added.
+ */
+int      reactor_remove( Reactor* reactor, L2SAP* l2 );
+
+/* Calls fn(arg) once, delay_ms milliseconds from now.
+ * Returns a timer id > 0 that can be passed to reactor_timer_cancel,
+ * or -1 in case of error.
+ */
+int      reactor_timer_add( Reactor* reactor, int delay_ms, ReactorTimerFn fn, void* arg );
+
+/* Cancels a timer that has not fired yet. Cancelling a timer that
+ * has fired or was cancelled before is harmless.
+ */
+void     reactor_timer_cancel( Reactor* reactor, int id );
+
+/* Makes a timer that calls fn(arg) when it fires, and is not armed.
+ */
+void     reactor_timer_init( ReactorTimer* timer, ReactorTimerFn fn, void* arg );
+
+/* Arms timer to fire once, delay_ns nanoseconds from now, or moves it
+ * there if it is armed. A timer that fires is disarmed before its
+ * function is called. Returns 0 or -1 in case of error.
+ */
+int      reactor_timer_arm( Reactor* reactor, ReactorTimer* timer, uint64_t delay_ns );
+
+/* Disarms timer. Disarming a timer that is not armed is harmless.
+ * Timers that are still armed when the reactor is destroyed are
+ * disarmed.
+ */
+void     reactor_timer_disarm( Reactor* reactor, ReactorTimer* timer );
+
+/* Waits at most timeout_ms milliseconds (-1 waits forever) until
+ * frames arrive or timers expire, and dispatches them.
+ * Returns the number of frames and timers dispatched, 0 if the time
+ * ran out, or -1 in case of error.
+ */
+int      reactor_run_once( Reactor* reactor, int timeout_ms );
+
+/* Like reactor_run_once, but waits until an absolute deadline on
+ * CLOCK_MONOTONIC, or forever if deadline is NULL.
+ */
+int      reactor_run_until( Reactor* reactor, const struct timespec* deadline );
+
+#endif /* REACTOR_H */
@@ -0,0 +1,304 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "timerwheel.h"
+#include "reactor.h"
+
+/* The wheel's tick, as in the reactor and the L4 server. */
+#define TICK_NS  100000
+
+/* How many ops the linear timer list gets; it needs a scan for each. */
+#define LINEAR_OPS 1000
+
+/* How many short timers fire while the others stay armed. */
+#define SHORT_TIMERS 1000
+
+typedef struct BenchTimer BenchTimer;
+
+struct BenchTimer
+{
+    TimerWheelTimer entry;
+    uint64_t        expiry_ns;
+    int             fired;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* A delay like the ones that the L4 layer arms: mostly retransmission
+ * timeouts of 10 ms to 2 s, and some idle timeouts of 30 s.
+ */
+static uint64_t random_delay_ns(void)
+{
+    if (rand() % 10 == 0)
+        return 30000000000ull;
+    return 10000000ull + (uint64_t)(rand() % 1990) * 1000000ull;
+}
+
+/* Arms, moves, cancels and expires count timers on a wheel whose time
+ * is simulated, and checks that every timer fires within one tick
+ * after its expiry.
+ */
+static int bench_wheel(int count)
+{
+    BenchTimer *timers = calloc(count, sizeof(BenchTimer));
+    if (timers == NULL)
+        return -1;
+
+    uint64_t clock = 1000000000ull;
+    TimerWheel *wheel = timerwheel_create(TICK_NS, clock);
+    if (wheel == NULL)
+    {
+        free(timers);
+        return -1;
+    }
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < count; i++)
+    {
+        timerwheel_timer_init(&timers[i].entry);
+        timers[i].expiry_ns = clock + random_delay_ns();
+        timerwheel_arm(wheel, &timers[i].entry, timers[i].expiry_ns);
+    }
+    uint64_t arm = now_ns() - start;
+
+    /* An ACK moves the retransmission timeout of its sender. */
+    start = now_ns();
+    for (int i = 0; i < count; i++)
+    {
+        timers[i].expiry_ns = clock + random_delay_ns();
+        timerwheel_arm(wheel, &timers[i].entry, timers[i].expiry_ns);
+    }
+    uint64_t rearm = now_ns() - start;
+
+    start = now_ns();
+    for (int i = 0; i < count; i += 2)
+        timerwheel_cancel(wheel, &timers[i].entry);
+    uint64_t cancel = now_ns() - start;
+
+    for (int i = 0; i < count; i += 2)
+        timerwheel_arm(wheel, &timers[i].entry, timers[i].expiry_ns);
+
+    /* Let a millisecond pass at a time until all have fired. */
+    int fired = 0;
+    int errors = 0;
+    uint64_t expire = 0;
+    while (timerwheel_count(wheel) > 0)
+    {
+        clock += 1000000;
+        start = now_ns();
+        TimerWheelTimer *entry;
+        while ((entry = timerwheel_expire(wheel, clock)) != NULL)
+        {
+            BenchTimer *timer = (BenchTimer *)entry;
+            timer->fired++;
+            fired++;
+            if (clock < timer->expiry_ns || clock >= timer->expiry_ns + 1000000 + TICK_NS)
+                errors++;
+        }
+        expire += now_ns() - start;
+    }
+    for (int i = 0; i < count; i++)
+        errors += timers[i].fired != 1;
+
+    printf("%-22s %10.1f %10.1f %10.1f %10.1f %8d %8d\n", "timer wheel",
+           (double)arm / count, (double)rearm / count, (double)cancel / ((count + 1) / 2),
+           (double)expire / fired, fired, errors);
+
+    timerwheel_destroy(wheel);
+    free(timers);
+    return errors == 0 ? 0 : -1;
+}
+
+/* The timer list that the reactor had before the wheel: an array that
+ * is searched for the id to cancel and scanned for the earliest expiry
+ * whenever it changes.
+ */
+typedef struct LinearTimer LinearTimer;
+
+struct LinearTimer
+{
+    int      id;
+    uint64_t expiry_ns;
+};
+
+static volatile uint64_t sink;
+
+static void linear_earliest(const LinearTimer *timers, int count)
+{
+    uint64_t earliest = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (earliest == 0 || timers[i].expiry_ns < earliest)
+            earliest = timers[i].expiry_ns;
+    }
+    sink = earliest;
+}
+
+static int bench_linear(int count)
+{
+    LinearTimer *timers = calloc(count + LINEAR_OPS, sizeof(LinearTimer));
+    if (timers == NULL)
+        return -1;
+
+    uint64_t clock = now_ns();
+    for (int i = 0; i < count; i++)
+    {
+        timers[i].id = i + 1;
+        timers[i].expiry_ns = clock + random_delay_ns();
+    }
+
+    int n = count;
+    uint64_t start = now_ns();
+    for (int i = 0; i < LINEAR_OPS; i++)
+    {
+        timers[n].id = count + i + 1;
+        timers[n].expiry_ns = clock + random_delay_ns();
+        n++;
+        linear_earliest(timers, n);
+    }
+    uint64_t arm = now_ns() - start;
+
+    /* The new timers are at the end, where the search finds them last. */
+    start = now_ns();
+    for (int i = 0; i < LINEAR_OPS; i++)
+    {
+        int id = count + i + 1;
+        for (int j = 0; j < n; j++)
+        {
+            if (timers[j].id == id)
+            {
+                timers[j] = timers[--n];
+                linear_earliest(timers, n);
+                break;
+            }
+        }
+    }
+    uint64_t cancel = now_ns() - start;
+
+    printf("%-22s %10.1f %10s %10.1f %10s %8s %8s\n", "linear list (before)",
+           (double)arm / LINEAR_OPS, "-", (double)cancel / LINEAR_OPS, "-", "-", "-");
+    free(timers);
+    return 0;
+}
+
+typedef struct ShortTimer ShortTimer;
+
+struct ShortTimer
+{
+    uint64_t expiry_ns;
+    uint64_t late_ns;
+    int      fired;
+};
+
+static void short_fired(void *arg)
+{
+    ShortTimer *timer = arg;
+    uint64_t now = now_ns();
+    timer->late_ns = now > timer->expiry_ns ? now - timer->expiry_ns : 0;
+    timer->fired = now >= timer->expiry_ns ? 1 : -1;
+}
+
+static void long_fired(void *arg)
+{
+    (void)arg;
+}
+
+/* Adds and cancels timers of a reactor that holds count timers, and
+ * lets SHORT_TIMERS short ones fire among them.
+ */
+static int bench_reactor(int count)
+{
+    Reactor *reactor = reactor_create();
+    int *ids = calloc(count, sizeof(int));
+    ShortTimer *shorts = calloc(SHORT_TIMERS, sizeof(ShortTimer));
+    if (reactor == NULL || ids == NULL || shorts == NULL)
+    {
+        reactor_destroy(reactor);
+        free(ids);
+        free(shorts);
+        return -1;
+    }
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < count; i++)
+        ids[i] = reactor_timer_add(reactor, 60000 + rand() % 60000, long_fired, NULL);
+    uint64_t add = now_ns() - start;
+
+    start = now_ns();
+    for (int i = 0; i < count; i++)
+    {
+        reactor_timer_cancel(reactor, ids[i]);
+        ids[i] = reactor_timer_add(reactor, 60000 + rand() % 60000, long_fired, NULL);
+    }
+    uint64_t readd = now_ns() - start;
+
+    for (int i = 0; i < SHORT_TIMERS; i++)
+    {
+        int delay_ms = 1 + rand() % 20;
+        shorts[i].expiry_ns = now_ns() + (uint64_t)delay_ms * 1000000;
+        reactor_timer_add(reactor, delay_ms, short_fired, &shorts[i]);
+    }
+
+    int fired = 0;
+    uint64_t end = now_ns() + 1000000000ull;
+    while (fired < SHORT_TIMERS && now_ns() < end)
+    {
+        int n = reactor_run_once(reactor, 100);
+        if (n < 0)
+            break;
+        fired += n;
+    }
+
+    int errors = 0;
+    uint64_t late = 0;
+    uint64_t max_late = 0;
+    for (int i = 0; i < SHORT_TIMERS; i++)
+    {
+        errors += shorts[i].fired != 1;
+        late += shorts[i].late_ns;
+        if (shorts[i].late_ns > max_late)
+            max_late = shorts[i].late_ns;
+    }
+
+    printf("%-22s %10.1f %10s %10.1f %10s %8d %8d\n", "reactor timers",
+           (double)add / count, "-", (double)readd / count, "-", fired, errors);
+    printf("%d short timers among %d: %.1f us late on average, %.1f us at most\n",
+           SHORT_TIMERS, count, late / 1000.0 / SHORT_TIMERS, max_late / 1000.0);
+
+    for (int i = 0; i < count; i++)
+        reactor_timer_cancel(reactor, ids[i]);
+    reactor_destroy(reactor);
+    free(ids);
+    free(shorts);
+    return errors == 0 ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+    int count = argc > 1 ? atoi(argv[1]) : 100000;
+    if (count <= 0)
+    {
+        fprintf(stderr, "Usage: %s [timers]\n", argv[0]);
+        return -1;
+    }
+
+    srand(1);
+    printf("%d armed timers, ns per op (the reactor's cancel column is cancel plus add)\n", count);
+    printf("%-22s %10s %10s %10s %10s %8s %8s\n", "", "arm", "move", "cancel", "expire", "fired", "errors");
+
+    int result = 0;
+    if (bench_wheel(count) < 0)
+        result = -1;
+    if (bench_linear(count) < 0)
+        result = -1;
+    if (bench_reactor(count) < 0)
+        result = -1;
+    return result;
+}
@@ -0,0 +1,261 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "timerwheel.h"
+#include "log.h"
+
+/* Each level has 2^TIMERWHEEL_BITS slots. */
+#define TIMERWHEEL_BITS  8
+#define TIMERWHEEL_MASK  (TimerWheelSlots - 1)
+#define TIMERWHEEL_WORDS (TimerWheelSlots / 64)
+
+struct TimerWheel
+{
+    uint64_t         tick_ns;
+
+    /* The current tick. Every armed timer is due at this tick or
+     * later, and the timers of this tick are in its slot on level 0.
+     */
+    uint64_t         tick;
+    int              count;
+
+    /* A bit for every slot that may hold timers. A bit whose slot has
+     * been emptied by cancelling is cleared when a search finds it.
+     */
+    uint64_t         used[TimerWheelLevels][TIMERWHEEL_WORDS];
+    TimerWheelTimer* slots[TimerWheelLevels][TimerWheelSlots];
+};
+
+TimerWheel *timerwheel_create(uint64_t tick_ns, uint64_t now_ns)
+{
+    if (tick_ns == 0)
+    {
+        LOG_ERROR("invalid parameters");
+        return NULL;
+    }
+
+    TimerWheel *wheel = calloc(1, sizeof(TimerWheel));
+    if (wheel == NULL)
+    {
+        LOG_ERROR("failed to allocate memory for timer wheel");
+        return NULL;
+    }
+    wheel->tick_ns = tick_ns;
+    wheel->tick = now_ns / tick_ns;
+    return wheel;
+}
+
+void timerwheel_destroy(TimerWheel *wheel)
+{
+    if (wheel == NULL)
+        return;
+
+    /* Disarm what is left, so that cancelling it later does not touch
+     * the freed slots.
+     */
+    for (int level = 0; level < TimerWheelLevels; level++)
+    {
+        for (int i = 0; i < TimerWheelSlots; i++)
+        {
+            for (TimerWheelTimer *timer = wheel->slots[level][i]; timer != NULL;)
+            {
+                TimerWheelTimer *next = timer->next;
+                timer->next = NULL;
+                timer->pprev = NULL;
+                timer = next;
+            }
+        }
+    }
+    free(wheel);
+}
+
+void timerwheel_timer_init(TimerWheelTimer *timer)
+{
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires = 0;
+}
+
+/* timerwheel_insert puts a timer that is due at the current tick or
+ * later into its slot: on the lowest level whose slots reach that far.
+ * Timers beyond the highest level go where that level ends.
+ */
+static void timerwheel_insert(TimerWheel *wheel, TimerWheelTimer *timer)
+{
+    uint64_t at = timer->expires;
+    uint64_t reach = (uint64_t)1 << (TIMERWHEEL_BITS * TimerWheelLevels);
+    if (at - wheel->tick >= reach)
+        at = wheel->tick + reach - 1;
+
+    int level = 0;
+    while (level < TimerWheelLevels - 1 && at - wheel->tick >= (uint64_t)1 << (TIMERWHEEL_BITS * (level + 1)))
+        level++;
+
+    int index = (int)((at >> (TIMERWHEEL_BITS * level)) & TIMERWHEEL_MASK);
+    TimerWheelTimer **slot = &wheel->slots[level][index];
+    timer->next = *slot;
+    if (*slot != NULL)
+        (*slot)->pprev = &timer->next;
+    timer->pprev = slot;
+    *slot = timer;
+    wheel->used[level][index / 64] |= (uint64_t)1 << (index % 64);
+}
+
+static void timerwheel_unlink(TimerWheelTimer *timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next != NULL)
+        timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+void timerwheel_arm(TimerWheel *wheel, TimerWheelTimer *timer, uint64_t expiry_ns)
+{
+    if (timer->pprev != NULL)
+        timerwheel_unlink(timer);
+    else
+        wheel->count++;
+
+    /* Rounded up, so that the timer never fires early. */
+    uint64_t expires = expiry_ns / wheel->tick_ns + (expiry_ns % wheel->tick_ns != 0);
+    if (expires <= wheel->tick)
+        expires = wheel->tick + 1;
+    timer->expires = expires;
+    timerwheel_insert(wheel, timer);
+}
+
+void timerwheel_cancel(TimerWheel *wheel, TimerWheelTimer *timer)
+{
+    if (timer->pprev == NULL)
+        return;
+
+    timerwheel_unlink(timer);
+    wheel->count--;
+}
+
+int timerwheel_armed(const TimerWheelTimer *timer)
+{
+    return timer->pprev != NULL;
+}
+
+/* timerwheel_scan returns how many slots after from (cyclically) the
+ * first slot of a level with timers lies, or -1 if all are empty.
+ */
+static int timerwheel_scan(TimerWheel *wheel, int level, int from)
+{
+    uint64_t *used = wheel->used[level];
+    for (int i = 0; i <= TIMERWHEEL_WORDS; i++)
+    {
+        int word = ((from / 64) + i) % TIMERWHEEL_WORDS;
+        uint64_t bits = used[word];
+        if (i == 0)
+            bits &= ~(uint64_t)0 << (from % 64);
+        else if (i == TIMERWHEEL_WORDS)
+            bits &= ~(~(uint64_t)0 << (from % 64));
+
+        while (bits != 0)
+        {
+            int index = word * 64 + __builtin_ctzll(bits);
+            if (wheel->slots[level][index] != NULL)
+                return (index - from) & TIMERWHEEL_MASK;
+            used[word] &= ~((uint64_t)1 << (index % 64));
+            bits &= bits - 1;
+        }
+    }
+    return -1;
+}
+
+/* timerwheel_next_tick returns the next tick after the current one at
+ * which a slot of level 0 expires or a slot of a higher level cascades.
+ * Slot i of level l is reached when the bits of the tick above the
+ * lower levels end in i and the bits below are 0.
+ */
+static uint64_t timerwheel_next_tick(TimerWheel *wheel)
+{
+    uint64_t next = UINT64_MAX;
+    for (int level = 0; level < TimerWheelLevels; level++)
+    {
+        int shift = TIMERWHEEL_BITS * level;
+        uint64_t base = (wheel->tick >> shift) + 1;
+        int distance = timerwheel_scan(wheel, level, (int)(base & TIMERWHEEL_MASK));
+        if (distance < 0)
+            continue;
+
+        uint64_t at = (base + distance) << shift;
+        if (at < next)
+            next = at;
+    }
+    return next;
+}
+
+/* timerwheel_cascade moves the timers of the higher-level slots that
+ * the current tick reaches down to the levels below, the highest level
+ * first, since its timers may go into a slot that cascades next.
+ */
+static void timerwheel_cascade(TimerWheel *wheel)
+{
+    for (int level = TimerWheelLevels - 1; level > 0; level--)
+    {
+        int shift = TIMERWHEEL_BITS * level;
+        if ((wheel->tick & (((uint64_t)1 << shift) - 1)) != 0)
+            continue;
+
+        int index = (int)((wheel->tick >> shift) & TIMERWHEEL_MASK);
+        TimerWheelTimer *timer = wheel->slots[level][index];
+        wheel->slots[level][index] = NULL;
+        wheel->used[level][index / 64] &= ~((uint64_t)1 << (index % 64));
+        while (timer != NULL)
+        {
+            TimerWheelTimer *next = timer->next;
+            timerwheel_insert(wheel, timer);
+            timer = next;
+        }
+    }
+}
+
+TimerWheelTimer *timerwheel_expire(TimerWheel *wheel, uint64_t now_ns)
+{
+    uint64_t target = now_ns / wheel->tick_ns;
+    while (1)
+    {
+        TimerWheelTimer *timer = wheel->slots[0][wheel->tick & TIMERWHEEL_MASK];
+        if (timer != NULL)
+        {
+            timerwheel_unlink(timer);
+            wheel->count--;
+            return timer;
+        }
+
+        if (wheel->tick >= target)
+            return NULL;
+
+        /* Skip the ticks at which nothing happens. */
+        uint64_t next = wheel->count > 0 ? timerwheel_next_tick(wheel) : UINT64_MAX;
+        if (next > target)
+        {
+            wheel->tick = target;
+            return NULL;
+        }
+        wheel->tick = next;
+        timerwheel_cascade(wheel);
+    }
+}
+
+uint64_t timerwheel_next(TimerWheel *wheel)
+{
+    if (wheel->count == 0)
+        return 0;
+
+    uint64_t tick = wheel->tick;
+    if (wheel->slots[0][tick & TIMERWHEEL_MASK] == NULL)
+        tick = timerwheel_next_tick(wheel);
+
+    /* 0 means "nothing armed". */
+    return tick * wheel->tick_ns > 0 ? tick * wheel->tick_ns : 1;
+}
+
+int timerwheel_count(const TimerWheel *wheel)
+{
+    return wheel->count;
+}
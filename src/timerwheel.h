@@ -0,0 +1,89 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <inttypes.h>
+
+/* A timer wheel keeps any number of timers and finds the ones that
+ * are due without looking at the others. Time is counted in ticks of
+ * a fixed length. The wheel has TimerWheelLevels levels of
+ * TimerWheelSlots slots: a timer that is due within 256 ticks goes
+ * into the slot of its tick on level 0, one that is due within 256^2
+ * ticks into a slot of 256 ticks on level 1, and so on. When the time
+ * reaches a slot of a higher level, its timers move down to the levels
+ * below (they cascade), so a timer is moved at most three times.
+ * Arming and cancelling a timer are O(1) list operations; a bitmap of
+ * the slots that are in use tells the next tick at which there is
+ * something to do.
+ *
+ * The timers belong to the caller and are embedded in its structures,
+ * so the wheel allocates nothing per timer. A timer fires no earlier
+ * than its expiry and at most one tick later. Timers that are further
+ * away than the wheel reaches (256^4 ticks) cascade again until they
+ * are due.
+ */
+
+#define TimerWheelLevels 4
+#define TimerWheelSlots  256
+
+typedef struct TimerWheel TimerWheel;
+
+typedef struct TimerWheelTimer TimerWheelTimer;
+
+struct TimerWheelTimer
+{
+    TimerWheelTimer*  next;
+
+    /* The pointer that points to this timer, or NULL if the timer is
+     * not armed.
+     */
+    TimerWheelTimer** pprev;
+
+    /* The tick at which the timer is due. */
+    uint64_t          expires;
+};
+
+/* Creates a wheel whose ticks are tick_ns nanoseconds long, starting
+ * at now_ns. Times are on any clock that the caller keeps using,
+ * usually CLOCK_MONOTONIC. Returns NULL in case of error.
+ */
+TimerWheel*      timerwheel_create( uint64_t tick_ns, uint64_t now_ns );
+
+/* Frees the wheel. The timers that are still armed stay as they are.
+ */
+void             timerwheel_destroy( TimerWheel* wheel );
+
+/* Makes a timer that is not armed. A timer must be initialised before
+ * it is armed or cancelled the first time.
+ */
+void             timerwheel_timer_init( TimerWheelTimer* timer );
+
+/* Arms timer to be due at expiry_ns, or moves it there if it was
+ * armed before. An expiry in the past makes it due at the next tick.
+ */
+void             timerwheel_arm( TimerWheel* wheel, TimerWheelTimer* timer, uint64_t expiry_ns );
+
+/* Disarms timer. Cancelling a timer that is not armed does nothing.
+ */
+void             timerwheel_cancel( TimerWheel* wheel, TimerWheelTimer* timer );
+
+/* Returns 1 if timer is armed, 0 if not.
+ */
+int              timerwheel_armed( const TimerWheelTimer* timer );
+
+/* Takes the next timer that is due at now_ns off the wheel and returns
+ * it, or returns NULL if no timer is due. Timers with the same tick
+ * come in no particular order. Between two calls, the caller may arm
+ * and cancel timers, also the ones it was given.
+ */
+TimerWheelTimer* timerwheel_expire( TimerWheel* wheel, uint64_t now_ns );
+
+/* Returns the time at which timerwheel_expire should be called next,
+ * or 0 if no timer is armed. This is the expiry of the earliest timer
+ * if it is due within 256 ticks, or else the earlier time at which
+ * its slot cascades, when there may still be nothing to expire.
+ */
+uint64_t         timerwheel_next( TimerWheel* wheel );
+
+int              timerwheel_count( const TimerWheel* wheel );
+
+#endif /* TIMERWHEEL_H */
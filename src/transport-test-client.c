@@ -4,6 +4,7 @@
 #include <sys/select.h>
 
 #include "l4sap.h"
+#include "log.h"
 
 static int maxi( int a, int b )
 {
@@ -27,67 +28,79 @@ int main( int argc, char *argv[] )
     L4SAP* l4 = l4sap_create( argv[1], atoi(argv[2]) );
     if( !l4 )
     {
-        fprintf( stderr, "%s: Failed to create server\n", __FUNCTION__ );
+        LOG_ERROR( "Failed to create server" );
         return -1;
     }
 
     for( int i=0; i<20; i++ )
     {
-        fprintf( stderr, "\n%s: Round %d\n\n", __FUNCTION__, i );
+        LOG_INFO( "Round %d", i );
 
         char buffer[1024];
         snprintf( buffer, 1024, "This is message %d from the client to the server.", i );
 
         int len = maxi( strlen(buffer)+1, 4*(2<<i) );
 
-        fprintf( stderr, "%s: Client sends: '%s' and %d bytes\n", __FUNCTION__, buffer, len );
+        LOG_INFO( "Client sends: '%s' and %d bytes", buffer, len );
 
         int retval = l4sap_send( l4, (uint8_t*)buffer, len );
         if( retval == L4_SEND_FAILED )
         {
-            fprintf( stderr, "%s: Send failed. Giving up.\n", __FUNCTION__ );
+            LOG_ERROR( "Send failed. Giving up." );
             l4sap_destroy( l4 );
             exit( -1 );
         }
         if( retval == L4_QUIT )
         {
-            fprintf( stderr, "%s: Quit due to retrans failure.\n", __FUNCTION__ );
+            LOG_ERROR( "Quit due to retrans failure." );
             l4sap_destroy( l4 );
             exit( -1 );
         }
 
         if( retval < 0 )
         {
-            fprintf( stderr, "%s: Failed to send data\n", __FUNCTION__ );
+            LOG_ERROR( "Failed to send data" );
             continue;
         }
-        fprintf( stderr, "%s: l4sap_send returned with code %d\n", __FUNCTION__, retval );
+        LOG_INFO( "l4sap_send returned with code %d", retval );
 
-        fprintf( stderr, "%s: waiting for data from server.\n", __FUNCTION__ );
+        LOG_INFO( "waiting for data from server." );
         retval = l4sap_recv( l4, (uint8_t*)buffer, len );
         if( retval == L4_QUIT )
         {
-            fprintf( stderr, "%s: Quit due to retrans failure.\n", __FUNCTION__ );
+            LOG_ERROR( "Quit due to retrans failure." );
             l4sap_destroy( l4 );
             exit( -1 );
         }
         else if( retval < 0 )
         {
-            fprintf( stderr, "%s: Failed to receive data (error)\n", __FUNCTION__ );
+            LOG_ERROR( "Failed to receive data (error)" );
         }
         else if( retval == L4_TIMEOUT )
         {
-            fprintf( stderr, "%s: Failed to receive data (timeout)\n", __FUNCTION__ );
+            LOG_WARN( "Failed to receive data (timeout)" );
         }
         else
         {
-            fprintf( stderr, "%s: Received %d bytes\n", __FUNCTION__, retval );
-            fprintf( stderr, "%s: Message is '%s'\n", __FUNCTION__, buffer );
+            LOG_INFO( "Received %d bytes", retval );
+            LOG_INFO( "Message is '%s'", buffer );
         }
     }
 
     l4sap_send( l4, (uint8_t*)"QUIT", 5 );
 
+    /* A snapshot of the counters for monitoring, see l4sap_dump_stats. */
+    const char* stats_file = getenv( "L4_STATS" );
+    if( stats_file != NULL )
+    {
+        FILE* out = fopen( stats_file, "w" );
+        if( out != NULL )
+        {
+            l4sap_dump_stats( l4, out, "transport-test-client" );
+            fclose( out );
+        }
+    }
+
     l4sap_destroy( l4 );
 }
 